@@ -0,0 +1,189 @@
+#include "dhgroup.h"
+#include <pthread.h>
+
+
+pthread_mutex_t dhlock = PTHREAD_MUTEX_INITIALIZER;
+DHGroup *dhGroup1  = NULL;
+DHGroup *dhGroup14 = NULL;
+
+
+/*
+==================
+static DHGroup::Get
+
+The groups are created (and their tables built) on the
+first request.
+==================
+*/
+DHGroup* DHGroup::Get(DHType type) {
+	DHGroup *group = NULL;
+
+	pthread_mutex_lock(&dhlock);
+
+	if (type == DH_GROUP1) {
+		if (!dhGroup1) {
+			dhGroup1 = new DHGroup(MODP_OAK2, GEN_OAK2,
+								   DH_EXPBITS_GROUP1);
+		}
+		group = dhGroup1;
+	} else if (type == DH_GROUP14) {
+		if (!dhGroup14) {
+			dhGroup14 = new DHGroup(MODP_OAK14, GEN_OAK14,
+									DH_EXPBITS_GROUP14);
+		}
+		group = dhGroup14;
+	}
+
+	pthread_mutex_unlock(&dhlock);
+
+	if (!group) {
+		Critical("Unkown DH-group!");
+	}
+
+	return group;
+}
+
+/*
+==================
+DHGroup::DHGroup
+==================
+*/
+DHGroup::DHGroup(const char *modp, const char *gen, uint32 bits) {
+	p.set_str(modp, 16);
+	g.set_str(gen, 16);
+	q = (p-1) / 2;
+	expBits = bits;
+
+	BuildTable();
+}
+
+/*
+==================
+DHGroup::SingleBit
+
+With g == 2, table[i] is a single set bit as long as 
+2^(DH_WINDOW*i) is shorter than the modulus.
+==================
+*/
+bool DHGroup::SingleBit(uint32 i, uint32 pbits) {
+	uint32 shift = DH_WINDOW * i;
+	return g == 2 && shift < 32 && (1u << shift) < pbits - 1;
+}
+
+/*
+==================
+DHGroup::BuildTable
+
+table[i] = g^(2^(DH_WINDOW*i)) mod p, for every digit of
+an "expBits" long exponent.
+
+When g == 2, the first entries are a single set bit, and
+are set directly instead of squared.
+==================
+*/
+void DHGroup::BuildTable() {
+	uint32 digits = (expBits + DH_WINDOW - 1) / DH_WINDOW;
+	uint32 pbits = mpz_sizeinbase(p.get_mpz_t(), 2);
+	mpz_class cur = g;
+
+	table.resize(digits);
+
+	for (uint32 i=0; i<digits; i++) {
+		if (SingleBit(i, pbits)) {
+			/* 2^(2^shift) < p: just set the bit */
+			cur = 0;
+			mpz_setbit(cur.get_mpz_t(), 1u << (DH_WINDOW * i));
+		}
+
+		table[i] = cur;
+
+		if (SingleBit(i + 1, pbits)) {
+			continue;
+		}
+
+		/* cur = cur^(2^DH_WINDOW) mod p */
+		for (int j=0; j<DH_WINDOW; j++) {
+			mpz_mul(cur.get_mpz_t(), cur.get_mpz_t(), cur.get_mpz_t());
+			mpz_mod(cur.get_mpz_t(), cur.get_mpz_t(), p.get_mpz_t());
+		}
+	}
+}
+
+/*
+==================
+DHGroup::PowG
+
+Fixed-base windowed exponentiation (Brickell, Gordon,
+McCurley and Wilson). With x written as digits d_i in base
+2^w:
+	g^x = prod_{j=1}^{2^w-1} ( prod_{i : d_i == j} table[i] )^j
+
+which costs (digits + 2^w) multiplications and no squarings,
+compared to the ~expBits squarings of a plain "mpz_powm".
+
+Exponents longer than the table fall back to "mpz_powm".
+==================
+*/
+void DHGroup::PowG(mpz_class &r, const mpz_class &x) {
+	uint32 digits = table.size();
+
+	if (x < 0 || mpz_sizeinbase(x.get_mpz_t(), 2) > digits * DH_WINDOW) {
+		mpz_powm(r.get_mpz_t(), g.get_mpz_t(),
+				 x.get_mpz_t(), p.get_mpz_t());
+		return;
+	}
+
+	/* Split the exponent into digits */
+	ubyte *d = new ubyte[digits];
+	for (uint32 i=0; i<digits; i++) {
+		d[i] = 0;
+		for (int b=0; b<DH_WINDOW; b++) {
+			d[i] |= mpz_tstbit(x.get_mpz_t(), i*DH_WINDOW + b) << b;
+		}
+	}
+
+	mpz_class A = 1;
+	mpz_class B = 1;
+	bool bEmpty = true;
+
+	for (int j=(1<<DH_WINDOW)-1; j>0; j--) {
+		for (uint32 i=0; i<digits; i++) {
+			if (d[i] != j) {
+				continue;
+			}
+
+			if (bEmpty) {
+				B = table[i];
+				bEmpty = false;
+			} else {
+				mpz_mul(B.get_mpz_t(), B.get_mpz_t(),
+						table[i].get_mpz_t());
+				mpz_mod(B.get_mpz_t(), B.get_mpz_t(), p.get_mpz_t());
+			}
+		}
+
+		if (!bEmpty) {
+			mpz_mul(A.get_mpz_t(), A.get_mpz_t(), B.get_mpz_t());
+			mpz_mod(A.get_mpz_t(), A.get_mpz_t(), p.get_mpz_t());
+		}
+	}
+
+	delete[] d;
+	r = A;
+}
+
+/*
+==================
+DHGroup::RandomExponent
+
+RFC-4253 only requires 1 < x < q. An exponent of twice the
+security level of the group is plenty, and much cheaper than
+one the size of the modulus.
+==================
+*/
+void DHGroup::RandomExponent(mpz_class &x, gmp_randclass &ran) {
+	x = 0;
+	while (x <= 1 || x >= q) {
+		x = ran.get_z_bits(expBits);
+	}
+}
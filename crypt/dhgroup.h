@@ -0,0 +1,90 @@
+#pragma once
+
+#include "../sshay.h"
+
+enum DHType {
+	DH_GROUP1,		// Use Oakley group 2
+	DH_GROUP14,		// Use Oakley group 14
+};
+
+/*
+==================
+DHGroup
+
+The fixed parameters of a MODP-group. Both supported groups
+use the generator 2, so "e = g^x mod p" is computed from a table
+of the precomputed powers g^(2^(w*i)) (fixed-base windowing).
+The table is built once per process on the first call to "Get"
+and shared by every following key exchange.
+
+The private exponent is sized to the security level of the
+group rather than to the size of the modulus.
+==================
+*/
+class DHGroup {
+public:
+	static DHGroup*		Get(DHType type);
+
+	/* r = g^x mod p */
+	void 				PowG(mpz_class &r, const mpz_class &x);
+
+	/* Set x to a random exponent of "expBits" bits */
+	void 				RandomExponent(mpz_class &x, gmp_randclass &ran);
+
+	mpz_class 			p;			// The stupidly high prime
+	mpz_class 			g;			// The generator
+	mpz_class 			q;			// (p-1) / 2
+	uint32 				expBits;	// Bits in the private exponent
+
+private:
+						DHGroup(const char *modp, const char *gen,
+								uint32 bits);
+
+	/* table[i] = g^(2^(DH_WINDOW*i)) mod p */
+	vector<mpz_class> 	table;
+
+	void 				BuildTable();
+	bool 				SingleBit(uint32 i, uint32 pbits);
+};
+
+
+/* Width in bits of each exponent digit in the fixed-base table */
+#define DH_WINDOW 	4
+
+/* Private exponent sizes: twice the security of the group */
+#define DH_EXPBITS_GROUP1 	160 	// 1024 bit MODP, ~80 bit security
+#define DH_EXPBITS_GROUP14 	224 	// 2048 bit MODP, ~112 bit security
+
+
+// ============================================= //
+// The number defined below are the responses    //
+// received in the KEXDH_REPLY packet sent from  //
+// an OpenSSH-server with DH-group1 as KEX-algo. //
+// The number could be (read: probably are) way  //
+// off what is expected. I was not able to       //
+// verify the integrity of these numbers.        //
+// This is a dangerous assumption.               //
+// ============================================= //
+
+#define MODP_OAK2								   \
+"FFFFFFFFFFFFFFFFC90FDAA22168C234C4C6628B80DC1CD1" \
+"29024E088A67CC74020BBEA63B139B22514A08798E3404DD" \
+"EF9519B3CD3A431B302B0A6DF25F14374FE1356D6D51C245" \
+"E485B576625E7EC6F44C42E9A637ED6B0BFF5CB6F406B7ED" \
+"EE386BFB5A899FA5AE9F24117C4B1FE649286651ECE65381" \
+"FFFFFFFFFFFFFFFF"
+#define MODP_OAK14 								   \
+"FFFFFFFFFFFFFFFFC90FDAA22168C234C4C6628B80DC1CD1" \
+"29024E088A67CC74020BBEA63B139B22514A08798E3404DD" \
+"EF9519B3CD3A431B302B0A6DF25F14374FE1356D6D51C245" \
+"E485B576625E7EC6F44C42E9A637ED6B0BFF5CB6F406B7ED" \
+"EE386BFB5A899FA5AE9F24117C4B1FE649286651ECE45B3D" \
+"C2007CB8A163BF0598DA48361C55D39A69163FA8FD24CF5F" \
+"83655D23DCA3AD961C62F356208552BB9ED529077096966D" \
+"670C354E4ABC9804F1746C08CA18217C32905E462E36CE3B" \
+"E39E772C180E86039B2783A2EC07A28FB5C55DF06F4C52C9" \
+"DE2BCBF6955817183995497CEA956AE515D2261898FA0510" \
+"15728E5A8AACAA68FFFFFFFFFFFFFFFF"
+
+#define GEN_OAK2	"2"
+#define GEN_OAK14 	"2"
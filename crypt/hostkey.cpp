@@ -0,0 +1,333 @@
+/* The key setters used below are deprecated as of OpenSSL 3.0,
+ * but are the only ones shared with OpenSSL 1.1. */
+#define OPENSSL_API_COMPAT 0x10100000L
+
+#include "hostkey.h"
+#include <openssl/dsa.h>
+#include <openssl/rsa.h>
+#include <openssl/bn.h>
+#include <openssl/err.h>
+
+/* RSA host keys shorter than this are refused */
+#define HOSTKEY_RSA_MINBITS 	1024
+
+
+/*
+==================
+HostKey::HostKey
+==================
+*/
+HostKey::HostKey() {
+	rawLen 	= 0;
+	raw 	= NULL;
+	pkey 	= NULL;
+}
+
+/*
+==================
+HostKey::~HostKey
+==================
+*/
+HostKey::~HostKey() {
+	if (raw) {
+		delete[] raw;
+	}
+
+	if (pkey) {
+		EVP_PKEY_free(pkey);
+	}
+}
+
+/*
+==================
+HostKey::SetFromRaw
+==================
+*/
+uint32 HostKey::SetFromRaw(const ubyte *data, uint32 len) {
+	uint32 pos = 0;
+	const ubyte *blob, *type;
+	uint32 blobLen, typeLen;
+
+	if (!ReadString(data, len, pos, blob, blobLen)) {
+		Error("HostKey::SetFromRaw(): Truncated key blob");
+		return 0;
+	}
+
+	if (raw) {
+		delete[] raw;
+	}
+
+	rawLen = blobLen + 4;
+	raw = new ubyte[rawLen];
+	memcpy(raw, data, rawLen);
+
+	pos = 0;
+	if (!ReadString(blob, blobLen, pos, type, typeLen)) {
+		Error("HostKey::SetFromRaw(): Missing key type");
+		return 0;
+	}
+
+	keyType.assign((const char*)type, typeLen);
+
+	if (pkey) {
+		EVP_PKEY_free(pkey);
+		pkey = NULL;
+	}
+
+	if (keyType == "ssh-ed25519") {
+		pkey = ParseEd25519(blob+pos, blobLen-pos);
+	} else if (keyType == "ssh-rsa") {
+		pkey = ParseRSA(blob+pos, blobLen-pos);
+	} else if (keyType == "ssh-dss") {
+		pkey = ParseDSS(blob+pos, blobLen-pos);
+	} else {
+		printf("Unsupported host key type: %s\n", keyType.c_str());
+		return 0;
+	}
+
+	if (!pkey) {
+		printf("Malformed %s host key\n", keyType.c_str());
+		return 0;
+	}
+
+	return rawLen;
+}
+
+/*
+==================
+HostKey::Verify
+
+The signature string holds the name of the signature
+algorithm, followed by the signature itself:
+	string 		"ssh-ed25519" / "rsa-sha2-256" / "ssh-dss"
+	string 		signature
+==================
+*/
+bool HostKey::Verify(string algo, const ubyte *sig, uint32 siglen,
+					 const ubyte *data, uint32 datalen) {
+	const ubyte *name, *blob;
+	uint32 nameLen, blobLen;
+	uint32 pos = 0;
+
+	if (!pkey) {
+		Error("HostKey::Verify(): No key");
+		return false;
+	}
+
+	if (KeyTypeOf(algo) != keyType) {
+		printf("Host key type %s does not match algorithm %s\n",
+			   keyType.c_str(), algo.c_str());
+		return false;
+	}
+
+	if (!ReadString(sig, siglen, pos, name, nameLen)
+	||  !ReadString(sig, siglen, pos, blob, blobLen)) {
+		Error("HostKey::Verify(): Malformed signature");
+		return false;
+	}
+
+	if (algo != string((const char*)name, nameLen)) {
+		printf("Expected a %s signature, got %s\n", algo.c_str(),
+			   string((const char*)name, nameLen).c_str());
+		return false;
+	}
+
+	const EVP_MD *md = NULL;
+	ubyte *der = NULL;
+	int result;
+
+	if (algo == "ssh-ed25519") {
+		/* Ed25519 hashes the message itself */
+		if (blobLen != 64) {
+			Error("Ed25519 signature length mismatch", blobLen);
+			return false;
+		}
+	} else if (algo == "rsa-sha2-256") {
+		md = EVP_sha256();
+	} else if (algo == "ssh-dss") {
+		/* r and s are 160 bits each, EVP expects them DER encoded */
+		if (blobLen != 40) {
+			Error("DSA signature length mismatch", blobLen);
+			return false;
+		}
+
+		DSA_SIG *dsasig = DSA_SIG_new();
+		DSA_SIG_set0(dsasig, BN_bin2bn(blob, 20, NULL),
+							 BN_bin2bn(blob+20, 20, NULL));
+
+		int derLen = i2d_DSA_SIG(dsasig, &der);
+		DSA_SIG_free(dsasig);
+
+		if (derLen <= 0) {
+			Error("Failed to encode the DSA signature");
+			return false;
+		}
+
+		blob = der;
+		blobLen = derLen;
+		md = EVP_sha1();
+	}
+
+	EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+	result = EVP_DigestVerifyInit(ctx, NULL, md, NULL, pkey);
+	if (result == 1) {
+		result = EVP_DigestVerify(ctx, blob, blobLen, data, datalen);
+	}
+	EVP_MD_CTX_free(ctx);
+
+	if (der) {
+		OPENSSL_free(der);
+	}
+
+	if (result == 0) {
+		Warning("Signature verification failed. DISCONNECTING!");
+		return false;
+	} else if (result < 0) {
+		Error("An error occurred when verifying signature");
+		ERR_print_errors_fp(stdout);
+		return false;
+	}
+
+	return true;
+}
+
+/*
+==================
+HostKey::GetKeyType
+==================
+*/
+string HostKey::GetKeyType() {
+	return keyType;
+}
+
+/*
+==================
+static HostKey::KeyTypeOf
+==================
+*/
+string HostKey::KeyTypeOf(string algo) {
+	if (algo == "rsa-sha2-256") {
+		return "ssh-rsa";
+	}
+
+	return algo;
+}
+
+
+// ======================================================
+
+
+/*
+==================
+HostKey::ParseDSS
+
+	mpint 		p
+	mpint 		q
+	mpint 		g
+	mpint 		y
+==================
+*/
+EVP_PKEY* HostKey::ParseDSS(const ubyte *data, uint32 len) {
+	BIGNUM *bn[4];
+	uint32 pos = 0;
+
+	for (int i=0; i<4; i++) {
+		const ubyte *mp;
+		uint32 mpLen;
+
+		if (!ReadString(data, len, pos, mp, mpLen)) {
+			for (int j=0; j<i; j++) {
+				BN_free(bn[j]);
+			}
+			return NULL;
+		}
+
+		bn[i] = BN_bin2bn(mp, mpLen, NULL);
+	}
+
+	DSA *dsa = DSA_new();
+	DSA_set0_pqg(dsa, bn[0], bn[1], bn[2]);
+	DSA_set0_key(dsa, bn[3], NULL);
+
+	EVP_PKEY *key = EVP_PKEY_new();
+	EVP_PKEY_assign_DSA(key, dsa);
+
+	return key;
+}
+
+/*
+==================
+HostKey::ParseRSA
+
+	mpint 		e
+	mpint 		n
+==================
+*/
+EVP_PKEY* HostKey::ParseRSA(const ubyte *data, uint32 len) {
+	const ubyte *e, *n;
+	uint32 eLen, nLen;
+	uint32 pos = 0;
+
+	if (!ReadString(data, len, pos, e, eLen)
+	||  !ReadString(data, len, pos, n, nLen)) {
+		return NULL;
+	}
+
+	RSA *rsa = RSA_new();
+	RSA_set0_key(rsa, BN_bin2bn(n, nLen, NULL),
+					  BN_bin2bn(e, eLen, NULL), NULL);
+
+	if (RSA_bits(rsa) < HOSTKEY_RSA_MINBITS) {
+		Error("RSA host key is too short", RSA_bits(rsa));
+		RSA_free(rsa);
+		return NULL;
+	}
+
+	EVP_PKEY *key = EVP_PKEY_new();
+	EVP_PKEY_assign_RSA(key, rsa);
+
+	return key;
+}
+
+/*
+==================
+HostKey::ParseEd25519
+
+	string 		32 byte public key
+==================
+*/
+EVP_PKEY* HostKey::ParseEd25519(const ubyte *data, uint32 len) {
+	const ubyte *pub;
+	uint32 pubLen;
+	uint32 pos = 0;
+
+	if (!ReadString(data, len, pos, pub, pubLen) || pubLen != 32) {
+		return NULL;
+	}
+
+	return EVP_PKEY_new_raw_public_key(EVP_PKEY_ED25519, NULL, pub, pubLen);
+}
+
+/*
+==================
+static HostKey::ReadString
+==================
+*/
+bool HostKey::ReadString(const ubyte *data, uint32 len, uint32 &pos,
+						 const ubyte *&str, uint32 &slen) {
+	if (len < 4 || pos > len - 4) {
+		return false;
+	}
+
+	BytesToInt(slen, data+pos);
+	pos += 4;
+
+	if (slen > len - pos) {
+		return false;
+	}
+
+	str = data + pos;
+	pos += slen;
+
+	return true;
+}
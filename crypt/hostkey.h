@@ -0,0 +1,56 @@
+#pragma once
+
+#include "../sshay.h"
+#include <openssl/evp.h>
+
+/*
+==================
+HostKey
+
+The server's public host key (K_S). The key blob is parsed
+straight into an EVP_PKEY, and signatures are verified
+through the EVP interface.
+
+Supported host key algorithms:
+	ssh-ed25519 	Ed25519 key and signature
+	rsa-sha2-256 	"ssh-rsa" key, RSASSA-PKCS1-v1_5 with SHA-256
+	ssh-dss 		DSA key, SHA-1 signature of 2x160 bits
+==================
+*/
+class HostKey {
+public:
+				HostKey();
+				~HostKey();
+
+	/* Parse the K_S string, including its length field.
+	 * The total length of the field is returned, or 0 if the
+	 * key is malformed or of an unsupported type. */
+	uint32 		SetFromRaw(const ubyte *data, uint32 len);
+
+	/* Verify the signature string (without its length field) of
+	 * "data" made with the host key algorithm "algo". */
+	bool 		Verify(string algo, const ubyte *sig, uint32 siglen,
+					   const ubyte *data, uint32 datalen);
+
+	/* The key type of the blob, e.g. "ssh-rsa" */
+	string 		GetKeyType();
+
+	/* The key type used by the host key algorithm "algo" */
+	static string KeyTypeOf(string algo);
+
+	/* Keep the raw data, including the length field */
+	uint32 		rawLen;
+	ubyte 		*raw;
+
+private:
+	string 		keyType;
+	EVP_PKEY 	*pkey;
+
+	EVP_PKEY* 	ParseDSS(const ubyte *data, uint32 len);
+	EVP_PKEY* 	ParseRSA(const ubyte *data, uint32 len);
+	EVP_PKEY* 	ParseEd25519(const ubyte *data, uint32 len);
+
+	/* Read a string field, advancing "pos". False on overrun. */
+	static bool ReadString(const ubyte *data, uint32 len, uint32 &pos,
+						   const ubyte *&str, uint32 &slen);
+};
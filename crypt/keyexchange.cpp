@@ -1,30 +1,17 @@
 #include "keyexchange.h"
 #include "../prot/session.h"
 #include "../mac/macsha1.h"
-#include "../globdata.h"
-#include <sys/time.h>
-#include <openssl/dsa.h>
-#include <openssl/bn.h>
-#include <openssl/evp.h>
-#include <openssl/err.h>
+#include "hostkey.h"
+#include <openssl/rand.h>
 
 /*
 ==================
 KeyExchange::KeyExchange
 ==================
 */
-KeyExchange::KeyExchange() {
+KeyExchange::KeyExchange(Transport *t) {
+	transport 		= t;
 	isInitiated 	= false;
-
-	dsasig 	  		= DSA_SIG_new();
-	dsasig->r 		= BN_new();
-	dsasig->s 		= BN_new();
-
-	dsakey 	  		= DSA_new();
-	dsakey->p 		= BN_new();
-	dsakey->q 		= BN_new();
-	dsakey->g 		= BN_new();
-	dsakey->pub_key = BN_new();
 }
 
 /*
@@ -33,8 +20,7 @@ KeyExchange::~KeyExchange
 ==================
 */
 KeyExchange::~KeyExchange() {
-	DSA_free(dsakey);
-	DSA_SIG_free(dsasig);
+
 }
 
 /*
@@ -42,9 +28,10 @@ KeyExchange::~KeyExchange() {
 KeyExchange::Init
 ==================
 */
-void KeyExchange::Init(DHType type, Socket *so) {
+void KeyExchange::Init(DHType type, string algo, Socket *so) {
 	socket = so;
 	dhtype = type;
+	hostKeyAlgo = algo;
 
 	if (!socket->IsConnected()) {
 		Critical("Could not start KEXDH - socket disconnected");
@@ -78,17 +65,16 @@ bool KeyExchange::SendDHInit() {
 /*
 ==================
 KeyExchange::VerifyDHReply
+
+Read the KEXDH_REPLY from the socket and verify it.
 ==================
 */
 bool KeyExchange::VerifyDHReply() {
-	if (!isInitiated) {
-		Warning("KeyExchange::VerifyDHReply(): "
-				"NOT initiated!!!!");
-	}
-
-	ubyte *data = socket->Read();
+	/* Packets of other types are left for the session */
+	ubyte types[] = { SSH_MSG_KEXDH_REPLY, SSH_MSG_DISCONNECT };
+	ubyte *data = socket->ReadMatching(types, 2);
 
-	if (socket->LastSize() >= 6) {
+	if (data && socket->LastSize() >= 6) {
 		if (data[5] != 31) {
 			printf("Expected 31, got %i\n", data[5]);
 			return false;
@@ -97,13 +83,34 @@ bool KeyExchange::VerifyDHReply() {
 		return false;
 	}
 
-	GData::dhReply = new KexDHPacket(data, socket->LastSize());
-	if (!GData::dhReply->IsOfType(SSH_MSG_KEXDH_REPLY)) {
+	return HandleDHReply(data, socket->LastSize());
+}
+
+/*
+==================
+KeyExchange::HandleDHReply
+
+Verify a received KEXDH_REPLY. On success, the shared secret
+and the exchange hash are stored in the Transport.
+==================
+*/
+bool KeyExchange::HandleDHReply(const ubyte *data, uint32 len) {
+	if (!isInitiated) {
+		Warning("KeyExchange::HandleDHReply(): "
+				"NOT initiated!!!!");
+	}
+
+	if (transport->dhReply) {
+		delete transport->dhReply;
+	}
+
+	transport->dhReply = new KexDHPacket(data, len);
+	if (!transport->dhReply->valid) {
 		return false;
 	}
 
-	if (GData::dhReply->dhF.mpz < 1 
-	||  GData::dhReply->dhF.mpz >= dhP.mpz) {
+	if (transport->dhReply->dhF.mpz < 1 
+	||  transport->dhReply->dhF.mpz >= dhP.mpz) {
 		printf("Invalid F-value\n");
 		return false;
 	}
@@ -126,20 +133,20 @@ KeyExchange::CalculateSharedSecret
 ==================
 */
 void KeyExchange::CalculateSharedSecret() {
-	if (!GData::dhReply) { 
+	if (!transport->dhReply) { 
 		Error("Cannot calculate shared secret without F!");
 		return;
 	}
 
-	if (GData::sharedSecret) {
-		delete GData::sharedSecret;
+	if (transport->sharedSecret) {
+		delete transport->sharedSecret;
 	}
 
-	GData::sharedSecret = new MPInt;
+	transport->sharedSecret = new MPInt;
 
 	mpz_powm(
-		GData::sharedSecret->mpz.get_mpz_t(),
-		GData::dhReply->dhF.mpz.get_mpz_t(),
+		transport->sharedSecret->mpz.get_mpz_t(),
+		transport->dhReply->dhF.mpz.get_mpz_t(),
 		dhX.mpz.get_mpz_t(),
 		dhP.mpz.get_mpz_t()
 	);
@@ -165,88 +172,45 @@ The hash is calculated from the following values:
 ==================
 */
 void KeyExchange::CalculateDHReplyHash(ubyte *hashBuf) {
-	if (!GData::dhReply) return;
+	if (!transport->dhReply) return;
 
-	uint32 len = 0;
-	ubyte *buf = 0;
-
-	/* We're not using "mac" to hash, but to store
-	 * the data. Sorry for the confusion. */
+	/* Every field is hashed as it is added, nothing is buffered */
 	MacSHA1 mac;
-	
-	string V_C;
-	string V_S;
-	/* I_C: session->lKexinitPl */
-	/* I_S: session->rKexinitPl */
-	/* K_S: kexDH->dss.y */
-	/* mpint e: dhE */
-	/* mpint f: kexDH->mpF.mpz */
-	/* mpint k: dhK */
-
-	V_C = GData::localid;
-	V_C = V_C.substr(0, V_C.length()-2);
-	mac.AddUI(V_C.length());
-	mac.Add(V_C);
-
-	V_S = GData::remoteid;
-	mac.AddUI(V_S.length());
-	mac.Add(V_S);
-
-	mac.AddUI(GData::localKexinitlen);
-	mac.Add(GData::localKexinit, GData::localKexinitlen);
-
-	mac.AddUI(GData::remoteKexinitlen);
-	mac.Add(GData::remoteKexinit, GData::remoteKexinitlen);
-
-	/* PUBLIC KEY */
-	mac.Add(GData::dssBlob->raw, GData::dssBlob->rawLen);
-
-	/* MPINTS */
-	len = dhE.GetRawLength();
-	buf = new ubyte[len];
-	dhE.GetRawBytes(buf);
-	mac.Add(buf, len);
-	delete[] buf;
-	//printf("E len: %i\n", len-4);
-
-	len = GData::dhReply->rawFlen;
-	mac.Add(GData::dhReply->rawF, len);
-	//printf("F len: %i\n", len-4);
-
-	/* TO DO: 
-	 * Find the correlation between leading zero
-	 * in the shared secret and E+F. 
-	 */
-	MPInt *dhK = GData::sharedSecret;
-	//dhK->leadingZero = GData::dhReply->rawFlen == 133;
-
-	len = dhK->GetRawLength();
-	buf = new ubyte[len];
-	dhK->GetRawBytes(buf);
-	mac.Add(buf, len);
-	delete[] buf;
-	//printf("K len: %i\n", len-4);
-
-	/* Double hash the data, store the first hash */
-	memcpy(hashBuf, mac.GetHash(), 20);
-	memcpy(GData::exchangeHash, hashBuf, 20);
-
-	/* Print the raw data */
-	/*
-	printf("Raw hash buffer: \n\t");
-	ubyte *rawbuf = mac.GetBuffer();
-	for (int i=0; i<mac.GetBufferLength(); i++) {
-		printf("%s%x ", rawbuf[i]<0x10?"0":"", rawbuf[i]);
-		if (!(i%32)) {
-			printf("\n\t");
-		}
-	}
-	printf("\n\n\n");
-	*/
+	vector<ubyte> buf;
+
+	/* V_C and V_S, without CR LF */
+	uint32 lenC = transport->localId.length() - 2;
+	mac.AddUI(lenC);
+	mac.Add((const ubyte*)transport->localId.c_str(), lenC);
+
+	mac.AddUI(transport->remoteId.length());
+	mac.Add(transport->remoteId);
+
+	/* I_C and I_S */
+	mac.AddUI(transport->localKexinit.size());
+	mac.Add(&transport->localKexinit[0], transport->localKexinit.size());
+
+	mac.AddUI(transport->remoteKexinit.size());
+	mac.Add(&transport->remoteKexinit[0], transport->remoteKexinit.size());
+
+	/* K_S */
+	HostKey &hostKey = transport->dhReply->hostKey;
+	mac.Add(hostKey.raw, hostKey.rawLen);
 
-	mac.Clear();
-	mac.Add(hashBuf, 20);
+	/* e, f and K */
+	buf.resize(dhE.GetRawLength());
+	dhE.GetRawBytes(&buf[0]);
+	mac.Add(&buf[0], buf.size());
+
+	mac.Add(transport->dhReply->rawF, transport->dhReply->rawFlen);
+
+	buf.resize(transport->sharedSecret->GetRawLength());
+	transport->sharedSecret->GetRawBytes(&buf[0]);
+	mac.Add(&buf[0], buf.size());
+
+	/* The exchange hash H is what the server signs */
 	memcpy(hashBuf, mac.GetHash(), 20);
+	memcpy(transport->exchangeHash, hashBuf, 20);
 }
 
 /*
@@ -254,106 +218,54 @@ void KeyExchange::CalculateDHReplyHash(ubyte *hashBuf) {
 KeyExchange::VerifyDHReplyHash
 
 "myHash" is the hash calculated by "CalculateDHReplyHash()".
+The signature is verified with the negotiated host key
+algorithm, which hashes H once more where it applies.
 ==================
 */
 bool KeyExchange::VerifyDHReplyHash(ubyte *myHash) {
-	if (BN_bin2bn(GData::dhReply->dssR, 20, dsasig->r) == 0) {
-		printf("Failed to set dsasig->r\n");
-		return false;
-	}
-
-	if (BN_bin2bn(GData::dhReply->dssS, 20, dsasig->s) == 0) {
-		printf("Failed to set dsasig->s\n");
-		return false;
-	}
+	KexDHPacket *reply = transport->dhReply;
 
-	/* Set the DSS P, Q, G and Y values */
-	MPInt *src[4] = { 
-		&GData::dssBlob->p, 	&GData::dssBlob->q,
-		&GData::dssBlob->g, 	&GData::dssBlob->y };
-	BIGNUM *dst[4] = {
-		dsakey->p, 				dsakey->q,
-		dsakey->g, 				dsakey->pub_key };
-
-    for (int i=0; i<4; i++) {
-    	uint32 len = src[i]->GetRawLength();
-    	ubyte *raw = new ubyte[len];
-    	src[i]->GetRawBytes(raw);
-
-    	if (BN_bin2bn(raw+4, len-4, dst[i]) == 0) {
-    		printf("Failed to set dsakey->[%i]\n", i);
-    		delete[] raw;
-    		return false;
-    	}
-
-    	delete[] raw;
-    }
-
-    int result = 0;
-    result = DSA_do_verify(myHash, 20, dsasig, dsakey);
-
-	if (result == 0) {
-		Warning("Signature verification failed. DISCONNECTING!");
-
-		return false;
-	} else if (result == -1) {
-		Error("An error occurred when verifying signature");
-		BIO *bio = BIO_new_fp(stdout, BIO_NOCLOSE);
-		ERR_print_errors(bio);
-		BIO_free(bio);
-		return false;
-	} else if (result == 1) {
-		/* Everything went WAY better than expected */
-		//printf("DSA Signature verified!\n");
-		return true;
-	}
-
-	Critical("KeyExchange::VerifyDHReplyHash(): \n\t"
-			 "DSA_do_verify returned something "
-			 "exceptionally wrong!");
+	return reply->hostKey.Verify(hostKeyAlgo, 
+								 reply->rawSig, 
+								 reply->rawSiglen,
+								 myHash, 20);
 }
 
 /*
 ==================
 KeyExchange::SetDHParams
+
+The exponent "x" is sized to the security level of the group,
+and "e" is computed from the group's precomputed fixed-base table.
 ==================
 */
 bool KeyExchange::SetDHParams() {
 	/* Set the known parameters */
-	if (dhtype == DH_GROUP1) {
-		dhP.mpz.set_str(MODP_OAK2, 16);
-		dhG.mpz.set_str(GEN_OAK2, 16);
-	} else if (dhtype == DH_GROUP14) {
-		dhP.mpz.set_str(MODP_OAK14, 16);
-		dhG.mpz.set_str(GEN_OAK14, 16);
-	} else {
-		Critical("Unkown DH-group!");
-	}
+	DHGroup *group = DHGroup::Get(dhtype);
+	dhP.mpz = group->p;
+	dhG.mpz = group->g;
 
-	/* Calculate a random X up to 159 bits */
+	/* The seed comes from the system's entropy pool. A seed taken
+	 * from the clock would give the same exponent to sessions
+	 * started in the same microsecond. */
 	gmp_randclass ran(gmp_randinit_default);
+	ubyte seed[32];
+	mpz_class mseed;
+
+	if (RAND_bytes(seed, sizeof(seed)) != 1) {
+		Error("Failed to seed the DH exponent");
+		return false;
+	}
+
+	mpz_import(mseed.get_mpz_t(), sizeof(seed), 1, 1, 0, 0, seed);
+	ran.seed(mseed);
+
+	group->RandomExponent(dhX.mpz, ran);
 
-	struct timeval tp;
-	gettimeofday(&tp, NULL);
-	ran.seed(tp.tv_sec + tp.tv_usec);
-
-	MPInt dhQ;
-	dhQ.mpz = (dhP.mpz-1) / 2;
-
-	do {
-		dhX.mpz = 0;
-		while ((dhX.mpz <= 1 || dhX.mpz >= dhQ.mpz)) {
-			dhX.mpz = ran.get_z_bits(159);
-		}
-
-		// e = g^x % p
-		mpz_powm(
-			dhE.mpz.get_mpz_t(),
-			dhG.mpz.get_mpz_t(),
-			dhX.mpz.get_mpz_t(),
-			dhP.mpz.get_mpz_t()
-		);
-	} while (dhE.mpz >= dhQ.mpz);
+	// e = g^x % p
+	group->PowG(dhE.mpz, dhX.mpz);
+
+	return true;
 }
 
 /*
@@ -368,17 +280,10 @@ Message KeyExchange::GetDHInitMessage() {
 		return m;
 	}
 
-	ubyte *data;
-	uint32 len;
 	Message msg;
 
-	len = dhE.GetRawLength();
-	data = new ubyte[len];
-	dhE.GetRawBytes(data);
-
 	msg.Add((ubyte)SSH_MSG_KEXDH_INIT);
-	msg.Add(data, len);
-	delete[] data;
+	msg.Add(dhE);
 
 	return msg;
 }
\ No newline at end of file
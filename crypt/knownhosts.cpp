@@ -0,0 +1,749 @@
+#include "knownhosts.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <openssl/evp.h>
+#include <pthread.h>
+#include <algorithm>
+
+
+/*
+==================
+KnownHosts::KnownHosts
+==================
+*/
+KnownHosts::KnownHosts() {
+	fileFd 		= -1;
+	fileData 	= NULL;
+	fileSize 	= 0;
+
+	indexFd 	= -1;
+	indexData 	= NULL;
+	indexSize 	= 0;
+}
+
+/*
+==================
+KnownHosts::~KnownHosts
+==================
+*/
+KnownHosts::~KnownHosts() {
+	Close();
+}
+
+/*
+==================
+static KnownHosts::DefaultPath
+
+$SSHAY_KNOWN_HOSTS if set, ~/.ssh/known_hosts otherwise.
+==================
+*/
+string KnownHosts::DefaultPath() {
+	const char *env = getenv("SSHAY_KNOWN_HOSTS");
+	if (env && *env) {
+		return env;
+	}
+
+	const char *home = getenv("HOME");
+	return string(home ? home : ".") + "/.ssh/known_hosts";
+}
+
+/*
+==================
+KnownHosts::Open
+==================
+*/
+bool KnownHosts::Open(string path) {
+	Close();
+
+	filePath = path;
+	indexPath = path + ".idx";
+
+	if (!MapFile()) {
+		return false;
+	}
+
+	/* Nothing to index */
+	if (!fileSize) {
+		return true;
+	}
+
+	if (MapIndex() && IndexIsCurrent()) {
+		return true;
+	}
+
+	return BuildIndex();
+}
+
+/*
+==================
+KnownHosts::Close
+==================
+*/
+void KnownHosts::Close() {
+	Unmap();
+	filePath = "";
+	indexPath = "";
+}
+
+/*
+==================
+KnownHosts::Check
+
+A host known only with keys of other types is not unknown.
+The key offered could be a man-in-the-middle's, which is
+why the server offered a type we had not seen from it.
+==================
+*/
+KHResult KnownHosts::Check(string host, int port,
+						   const ubyte *blob, uint32 len) {
+	if (!fileData || !indexData) {
+		return KH_UNKNOWN;
+	}
+
+	string key = MakeKey(host, port);
+	string keyType = GetKeyType(blob, len);
+	string encoded = EncodeKey(blob, len);
+	uint64 hash = Hash(key);
+
+	KHSlot *slots = Slots();
+	uint32 mask = Header()->numSlots - 1;
+	bool changed = false;
+	bool otherType = false;
+
+	for (uint32 i=hash&mask, n=0; n<=mask; i=(i+1)&mask, n++) {
+		string lineType, lineKey;
+
+		if (!slots[i].hash) {
+			break;
+		}
+
+		if (!ReadEntry(slots[i], hash, key, lineType, lineKey)) {
+			continue;
+		}
+
+		if (lineType != keyType) {
+			otherType = true;
+			continue;
+		}
+
+		if (lineKey == encoded) {
+			return KH_OK;
+		}
+
+		changed = true;
+	}
+
+	if (changed) {
+		return KH_CHANGED;
+	}
+
+	return otherType ? KH_OTHER_TYPE : KH_UNKNOWN;
+}
+
+/*
+==================
+KnownHosts::KeyTypes
+==================
+*/
+vector<string> KnownHosts::KeyTypes(string host, int port) {
+	vector<string> types;
+
+	if (!fileData || !indexData) {
+		return types;
+	}
+
+	string key = MakeKey(host, port);
+	uint64 hash = Hash(key);
+
+	KHSlot *slots = Slots();
+	uint32 mask = Header()->numSlots - 1;
+
+	for (uint32 i=hash&mask, n=0; n<=mask && slots[i].hash; i=(i+1)&mask, n++) {
+		string lineType, lineKey;
+
+		if (ReadEntry(slots[i], hash, key, lineType, lineKey)
+		&&  find(types.begin(), types.end(), lineType) == types.end()) {
+			types.push_back(lineType);
+		}
+	}
+
+	return types;
+}
+
+/*
+==================
+KnownHosts::ReadEntry
+
+Read the key type and key of the line in "slot", if the
+line is an entry for "key". Slots of other hosts with the
+same hash are ruled out by the host names of the line.
+==================
+*/
+bool KnownHosts::ReadEntry(const KHSlot &slot, uint64 hash, const string &key,
+						   string &keyType, string &encoded) {
+	string hosts;
+
+	if (slot.hash != hash 
+	||  (uint64)slot.offset + slot.length > fileSize) {
+		return false;
+	}
+
+	if (!SplitLine(fileData + slot.offset, slot.length, 
+				   hosts, keyType, encoded)) {
+		return false;
+	}
+
+	size_t start = 0;
+	while (start <= hosts.length()) {
+		size_t end = hosts.find(',', start);
+		if (end == string::npos) {
+			end = hosts.length();
+		}
+
+		string tokenKey;
+		if (ParseHostToken(hosts.substr(start, end-start), tokenKey)
+		&&  tokenKey == key) {
+			return true;
+		}
+
+		start = end + 1;
+	}
+
+	return false;
+}
+
+/*
+==================
+KnownHosts::Add
+
+Append the host key to the known_hosts file. The index is
+updated in place when possible, and rebuilt otherwise.
+==================
+*/
+bool KnownHosts::Add(string host, int port, const ubyte *blob, uint32 len) {
+	stringstream ss;
+	struct stat st;
+	uint64 oldSize;
+	uint32 lineStart;
+	string line;
+	int fd;
+
+	if (port == 22) {
+		ss <<host;
+	} else {
+		ss <<"[" <<host <<"]:" <<port;
+	}
+	ss <<" " <<GetKeyType(blob, len) <<" " <<EncodeKey(blob, len);
+
+	fd = open(filePath.c_str(), O_RDWR | O_APPEND | O_CREAT, 0600);
+	if (fd < 0 && errno == ENOENT) {
+		/* Create the directory (typically ~/.ssh) */
+		size_t slash = filePath.rfind('/');
+		if (slash != string::npos && slash > 0) {
+			mkdir(filePath.substr(0, slash).c_str(), 0700);
+		}
+		fd = open(filePath.c_str(), O_RDWR | O_APPEND | O_CREAT, 0600);
+	}
+
+	if (fd < 0) {
+		Error("Failed to open known_hosts", errno);
+		return false;
+	}
+
+	flock(fd, LOCK_EX);
+	fstat(fd, &st);
+	oldSize = st.st_size;
+
+	/* Terminate a last line lacking a newline */
+	line = ss.str() + "\n";
+	lineStart = oldSize;
+	if (oldSize) {
+		char last = 0;
+		if (pread(fd, &last, 1, oldSize-1) == 1 && last != '\n') {
+			line = "\n" + line;
+			lineStart++;
+		}
+	}
+
+	bool ok = (write(fd, line.c_str(), line.length()) == (int)line.length());
+	if (!ok) {
+		Error("Failed to write to known_hosts", errno);
+	}
+
+	flock(fd, LOCK_UN);
+	close(fd);
+
+	if (!ok) {
+		return false;
+	}
+
+	/* Insert into the index only if it covered the entire file
+	 * up until now, and has room for the entry. Otherwise the
+	 * index is rebuilt. */
+	bool inPlace = indexData && indexFd >= 0 && fileSize == oldSize
+				&& Header()->fileSize == oldSize
+				&& (Header()->numUsed + 1) * 4 <= Header()->numSlots * 3;
+
+	if (!inPlace) {
+		return Open(filePath);
+	}
+
+	munmap((void*)fileData, fileSize);
+	close(fileFd);
+	fileData = NULL;
+	fileFd = -1;
+
+	if (!MapFile()) {
+		return false;
+	}
+
+	fstat(fileFd, &st);
+
+	flock(indexFd, LOCK_EX);
+	InsertSlot(Slots(), Header()->numSlots, Hash(MakeKey(host, port)),
+			   lineStart, line.length() - (lineStart - oldSize) - 1);
+	Header()->numUsed++;
+	Header()->fileSize = st.st_size;
+	Header()->fileMtime = (uint64)st.st_mtim.tv_sec * 1000000000
+						+ st.st_mtim.tv_nsec;
+	flock(indexFd, LOCK_UN);
+
+	return true;
+}
+
+
+// ======================================================
+
+
+/*
+==================
+KnownHosts::Header
+==================
+*/
+KHIndexHeader* KnownHosts::Header() {
+	return (KHIndexHeader*)indexData;
+}
+
+/*
+==================
+KnownHosts::Slots
+==================
+*/
+KHSlot* KnownHosts::Slots() {
+	return (KHSlot*)(indexData + sizeof(KHIndexHeader));
+}
+
+/*
+==================
+KnownHosts::MapFile
+
+A missing known_hosts file is treated as an empty one.
+==================
+*/
+bool KnownHosts::MapFile() {
+	struct stat st;
+
+	fileFd = open(filePath.c_str(), O_RDONLY);
+	if (fileFd < 0) {
+		if (errno == ENOENT) {
+			fileSize = 0;
+			return true;
+		}
+
+		Error("Failed to open known_hosts", errno);
+		return false;
+	}
+
+	if (fstat(fileFd, &st) < 0) {
+		Error("Failed to stat known_hosts", errno);
+		return false;
+	}
+
+	fileSize = st.st_size;
+	if (!fileSize) {
+		return true;
+	}
+
+	void *ptr = mmap(NULL, fileSize, PROT_READ, MAP_SHARED, fileFd, 0);
+	if (ptr == MAP_FAILED) {
+		Error("Failed to map known_hosts", errno);
+		fileSize = 0;
+		return false;
+	}
+
+	fileData = (const char*)ptr;
+	return true;
+}
+
+/*
+==================
+KnownHosts::MapIndex
+==================
+*/
+bool KnownHosts::MapIndex() {
+	struct stat st;
+
+	indexFd = open(indexPath.c_str(), O_RDWR);
+	if (indexFd < 0) {
+		return false;
+	}
+
+	if (fstat(indexFd, &st) < 0
+	||  (uint64)st.st_size < sizeof(KHIndexHeader)) {
+		return false;
+	}
+
+	indexSize = st.st_size;
+
+	void *ptr = mmap(NULL, indexSize, PROT_READ | PROT_WRITE,
+					 MAP_SHARED, indexFd, 0);
+	if (ptr == MAP_FAILED) {
+		indexSize = 0;
+		return false;
+	}
+
+	indexData = (ubyte*)ptr;
+	return true;
+}
+
+/*
+==================
+KnownHosts::IndexIsCurrent
+==================
+*/
+bool KnownHosts::IndexIsCurrent() {
+	struct stat st;
+	KHIndexHeader *hdr = Header();
+
+	if (!hdr || fstat(fileFd, &st) < 0) {
+		return false;
+	}
+
+	uint64 mtime = (uint64)st.st_mtim.tv_sec * 1000000000
+				 + st.st_mtim.tv_nsec;
+
+	return hdr->magic == KH_MAGIC
+		&& hdr->version == KH_VERSION
+		&& hdr->fileSize == (uint64)st.st_size
+		&& hdr->fileMtime == mtime
+		&& hdr->numSlots
+		&& !(hdr->numSlots & (hdr->numSlots - 1))
+		&& indexSize >= sizeof(KHIndexHeader)
+					  + (uint64)hdr->numSlots * sizeof(KHSlot);
+}
+
+/*
+==================
+KnownHosts::BuildIndex
+
+Index every host of every line in known_hosts. The table
+is kept at most half full. The index is written to a
+temporary file and renamed into place, so concurrent
+readers never see a partial index. The temporary name is
+unique to the thread, as several sessions may rebuild the
+index at once. If the index can not be written, it is 
+kept in anonymous memory for this process.
+==================
+*/
+bool KnownHosts::BuildIndex() {
+	vector<KHSlot> entries;
+	struct stat st;
+
+	if (indexData) {
+		munmap(indexData, indexSize);
+		indexData = NULL;
+	}
+	if (indexFd >= 0) {
+		close(indexFd);
+		indexFd = -1;
+	}
+
+	uint64 pos = 0;
+	while (pos < fileSize && pos <= 0xFFFFFFFF) {
+		const char *nl = (const char*)memchr(fileData+pos, '\n', fileSize-pos);
+		uint64 end = nl ? (uint64)(nl - fileData) : fileSize;
+
+		string hosts, keyType, key;
+		if (SplitLine(fileData+pos, end-pos, hosts, keyType, key)) {
+			size_t start = 0;
+			while (start <= hosts.length()) {
+				size_t comma = hosts.find(',', start);
+				if (comma == string::npos) {
+					comma = hosts.length();
+				}
+
+				string tokenKey;
+				if (ParseHostToken(hosts.substr(start, comma-start), tokenKey)) {
+					KHSlot slot;
+					slot.hash = Hash(tokenKey);
+					slot.offset = pos;
+					slot.length = end - pos;
+					entries.push_back(slot);
+				}
+
+				start = comma + 1;
+			}
+		}
+
+		pos = end + 1;
+	}
+
+	uint32 numSlots = 16;
+	while (numSlots < entries.size() * 2) {
+		numSlots <<= 1;
+	}
+
+	indexSize = sizeof(KHIndexHeader) + (uint64)numSlots * sizeof(KHSlot);
+
+	/* Write the index to a temporary file */
+	stringstream tmp;
+	tmp <<indexPath <<".tmp." <<getpid() <<"." <<pthread_self();
+
+	int fd = open(tmp.str().c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+	void *ptr = MAP_FAILED;
+
+	if (fd >= 0 && ftruncate(fd, indexSize) == 0) {
+		ptr = mmap(NULL, indexSize, PROT_READ | PROT_WRITE,
+				   MAP_SHARED, fd, 0);
+	}
+
+	if (ptr == MAP_FAILED) {
+		Warning("Failed to write the known_hosts index");
+		if (fd >= 0) {
+			close(fd);
+			unlink(tmp.str().c_str());
+			fd = -1;
+		}
+
+		ptr = mmap(NULL, indexSize, PROT_READ | PROT_WRITE,
+				   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (ptr == MAP_FAILED) {
+			Error("Failed to allocate the known_hosts index", errno);
+			indexSize = 0;
+			return false;
+		}
+	}
+
+	indexData = (ubyte*)ptr;
+	memset(indexData, 0, indexSize);
+
+	for (unsigned i=0; i<entries.size(); i++) {
+		InsertSlot(Slots(), numSlots, entries[i].hash,
+				   entries[i].offset, entries[i].length);
+	}
+
+	fstat(fileFd, &st);
+
+	KHIndexHeader *hdr = Header();
+	hdr->fileSize 	= st.st_size;
+	hdr->fileMtime 	= (uint64)st.st_mtim.tv_sec * 1000000000
+					+ st.st_mtim.tv_nsec;
+	hdr->numSlots 	= numSlots;
+	hdr->numUsed 	= entries.size();
+	hdr->version 	= KH_VERSION;
+	hdr->magic 		= KH_MAGIC;
+
+	if (fd >= 0) {
+		msync(indexData, indexSize, MS_SYNC);
+		if (rename(tmp.str().c_str(), indexPath.c_str()) < 0) {
+			unlink(tmp.str().c_str());
+			close(fd);
+			fd = -1;
+		}
+	}
+
+	indexFd = fd;
+	return true;
+}
+
+/*
+==================
+KnownHosts::Unmap
+==================
+*/
+void KnownHosts::Unmap() {
+	if (fileData) {
+		munmap((void*)fileData, fileSize);
+		fileData = NULL;
+	}
+
+	if (fileFd >= 0) {
+		close(fileFd);
+		fileFd = -1;
+	}
+
+	if (indexData) {
+		munmap(indexData, indexSize);
+		indexData = NULL;
+	}
+
+	if (indexFd >= 0) {
+		close(indexFd);
+		indexFd = -1;
+	}
+
+	fileSize = 0;
+	indexSize = 0;
+}
+
+/*
+==================
+KnownHosts::InsertSlot
+==================
+*/
+void KnownHosts::InsertSlot(KHSlot *slots, uint32 numSlots,
+							uint64 hash, uint32 off, uint32 len) {
+	uint32 mask = numSlots - 1;
+	uint32 i = hash & mask;
+
+	while (slots[i].hash) {
+		i = (i + 1) & mask;
+	}
+
+	slots[i].offset = off;
+	slots[i].length = len;
+	slots[i].hash = hash;
+}
+
+
+// ======================================================
+
+
+/*
+==================
+static KnownHosts::Hash
+
+64 bit FNV-1a. Zero is reserved for empty slots.
+==================
+*/
+uint64 KnownHosts::Hash(const string &key) {
+	uint64 hash = 14695981039346656037ULL;
+
+	for (unsigned i=0; i<key.length(); i++) {
+		hash ^= (ubyte)key[i];
+		hash *= 1099511628211ULL;
+	}
+
+	return hash ? hash : 1;
+}
+
+/*
+==================
+static KnownHosts::MakeKey
+==================
+*/
+string KnownHosts::MakeKey(string host, int port) {
+	stringstream ss;
+
+	for (unsigned i=0; i<host.length(); i++) {
+		host[i] = tolower(host[i]);
+	}
+
+	ss <<host <<":" <<port;
+	return ss.str();
+}
+
+/*
+==================
+static KnownHosts::ParseHostToken
+
+Turn a single host of a known_hosts line, "host" or
+"[host]:port", into an index key. False is returned for
+hashed names and patterns, which can not be indexed.
+==================
+*/
+bool KnownHosts::ParseHostToken(string token, string &key) {
+	int port = 22;
+
+	if (!token.length() || token[0] == '|') {
+		return false;
+	}
+
+	if (token.find_first_of("*?!") != string::npos) {
+		return false;
+	}
+
+	if (token[0] == '[') {
+		size_t close = token.find("]:");
+		if (close == string::npos) {
+			return false;
+		}
+
+		port = atoi(token.c_str() + close + 2);
+		token = token.substr(1, close - 1);
+	}
+
+	key = MakeKey(token, port);
+	return true;
+}
+
+/*
+==================
+static KnownHosts::SplitLine
+
+Split a known_hosts line into its host list, key type and
+base64 encoded key. Comments, blank lines and lines with an
+@-marker are rejected.
+==================
+*/
+bool KnownHosts::SplitLine(const char *line, uint32 len, string &hosts,
+						   string &keyType, string &key) {
+	string *fields[3] = { &hosts, &keyType, &key };
+	uint32 i = 0;
+
+	for (int f=0; f<3; f++) {
+		while (i < len && (line[i] == ' ' || line[i] == '\t')) {
+			i++;
+		}
+
+		uint32 start = i;
+		while (i < len && line[i] != ' ' && line[i] != '\t'
+					   && line[i] != '\r') {
+			i++;
+		}
+
+		if (start == i) {
+			return false;
+		}
+
+		fields[f]->assign(line + start, i - start);
+	}
+
+	return hosts[0] != '#' && hosts[0] != '@';
+}
+
+/*
+==================
+static KnownHosts::EncodeKey
+==================
+*/
+string KnownHosts::EncodeKey(const ubyte *blob, uint32 len) {
+	vector<ubyte> out(4 * ((len + 2) / 3) + 1);
+	int n = EVP_EncodeBlock(&out[0], blob, len);
+	return string((const char*)&out[0], n);
+}
+
+/*
+==================
+static KnownHosts::GetKeyType
+
+The key type is the first string of the key blob.
+==================
+*/
+string KnownHosts::GetKeyType(const ubyte *blob, uint32 len) {
+	uint32 slen;
+
+	if (len < 4) {
+		return "";
+	}
+
+	BytesToInt(slen, blob);
+	if (slen > len - 4) {
+		return "";
+	}
+
+	return string((const char*)blob + 4, slen);
+}
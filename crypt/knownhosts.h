@@ -0,0 +1,112 @@
+#pragma once
+
+#include "../sshay.h"
+
+/*
+==================
+KHResult
+==================
+*/
+enum KHResult {
+	KH_OK,			// The host is known with this key
+	KH_UNKNOWN,		// The host is not in the file
+	KH_CHANGED,		// The host is known with a different key
+	KH_OTHER_TYPE,	// The host is known only with keys of other types
+	KH_ERROR,		// The file could not be read
+};
+
+/*
+==================
+KHIndexHeader / KHSlot
+
+Layout of the index file. The header is followed by
+"numSlots" slots, an open-addressed (linear probing) hash
+table keyed on "host:port". Each slot points at the line of
+the known_hosts file holding the entry.
+==================
+*/
+struct KHIndexHeader {
+	uint32 		magic;
+	uint32 		version;
+	uint64 		fileSize;		// Size of known_hosts when indexed
+	uint64 		fileMtime;		// Modification time of known_hosts
+	uint32 		numSlots;		// Always a power of two
+	uint32 		numUsed;
+};
+
+struct KHSlot {
+	uint64 		hash;			// 0 marks an empty slot
+	uint32 		offset;			// Start of the line in known_hosts
+	uint32 		length;			// Length of the line
+};
+
+#define KH_MAGIC 		0x49484b53		// "SKHI"
+#define KH_VERSION 		1
+
+/*
+==================
+KnownHosts
+
+Verification of server host keys against an OpenSSH-style
+known_hosts file. Both the file and an index of it (stored
+as "<file>.idx") are mmap'd, so a lookup touches only a few
+slots and lines no matter how many entries the file holds.
+
+The index is rebuilt when the size or modification time of
+the known_hosts file no longer matches the index header.
+Hashed host names, wildcard patterns and @-markers are not
+indexed.
+==================
+*/
+class KnownHosts {
+public:
+				KnownHosts();
+				~KnownHosts();
+
+	/* Map "path" and its index, building the index if needed */
+	bool 		Open(string path);
+	void 		Close();
+
+	/* "blob" is the raw host key (K_S) without its length field */
+	KHResult 	Check(string host, int port, const ubyte *blob, uint32 len);
+	bool 		Add(string host, int port, const ubyte *blob, uint32 len);
+
+	/* The key types the host is known with, e.g. "ssh-rsa" */
+	vector<string> KeyTypes(string host, int port);
+
+	static string DefaultPath();
+
+private:
+	string 		filePath;
+	string 		indexPath;
+
+	int 		fileFd;
+	const char 	*fileData;
+	uint64 		fileSize;
+
+	int 		indexFd;
+	ubyte 		*indexData;
+	uint64 		indexSize;
+
+	KHIndexHeader* 	Header();
+	KHSlot* 		Slots();
+
+	bool 		MapFile();
+	bool 		MapIndex();
+	bool 		BuildIndex();
+	bool 		IndexIsCurrent();
+	void 		Unmap();
+
+	void 		InsertSlot(KHSlot *slots, uint32 numSlots,
+						   uint64 hash, uint32 off, uint32 len);
+	bool 		ReadEntry(const KHSlot &slot, uint64 hash, const string &key,
+						  string &keyType, string &encoded);
+
+	static uint64 	Hash(const string &key);
+	static string 	MakeKey(string host, int port);
+	static bool 	ParseHostToken(string token, string &key);
+	static bool 	SplitLine(const char *line, uint32 len, string &hosts,
+							  string &keyType, string &key);
+	static string 	EncodeKey(const ubyte *blob, uint32 len);
+	static string 	GetKeyType(const ubyte *blob, uint32 len);
+};
@@ -1,5 +1,4 @@
 #include "macsha1.h"
-#include <openssl/sha.h>
 
 /*
 ==================
@@ -7,7 +6,13 @@ MacSHA1::MacSHA1
 ==================
 */
 MacSHA1::MacSHA1() {
-	lptr = NULL;
+	ctx = EVP_MD_CTX_new();
+	EVP_DigestInit_ex(ctx, EVP_sha1(), NULL);
+}
+
+MacSHA1::MacSHA1(const MacSHA1 &other) {
+	ctx = EVP_MD_CTX_new();
+	EVP_MD_CTX_copy_ex(ctx, other.ctx);
 }
 
 /*
@@ -16,55 +21,38 @@ MacSHA1::~MacSHA1
 ==================
 */
 MacSHA1::~MacSHA1() {
-	if (lptr) {
-		delete[] lptr;
-	}
+	EVP_MD_CTX_free(ctx);
 }
 
 /*
 ==================
-MacSHA1::GetHash
+MacSHA1::operator=
 ==================
 */
-ubyte* MacSHA1::GetHash() {
-	if (lptr) {
-		delete[] lptr;
+MacSHA1& MacSHA1::operator=(const MacSHA1 &other) {
+	if (this != &other) {
+		EVP_MD_CTX_copy_ex(ctx, other.ctx);
 	}
 
-	ubyte *input = new ubyte[buffer.size()];
-	copy(buffer.begin(), buffer.end(), input);
-
-	lptr = new ubyte[20];
-
-	SHA1(input, buffer.size(), lptr);
-
-	delete[] input;
-	return lptr;
+	return *this;
 }
 
 /*
 ==================
-MacSHA1::GetBuffer
+MacSHA1::GetHash
+
+The hash is finished on a copy of the state, leaving the
+running hash untouched.
 ==================
 */
-ubyte* MacSHA1::GetBuffer() {
-	if (lptr) {
-		delete[] lptr;
-	}
-
-	lptr = new ubyte[buffer.size()];
-	copy(buffer.begin(), buffer.end(), lptr);
+ubyte* MacSHA1::GetHash() {
+	EVP_MD_CTX *fin = EVP_MD_CTX_new();
 
-	return lptr;
-}
+	EVP_MD_CTX_copy_ex(fin, ctx);
+	EVP_DigestFinal_ex(fin, hash, NULL);
+	EVP_MD_CTX_free(fin);
 
-/*
-==================
-MacSHA1::GetBufferLength
-==================
-*/
-int MacSHA1::GetBufferLength() {
-	return buffer.size();
+	return hash;
 }
 
 /*
@@ -73,7 +61,7 @@ MacSHA1::Clear
 ==================
 */
 void MacSHA1::Clear() {
-	buffer.clear();
+	EVP_DigestInit_ex(ctx, EVP_sha1(), NULL);
 }
 
 /*
@@ -82,30 +70,26 @@ MacSHA1::Add
 ==================
 */
 void MacSHA1::Add(string str) {
-	for (int i=0; i<str.length(); i++) {
-		buffer.push_back((ubyte)str[i]);
-	}
+	EVP_DigestUpdate(ctx, str.c_str(), str.length());
 }
 
 void MacSHA1::Add(byte b) {
-	buffer.push_back((ubyte)b);
+	EVP_DigestUpdate(ctx, &b, 1);
 }
 
 void MacSHA1::Add(ubyte ub) {
-	buffer.push_back(ub);
+	EVP_DigestUpdate(ctx, &ub, 1);
 }
 
-void MacSHA1::Add(ubyte *ub, uint32 len) {
-	for (int i=0; i<len; i++) {
-		buffer.push_back(ub[i]);
-	}
+void MacSHA1::Add(const ubyte *ub, uint32 len) {
+	EVP_DigestUpdate(ctx, ub, len);
 }
 
 void MacSHA1::AddUI(uint32 ui) {
-	ubyte *ptr = (ubyte*)&ui;
+	ubyte bytes[4] = {
+		(ubyte)(ui >> 24), (ubyte)(ui >> 16),
+		(ubyte)(ui >> 8),  (ubyte)ui
+	};
 
-	buffer.push_back(ptr[3]);
-	buffer.push_back(ptr[2]);
-	buffer.push_back(ptr[1]);
-	buffer.push_back(ptr[0]);
-}
\ No newline at end of file
+	EVP_DigestUpdate(ctx, bytes, 4);
+}
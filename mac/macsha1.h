@@ -1,24 +1,37 @@
 #pragma once
 
-#include <openssl/sha.h>
+#include <openssl/evp.h>
 #include "../sshay.h"
 
+/*
+==================
+MacSHA1
+
+Incremental SHA-1. Data is hashed as it is added, and
+"GetHash" may be called at any point without ending the
+hash, so more data can be added afterwards. Copying a
+MacSHA1 clones the hash state, which lets a common prefix
+be hashed once and extended in several ways.
+==================
+*/
 class MacSHA1 {
 public:
 					MacSHA1();
+					MacSHA1(const MacSHA1 &other);
 					~MacSHA1();
+	MacSHA1& 		operator=(const MacSHA1 &other);
+
+	/* The hash of all data added so far */
 	ubyte*			GetHash();
-	ubyte* 			GetBuffer();
-	int 			GetBufferLength();
 	void 			Clear();
 
 	void 			Add(string str);
 	void 			Add(byte b);
 	void 			Add(ubyte ub);
-	void 			Add(ubyte *ub, uint32 len);
+	void 			Add(const ubyte *ub, uint32 len);
 	void 			AddUI(uint32 ui);
-	
+
 private:
-	vector<ubyte> 	buffer;
-	ubyte 			*lptr;
-};
\ No newline at end of file
+	EVP_MD_CTX 		*ctx;
+	ubyte 			hash[20];
+};
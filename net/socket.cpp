@@ -1,11 +1,13 @@
 #include "socket.h"
 #include "../prot/packet.h"
-#include "../prot/session.h"
-#include "../mac/macsha1.h"
+#include "../prot/transport.h"
 #include "../crypt/crypttdes.h"
-#include "../globdata.h"
 
 #include <fcntl.h>
+#include <netinet/tcp.h>
+#ifdef __linux__
+#include <linux/sockios.h>
+#endif
 
 /*
 ==================
@@ -14,15 +16,18 @@ Socket::Socket
 */
 Socket::Socket() {
 	socketID 			= -1;
-	server 				= NULL;
 	connected 			= false;
 	port 				= 22;
 	lptr 				= NULL;
 	recBytes 			= 0;
 	senBytes 			= 0;
+	corked 				= false;
+	inpos 				= 0;
+	haveFirst 			= false;
+	holdSplit 			= false;
+	transport 			= NULL;
 
-	while (!pqueue.empty()) 
-		pqueue.pop();
+	pqueue.clear();
 
 	bzero((char*)&serverAddress, sizeof(serverAddress));
 }
@@ -42,10 +47,23 @@ Socket::~Socket() {
 	while (!pqueue.empty()) {
 		pair<uint32, ubyte*> p = pqueue.front();
 		delete[] p.second;
-		pqueue.pop();
+		pqueue.pop_front();
 	}
 }
 
+/*
+==================
+Socket::SetTransport
+
+Packets are protected with the cipher, MAC keys and 
+sequence numbers of "t". Without a transport, packets
+are written and read in the clear.
+==================
+*/
+void Socket::SetTransport(Transport *t) {
+	transport = t;
+}
+
 /*
 ==================
 Socket::Connect
@@ -66,12 +84,20 @@ bool Socket::Connect(string addr, int portnum) {
 	port = portnum;
 	strAddress = addr;
 
-	server = gethostbyname(addr.c_str());
-	if (!server) {
+	/* getaddrinfo is used, rather than gethostbyname, as sessions
+	 * may connect from several threads at once */
+	addrinfo hints, *res = NULL;
+	bzero((char*)&hints, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+
+	if (getaddrinfo(addr.c_str(), NULL, &hints, &res) || !res) {
 		Error("Failed to get host from name");
 		return false;
 	}
 
+	memcpy(&serverAddress, res->ai_addr, sizeof(serverAddress));
+	freeaddrinfo(res);
 
 	socketID = socket(AF_INET, SOCK_STREAM, 0);
 	if (socketID < 0) {
@@ -80,19 +106,25 @@ bool Socket::Connect(string addr, int portnum) {
 	}
 
 	serverAddress.sin_family = AF_INET;
-	bcopy((char*)server->h_addr,
-		  (char*)&serverAddress.sin_addr.s_addr,
-		   server->h_length);
 	serverAddress.sin_port = htons(port);
 
 	int n = connect(socketID, (sockaddr*)&serverAddress, sizeof(serverAddress));
 	if (n < 0) {
 		Error("Failed to connect to host", errno);
+		close(socketID);
+		socketID = -1;
 		return false;
 	}
 
 	connected = true;
 
+#ifdef TCP_NOTSENT_LOWAT
+	/* Limit what sits unsent in the kernel, so that queued 
+	 * bulk data does not hold back later keystrokes */
+	int lowat = SOCKET_UNSENT_LOWAT;
+	setsockopt(socketID, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat, sizeof(lowat));
+#endif
+
 	return true;
 }
 
@@ -108,7 +140,6 @@ void Socket::Disconnect() {
 
 	connected 	= false;
 	socketID 	= -1;
-	server 		= NULL;
 	port 		= 22;
 
 	bzero((char*)&serverAddress, sizeof(serverAddress));
@@ -126,10 +157,16 @@ bool Socket::IsConnected() {
 /*
 ==================
 Socket::Write
+
+Append the MAC to a packet, encrypt and send it. If the 
+socket is corked, the packet is buffered until "Uncork" is 
+called.
 ==================
 */
 bool Socket::Write(const ubyte *raw, uint32 len) {
 	ubyte *data;
+	ubyte mac[20];
+	bool hash = transport && transport->hashOut;
 
 	if (!connected) {
 		Warning("Tried to write to closed socket");
@@ -141,55 +178,155 @@ bool Socket::Write(const ubyte *raw, uint32 len) {
 		return false;
 	}
 
-	data = new ubyte[len];
-	memcpy(data, raw, len);
-
-	if (Session::DoCipherPackets()) {
-		uint32 ciphLen = len;
-		if (Session::DoHashPackets()) {
-			ciphLen -= 20;
-		}
+	if (hash) {
+		transport->MacOut(raw, len, mac);
+	}
 
-		if (ciphLen % 8) {
+	if (transport && transport->cipherOut) {
+		if (len % 8) {
 			Error("Socket::Write(): Cannot encrypt data! "
 				  "The length of the data is not a factor of 8.",
-				  	ciphLen);
+				  	len);
 			return false;
 		}
 
-		CryptTDES *ciph = Session::GetCipher();
-		ubyte *enc = ciph->Encrypt(data, ciphLen);
-		memcpy(data, enc, ciphLen);
+		data = transport->cipher->Encrypt(raw, len);
+		outbuf.insert(outbuf.end(), data, data+len);
+	} else {
+		outbuf.insert(outbuf.end(), raw, raw+len);
 	}
 
-	// TODO: Verify MAC	
+	if (hash) {
+		outbuf.insert(outbuf.end(), mac, mac+20);
+	}
 
-	int n = write(socketID, data, len);
-	if (n < 0) {
-		Warning("Failed to write to socket", errno);
-		delete[] data;
+	if (transport) {
+		transport->sequenceOut++;
+	}
+
+	if (!corked) {
+		return Flush();
+	}
+
+	return true;
+}
+
+/*
+==================
+Socket::WriteRaw
+
+Write data which is not an SSH-packet, such as the
+identification string. The data is neither encrypted nor
+counted in the sequence numbers.
+==================
+*/
+bool Socket::WriteRaw(const ubyte *raw, uint32 len) {
+	if (!connected) {
+		Warning("Tried to write to closed socket");
 		return false;
 	}
 
-	senBytes += n;
+	outbuf.insert(outbuf.end(), raw, raw+len);
 
-	Session::IncrementSequenceOut();
+	if (!corked) {
+		return Flush();
+	}
 
-	delete[] data;
+	return true;
+}
+
+/*
+==================
+Socket::Unsent
+
+Data which is sent, but not yet acknowledged, is not
+counted.
+==================
+*/
+uint32 Socket::Unsent() {
+	int n = 0;
+
+#ifdef SIOCOUTQNSD
+	if (ioctl(socketID, SIOCOUTQNSD, &n) < 0) {
+		return 0;
+	}
+#endif
+
+	return (n > 0) ? n : 0;
+}
+
+/*
+==================
+Socket::Cork
+==================
+*/
+void Socket::Cork() {
+	corked = true;
+}
+
+/*
+==================
+Socket::Uncork
+
+Send everything written since "Cork" was called.
+==================
+*/
+bool Socket::Uncork() {
+	corked = false;
+	return Flush();
+}
+
+/*
+==================
+Socket::Flush
+==================
+*/
+bool Socket::Flush() {
+	uint32 pos = 0;
+
+	while (pos < outbuf.size()) {
+		int n = write(socketID, &outbuf[pos], outbuf.size()-pos);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			Warning("Failed to write to socket", errno);
+			outbuf.clear();
+			return false;
+		}
+
+		pos += n;
+		senBytes += n;
+	}
+
+	outbuf.clear();
 	return true;
 }
 
 /*
 ==================
 Socket::HasData
+
+Receives whatever is available without blocking, and 
+returns true if a complete packet can be read.
 ==================
 */
 bool Socket::HasData() {
+	if (!pqueue.empty()) {
+		return true;
+	}
+
 	if (!connected || socketID == -1) {
 		return false;
 	}
 
-	return (NextSize() > 0) || (!pqueue.empty());
+	SplitBuffered();
+	while (pqueue.empty() && Fill(false)) {
+		SplitBuffered();
+	}
+
+	return !pqueue.empty();
 }
 
 /*
@@ -206,52 +343,114 @@ ubyte* Socket::Read() {
 		lptr = NULL;
 	}
 
-	if (PopQueue()) {
-		return lptr;
+	while (true) {
+		SplitBuffered();
+
+		if (PopQueue()) {
+			return lptr;
+		}
+
+		if (!connected || socketID == -1) {
+			Warning("Tried to read from closed socket");
+			return NULL;
+		}
+
+		if (!Fill(true)) {
+			lastSize = 0;
+			return NULL;
+		}
 	}
+}
 
-	if (!connected || socketID == -1) {
-		Warning("Tried to read from closed socket");
-		return NULL;
+/*
+==================
+Socket::ReadMatching
+
+Returns the first packet with a message type in "types".
+Packets of other types are left in the queue, in order,
+for later calls to Read or ReadMatching.
+==================
+*/
+ubyte* Socket::ReadMatching(const ubyte *types, uint32 ntypes) {
+	uint32 i = 0;
+
+	if (lptr) {
+		delete[] lptr;
+		lptr = NULL;
 	}
 
-	vector<ubyte> buffer;
-	ubyte tmp[256];
-	ubyte *data;
-	int n = 0;
+	while (true) {
+		SplitBuffered();
 
-	do {
-		n = recv(socketID, tmp, 256, 0);
-		
-		for (int i=0; i<n; i++) {
-			buffer.push_back(tmp[i]);
+		for (; i<pqueue.size(); i++) {
+			if (pqueue[i].first < 6) {
+				continue;
+			}
+
+			for (uint32 t=0; t<ntypes; t++) {
+				if (pqueue[i].second[5] == types[t]) {
+					TakePacket(i);
+					return lptr;
+				}
+			}
 		}
-	} while (n == 256);
 
-	if (n < 0) {
-		Warning("Failed to read from socket", errno);
-		lastSize = 0;
-		return NULL;
-	} else if (!buffer.size()) {
-		Warning("The connection closed unexpectedly", errno);
-		lastSize = 0;
-		return NULL;
-	} 
+		/* Nothing beyond a NEWKEYS can be decrypted before
+		 * the NEWKEYS itself is handled. */
+		if (holdSplit) {
+			Warning("Socket::ReadMatching(): Unexpected NEWKEYS");
+			lastSize = 0;
+			return NULL;
+		}
+
+		if (!connected || socketID == -1) {
+			Warning("Tried to read from closed socket");
+			lastSize = 0;
+			return NULL;
+		}
 
-	data = new ubyte[buffer.size()];
-	for (int i=0; i<buffer.size(); i++) {
-		data[i] = buffer[i];
+		if (!Fill(true)) {
+			lastSize = 0;
+			return NULL;
+		}
 	}
+}
+
+/*
+==================
+Socket::ReadLine
 
-	ProcessData(data, buffer.size());
+Read a single CR LF terminated line. Only used before
+the binary packet protocol starts, to read the server's
+identification string and whatever lines preceeds it.
+==================
+*/
+bool Socket::ReadLine(string &line) {
+	line = "";
+
+	while (true) {
+		while (inpos < inbuf.size()) {
+			ubyte c = inbuf[inpos++];
 
-	recBytes += buffer.size();
+			if (c == 10) {
+				if (line.length() && line[line.length()-1] == 13) {
+					line = line.substr(0, line.length()-1);
+				}
+				return true;
+			}
 
-	Session::IncrementSequenceIn();
+			line += c;
+		}
 
-	PopQueue();
+		if (line.length() > 255) {
+			Error("Socket::ReadLine(): Line too long");
+			return false;
+		}
 
-	return lptr;
+		if (!Fill(true)) {
+			return false;
+		}
+	}
 }
 
 /*
@@ -304,36 +503,59 @@ int Socket::GetSocketID() {
 
 /*
 ==================
-Socket::ProcessData
+Socket::Fill
 
-If more than one packet is received at the same 
-time, the packets must be divided and stored in
-'pqueue'. 
-
-If the server identification string has NOT arrived,
-the packet is added directly to 'pqueue'.
+Receive data from the connection into 'inbuf'. False is
+returned when nothing was received.
 ==================
 */
-void Socket::ProcessData(ubyte *data, uint32 len) {
-	uint32 i = 0;
+bool Socket::Fill(bool blocking) {
+	ubyte tmp[16384];
+	int n;
+
+	/* Drop the data which has already been split */
+	if (inpos == inbuf.size()) {
+		inbuf.clear();
+		inpos = 0;
+	} else if (inpos > 65536) {
+		inbuf.erase(inbuf.begin(), inbuf.begin()+inpos);
+		inpos = 0;
+	}
 
-	if (GData::remoteid.length() == 0) {
-		ubyte *buf = new ubyte[len];
-		memcpy(buf, data, len);
+	do {
+		n = recv(socketID, tmp, sizeof(tmp), blocking ? 0 : MSG_DONTWAIT);
+	} while (n < 0 && errno == EINTR);
 
-		pair<uint32, ubyte*> p;
-		p.first = len;
-		p.second = buf;
-		pqueue.push(p);
-		return;
+	if (n < 0) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK) {
+			Warning("Failed to read from socket", errno);
+			Disconnect();
+		}
+		return false;
+	} else if (n == 0) {
+		Warning("The connection closed unexpectedly");
+		Disconnect();
+		return false;
 	}
 
-	while (i < len) {
-		uint32 ret = SplitPackets(data+i, len-i);
-		if (!ret) {
-			return;
-		}
-		i += ret;
+	inbuf.insert(inbuf.end(), tmp, tmp+n);
+	recBytes += n;
+
+	return true;
+}
+
+/*
+==================
+Socket::SplitBuffered
+
+Split as many complete packets as possible out of 'inbuf'.
+Splitting stops after a NEWKEYS packet, as the following
+packets must be decrypted with the new keys.
+==================
+*/
+void Socket::SplitBuffered() {
+	while (!holdSplit && SplitPackets()) {
+		continue;
 	}
 }
 
@@ -341,68 +563,85 @@ void Socket::ProcessData(ubyte *data, uint32 len) {
 ==================
 Socket::SplitPackets
 
-Given an input of N+X bytes, where the first N bytes
-make up an encrypted received packet, N is returned 
-and the N first bytes are pushed at the back of 'pqueue'.
+If the first N bytes of the unsplit data make up an 
+encrypted received packet, the decrypted packet is pushed
+at the back of 'pqueue' and N is returned. If the packet 
+is incomplete, 0 is returned and the data is left alone.
 ==================
 */
-uint32 Socket::SplitPackets(ubyte *data, uint32 len) {
+uint32 Socket::SplitPackets() {
 	ubyte *tmp, *buf;
-	ubyte first[8];
-	uint32 pacLen, remain, fullLen;
-	CryptTDES *cipher = Session::GetCipher();
+	uint32 pacLen, remain, fullLen, macLen;
+	bool decrypt = transport && transport->cipherIn;
 
-	if (len < 8) {
-		Warning("Socket::SplitPackets(): "
-				"len < 8", len);
-		return 0;
-	}
+	if (!haveFirst) {
+		if (inbuf.size() - inpos < 8) {
+			return 0;
+		}
 
-	if (Session::DoCipherPackets()) {
-		/* Decrypt the first 8 bytes of the packet */
-		tmp = cipher->Decrypt(data, 8);
-		memcpy(first, tmp, 8);
-	} else {
-		memcpy(first, data, 8);
+		/* Decrypt the first 8 bytes of the packet. This is done
+		 * once only, as it advances the cipher's working vector. */
+		if (decrypt) {
+			tmp = transport->cipher->Decrypt(&inbuf[inpos], 8);
+			memcpy(firstBlock, tmp, 8);
+		} else {
+			memcpy(firstBlock, &inbuf[inpos], 8);
+		}
+
+		inpos += 8;
+		haveFirst = true;
 	}
 
 	/* Retrieve the packet length */
-	BytesToInt(pacLen, first);
-	fullLen = pacLen + 4 + Session::DoHashPackets()*20;
-	remain = pacLen - 4;
+	BytesToInt(pacLen, firstBlock);
+	macLen = (transport && transport->hashIn) ? 20 : 0;
 
-	if (fullLen > len) {
-		Warning("Socket::SplitPackets(): "
-				"FullLen > len", fullLen-len);
+	if (pacLen < 12 || pacLen > SOCKET_MAX_PACKET) {
+		Error("Socket::SplitPackets(): Bad packet length", pacLen);
+		Disconnect();
 		return 0;
 	}
 
-	if (Session::DoCipherPackets()) {
-		/* Decrypt the rest of the packet */
-		tmp = cipher->Decrypt(data+8, remain);
-	} else {
-		tmp = new ubyte[remain];
-		memcpy(tmp, data+8, remain);
+	fullLen = pacLen + 4 + macLen;
+	remain = pacLen - 4;
+
+	if (inbuf.size() - inpos < remain + macLen) {
+		return 0;
 	}
 
 	/* Store the entire packet in buf */
 	buf = new ubyte[fullLen];
-	memcpy(buf+0, first, 8);
-	memcpy(buf+8, tmp, remain);
+	memcpy(buf+0, firstBlock, 8);
 
-	if (Session::DoHashPackets()) {
-		memcpy(buf+8+remain, data+pacLen+4, 20);
+	if (decrypt) {
+		/* Decrypt the rest of the packet */
+		tmp = transport->cipher->Decrypt(&inbuf[inpos], remain);
+		memcpy(buf+8, tmp, remain);
+	} else {
+		memcpy(buf+8, &inbuf[inpos], remain);
 	}
-	if (!Session::DoCipherPackets()) {
-		delete[] tmp;
+
+	if (macLen) {
+		memcpy(buf+8+remain, &inbuf[inpos+remain], macLen);
 	}
 
+	inpos += remain + macLen;
+	haveFirst = false;
+
 	/* Add the buffer to 'pqueue' */
 	pair<uint32, ubyte*> p;
 	p.first = fullLen;
 	p.second = buf;
 
-	pqueue.push(p);
+	pqueue.push_back(p);
+
+	if (transport) {
+		transport->sequenceIn++;
+	}
+
+	if (buf[5] == SSH_MSG_NEWKEYS) {
+		holdSplit = true;
+	}
 
 	return fullLen;
 }
@@ -422,17 +661,33 @@ bool Socket::PopQueue() {
 	}
 
 	if (!pqueue.empty()) {
-		pair<uint32, ubyte*> p = pqueue.front();
-
-		lastSize = p.first;
-		lptr = p.second;
-
-		pqueue.pop();
+		TakePacket(0);
 		return true;
-
 	} else {
 		lastSize = 0;
 		lptr = NULL;
 		return false;
 	}
-}
\ No newline at end of file
+}
+
+/*
+==================
+Socket::TakePacket
+
+Remove element "index" from 'pqueue' and make it the last
+read packet. Taking a NEWKEYS packet resumes splitting, as 
+the caller is expected to switch keys before the next read.
+==================
+*/
+void Socket::TakePacket(uint32 index) {
+	pair<uint32, ubyte*> p = pqueue[index];
+
+	lastSize = p.first;
+	lptr = p.second;
+
+	pqueue.erase(pqueue.begin() + index);
+
+	if (lastSize >= 6 && lptr[5] == SSH_MSG_NEWKEYS) {
+		holdSplit = false;
+	}
+}
@@ -7,10 +7,17 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <netdb.h>
-#include <queue>
+#include <deque>
 
-struct hostent;
 struct sockaddr_in;
+struct Transport;
+
+/* Packets longer than this are treated as a protocol error */
+#define SOCKET_MAX_PACKET 	262144
+
+/* The socket polls writable while less than this much of the
+ * written data is still unsent */
+#define SOCKET_UNSENT_LOWAT	131072
 
 
 class Socket {
@@ -18,36 +25,62 @@ public:
 					Socket();
 	virtual 		~Socket();
 
+	void 			SetTransport(Transport *t);
 	bool 			Connect(string addr, int portnum);
 	void 			Disconnect();
 	bool 			IsConnected();
 
 	bool 			Write(const ubyte *raw, uint32 len);
+	bool 			WriteRaw(const ubyte *raw, uint32 len);
 	bool 			HasData();
 	ubyte* 			Read();	
+	ubyte* 			ReadMatching(const ubyte *types, uint32 ntypes);
+	bool 			ReadLine(string &line);
 	int 			LastSize();	
 	int 			NextSize(bool blocking=false);
 	int 			GetSocketID();
+	uint64 			GetBytesSent() { return senBytes; }
+	uint64 			GetBytesReceived() { return recBytes; }
+
+	/* Written bytes the kernel has not yet sent, 0 if unknown */
+	uint32 			Unsent();
+
+	/* While corked, written packets are buffered and sent
+	 * together in a single write when uncorked. */
+	void 			Cork();
+	bool 			Uncork();
 
 private:
 	int 			socketID;
 	int 			port;
 	string 			strAddress;		// Store the address for debugging purposes
-	hostent 		*server;
 	sockaddr_in 	serverAddress;
 	bool 			connected;
+	Transport 		*transport;
 
 	int 			lastSize;
 	ubyte 			*lptr;
 
-	uint32 			recBytes;	// Received bytes
-	uint32 			senBytes;	// Sent bytes
+	uint64 			recBytes;	// Received bytes
+	uint64 			senBytes;	// Sent bytes
 
-	queue< pair<uint32, ubyte*> >	
+	deque< pair<uint32, ubyte*> >	
 					pqueue;			// Queued packets
 
-	void 			ProcessData(ubyte *data, uint32 len);
-	uint32 			SplitPackets(ubyte *data, uint32 len);
+	bool 			corked;
+	vector<ubyte> 	outbuf;			// Buffered outgoing data
+
+	vector<ubyte> 	inbuf;			// Received, unsplit data
+	uint32 			inpos;			// Start of the unsplit data
+	ubyte 			firstBlock[8];	// Decrypted start of next packet
+	bool 			haveFirst;
+	bool 			holdSplit;		// A NEWKEYS packet is queued
+
+	bool 			Fill(bool blocking);
+	bool 			Flush();
+	void 			SplitBuffered();
+	uint32 			SplitPackets();
 
 	bool 			PopQueue();
+	void 			TakePacket(uint32 index);
 };
\ No newline at end of file
@@ -0,0 +1,209 @@
+#include "blockhash.h"
+#include "scp.h"
+#include "../mac/macsha1.h"
+
+#include <fcntl.h>
+
+/*
+==================
+BlockHasher::BlockHasher
+==================
+*/
+BlockHasher::BlockHasher() : next(0), failed(false) {
+	fd = -1;
+	length = 0;
+}
+
+/*
+==================
+BlockHasher::~BlockHasher
+==================
+*/
+BlockHasher::~BlockHasher() {
+	Finish();
+}
+
+/*
+==================
+BlockHasher::Start
+==================
+*/
+bool BlockHasher::Start(string path, uint64 len) {
+	uint32 blocks = (len + HASH_BLOCK - 1) / HASH_BLOCK;
+	long cores = sysconf(_SC_NPROCESSORS_ONLN);
+	uint32 count = MIN(MAX(cores, 1), HASH_THREADS_MAX);
+
+	fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0) {
+		return false;
+	}
+
+	length = len;
+	hashes.assign(blocks, "");
+	posix_fadvise(fd, 0, len, POSIX_FADV_WILLNEED);
+
+	for (uint32 i=0; i<MIN(count, blocks); i++) {
+		pthread_t thread;
+
+		if (pthread_create(&thread, NULL, &HashThread, this)) {
+			break;
+		}
+
+		threads.push_back(thread);
+	}
+
+	/* Hashed here instead */
+	if (threads.empty() && blocks) {
+		HashThread(this);
+	}
+
+	return true;
+}
+
+/*
+==================
+BlockHasher::Finish
+
+A block which could not be read has no hash, and is never
+the same as the remote one.
+==================
+*/
+vector<string> BlockHasher::Finish() {
+	for (unsigned i=0; i<threads.size(); i++) {
+		pthread_join(threads[i], NULL);
+	}
+	threads.clear();
+
+	if (fd >= 0) {
+		close(fd);
+		fd = -1;
+	}
+
+	return hashes;
+}
+
+/*
+==================
+static BlockHasher::HashThread
+==================
+*/
+void* BlockHasher::HashThread(void *arg) {
+	static const char hex[] = "0123456789abcdef";
+	BlockHasher *h = (BlockHasher*)arg;
+	vector<ubyte> buf(HASH_BLOCK);
+	MacSHA1 sha;
+	uint32 i;
+
+	while ((i = h->next++) < h->hashes.size()) {
+		uint64 offset = (uint64)i * HASH_BLOCK;
+		uint32 len = MIN(h->length - offset, (uint64)HASH_BLOCK);
+		uint32 got = 0;
+
+		while (got < len) {
+			int n = pread(h->fd, &buf[got], len - got, offset + got);
+
+			if (n < 0 && errno == EINTR) {
+				continue;
+			}
+
+			if (n <= 0) {
+				break;
+			}
+
+			got += n;
+		}
+
+		if (got < len) {
+			continue;
+		}
+
+		sha.Clear();
+		sha.Add(&buf[0], len);
+
+		const ubyte *d = sha.GetHash();
+		string out(40, '0');
+
+		for (uint32 k=0; k<20; k++) {
+			out[2*k] = hex[d[k] >> 4];
+			out[2*k+1] = hex[d[k] & 15];
+		}
+
+		h->hashes[i] = out;
+	}
+
+	return NULL;
+}
+
+/*
+==================
+static BlockHasher::RemoteCommand
+==================
+*/
+string BlockHasher::RemoteCommand(string path, uint64 len) {
+	stringstream ss;
+	uint64 blocks = (len + HASH_BLOCK - 1) / HASH_BLOCK;
+
+	ss <<"f=" <<ScpClient::QuotePath(path) <<"; "
+	   <<"[ -f \"$f\" ] || exit " <<HASH_NO_FILE <<"; "
+	   <<"wc -c < \"$f\" || exit 1; "
+	   <<"if split --version >/dev/null 2>&1; then "
+	   <<"head -c " <<len <<" \"$f\" | split -b " <<HASH_BLOCK 
+	   <<" --filter=sha1sum; "
+	   <<"else i=0; while [ $i -lt " <<blocks <<" ]; do "
+	   <<"dd if=\"$f\" bs=" <<HASH_BLOCK <<" skip=$i count=1 2>/dev/null"
+	   <<" | sha1sum; i=$((i+1)); done; fi";
+
+	return ss.str();
+}
+
+/*
+==================
+static BlockHasher::ParseRemote
+
+The first line is the size, every other line starts with
+the hash of a block.
+==================
+*/
+bool BlockHasher::ParseRemote(const string &out, uint64 &size, 
+							  vector<string> &remote) {
+	stringstream ss(out);
+	string line;
+
+	if (!getline(ss, line) || line.find_first_of("0123456789") == string::npos) {
+		return false;
+	}
+
+	size = strtoull(line.c_str(), NULL, 10);
+	remote.clear();
+
+	while (getline(ss, line)) {
+		if (line.length() < 40 || line.find_first_not_of("0123456789abcdef") < 40) {
+			return false;
+		}
+
+		remote.push_back(line.substr(0, 40));
+	}
+
+	return true;
+}
+
+/*
+==================
+static BlockHasher::Compare
+
+Only whole blocks are the same. The rest of a partial last
+block is always copied.
+==================
+*/
+vector<bool> BlockHasher::Compare(const vector<string> &local, 
+								  const vector<string> &remote, 
+								  uint64 len) {
+	vector<bool> same(len / HASH_BLOCK, false);
+
+	for (uint32 i=0; i<same.size(); i++) {
+		same[i] = i < local.size() && i < remote.size() 
+			   && local[i].length() && local[i] == remote[i];
+	}
+
+	return same;
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include "../sshay.h"
+#include "sftp.h"
+#include <pthread.h>
+#include <atomic>
+
+/* Size of a compared block. The same as the blocks claimed
+ * by striped transfers, so a block is skipped as a whole. */
+#define HASH_BLOCK 			SFTP_BLOCK
+
+/* Most threads hashing at once */
+#define HASH_THREADS_MAX 	16
+
+/* Exit status of the remote command if there is no file */
+#define HASH_NO_FILE 		2
+
+/*
+==================
+BlockHasher
+
+Hashes a local file in HASH_BLOCK blocks, on a thread per
+core, for comparing it with the same file on the server. 
+The threads take the next unhashed block in turn, and each
+block's SHA-1 is kept as lowercase hex, as "sha1sum" 
+writes it.
+
+The hashes of the remote file are made by the command of
+"RemoteCommand", run on the server. It writes the file's 
+size, followed by a hash per block. Only a shell, "wc", 
+"dd" and "sha1sum" are needed, and GNU split is used if 
+present, to hash the file in a single pass.
+==================
+*/
+class BlockHasher {
+public:
+					BlockHasher();
+					~BlockHasher();
+
+	/* Start hashing the first "len" bytes of "path" */
+	bool 			Start(string path, uint64 len);
+
+	/* Wait for the threads, and return the hashes */
+	vector<string> 	Finish();
+
+	/* Hash the first "len" bytes of "path" on the server */
+	static string 	RemoteCommand(string path, uint64 len);
+
+	/* Read the output of "RemoteCommand" */
+	static bool 	ParseRemote(const string &out, uint64 &size, 
+								vector<string> &hashes);
+
+	/* The blocks which are the same on both sides, within 
+	 * the first "len" bytes */
+	static vector<bool> Compare(const vector<string> &local, 
+								const vector<string> &remote,
+								uint64 len);
+
+private:
+	int 			fd;
+	uint64 			length;
+	vector<string> 	hashes;
+	atomic<uint32> 	next;		// The next block to hash
+	atomic<bool> 	failed;
+	vector<pthread_t> threads;
+
+	static void* 	HashThread(void *arg);
+};
@@ -1,18 +1,38 @@
 #include "channel.h"
 #include "session.h"
+#include "scheduler.h"
+
+#include <poll.h>
 
 /*
 ==================
 Channel::Channel
 ==================
 */
-Channel::Channel(CHDir dir, uint32 chn, string ty, Socket *s) {
+Channel::Channel(CHDir dir, uint32 chn, string ty, Session *s) {
 	reqType 	= ty;
-	socket  	= s;
+	session 	= s;
 	direction 	= dir;
-	winSizeIn 	= 15000;
 	winSizeOut 	= 0;
 	maxSize 	= 0;
+	closeSent 	= false;
+	eofPending 	= false;
+	outOff 		= 0;
+	mapData 	= NULL;
+	mapLen 		= 0;
+	mapAfter 	= 0;
+	scheduler 	= NULL;
+	echo 		= NULL;
+	recorder 	= NULL;
+	keepOut 	= false;
+	keepIn 		= false;
+	exitStatus 	= -1;
+	outFd 		= STDOUT_FILENO;
+	errFd 		= STDERR_FILENO;
+	rawOut 		= false;
+	nonBlocking = false;
+	unconsumed[0] = unconsumed[1] = 0;
+	haveDim 	= false;
 
 	if (dir == CH_CLI) {
 		status = ST_CLOSED;
@@ -23,6 +43,17 @@ Channel::Channel(CHDir dir, uint32 chn, string ty, Socket *s) {
 	}
 }
 
+/*
+==================
+Channel::~Channel
+==================
+*/
+Channel::~Channel() {
+	if (echo) {
+		delete echo;
+	}
+}
+
 /*
 ==================
 Channel::Init
@@ -54,6 +85,8 @@ bool Channel::Init(ubyte *data, uint32 len) {
 /*
 ==================
 Channel::AdjustWindow
+
+Let the server send "increment" more bytes of data.
 ==================
 */
 bool Channel::AdjustWindow(uint32 increment) {
@@ -67,50 +100,383 @@ bool Channel::AdjustWindow(uint32 increment) {
 		return false;
 	}
 
-	winSizeIn += increment;
+	window.Grant(increment, GetTimeUsec());
 	return true;
 }
 
 /*
 ==================
 Channel::SendInput
+
+The input is queued, and sent as soon as the channel is
+ready and the server's window allows.
 ==================
 */
 void Channel::SendInput(string input) {
-	Message msg;
+	SendInput((const ubyte*)input.c_str(), input.length());
+}
+
+/*
+==================
+Channel::SendInput
+==================
+*/
+void Channel::SendInput(const ubyte *data, uint32 len) {
+	if (!len || closeSent) {
+		return;
+	}
+
+	if (echo) {
+		echo->OnInput(data, len, GetTimeUsec());
+	}
+
+	if (recorder) {
+		recorder->Input(data, len);
+	}
+
+	outBuf.append((const char*)data, len);
+	FlushOutput();
+}
+
+/*
+==================
+Channel::SendMapped
+
+The block is not recorded, nor echoed. It is meant for 
+files, not typing.
+==================
+*/
+void Channel::SendMapped(const ubyte *data, uint64 len) {
+	if (!len || closeSent) {
+		return;
+	}
+
+	if (mapLen) {
+		Error("Channel::SendMapped(): A block is already pending");
+		return;
+	}
+
+	mapData = data;
+	mapLen = len;
+	mapAfter = outBuf.length() - outOff;
+	FlushOutput();
+}
+
+/*
+==================
+Channel::NextInput
+
+The unsent input which is contiguous in memory: the queued
+input before the mapped block, the mapped block, or the
+queued input after it.
+==================
+*/
+const ubyte* Channel::NextInput(uint64 &len) {
+	if (mapLen && !mapAfter) {
+		len = mapLen;
+		return mapData;
+	}
 
-	if (!input.length()) {
+	len = mapLen ? mapAfter : outBuf.length() - outOff;
+	return (const ubyte*)outBuf.data() + outOff;
+}
+
+/*
+==================
+Channel::FlushOutput
+
+Hand the queued input to the scheduler, or send it right
+away without one. A pending EOF is sent once the last of
+the input is.
+==================
+*/
+void Channel::FlushOutput() {
+	if (!IsReady() || closeSent) {
+		return;
+	}
+
+	if (!OutputPending()) {
+		if (eofPending) {
+			eofPending = false;
+			SendEOF();
+		}
 		return;
 	}
 
+	if (scheduler) {
+		scheduler->Activate(this);
+		return;
+	}
+
+	while (NextPacketSize() && SendPacket());
+}
+
+/*
+==================
+Channel::NextPacketSize
+
+The amount of queued input the next CHANNEL_DATA would 
+carry. Limited by the server's window and maximum packet 
+size, and 0 if nothing can be sent.
+==================
+*/
+uint32 Channel::NextPacketSize() {
+	if (!IsReady() || closeSent) {
+		return 0;
+	}
+
+	uint64 avail;
+	NextInput(avail);
+
+	uint32 n = MIN(avail, (uint64)winSizeOut);
+	return MIN(n, maxSize);
+}
+
+/*
+==================
+Channel::SendPacket
+
+Send the next CHANNEL_DATA of queued input. The queue is 
+usually refilled before it empties, so the sent input is
+dropped from its front once there is enough of it, and 
+the queue never holds much more than CHAN_QUEUE_MAX.
+==================
+*/
+bool Channel::SendPacket() {
+	uint32 n = NextPacketSize();
+	bool mapped = mapLen && !mapAfter;
+	uint64 avail;
+	const ubyte *data = NextInput(avail);
+	Message msg;
+
+	if (!n) {
+		return false;
+	}
+
 	msg.Add(SSH_MSG_CHANNEL_DATA);
 	msg.AddUI(recChan);
-	msg.AddUI(input.length());
-	msg.Add(input);
+	msg.AddUI(n);
+	msg.Add(data, n);
 
-	SendMessage(msg);
+	if (!SendMessage(msg)) {
+		return false;
+	}
+
+	winSizeOut -= n;
+
+	if (mapped) {
+		mapData += n;
+		mapLen -= n;
+	} else {
+		outOff += n;
+		mapAfter -= mapLen ? n : 0;
+	}
+
+	if (!OutputPending()) {
+		outBuf.clear();
+		outOff = 0;
+		FlushOutput();
+	} else if (outOff >= CHAN_QUEUE_MAX) {
+		outBuf.erase(0, outOff);
+		outOff = 0;
+	}
+
+	return true;
 }
 
 /*
 ==================
-Channel::
+Channel::Close
+
+Send CHANNEL_CLOSE. The channel is closed once the
+server's CHANNEL_CLOSE is received as well.
 ==================
 */
-void Channel::HandleMessage(const ubyte *data, uint32 len) {
-	if (winSizeIn < 5000) {
-		AdjustWindow(15000);
+bool Channel::Close() {
+	Message msg;
+
+	if (closeSent) {
+		return true;
 	}
 
-	if (!len || !data) {
-		Warning("Channel::HandleMessage(): NULL-data given!");
+	msg.Add(SSH_MSG_CHANNEL_CLOSE);
+	msg.AddUI(recChan);
+
+	closeSent = true;
+	return SendMessage(msg);
+}
+
+/*
+==================
+Channel::TakeOutput
+==================
+*/
+void Channel::TakeOutput(string &out) {
+	if (out.empty()) {
+		out.swap(received);
+		return;
+	}
+
+	out.append(received);
+	received.clear();
+}
+
+/*
+==================
+Channel::SetOutputFds
+
+The output is untouched by the terminal handling.
+==================
+*/
+void Channel::SetOutputFds(int out, int err, bool nb) {
+	outFd = out;
+	errFd = err;
+	rawOut = true;
+	nonBlocking = nb;
+}
+
+/*
+==================
+Channel::FlushWrites
+==================
+*/
+void Channel::FlushWrites() {
+	for (int i=0; i<2; i++) {
+		if (unwritten[i].length()) {
+			ConsumeWindow(WriteBuffered(i, NULL, 0, false));
+		}
+	}
+}
+
+/*
+==================
+Channel::WriteBuffered
+
+Write the kept output of "stream", followed by "data", to 
+its non-blocking fd, and keep what could not be written. 
+"isData" is set for channel data, which counts against the
+window.
+
+Returns the bytes of channel data written, which may now 
+be consumed from the window. If the fd fails, the output 
+is dropped, and counts as written.
+==================
+*/
+uint32 Channel::WriteBuffered(int stream, const ubyte *data, uint32 len, 
+							  bool isData) {
+	string &buf = unwritten[stream];
+	int fd = stream ? errFd : outFd;
+	uint32 written = 0;
+
+	buf.append((const char*)data, len);
+	if (isData) {
+		unconsumed[stream] += len;
+	}
+
+	while (written < buf.length()) {
+		int n = write(fd, buf.data() + written, buf.length() - written);
+
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			break;
+		}
+
+		if (n <= 0) {
+			written = buf.length();
+			break;
+		}
+
+		written += n;
+	}
+
+	buf.erase(0, written);
+
+	/* Kept data comes before any other output */
+	uint32 consumed = MIN(written, unconsumed[stream]);
+	unconsumed[stream] -= consumed;
+
+	return consumed;
+}
+
+/*
+==================
+Channel::ConsumeWindow
+
+The data is consumed once written out. Only the data
+counts against the window.
+==================
+*/
+void Channel::ConsumeWindow(uint32 len) {
+	if (!len) {
 		return;
 	}
 
-	if (!IsPacketForMe(data, len)) {
+	window.Consume(len, GetTimeUsec());
+
+	uint32 inc = window.PendingIncrement();
+	if (inc && !closeSent) {
+		AdjustWindow(inc);
+	}
+}
+
+/*
+==================
+Channel::SetTermDim
+
+Use these dimensions in the pty request, rather than
+those of our own terminal.
+==================
+*/
+void Channel::SetTermDim(uint32 chW, uint32 chH, uint32 pW, uint32 pH) {
+	dim[0] = chW;
+	dim[1] = chH;
+	dim[2] = pW;
+	dim[3] = pH;
+	haveDim = true;
+}
+
+/*
+==================
+Channel::EnableLocalEcho
+
+Only for a shell written to our own terminal.
+==================
+*/
+void Channel::EnableLocalEcho(PredictMode mode) {
+	if (echo || rawOut || command.length() || mode == PM_NEVER) {
 		return;
 	}
 
-	winSizeIn -= len;
+	echo = new LocalEcho(&term, mode);
+}
+
+/*
+==================
+Channel::Tick
+==================
+*/
+void Channel::Tick() {
+	if (echo) {
+		echo->Tick(GetTimeUsec());
+	}
+}
+
+/*
+==================
+Channel::HandleMessage
+
+The message is routed to the channel by the ChannelTable
+of the connection, by its recipient channel field.
+==================
+*/
+void Channel::HandleMessage(const ubyte *data, uint32 len) {
+	if (!len || !data) {
+		Warning("Channel::HandleMessage(): NULL-data given!");
+		return;
+	}
 
 	Packet p(data, len);
 	
@@ -118,6 +484,10 @@ void Channel::HandleMessage(const ubyte *data, uint32 len) {
 		case SSH_MSG_CHANNEL_OPEN_CONFIRMATION:
 			OnChanOpenConfirmation(data, len);
 			break;
+		case SSH_MSG_CHANNEL_OPEN_FAILURE:
+			Error("The server refused to open the channel");
+			status = ST_CHAN_CLOSED;
+			break;
 		case SSH_MSG_CHANNEL_SUCCESS:
 			OnChanSuccess(data, len);
 			break;
@@ -131,29 +501,22 @@ void Channel::HandleMessage(const ubyte *data, uint32 len) {
 		case SSH_MSG_CHANNEL_EXTENDED_DATA:
 			OnChanData(data, len);
 			break;
+		case SSH_MSG_CHANNEL_EOF:
+			OnChanEOF(data, len);
+			break;
+		case SSH_MSG_CHANNEL_CLOSE:
+			OnChanClose(data, len);
+			break;
+		case SSH_MSG_CHANNEL_REQUEST:
+			OnChanRequest(data, len);
+			break;
 		default:
 			printf("[Chann] Unkown packet:  ");
-			Session::GetSingleton()->DeterminePacket(data,len);
+			Session::DeterminePacket(data,len);
 			break;
 	}
 }
 
-/*
-==================
-Channel::IsPacketForMe
-==================
-*/
-bool Channel::IsPacketForMe(const ubyte *data, uint32 len) {
-	if (len > 10) {
-		uint32 recp;
-		BytesToInt(recp, data+6);
-
-		return (recp == senChan);
-	} 
-
-	return false;
-}
-
 /*
 ==================
 Channel::OnChanOpenConfirmation
@@ -161,24 +524,34 @@ Channel::OnChanOpenConfirmation
 */
 void Channel::OnChanOpenConfirmation(const ubyte *data, uint32 len) {
 	status = ST_CHAN_OPEN;
-	printf("Channel openend\n");
 
-	uint32 b = 6;
+	/* Our own channel number is followed by the server's */
+	uint32 b = 10;
 
 	BytesToInt(recChan, data+b);
 	b += 4;
 
-	BytesToInt(senChan, data+b);
-	b += 4;
-
 	BytesToInt(winSizeOut, data+b);
 	b += 4;
 
 	BytesToInt(maxSize, data+b);
 	b += 4;
 
-	printf("Rec chan: %i\nSen chan: %i\n", recChan, senChan);
-	printf("Cur wind: %i\nMax pack: %i\n", winSizeOut, maxSize);
+	if (command.length()) {
+		SendExecRequest();
+		return;
+	}
+
+	if (subsystem.length()) {
+		SendSubsystemRequest();
+		return;
+	}
+
+	if (!rawOut) {
+		printf("Channel openend\n");
+		printf("Rec chan: %i\nSen chan: %i\n", recChan, senChan);
+		printf("Cur wind: %i\nMax pack: %i\n", winSizeOut, maxSize);
+	}
 
 	SendTTYRequest();
 }
@@ -189,16 +562,31 @@ Channel::OnChanSuccess
 ==================
 */
 void Channel::OnChanSuccess(const ubyte *data, uint32 len) {
-	printf("CHANNEL_SUCCESS received\n");
+	/* Input for a command whose output or stdin is kept may
+	 * have been queued before it started. Other commands get
+	 * none. */
+	if (status == ST_CHAN_OPEN && (command.length() || subsystem.length())) {
+		status = ST_EXEC_OPEN;
+
+		if (keepOut || keepIn) {
+			FlushOutput();
+		} else {
+			SendEOF();
+		}
+		return;
+	}
 
 	if (status == ST_CHAN_OPEN) {
 		status = ST_TTY_OPEN;
-		printf("TTY open\n");
-
 		SendShellRequest();
 	} else if (status == ST_TTY_OPEN) {
 		status = ST_SHELL_OPEN;
-		printf("Shell open\n");
+		FlushOutput();
+	}
+
+	if (!rawOut) {
+		printf("CHANNEL_SUCCESS received\n");
+		printf((status == ST_TTY_OPEN) ? "TTY open\n" : "Shell open\n");
 	}
 }
 
@@ -208,6 +596,18 @@ Channel::OnChanFailure
 ==================
 */
 void Channel::OnChanFailure(const ubyte *data, uint32 len) {
+	if (command.length()) {
+		Error("The server refused to execute the command");
+		Close();
+		return;
+	}
+
+	if (subsystem.length()) {
+		Error("The server refused to start the subsystem");
+		Close();
+		return;
+	}
+
 	HexDump(data, len, "ChanFailure");
 
 	switch (status) {
@@ -228,70 +628,191 @@ void Channel::OnChanFailure(const ubyte *data, uint32 len) {
 /*
 ==================
 Channel::OnWindowAdjust
+
+Queued input is sent as far as the new window allows.
 ==================
 */
 void Channel::OnWindowAdjust(const ubyte *data, uint32 len) {
 	uint32 increment;
+
+	if (len < 14) {
+		return;
+	}
+
 	BytesToInt(increment, data+10);
 
 	winSizeOut += increment;
-	printf("Window adjust recvd: %i\n", increment);
+	FlushOutput();
 }
 
 /*
 ==================
 Channel::OnChanData
+
+EXTENDED_DATA carries the data type code in front of the
+data. The output of a command, or of a channel with its own
+output fds, goes straight to stdout, or stderr for 
+EXTENDED_DATA. Shell output is otherwise written through
+the terminal handling.
 ==================
 */
 void Channel::OnChanData(const ubyte *data, uint32 len) {
-	uint32 plen, dlen;
-	ubyte ub;
-	Packet p(data, len);
+	uint32 dlen, off = 10;
+	int fd = outFd;
+	string *partial = &partialOut;
+
+	if (data[5] == SSH_MSG_CHANNEL_EXTENDED_DATA) {
+		off = 14;
+		fd = errFd;
+		partial = &partialErr;
+	}
 
-	/* Raw payload length */
-	plen = p.packetLength - p.paddingLength - 1;
+	if (len < off + 4) {
+		return;
+	}
 
 	/* Actual data length */
-	BytesToInt(dlen, data+10);
-	//HexDump(data+14, dlen, "ascii");
+	BytesToInt(dlen, data+off);
+	if (dlen > len - off - 4) {
+		Warning("Channel::OnChanData(): Bad data length", dlen);
+		return;
+	}
+	//HexDump(data+off+4, dlen, "ascii");
 
-	for (int i=0; i<dlen; i++) {
-		ub = data[14+i];
-		if (IsUbytePrintable(ub)) {
-			printf("%c", ub);
-		} else {
-			HandleUnprintable(ub);
-		}
+	if (recorder) {
+		recorder->Output(data+off+4, dlen);
 	}
+
+	if (nonBlocking) {
+		int stream = (fd == errFd) ? 1 : 0;
+
+		ConsumeWindow(WriteBuffered(stream, data+off+4, dlen, true));
+		return;
+	}
+
+	if (keepOut && data[5] == SSH_MSG_CHANNEL_DATA) {
+		received.append((const char*)data+off+4, dlen);
+	} else if (outPrefix.length()) {
+		WritePrefixed(fd, outPrefix, *partial, data+off+4, dlen);
+	} else if (command.length() || rawOut) {
+		WriteFd(fd, data+off+4, dlen);
+	} else if (echo) {
+		echo->OnOutput(data+off+4, dlen, GetTimeUsec());
+	} else {
+		term.Write(data+off+4, dlen);
+	}
+
+	ConsumeWindow(dlen);
 }
 
 /*
 ==================
-Channel::SendMessage
+Channel::OnChanEOF
+==================
+*/
+void Channel::OnChanEOF(const ubyte *data, uint32 len) {
+	FlushPartial();
+}
 
-Send the desired message. If "initMsg==true", the 
-window size and maximum packet size is NOT taken 
-into any account.
+/*
+==================
+Channel::OnChanClose
 ==================
 */
-bool Channel::SendMessage(Message &msg, bool initMsg) {
-	uint32 len;
+void Channel::OnChanClose(const ubyte *data, uint32 len) {
+	FlushPartial();
+	Close();
 
-	len = msg.GetLength();
+	status = ST_CHAN_CLOSED;
+}
 
-	if (!initMsg && (len > winSizeOut || len > maxSize)) {
-		Warning("Message too long", len);
-		printf("Current outgoing winsize: %i\n", winSizeOut);
-		return false;
+/*
+==================
+Channel::OnChanRequest
+
+"exit-status" and "exit-signal" are recorded as the exit
+status. No other channel requests from the server are 
+supported. If a reply is wanted, CHANNEL_FAILURE is sent.
+==================
+*/
+void Channel::OnChanRequest(const ubyte *data, uint32 len) {
+	uint32 tlen, b;
+	Message msg;
+
+	if (len < 14) {
+		return;
 	}
 
-	if (socket->Write(msg.GetData(), len)) {
-		winSizeOut -= len * !initMsg;
-	} else {
-		return false;
+	BytesToInt(tlen, data+10);
+	if (tlen > len - 15) {
+		return;
 	}
 
-	return true;
+	string type((const char*)data+14, tlen);
+	b = 15 + tlen;
+
+	if (type == "exit-status" && b + 4 <= len) {
+		uint32 code;
+		BytesToInt(code, data+b);
+		exitStatus = code;
+	} else if (type == "exit-signal" && b + 4 <= len) {
+		uint32 slen;
+		BytesToInt(slen, data+b);
+
+		if (slen <= len - b - 4) {
+			string sig((const char*)data+b+4, slen);
+			string text = "Killed by signal SIG" + sig + "\n";
+
+			if (nonBlocking) {
+				ConsumeWindow(WriteBuffered(1, (const ubyte*)text.c_str(), 
+											text.length(), false));
+			} else if (!outPrefix.length()) {
+				WriteFd(errFd, text.c_str(), text.length());
+			}
+		}
+
+		exitStatus = 255;
+	}
+
+	/* want_reply follows the request type */
+	if (!data[14+tlen]) {
+		return;
+	}
+
+	msg.Add(SSH_MSG_CHANNEL_FAILURE);
+	msg.AddUI(recChan);
+	SendMessage(msg);
+}
+
+/*
+==================
+Channel::FlushPartial
+
+Write any unterminated line of prefixed output.
+==================
+*/
+void Channel::FlushPartial() {
+	const ubyte nl = 10;
+
+	if (partialOut.length()) {
+		WritePrefixed(outFd, outPrefix, partialOut, &nl, 1);
+	}
+
+	if (partialErr.length()) {
+		WritePrefixed(errFd, outPrefix, partialErr, &nl, 1);
+	}
+}
+
+/*
+==================
+Channel::SendMessage
+
+Send the desired message. Only CHANNEL_DATA counts against
+the server's window, which SendPacket takes care of.
+==================
+*/
+bool Channel::SendMessage(Message &msg) {
+	return session->Send(msg);
 }
 
 
@@ -302,7 +823,7 @@ Channel::SendOpenRequest
 */
 bool Channel::SendOpenRequest() {
 	Message msg = GetOpenRequestMsg();
-	return SendMessage(msg, true);
+	return SendMessage(msg);
 }
 
 /*
@@ -312,7 +833,7 @@ Channel::SendTTYRequest
 */
 bool Channel::SendTTYRequest() {
 	Message msg = GetTTYRequestMsg();
-	return SendMessage(msg, true);
+	return SendMessage(msg);
 }
 
 /*
@@ -322,7 +843,49 @@ Channel::SendShellRequest
 */
 bool Channel::SendShellRequest() {
 	Message msg = GetShellRequestMsg();
-	return SendMessage(msg, true);
+	return SendMessage(msg);
+}
+
+/*
+==================
+Channel::SendExecRequest
+==================
+*/
+bool Channel::SendExecRequest() {
+	Message msg = GetExecRequestMsg();
+	return SendMessage(msg);
+}
+
+/*
+==================
+Channel::SendSubsystemRequest
+==================
+*/
+bool Channel::SendSubsystemRequest() {
+	Message msg = GetSubsystemRequestMsg();
+	return SendMessage(msg);
+}
+
+/*
+==================
+Channel::SendEOF
+
+Nothing more is sent to a command's stdin. Any queued 
+input is sent before the EOF.
+==================
+*/
+bool Channel::SendEOF() {
+	Message msg;
+
+	if (!IsReady() || OutputPending()) {
+		eofPending = true;
+		return true;
+	}
+
+	msg.Add(SSH_MSG_CHANNEL_EOF);
+	msg.AddUI(recChan);
+
+	return SendMessage(msg);
 }
 
 /*
@@ -337,8 +900,8 @@ Message Channel::GetOpenRequestMsg() {
 	msg.AddUI(reqType.length());
 	msg.Add(reqType);
 	msg.AddUI(senChan);
-	msg.AddUI(winSizeIn); 	// Window IN
-	msg.AddUI(35000);		// Max packet
+	msg.AddUI(window.Size()); 	// Window IN
+	msg.AddUI(RWIN_MAX_PACKET);	// Max packet
 
 	return msg;
 }
@@ -352,7 +915,14 @@ Message Channel::GetTTYRequestMsg() {
 	Message msg;
 	uint32 chW, chH, pW, pH;
 
-	GetTermDim(chW, chH, pW, pH);
+	if (haveDim) {
+		chW = dim[0];
+		chH = dim[1];
+		pW  = dim[2];
+		pH  = dim[3];
+	} else {
+		GetTermDim(chW, chH, pW, pH);
+	}
 
 	msg.Add(SSH_MSG_CHANNEL_REQUEST);
 	msg.AddUI(recChan);
@@ -392,42 +962,103 @@ Message Channel::GetShellRequestMsg() {
 
 /*
 ==================
-Channel::IsUbytePrintable
+Channel::GetExecRequestMsg
 ==================
 */
-bool Channel::IsUbytePrintable(ubyte c) {
-	if ( 	c == 9
-		 || c == 10
-		 || c == 27
-		 ||(c >= 32
-		 && c <= 126) ) {
-		return true;
-	}	
+Message Channel::GetExecRequestMsg() {
+	Message msg;
 
-	return false;
+	msg.Add(SSH_MSG_CHANNEL_REQUEST);
+	msg.AddUI(recChan);
+	msg.AddUI(4);
+	msg.Add("exec");
+	msg.Add(true);			// Want reply
+
+	msg.AddUI(command.length());
+	msg.Add(command);
+
+	return msg;
 }
 
 /*
 ==================
-Channel::HandleUnprintable
+Channel::GetSubsystemRequestMsg
 ==================
 */
-void Channel::HandleUnprintable(ubyte c) {
-	switch (c) {
-		case 8:
-			printf("\b");
-			break;
+Message Channel::GetSubsystemRequestMsg() {
+	Message msg;
 
-		case 27:	
-			printf("\b \b");
-			break;             
+	msg.Add(SSH_MSG_CHANNEL_REQUEST);
+	msg.AddUI(recChan);
+	msg.AddUI(9);
+	msg.Add("subsystem");
+	msg.Add(true);			// Want reply
 
-		case 13:
-			printf("\b");
-			break;
+	msg.AddUI(subsystem.length());
+	msg.Add(subsystem);
 
-		default:
-			printf("%c", c);
-			break;
+	return msg;
+}
+
+/*
+==================
+static Channel::WritePrefixed
+
+All complete lines are gathered and written at once, so
+lines from several channels sharing "fd" never interleave.
+==================
+*/
+bool Channel::WritePrefixed(int fd, const string &prefix, string &partial,
+							const ubyte *data, uint32 len) {
+	const ubyte *nl;
+	string out;
+	uint32 pos = 0;
+
+	while ((nl = (const ubyte*)memchr(data+pos, 10, len-pos))) {
+		uint32 end = nl - data + 1;
+
+		out += prefix;
+		out += partial;
+		out.append((const char*)data+pos, end-pos);
+
+		partial.clear();
+		pos = end;
 	}
+
+	partial.append((const char*)data+pos, len-pos);
+
+	return WriteFd(fd, out.c_str(), out.length());
+}
+
+/*
+==================
+static Channel::WriteFd
+
+The fd may have been made non-blocking by a control master
+sharing our terminal, so a full fd is waited for.
+==================
+*/
+bool Channel::WriteFd(int fd, const void *data, uint32 len) {
+	const char *ptr = (const char*)data;
+
+	while (len) {
+		int n = write(fd, ptr, len);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				pollfd pfd = { fd, POLLOUT, 0 };
+				poll(&pfd, 1, -1);
+				continue;
+			}
+			return false;
+		}
+
+		ptr += n;
+		len -= n;
+	}
+
+	return true;
 }
\ No newline at end of file
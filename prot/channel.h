@@ -3,6 +3,17 @@
 #include "../sshay.h"
 #include "../net/socket.h"
 #include "packet.h"
+#include "recvwindow.h"
+#include "termwriter.h"
+#include "localecho.h"
+#include "recorder.h"
+
+class Session;
+class ChannelScheduler;
+
+/* Input queued beyond this should not be read until the 
+ * server's window opens */
+#define CHAN_QUEUE_MAX 	1048576
 
 /*
 ==================
@@ -29,6 +40,8 @@ enum CHStat {
 	ST_CHAN_OPEN, 	// The channel is open
 	ST_TTY_OPEN, 	// The tty is open and active as all hell.
 	ST_SHELL_OPEN,	// The shell is active
+	ST_EXEC_OPEN,	// The command is running
+	ST_CHAN_CLOSED,	// Both sides have sent CHANNEL_CLOSE
 };
 
 /*
@@ -36,16 +49,102 @@ enum CHStat {
 Channel
 
 Encapsulates a channel as specified in [SSH-CONN], RFC-4254.
+
+By default the channel requests a pty and a shell. If a
+command is set before "Init", the command is executed 
+instead, without a pty. Its output is then passed to
+stdout and stderr untouched, and its stdin is closed,
+unless it is kept open for input. If a subsystem is set,
+the subsystem is started, and its output is kept for the
+caller to take. The output of a command can be kept as 
+well, and its stdin is then left open.
+
+Input is queued, and sent in packets no larger than the
+server's maximum packet size, as far as the server's 
+window allows. The rest waits for a WINDOW_ADJUST. With a
+scheduler, the scheduler decides when each packet is sent.
+A large block of input, like a mapped file, can be sent 
+from where it is instead of being copied into the queue.
 ==================
 */
 class Channel {
 public:
-				Channel(CHDir,uint32 chnl, string type, Socket *s);
+				Channel(CHDir,uint32 chnl, string type, Session *s);
+	virtual 	~Channel();
 	bool	 	Init(ubyte *data=NULL, uint32 len=0);
 	bool 		AdjustWindow(uint32 increment);
 
 	void 		SendInput(string input);
+	void 		SendInput(const ubyte *data, uint32 len);
+
+	/* Send "len" bytes from "data" without copying them into
+	 * the queue. They are sent after the input queued before,
+	 * and must stay valid until sent. Only one block at a 
+	 * time. */
+	void 		SendMapped(const ubyte *data, uint64 len);
+	uint64 		MappedPending() { return mapLen; }
 	void 		HandleMessage(const ubyte *data, uint32 len);
+	bool 		Close();
+	bool 		SendEOF();
+
+	/* Bytes of input queued until the server's window allows */
+	uint64 		OutputPending() { return outBuf.length() - outOff + mapLen; }
+
+	/* Queued input is sent when the scheduler says so */
+	void 		SetScheduler(ChannelScheduler *s) { scheduler = s; }
+	uint32 		NextPacketSize();
+	bool 		SendPacket();
+
+	/* A shell, typed into */
+	bool 		IsInteractive() { return command.empty() 
+										&& subsystem.empty(); }
+
+	void 		SetCommand(string cmd) { command = cmd; }
+	void 		SetSubsystem(string name) { subsystem = name; 
+												keepOut = true; }
+
+	/* Keep the output for "TakeOutput", instead of writing it */
+	void 		KeepOutput() { keepOut = true; }
+
+	/* Leave the command's stdin open, for "SendInput" until
+	 * "SendEOF" */
+	void 		KeepInput() { keepIn = true; }
+
+	/* Append the output kept so far to "out" */
+	void 		TakeOutput(string &out);
+
+	/* Prefix every line of output, for telling the output 
+	 * of several channels apart */
+	void 		SetOutputPrefix(string prefix) { outPrefix = prefix; }
+
+	bool 		IsClosed() { return status == ST_CHAN_CLOSED; }
+	bool 		IsReady() { return status == ST_SHELL_OPEN
+									|| status == ST_EXEC_OPEN; }
+
+	/* Write all output to "out" and "err". If they are non-
+	 * blocking, output which cannot be written yet is kept,
+	 * and holds back the server's window until it is. */
+	void 		SetOutputFds(int out, int err, bool nonBlocking=false);
+
+	/* Write the kept output, as far as the fds allow */
+	void 		FlushWrites();
+
+	/* Output is kept for stdout (0) or stderr (1) */
+	bool 		HasUnwritten(int stream) { return unwritten[stream].length() > 0; }
+	void 		SetTermDim(uint32 chW, uint32 chH, uint32 pW, uint32 pH);
+
+	/* Draw typed characters before the server echoes them */
+	void 		EnableLocalEcho(PredictMode mode);
+	void 		Tick();
+
+	/* Record the data sent and received to "rec" */
+	void 		SetRecorder(SessionRecorder *rec) { recorder = rec; }
+
+	/* The command's exit status, or -1 if none was received */
+	int 		GetExitStatus() { return exitStatus; }
+
+	/* The server's maximum packet size, 0 until open */
+	uint32 		GetMaxPacket()    { return maxSize; }
 
 	uint32 		GetRecipientChn() { return recChan; }
 	uint32 		GetSenderChn()    { return senChan; }
@@ -53,32 +152,85 @@ public:
 protected:
 	CHStat		status;
 	CHDir 		direction;	
-	Socket 		*socket;
+	Session 	*session;
 
 	string 		reqType;	// Channel type
 	uint32 		recChan;	// Recipient Channel
 	uint32 		senChan;	// Sender Channel
-	uint32 		winSizeIn;	// Window size in
+	RecvWindow 	window;		// Window size in
 	uint32 		winSizeOut;	// Window size out
 	uint32 		maxSize;	// Maximum packet size
+	bool 		closeSent;
+	bool 		eofPending;	// EOF follows the queued input
+
+	string 		outBuf;		// Input waiting for the window
+	uint32 		outOff;		// Start of the unsent input, kept small
+	const ubyte *mapData;	// Unsent input of "SendMapped"
+	uint64 		mapLen;
+	uint32 		mapAfter;	// Queued input to send before it
+	ChannelScheduler *scheduler;
+
+	string 		command;	// Executed command, if any
+	string 		subsystem;	// Started subsystem, if any
+	bool 		keepOut;	// Output is kept, not written
+	bool 		keepIn;		// Stdin is left open for input
+	string 		received;	// Kept output not yet taken
+	string 		outPrefix;	// Output line prefix, if any
+	string 		partialOut;	// Unterminated lines of output
+	string 		partialErr;
+	int 		exitStatus;
+
+	int 		outFd;		// Output of the channel
+	int 		errFd;
+	bool 		rawOut;		// Output bypasses the terminal handling
+	bool 		nonBlocking;	// The output fds are non-blocking
+	string 		unwritten[2];	// Output of stdout and stderr not yet written
+	uint32 		unconsumed[2];	// Of it, data not yet consumed from the window
+	TermWriter 	term;
+	LocalEcho 	*echo;		// Predicted echo, if enabled
+	SessionRecorder *recorder;	// Not owned, NULL if not recording
+	bool 		haveDim;	// Terminal dimensions for the pty
+	uint32 		dim[4];
 
 	/* Message Handlers */
-	bool 		IsPacketForMe(const ubyte*, uint32);
 	void 		OnChanOpenConfirmation(const ubyte*, uint32);
 	void 		OnChanSuccess(const ubyte*, uint32);
 	void 		OnChanFailure(const ubyte*, uint32);
 	void 		OnWindowAdjust(const ubyte*,uint32);
 	void 		OnChanData(const ubyte*, uint32);
+	void 		OnChanEOF(const ubyte*, uint32);
+	void 		OnChanClose(const ubyte*, uint32);
+	void 		OnChanRequest(const ubyte*, uint32);
 
-	bool 		SendMessage(Message &msg, bool initMsg=false);
+	/* Sent through the session. Tests catch it instead. */
+	virtual bool SendMessage(Message &msg);
+	void 		FlushOutput();
 	bool 		SendOpenRequest();
 	bool 		SendTTYRequest();
 	bool 		SendShellRequest();
+	bool 		SendExecRequest();
+	bool 		SendSubsystemRequest();
 
 	Message 	GetOpenRequestMsg();
 	Message 	GetTTYRequestMsg();
 	Message 	GetShellRequestMsg();
+	Message 	GetExecRequestMsg();
+	Message 	GetSubsystemRequestMsg();
+
+	void 		FlushPartial();
+	uint32 		WriteBuffered(int stream, const ubyte *data, uint32 len,
+							  bool isData);
+	void 		ConsumeWindow(uint32 len);
+	const ubyte *NextInput(uint64 &len);
+
+
+public:
+	/* Write all of "data" to "fd" */
+	static bool WriteFd(int fd, const void *data, uint32 len);
 
-	bool 		IsUbytePrintable(ubyte c);
-	void 		HandleUnprintable(ubyte c);
+	/* Write the complete lines of "data" to "fd", each behind
+	 * "prefix". The unterminated end is kept in "partial". */
+	static bool WritePrefixed(int fd, const string &prefix, 
+							  string &partial, 
+							  const ubyte *data, uint32 len);
 };
\ No newline at end of file
@@ -0,0 +1,103 @@
+#include "channeltable.h"
+#include "channel.h"
+
+/*
+==================
+ChannelTable::ChannelTable
+==================
+*/
+ChannelTable::ChannelTable() {
+	count = 0;
+}
+
+/*
+==================
+ChannelTable::~ChannelTable
+
+All remaining channels are deleted.
+==================
+*/
+ChannelTable::~ChannelTable() {
+	for (unsigned i=0; i<slots.size(); i++) {
+		if (slots[i]) {
+			delete slots[i];
+		}
+	}
+}
+
+/*
+==================
+ChannelTable::Open
+==================
+*/
+Channel* ChannelTable::Open(Session *session) {
+	uint32 id;
+
+	if (freeIds.size()) {
+		id = freeIds.back();
+		freeIds.pop_back();
+	} else {
+		id = slots.size();
+		slots.push_back(NULL);
+	}
+
+	slots[id] = new Channel(CH_CLI, id, "session", session);
+	count++;
+
+	return slots[id];
+}
+
+/*
+==================
+ChannelTable::Remove
+
+The channel is deleted, and its number may be reused.
+The channel must be closed in both directions first
+(RFC-4254, section 5.3).
+==================
+*/
+void ChannelTable::Remove(Channel *ch) {
+	uint32 id = ch->GetSenderChn();
+
+	if (Get(id) != ch) {
+		Warning("ChannelTable::Remove(): Unknown channel", id);
+		return;
+	}
+
+	delete ch;
+	slots[id] = NULL;
+	freeIds.push_back(id);
+	count--;
+}
+
+/*
+==================
+ChannelTable::Get
+==================
+*/
+Channel* ChannelTable::Get(uint32 id) {
+	if (id >= slots.size()) {
+		return NULL;
+	}
+
+	return slots[id];
+}
+
+/*
+==================
+ChannelTable::Lookup
+
+Every channel message has the recipient channel right
+after the message type.
+==================
+*/
+Channel* ChannelTable::Lookup(const ubyte *data, uint32 len) {
+	uint32 recp;
+
+	if (len < 10) {
+		return NULL;
+	}
+
+	BytesToInt(recp, data+6);
+	return Get(recp);
+}
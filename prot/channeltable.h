@@ -0,0 +1,40 @@
+#pragma once
+
+#include "../sshay.h"
+
+class Channel;
+class Session;
+
+/*
+==================
+ChannelTable
+
+The open channels of a connection, indexed by our local
+channel number. The number is the index into a dense 
+vector, so a channel message is routed by its recipient
+channel field in constant time. Numbers of removed 
+channels are kept on a free list and reused.
+==================
+*/
+class ChannelTable {
+public:
+					ChannelTable();
+					~ChannelTable();
+
+	/* Create a session channel with the next free number */
+	Channel* 		Open(Session *session);
+	void 			Remove(Channel *ch);
+
+	/* NULL if no channel has the number */
+	Channel* 		Get(uint32 id);
+
+	/* The channel addressed by a channel message */
+	Channel* 		Lookup(const ubyte *data, uint32 len);
+
+	uint32 			Count() { return count; }
+
+private:
+	vector<Channel*> slots;
+	vector<uint32> 	freeIds;
+	uint32 			count;
+};
@@ -0,0 +1,74 @@
+#include "coalescer.h"
+
+/*
+==================
+InputCoalescer::InputCoalescer
+==================
+*/
+InputCoalescer::InputCoalescer() {
+	lastInput 	= 0;
+	lastAvail 	= 0;
+	holding 	= false;
+	holdStart 	= 0;
+}
+
+/*
+==================
+InputCoalescer::Take
+
+Whole packets are always sent. The rest is sent at once if
+it is a short bit of input after an idle spell, and held
+back otherwise, until the hold expires.
+==================
+*/
+uint32 InputCoalescer::Take(uint32 avail, uint32 packet, uint64 now, bool flush) {
+	bool idle = (now - lastInput >= COALESCE_IDLE);
+	uint32 take;
+
+	if (!packet) {
+		packet = COALESCE_PACKET;
+	}
+
+	if (avail > lastAvail) {
+		lastInput = now;
+	}
+
+	if (flush || !avail) {
+		take = avail;
+	} else if (!holding && idle && avail < COALESCE_BURST) {
+		take = avail;
+	} else if (holding && now - holdStart >= COALESCE_DELAY) {
+		take = avail;
+	} else {
+		take = avail - avail % packet;
+	}
+
+	/* The hold starts over with each packet sent */
+	lastAvail = avail - take;
+	if (!lastAvail) {
+		holding = false;
+	} else if (!holding || take) {
+		holding = true;
+		holdStart = now;
+	}
+
+	return take;
+}
+
+/*
+==================
+InputCoalescer::Timeout
+==================
+*/
+int InputCoalescer::Timeout(uint64 now) {
+	if (!holding) {
+		return -1;
+	}
+
+	uint64 due = holdStart + COALESCE_DELAY;
+	if (due <= now) {
+		return 0;
+	}
+
+	return (due - now + 999) / 1000;
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include "../sshay.h"
+
+/* Input after this long without any is typed, not pasted */
+#define COALESCE_IDLE 		10000
+
+/* Longest a burst of input is held back, in microseconds */
+#define COALESCE_DELAY 		3000
+
+/* More input than this at once is not typed */
+#define COALESCE_BURST 		64
+
+/* Packet size used before the server's is known */
+#define COALESCE_PACKET 	32768
+
+/*
+==================
+InputCoalescer
+
+Decides how much of the input read so far to send now. 
+A keystroke after idle input is sent at once. A burst of
+input, like a paste or piped input, is held back until it
+fills a packet, or for at most COALESCE_DELAY. Pastes then
+go out in few large packets instead of many small ones.
+
+Times are in microseconds.
+==================
+*/
+class InputCoalescer {
+public:
+					InputCoalescer();
+
+	/* The number of bytes out of "avail" to send at "now".
+	 * With "flush", all of it is sent. */
+	uint32 			Take(uint32 avail, uint32 packet, uint64 now, bool flush=false);
+
+	/* Milliseconds until held input is due, -1 if none is */
+	int 			Timeout(uint64 now);
+
+private:
+	uint64 			lastInput;		// When more input was last seen
+	uint32 			lastAvail;		// Input left after the last call
+	bool 			holding;
+	uint64 			holdStart;
+};
@@ -1,21 +1,24 @@
 #include "connection.h"
 #include "session.h"
+#include "controlmaster.h"
+#include "sftp.h"
+#include "scp.h"
 
 #include <pthread.h>
+#include <poll.h>
 
 
 /*
 ==================
 StdinThread
 
-Background thread reading stdin-input and storing it
-in 'g_input'. The background thread quits when 't_continue'
-is set to false.
+Background thread reading stdin into the InputRing given
+as its argument, a whole read() at a time. The thread 
+quits at the end of stdin, or when 't_continue' is set to
+false.
 ==================
 */
-pthread_mutex_t inlock;
-string g_input;
-bool t_continue = true;
+atomic<bool> t_continue(true);
 
 void StdinNoncanonical(struct termios &orgopt) {
 	struct termios new_opts;
@@ -23,9 +26,11 @@ void StdinNoncanonical(struct termios &orgopt) {
 	tcgetattr(STDIN_FILENO, &orgopt);
 	memcpy(&new_opts, &orgopt, sizeof(new_opts));
 
+	/* read() waits for at least one byte, so that it only 
+	 * returns 0 at the actual end of the input */
 	new_opts.c_lflag &= ~(ECHO);
 	new_opts.c_lflag &= ~(ICANON);
-	new_opts.c_cc[VMIN] = 0;
+	new_opts.c_cc[VMIN] = 1;
 	new_opts.c_cc[VTIME] = 0;
 	tcsetattr(STDIN_FILENO, TCSANOW, &new_opts);
 }
@@ -34,23 +39,32 @@ void StdinCanonical(struct termios &orgopt) {
 	tcsetattr(STDIN_FILENO, TCSANOW, &orgopt);
 }
 
-void* StdinThread(void*) {
-	struct termios orgopts;
-	int c=0, res=0;
-
-	StdinNoncanonical(orgopts);
+void* StdinThread(void *arg) {
+	InputRing *ring = (InputRing*)arg;
+	ubyte buf[16384];
 
 	while (t_continue) {
-		while ((c = getchar()) > 0) {
-			pthread_mutex_lock(&inlock);
-			g_input += c;
-			pthread_mutex_unlock(&inlock);
+		uint32 room = MIN(ring->Free(), sizeof(buf));
+
+		/* The network loop is behind, wait for it */
+		if (!room) {
+			usleep(1000);
+			continue;
 		}
-		
-		usleep(10000);
-	}
 
-  	StdinCanonical(orgopts);
+		pollfd pfd = { STDIN_FILENO, POLLIN, 0 };
+		if (poll(&pfd, 1, 100) <= 0) {
+			continue;
+		}
+
+		int n = read(STDIN_FILENO, buf, room);
+		if (n > 0) {
+			ring->Write(buf, n);
+		} else if (n == 0 || (errno != EINTR && errno != EAGAIN)) {
+			ring->SetEOF();
+			break;
+		}
+	}
 
   	return NULL;
 }
@@ -61,11 +75,16 @@ void* StdinThread(void*) {
 Connection::Connection
 ==================
 */
-Connection::Connection(Socket *s) {
+Connection::Connection(Session *ses, Socket *s) : scheduler(s) {
+	session = ses;
 	socket = s;
 	quit = false;
+	master = NULL;
+	recorder = NULL;
+	input = NULL;
+	inputDone = false;
 
-	channel = new Channel(CH_CLI, 0, "session", s);
+	channel = OpenChannel();
 }
 
 /*
@@ -74,8 +93,12 @@ Connection::~Connection
 ==================
 */
 Connection::~Connection() {
-	if (channel) {
-		delete channel;
+	if (master) {
+		delete master;
+	}
+
+	if (recorder) {
+		delete recorder;
 	}
 }
 
@@ -89,41 +112,375 @@ Return values:
 ==================
 */
 int Connection::MainLoop() {
+	struct termios orgopts;
 	pthread_t inputThread;
+	InputRing ring;
 
-	if (pthread_mutex_init(&inlock, NULL)) {
-		Error("Failed to create mutex", errno);
+	if (!ring.Init()) {
 		return -1;
 	}
 
-	if (pthread_create(&inputThread, NULL, &StdinThread, NULL)) {
+	input = &ring;
+	t_continue = true;
+
+	StdinNoncanonical(orgopts);
+	if (pthread_create(&inputThread, NULL, &StdinThread, &ring)) {
 		Error("Failed to create stdin-thread", errno);
+		StdinCanonical(orgopts);
 		return -1;
 	}
 
+	if (isatty(STDIN_FILENO) && isatty(STDOUT_FILENO)) {
+		channel->EnableLocalEcho(LocalEcho::ModeFromEnv());
+	}
+
 	if (!channel->Init()) {
 		return -1;
 	}
 
-	while (!quit) {
-		while (socket->HasData())  {
-			DispatchPacket();
+	while (Poll()) {
+		vector<pollfd> fds;
+		pollfd pfd = { ring.GetWakeFd(), POLLIN, 0 };
+
+		channel->Tick();
+
+		fds.push_back(pfd);
+		if (master) {
+			master->AddPollFds(fds);
 		}
-			
-		HandleInput();
 
-		usleep(10000);
+		int timeout = coalescer.Timeout(GetTimeUsec());
+		WaitForSocket(fds, (timeout < 0) ? 100 : timeout);
+		HandleInput();
 	}
 
 	socket->Disconnect();
 
 	t_continue = false;
 	pthread_join(inputThread, NULL);
-	pthread_mutex_destroy(&inlock);
+	StdinCanonical(orgopts);
+	input = NULL;
 
 	return 0;
 }
 
+/*
+==================
+Connection::RunCommand
+
+Run "command" and wait for it to finish. Stdin is passed
+to the command as it is, the terminal is left alone. The
+exit status of the command is returned, or 255 if there is
+none.
+==================
+*/
+int Connection::RunCommand(string command) {
+	pthread_t inputThread;
+	InputRing ring;
+
+	if (!ring.Init()) {
+		return 255;
+	}
+
+	channel->KeepInput();
+	if (!StartExec(command, "")) {
+		return 255;
+	}
+
+	input = &ring;
+	t_continue = true;
+
+	if (pthread_create(&inputThread, NULL, &StdinThread, &ring)) {
+		Error("Failed to create stdin-thread", errno);
+		input = NULL;
+		return 255;
+	}
+
+	while (Poll()) {
+		vector<pollfd> fds;
+		pollfd pfd = { ring.GetWakeFd(), POLLIN, 0 };
+
+		fds.push_back(pfd);
+		if (master) {
+			master->AddPollFds(fds);
+		}
+
+		int timeout = coalescer.Timeout(GetTimeUsec());
+		WaitForSocket(fds, (timeout < 0) ? 1000 : timeout);
+		HandleInput();
+	}
+
+	t_continue = false;
+	pthread_join(inputThread, NULL);
+	input = NULL;
+
+	int status = GetExitStatus();
+	return (status < 0) ? 255 : status;
+}
+
+/*
+==================
+Connection::RunSftp
+
+Run the transfer of "sftp" on the sftp subsystem, and 
+wait for it to finish.
+==================
+*/
+bool Connection::RunSftp(SftpClient *sftp) {
+	channel->SetSubsystem("sftp");
+
+	if (!sftp->Start(channel) || !channel->Init()) {
+		return false;
+	}
+
+	while (Poll()) {
+		vector<pollfd> fds;
+
+		sftp->Update();
+		if (sftp->IsDone()) {
+			break;
+		}
+
+		int timeout = sftp->Timeout();
+		WaitForSocket(fds, (timeout < 0) ? 1000 : timeout);
+	}
+
+	if (!sftp->IsDone()) {
+		Error("The connection closed during the transfer");
+		return false;
+	}
+
+	channel->Close();
+	return !sftp->HasFailed();
+}
+
+/*
+==================
+Connection::RunScp
+
+Run the transfer of "scp" on an exec channel, and wait for
+the remote scp to exit.
+==================
+*/
+bool Connection::RunScp(ScpClient *scp) {
+	if (!scp->Start(channel) || !channel->Init()) {
+		return false;
+	}
+
+	while (Poll()) {
+		vector<pollfd> fds;
+
+		scp->Update();
+		if (scp->HasFailed()) {
+			break;
+		}
+
+		WaitForSocket(fds, 1000);
+	}
+
+	/* What arrived along with the channel's close */
+	if (!scp->HasFailed()) {
+		scp->Update();
+	}
+
+	if (scp->HasFailed()) {
+		channel->Close();
+		return false;
+	}
+
+	if (!scp->IsDone()) {
+		Error("The remote scp exited before the transfer finished");
+		return false;
+	}
+
+	return GetExitStatus() <= 0;
+}
+
+/*
+==================
+Connection::RunCapture
+
+Our own channel is left unopened, for a later transfer on
+the same connection.
+==================
+*/
+int Connection::RunCapture(string command, string &out) {
+	Channel *ch = OpenChannel();
+
+	ch->SetCommand(command);
+	ch->KeepOutput();
+
+	if (!ch->Init()) {
+		RemoveChannel(ch);
+		return -1;
+	}
+
+	ch->SendEOF();
+
+	while (!ch->IsClosed() && Poll()) {
+		vector<pollfd> fds;
+
+		ch->TakeOutput(out);
+		WaitForSocket(fds, 1000);
+	}
+
+	ch->TakeOutput(out);
+
+	int status = ch->IsClosed() ? ch->GetExitStatus() : -1;
+	RemoveChannel(ch);
+
+	return status;
+}
+
+/*
+==================
+Connection::EnableControlMaster
+
+Share the connection through a Unix socket at "path".
+==================
+*/
+bool Connection::EnableControlMaster(string path) {
+	master = new ControlMaster(this);
+
+	if (!master->Listen(path)) {
+		delete master;
+		master = NULL;
+		return false;
+	}
+
+	return true;
+}
+
+/*
+==================
+Connection::EnableRecording
+
+Without a terminal size, the recording is sized as the 
+usual 80x24. The input is recorded only with "input".
+==================
+*/
+bool Connection::EnableRecording(string path, string command, bool input) {
+	uint32 chW = 0, chH = 0, pW, pH;
+
+	if (isatty(STDIN_FILENO)) {
+		GetTermDim(chW, chH, pW, pH);
+	}
+
+	if (!chW || !chH) {
+		chW = 80;
+		chH = 24;
+	}
+
+	recorder = new SessionRecorder();
+	recorder->SetInput(input);
+
+	if (!recorder->Open(path, chW, chH, command)) {
+		delete recorder;
+		recorder = NULL;
+		return false;
+	}
+
+	channel->SetRecorder(recorder);
+	return true;
+}
+
+/*
+==================
+Connection::OpenChannel
+
+Create a session channel. It is opened by calling "Init".
+==================
+*/
+Channel* Connection::OpenChannel() {
+	Channel *ch = channels.Open(session);
+
+	ch->SetScheduler(&scheduler);
+	return ch;
+}
+
+/*
+==================
+Connection::RemoveChannel
+==================
+*/
+void Connection::RemoveChannel(Channel *ch) {
+	scheduler.Remove(ch);
+	channels.Remove(ch);
+}
+
+/*
+==================
+Connection::StartExec
+
+Open a channel executing "command". Every line of output
+is written behind "prefix".
+==================
+*/
+bool Connection::StartExec(string command, string prefix) {
+	channel->SetCommand(command);
+	channel->SetOutputPrefix(prefix);
+
+	return channel->Init();
+}
+
+/*
+==================
+Connection::Poll
+
+Handle every packet received so far, without blocking,
+and send what the scheduler allows of the queued input.
+False is returned once the connection has closed, or our
+own channel has closed and no control clients are left.
+==================
+*/
+bool Connection::Poll() {
+	while (socket->HasData())  {
+		DispatchPacket();
+	}
+
+	if (master) {
+		if (channel->IsClosed()) {
+			master->StopListening();
+		}
+
+		master->Poll();
+	}
+
+	if (!socket->IsConnected()) {
+		quit = true;
+		return false;
+	}
+
+	if (channel->IsClosed() && (!master || !master->HasClients())) {
+		quit = true;
+		return false;
+	}
+
+	session->CheckRekey();
+	scheduler.Run();
+
+	return !quit;
+}
+
+/*
+==================
+Connection::WaitForSocket
+
+Wait until the socket is readable, or writable while the
+scheduler has input to send, or one of "fds" is readable.
+==================
+*/
+void Connection::WaitForSocket(vector<pollfd> &fds, int timeout) {
+	pollfd pfd = { socket->GetSocketID(), POLLIN, 0 };
+
+	if (scheduler.HasWork()) {
+		pfd.events |= POLLOUT;
+	}
+
+	fds.push_back(pfd);
+	poll(&fds[0], fds.size(), timeout);
+}
+
 /*
 ==================
 Connection::DispatchPacket
@@ -144,9 +501,6 @@ void Connection::DispatchPacket() {
 	Packet p(data, len);
 
 	switch (p.type) {
-		case SSH_MSG_REQUEST_SUCCESS:
-		case SSH_MSG_REQUEST_FAILURE:
-		case SSH_MSG_CHANNEL_OPEN:
 		case SSH_MSG_CHANNEL_OPEN_CONFIRMATION:
 		case SSH_MSG_CHANNEL_OPEN_FAILURE:
 		case SSH_MSG_CHANNEL_WINDOW_ADJUST:
@@ -157,7 +511,22 @@ void Connection::DispatchPacket() {
 		case SSH_MSG_CHANNEL_DATA:
 		case SSH_MSG_CHANNEL_EXTENDED_DATA:
 		case SSH_MSG_CHANNEL_EOF:
-			channel->HandleMessage(data, len);
+			DispatchChannel(data, len);
+			break;
+
+		case SSH_MSG_KEXINIT:
+		case SSH_MSG_KEXDH_REPLY:
+		case SSH_MSG_NEWKEYS:
+			session->HandleKexPacket(data, len);
+			break;
+
+		/* Neither global requests nor server initiated 
+		 * channels are made use of */
+		case SSH_MSG_REQUEST_SUCCESS:
+		case SSH_MSG_REQUEST_FAILURE:
+		case SSH_MSG_CHANNEL_OPEN:
+		case SSH_MSG_IGNORE:
+		case SSH_MSG_DEBUG:
 			break;
 
 		case SSH_MSG_GLOBAL_REQUEST:
@@ -165,21 +534,61 @@ void Connection::DispatchPacket() {
 
 		default:
 			printf("[Conn] Unidentified packet:\n");
-			Session::GetSingleton()->DeterminePacket(data,len);
+			Session::DeterminePacket(data,len);
 			break;
 	}
 }
 
+/*
+==================
+Connection::DispatchChannel
+
+Pass a channel message to the channel it is addressed to.
+==================
+*/
+void Connection::DispatchChannel(const ubyte *data, uint32 len) {
+	Channel *ch = channels.Lookup(data, len);
+
+	if (!ch) {
+		printf("[Conn] Message for unknown channel\n");
+		return;
+	}
+
+	ch->HandleMessage(data, len);
+}
+
 /*
 ==================
 Connection::HandleInput
+
+Pass what the input thread has read to our channel, as 
+far as the coalescer allows, and as long as the channel's
+queue is not too long. The rest stays in the ring, and the
+input thread waits while the ring is full.
 ==================
 */
 void Connection::HandleInput() {
-	pthread_mutex_lock(&inlock);
+	ubyte buf[16384];
+	uint32 n, take;
 
-	channel->SendInput(g_input);
-	g_input = "";
+	input->ClearWake();
 
-	pthread_mutex_unlock(&inlock);
+	if (channel->IsClosed()) {
+		while (input->Read(buf, sizeof(buf)));
+		return;
+	}
+
+	take = coalescer.Take(input->Size(), channel->GetMaxPacket(), 
+						  GetTimeUsec(), input->HasEnded());
+
+	while (take && channel->OutputPending() < CHAN_QUEUE_MAX
+			&& (n = input->Read(buf, MIN(take, sizeof(buf))))) {
+		channel->SendInput(buf, n);
+		take -= n;
+	}
+
+	if (!inputDone && input->AtEOF()) {
+		inputDone = true;
+		channel->SendEOF();
+	}
 }
\ No newline at end of file
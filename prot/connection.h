@@ -1,8 +1,18 @@
 #pragma once
 
 #include "channel.h"
+#include "channeltable.h"
+#include "scheduler.h"
+#include "inputring.h"
+#include "coalescer.h"
 #include "../sshay.h"
 #include "../net/socket.h"
+#include <poll.h>
+
+class Session;
+class ControlMaster;
+class SftpClient;
+class ScpClient;
 
 /*
 ==================
@@ -11,21 +21,63 @@ Connection
 Implements the SSH-CONNECTION Protocol.
 Before an obejct of this class is instantiated,
 the user MUST be authorized access by the server.
+
+"MainLoop" runs an interactive shell, "RunCommand" a 
+single command, and "RunSftp" and "RunScp" a file 
+transfer. Alternatively, a command is started with
+"StartExec", and the caller drives the connection by 
+calling "Poll" whenever the socket is readable.
+
+With a control master enabled, other processes open
+channels of their own on the connection, and it is kept 
+open until the last of them is done.
 ==================
 */
 class Connection {
 public:
-					Connection(Socket *s);
+					Connection(Session *ses, Socket *s);
 					~Connection();
 	int 			MainLoop();
+	int 			RunCommand(string command);
+	bool 			RunSftp(SftpClient *sftp);
+	bool 			RunScp(ScpClient *scp);
+
+	/* Run "command" on a channel of its own, and keep its 
+	 * output in "out". The exit status is returned, or -1. */
+	int 			RunCapture(string command, string &out);
+
+	bool 			StartExec(string command, string prefix);
+	bool 			Poll();
+	int 			GetExitStatus() { return channel->GetExitStatus(); }
+
+	bool 			EnableControlMaster(string path);
+
+	/* Record our own channel to an asciicast file at "path" */
+	bool 			EnableRecording(string path, string command, bool input);
+
+	/* Additional channels, besides the first */
+	Channel* 		OpenChannel();
+	void 			RemoveChannel(Channel *ch);
 
 private:
+	Session 		*session;
 	Socket 			*socket;
 	bool 			quit;
 
-	Channel 		*channel;
+	Channel 		*channel;		// Our own channel
+	ChannelTable 	channels;		// All open channels
+	ChannelScheduler scheduler;		// Decides who sends next
+
+	ControlMaster 	*master;
+	SessionRecorder *recorder;
+
+	InputRing 		*input;			// Filled by the stdin thread
+	bool 			inputDone;		// EOF is sent for the end of stdin
+	InputCoalescer 	coalescer;
 
 	void 			DispatchPacket();
+	void 			DispatchChannel(const ubyte *data, uint32 len);
 
 	void 			HandleInput();
+	void 			WaitForSocket(vector<pollfd> &fds, int timeout);
 };
\ No newline at end of file
@@ -0,0 +1,578 @@
+#include "controlmaster.h"
+#include "connection.h"
+
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+
+/*
+==================
+CMAddUI
+==================
+*/
+static void CMAddUI(vector<ubyte> &buf, uint32 ui) {
+	buf.push_back(ui >> 24);
+	buf.push_back(ui >> 16);
+	buf.push_back(ui >> 8);
+	buf.push_back(ui);
+}
+
+/*
+==================
+CMAddress
+
+False is returned if "path" is too long for a Unix socket.
+==================
+*/
+static bool CMAddress(string path, sockaddr_un &addr) {
+	bzero((char*)&addr, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+
+	if (path.length() >= sizeof(addr.sun_path)) {
+		Warning("The control socket path is too long");
+		return false;
+	}
+
+	strcpy(addr.sun_path, path.c_str());
+	return true;
+}
+
+
+/*
+==================
+ControlMaster::ControlMaster
+==================
+*/
+ControlMaster::ControlMaster(Connection *conn) {
+	connection = conn;
+	listenFd = -1;
+}
+
+/*
+==================
+ControlMaster::~ControlMaster
+
+Clients still attached get exit status 255.
+==================
+*/
+ControlMaster::~ControlMaster() {
+	StopListening();
+
+	for (unsigned i=0; i<clients.size(); i++) {
+		Finish(clients[i]);
+	}
+}
+
+/*
+==================
+ControlMaster::Listen
+
+The socket is bound to a temporary name and linked into
+place, so clients never find a socket which is not yet
+listening. A stale socket left behind by a master which
+died is replaced.
+==================
+*/
+bool ControlMaster::Listen(string path) {
+	sockaddr_un addr;
+	stringstream tmp;
+
+	tmp <<path <<"." <<getpid();
+	if (!CMAddress(tmp.str(), addr)) {
+		return false;
+	}
+
+	listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listenFd < 0) {
+		Warning("Failed to create the control socket", errno);
+		return false;
+	}
+
+	unlink(tmp.str().c_str());
+
+	if (bind(listenFd, (sockaddr*)&addr, sizeof(addr)) < 0
+	||  chmod(tmp.str().c_str(), 0600) < 0
+	||  listen(listenFd, 16) < 0) {
+		Warning("Failed to listen on the control socket", errno);
+		unlink(tmp.str().c_str());
+		close(listenFd);
+		listenFd = -1;
+		return false;
+	}
+
+	if (link(tmp.str().c_str(), path.c_str()) < 0) {
+		unlink(path.c_str());
+
+		if (link(tmp.str().c_str(), path.c_str()) < 0) {
+			Warning("Failed to create the control socket", errno);
+			unlink(tmp.str().c_str());
+			close(listenFd);
+			listenFd = -1;
+			return false;
+		}
+	}
+
+	unlink(tmp.str().c_str());
+	fcntl(listenFd, F_SETFL, O_NONBLOCK);
+	sockPath = path;
+
+	/* A client going away must not take the master with it */
+	signal(SIGPIPE, SIG_IGN);
+
+	return true;
+}
+
+/*
+==================
+ControlMaster::StopListening
+
+Attached clients are served until their channels close,
+but new invocations start a connection of their own.
+==================
+*/
+void ControlMaster::StopListening() {
+	if (listenFd < 0) {
+		return;
+	}
+
+	close(listenFd);
+	listenFd = -1;
+
+	unlink(sockPath.c_str());
+}
+
+/*
+==================
+ControlMaster::Poll
+==================
+*/
+void ControlMaster::Poll() {
+	if (listenFd >= 0) {
+		Accept();
+	}
+
+	for (unsigned i=0; i<clients.size(); ) {
+		ControlClient *c = clients[i];
+
+		if (!c->channel && !ReadRequest(c)) {
+			Finish(c);
+			clients.erase(clients.begin() + i);
+			continue;
+		}
+
+		/* The rest of the request has not arrived */
+		if (!c->channel) {
+			i++;
+			continue;
+		}
+
+		ForwardInput(c);
+		c->channel->FlushWrites();
+
+		/* The client only ever writes its request. Anything
+		 * more readable means it has gone away. */
+		pollfd pfd = { c->ctl, POLLIN, 0 };
+		if (poll(&pfd, 1, 0) > 0) {
+			c->channel->Close();
+		}
+
+		/* Output kept for the client is written first */
+		if (c->channel->IsClosed() && !c->channel->HasUnwritten(0)
+		&&  !c->channel->HasUnwritten(1)) {
+			Finish(c);
+			clients.erase(clients.begin() + i);
+			continue;
+		}
+
+		i++;
+	}
+}
+
+/*
+==================
+ControlMaster::AddPollFds
+
+Add the fds which "Poll" should be called for when they
+become readable.
+==================
+*/
+void ControlMaster::AddPollFds(vector<pollfd> &fds) {
+	if (listenFd >= 0) {
+		pollfd pfd = { listenFd, POLLIN, 0 };
+		fds.push_back(pfd);
+	}
+
+	for (unsigned i=0; i<clients.size(); i++) {
+		ControlClient *c = clients[i];
+		pollfd pfd = { c->ctl, POLLIN, 0 };
+		fds.push_back(pfd);
+
+		if (!c->channel) {
+			continue;
+		}
+
+		if (c->fds[0] >= 0 
+			&& c->channel->OutputPending() < CHAN_QUEUE_MAX) {
+			pfd.fd = c->fds[0];
+			fds.push_back(pfd);
+		}
+
+		/* Kept output waits for the client's stdout or stderr */
+		for (int s=0; s<2; s++) {
+			if (c->channel->HasUnwritten(s)) {
+				pollfd out = { c->fds[1 + s], POLLOUT, 0 };
+				fds.push_back(out);
+			}
+		}
+	}
+}
+
+/*
+==================
+static ControlMaster::DefaultPath
+
+The socket is placed in $SSHAY_CONTROL_DIR if set, ~/.ssh
+otherwise.
+==================
+*/
+string ControlMaster::DefaultPath(string host, int port) {
+	stringstream ss;
+	const char *env = getenv("SSHAY_CONTROL_DIR");
+
+	if (env && *env) {
+		ss <<env;
+	} else {
+		const char *home = getenv("HOME");
+		ss <<(home ? home : ".") <<"/.ssh";
+	}
+
+	ss <<"/sshay-" <<host <<":" <<port;
+	return ss.str();
+}
+
+/*
+==================
+ControlMaster::Accept
+
+Only processes of our own user are served. Their requests
+are read by "Poll" as they arrive.
+==================
+*/
+void ControlMaster::Accept() {
+	int fd;
+
+	while ((fd = accept(listenFd, NULL, NULL)) >= 0) {
+		struct ucred cred;
+		socklen_t clen = sizeof(cred);
+
+		if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &clen) < 0
+		||  cred.uid != getuid()) {
+			close(fd);
+			continue;
+		}
+
+		fcntl(fd, F_SETFL, O_NONBLOCK);
+
+		ControlClient *c = new ControlClient;
+		c->ctl 		= fd;
+		c->fds[0] 	= -1;
+		c->fds[1] 	= -1;
+		c->fds[2] 	= -1;
+		c->shell 	= false;
+		c->channel 	= NULL;
+
+		clients.push_back(c);
+	}
+}
+
+/*
+==================
+ControlMaster::ReadRequest
+
+Read what has arrived of a new client's request, and open
+its channel once all of it has. The stdio fds are attached
+to the first part. False is returned if the client is to
+be dropped.
+==================
+*/
+bool ControlMaster::ReadRequest(ControlClient *c) {
+	vector<ubyte> &buf = c->request;
+	uint32 total = 0, version, cmdlen, dim[4];
+
+	for (;;) {
+		if (buf.size() >= 4) {
+			BytesToInt(total, &buf[0]);
+			if (total < 24 || total > CM_MAX_REQUEST - 4) {
+				return false;
+			}
+
+			if (buf.size() >= total + 4) {
+				break;
+			}
+		}
+
+		ubyte chunk[4096];
+		char cbuf[CMSG_SPACE(3 * sizeof(int))];
+		iovec iov = { chunk, sizeof(chunk) };
+		msghdr mh;
+
+		bzero((char*)&mh, sizeof(mh));
+		mh.msg_iov = &iov;
+		mh.msg_iovlen = 1;
+		mh.msg_control = cbuf;
+		mh.msg_controllen = sizeof(cbuf);
+
+		/* Only the request is sent, so nothing beyond it is read */
+		if (buf.size() >= 4) {
+			iov.iov_len = MIN(sizeof(chunk), total + 4 - buf.size());
+		}
+
+		int n = recvmsg(c->ctl, &mh, 0);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			return true;
+		}
+
+		if (n <= 0) {
+			return false;
+		}
+
+		if (buf.empty()) {
+			cmsghdr *cm = CMSG_FIRSTHDR(&mh);
+			if (!cm || cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS
+			||  cm->cmsg_len != CMSG_LEN(3 * sizeof(int))) {
+				Warning("ControlMaster: A client sent no stdio");
+				return false;
+			}
+			memcpy(c->fds, CMSG_DATA(cm), 3 * sizeof(int));
+
+			/* As OpenSSH does. The client restores them. */
+			for (int i=0; i<3; i++) {
+				fcntl(c->fds[i], F_SETFL, fcntl(c->fds[i], F_GETFL) | O_NONBLOCK);
+			}
+		}
+
+		buf.insert(buf.end(), chunk, chunk + n);
+	}
+
+	BytesToInt(version, &buf[4]);
+	if (version != CM_VERSION) {
+		Warning("ControlMaster: Unsupported client version", version);
+		return false;
+	}
+
+	for (int i=0; i<4; i++) {
+		BytesToInt(dim[i], &buf[8 + 4*i]);
+	}
+
+	BytesToInt(cmdlen, &buf[24]);
+	if (cmdlen > total - 24) {
+		return false;
+	}
+
+	c->shell = (cmdlen == 0);
+	c->channel = connection->OpenChannel();
+	c->channel->SetOutputFds(c->fds[1], c->fds[2], true);
+
+	if (c->shell) {
+		c->channel->SetTermDim(dim[0], dim[1], dim[2], dim[3]);
+	} else {
+		c->channel->SetCommand(string((const char*)&buf[28], cmdlen));
+		c->channel->KeepInput();
+	}
+
+	return c->channel->Init();
+}
+
+/*
+==================
+ControlMaster::ForwardInput
+
+Pass whatever the client's stdin has to its shell or
+command, unless the server's window holds back too much
+queued input. The end of stdin is passed on as an EOF.
+==================
+*/
+void ControlMaster::ForwardInput(ControlClient *c) {
+	char buf[4096];
+
+	if (c->fds[0] < 0 || !c->channel->IsReady()) {
+		return;
+	}
+
+	/* Wait for the queued input to be sent first */
+	if (c->channel->OutputPending() >= CHAN_QUEUE_MAX) {
+		return;
+	}
+
+	pollfd pfd = { c->fds[0], POLLIN, 0 };
+	if (poll(&pfd, 1, 0) <= 0) {
+		return;
+	}
+
+	int n = read(c->fds[0], buf, sizeof(buf));
+	if (n > 0) {
+		c->channel->SendInput(string(buf, n));
+	} else if (n == 0 || (errno != EINTR && errno != EAGAIN)) {
+		close(c->fds[0]);
+		c->fds[0] = -1;
+		c->channel->SendEOF();
+	}
+}
+
+/*
+==================
+ControlMaster::Finish
+
+Send the exit status to the client, and free everything
+held for it.
+==================
+*/
+void ControlMaster::Finish(ControlClient *c) {
+	int status = c->channel ? c->channel->GetExitStatus() : -1;
+	vector<ubyte> reply;
+
+	CMAddUI(reply, (status < 0) ? 255 : status);
+	send(c->ctl, &reply[0], reply.size(), MSG_NOSIGNAL);
+
+	close(c->ctl);
+	for (int i=0; i<3; i++) {
+		if (c->fds[i] >= 0) {
+			close(c->fds[i]);
+		}
+	}
+
+	if (c->channel) {
+		connection->RemoveChannel(c->channel);
+	}
+
+	delete c;
+}
+
+/*
+==================
+static ControlMaster::RunClient
+
+A shell gets the terminal in raw mode, as all terminal
+handling is done by the remote pty.
+==================
+*/
+int ControlMaster::RunClient(string path, string command) {
+	sockaddr_un addr;
+	vector<ubyte> req;
+	uint32 chW = 0, chH = 0, pW = 0, pH = 0;
+	int stdio[3] = { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO };
+	bool raw = !command.length() && isatty(STDIN_FILENO);
+
+	if (!CMAddress(path, addr)) {
+		return -1;
+	}
+
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) {
+		return -1;
+	}
+
+	if (connect(fd, (sockaddr*)&addr, sizeof(addr)) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	if (raw) {
+		GetTermDim(chW, chH, pW, pH);
+	}
+
+	CMAddUI(req, 0);
+	CMAddUI(req, CM_VERSION);
+	CMAddUI(req, chW);
+	CMAddUI(req, chH);
+	CMAddUI(req, pW);
+	CMAddUI(req, pH);
+	CMAddUI(req, command.length());
+	req.insert(req.end(), command.begin(), command.end());
+
+	uint32 total = req.size() - 4;
+	req[0] = total >> 24;
+	req[1] = total >> 16;
+	req[2] = total >> 8;
+	req[3] = total;
+
+	/* The stdio fds are attached to the first part of the request */
+	char cbuf[CMSG_SPACE(sizeof(stdio))];
+	iovec iov = { &req[0], req.size() };
+	msghdr mh;
+
+	bzero((char*)&mh, sizeof(mh));
+	bzero(cbuf, sizeof(cbuf));
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	mh.msg_control = cbuf;
+	mh.msg_controllen = sizeof(cbuf);
+
+	cmsghdr *cm = CMSG_FIRSTHDR(&mh);
+	cm->cmsg_level = SOL_SOCKET;
+	cm->cmsg_type = SCM_RIGHTS;
+	cm->cmsg_len = CMSG_LEN(sizeof(stdio));
+	memcpy(CMSG_DATA(cm), stdio, sizeof(stdio));
+
+	/* The master makes them non-blocking */
+	int flags[3];
+	for (int i=0; i<3; i++) {
+		flags[i] = fcntl(stdio[i], F_GETFL);
+	}
+
+	int n = sendmsg(fd, &mh, MSG_NOSIGNAL);
+	if (n <= 0 || !Channel::WriteFd(fd, &req[n], req.size() - n)) {
+		close(fd);
+		return 255;
+	}
+
+	struct termios orgopts, rawopts;
+	if (raw) {
+		tcgetattr(STDIN_FILENO, &orgopts);
+		rawopts = orgopts;
+		cfmakeraw(&rawopts);
+		tcsetattr(STDIN_FILENO, TCSANOW, &rawopts);
+	}
+
+	/* Wait for the exit status */
+	ubyte reply[4];
+	uint32 got = 0;
+
+	while (got < 4) {
+		n = read(fd, reply + got, 4 - got);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			break;
+		}
+		got += n;
+	}
+
+	if (raw) {
+		tcsetattr(STDIN_FILENO, TCSANOW, &orgopts);
+	}
+
+	for (int i=0; i<3; i++) {
+		if (flags[i] >= 0) {
+			fcntl(stdio[i], F_SETFL, flags[i]);
+		}
+	}
+
+	close(fd);
+
+	if (got < 4) {
+		return 255;
+	}
+
+	uint32 status;
+	BytesToInt(status, reply);
+	return status;
+}
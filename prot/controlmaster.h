@@ -0,0 +1,92 @@
+#pragma once
+
+#include "../sshay.h"
+#include <poll.h>
+
+class Connection;
+class Channel;
+
+/* Version of the control protocol */
+#define CM_VERSION 			1
+
+/* Longest accepted request */
+#define CM_MAX_REQUEST 		65536
+
+/*
+==================
+ControlClient
+
+A later invocation of sshay, attached through the control
+socket. Its stdin, stdout and stderr were passed along with
+its request, and are used directly by the channel. The
+channel is opened once all of the request has arrived.
+==================
+*/
+struct ControlClient {
+	int 			ctl;		// The control connection
+	int 			fds[3];		// stdin, stdout and stderr
+	bool 			shell;		// A shell on a pty, not a command
+	vector<ubyte> 	request;	// What has arrived of the request
+	Channel 		*channel;
+};
+
+/*
+==================
+ControlMaster
+
+Shares an authenticated connection with later invocations
+of sshay for the same host, in the manner of OpenSSH's
+ControlMaster. The master listens on a Unix socket. A
+client connects and sends a single request, holding its
+command and terminal size, with its stdio fds attached.
+The master opens a new channel for the client, and writes
+the exit status back when the channel closes. Without a
+command, the client gets a shell on a pty.
+
+The master serves its own session from the same loop, so
+it never waits for a client. The control connections and 
+the client's stdio are non-blocking, and output which a 
+client's stdout cannot take yet is kept by the channel. 
+The server's window then holds the rest back.
+
+Request, all integers are uint32 in network order:
+	length of the rest
+	CM_VERSION
+	width, height, pixel width, pixel height
+	command length, command
+
+Reply:
+	exit status
+==================
+*/
+class ControlMaster {
+public:
+					ControlMaster(Connection *conn);
+					~ControlMaster();
+
+	bool 			Listen(string path);
+	void 			StopListening();
+
+	/* Handle new clients, client input and closed channels */
+	void 			Poll();
+	void 			AddPollFds(vector<pollfd> &fds);
+	bool 			HasClients() { return clients.size() > 0; }
+
+	static string 	DefaultPath(string host, int port);
+
+	/* Run "command", or a shell if empty, through the master
+	 * listening on "path". The exit status is returned, or -1
+	 * if no master is listening. */
+	static int 		RunClient(string path, string command);
+
+private:
+	Connection 		*connection;
+	int 			listenFd;
+	string 			sockPath;
+	vector<ControlClient*> clients;
+
+	void 			Accept();
+	bool 			ReadRequest(ControlClient *c);
+	void 			ForwardInput(ControlClient *c);
+	void 			Finish(ControlClient *c);
+};
@@ -0,0 +1,282 @@
+#include "fanout.h"
+#include "session.h"
+#include "connection.h"
+
+#include <poll.h>
+#include <fcntl.h>
+
+
+/*
+==================
+FanOut::FanOut
+==================
+*/
+FanOut::FanOut() {
+	parallel 	= FANOUT_PARALLEL;
+	wakePipe[0] = -1;
+	wakePipe[1] = -1;
+}
+
+/*
+==================
+FanOut::~FanOut
+==================
+*/
+FanOut::~FanOut() {
+	for (unsigned i=0; i<hosts.size(); i++) {
+		delete hosts[i];
+	}
+
+	if (wakePipe[0] >= 0) {
+		close(wakePipe[0]);
+		close(wakePipe[1]);
+	}
+}
+
+/*
+==================
+FanOut::AddHost
+==================
+*/
+void FanOut::AddHost(string host, int port) {
+	FanOutHost *h = new FanOutHost;
+	stringstream ss;
+
+	ss <<host;
+	if (port != 22) {
+		ss <<":" <<port;
+	}
+	ss <<": ";
+
+	h->host 		= host;
+	h->port 		= port;
+	h->prefix 		= ss.str();
+	h->state 		= FO_WAITING;
+	h->session 		= NULL;
+	h->connection 	= NULL;
+	h->handshakeOk 	= false;
+	h->exitStatus 	= -1;
+
+	hosts.push_back(h);
+}
+
+/*
+==================
+FanOut::SetParallel
+==================
+*/
+void FanOut::SetParallel(uint32 n) {
+	parallel = MAX(n, 1);
+}
+
+/*
+==================
+FanOut::SetCredentials
+
+The same credentials are used on every host.
+==================
+*/
+void FanOut::SetCredentials(string u, string p) {
+	user = u;
+	password = p;
+}
+
+/*
+==================
+FanOut::Run
+
+Hosts are started in order, as earlier hosts finish.
+The main thread waits in poll() on the sockets of all
+running hosts, and on a pipe which the handshake threads
+write their host to when they are done.
+==================
+*/
+int FanOut::Run() {
+	vector<pollfd> fds;
+	vector<FanOutHost*> polled;
+	uint32 next = 0;
+	uint32 active = 0;
+	int failed = 0;
+
+	if (pipe(wakePipe) < 0) {
+		Error("FanOut::Run(): Failed to create pipe", errno);
+		return hosts.size();
+	}
+	fcntl(wakePipe[0], F_SETFL, O_NONBLOCK);
+
+	while (next < hosts.size() || active) {
+		while (active < parallel && next < hosts.size()) {
+			if (StartHandshake(hosts[next++])) {
+				active++;
+			}
+		}
+
+		fds.clear();
+		polled.clear();
+
+		pollfd wake = { wakePipe[0], POLLIN, 0 };
+		fds.push_back(wake);
+
+		for (unsigned i=0; i<hosts.size(); i++) {
+			if (hosts[i]->state == FO_RUNNING) {
+				Socket *s = hosts[i]->session->GetSocket();
+				pollfd pfd = { s->GetSocketID(), POLLIN, 0 };
+
+				fds.push_back(pfd);
+				polled.push_back(hosts[i]);
+			}
+		}
+
+		/* The timeout lets idle sessions check their rekey timers */
+		int n = poll(&fds[0], fds.size(), 1000);
+		if (n < 0 && errno != EINTR) {
+			Error("FanOut::Run(): poll failed", errno);
+			break;
+		}
+
+		for (unsigned i=0; i<polled.size(); i++) {
+			FanOutHost *h = polled[i];
+
+			if (n && !fds[i+1].revents) {
+				continue;
+			}
+
+			if (!h->connection->Poll()) {
+				Finish(h, FO_DONE);
+				active--;
+			}
+		}
+
+		FanOutHost *h;
+		while (read(wakePipe[0], &h, sizeof(h)) == sizeof(h)) {
+			FinishHandshake(h);
+
+			if (h->state != FO_RUNNING) {
+				active--;
+			}
+		}
+	}
+
+	for (unsigned i=0; i<hosts.size(); i++) {
+		if (hosts[i]->state != FO_DONE || hosts[i]->exitStatus) {
+			failed++;
+		}
+	}
+
+	return failed;
+}
+
+/*
+==================
+FanOut::StartHandshake
+==================
+*/
+bool FanOut::StartHandshake(FanOutHost *h) {
+	h->session = new Session;
+	h->session->SetCredentials(user, password);
+	h->state = FO_HANDSHAKE;
+	h->handshakeOk = false;
+	h->wakeFd = wakePipe[1];
+
+	if (pthread_create(&h->thread, NULL, &HandshakeThread, h)) {
+		Error("FanOut: Failed to create handshake thread", errno);
+		Finish(h, FO_FAILED);
+		return false;
+	}
+
+	return true;
+}
+
+/*
+==================
+FanOut::FinishHandshake
+
+Join the handshake thread of "h", and start the command
+if the handshake succeeded.
+==================
+*/
+void FanOut::FinishHandshake(FanOutHost *h) {
+	pthread_join(h->thread, NULL);
+
+	if (!h->handshakeOk) {
+		Finish(h, FO_FAILED);
+		return;
+	}
+
+	h->connection = new Connection(h->session, h->session->GetSocket());
+	if (!h->connection->StartExec(command, h->prefix)) {
+		Finish(h, FO_FAILED);
+		return;
+	}
+
+	h->state = FO_RUNNING;
+
+	/* Replies may already be waiting behind the authentication */
+	if (!h->connection->Poll()) {
+		Finish(h, FO_DONE);
+	}
+}
+
+/*
+==================
+FanOut::Finish
+
+Failures and non-zero exit statuses are reported on stderr.
+==================
+*/
+void FanOut::Finish(FanOutHost *h, FanOutState state) {
+	stringstream msg;
+	string partial;
+
+	if (h->connection) {
+		h->exitStatus = h->connection->GetExitStatus();
+	}
+
+	if (state == FO_FAILED) {
+		msg <<"connection failed\n";
+	} else if (h->exitStatus < 0) {
+		msg <<"no exit status received\n";
+	} else if (h->exitStatus) {
+		msg <<"exit status " <<h->exitStatus <<"\n";
+	}
+
+	string text = msg.str();
+	if (text.length()) {
+		Channel::WritePrefixed(STDERR_FILENO, h->prefix, partial,
+							   (const ubyte*)text.c_str(), text.length());
+	}
+
+	if (h->connection) {
+		delete h->connection;
+		h->connection = NULL;
+	}
+
+	if (h->session) {
+		if (h->session->GetSocket()->IsConnected()) {
+			h->session->Disconnect(SSH_DISCONNECT_BY_APPLICATION);
+		}
+
+		delete h->session;
+		h->session = NULL;
+	}
+
+	h->state = state;
+}
+
+/*
+==================
+static FanOut::HandshakeThread
+
+Connect and authenticate. The host is written to the
+wake pipe when done, successful or not.
+==================
+*/
+void* FanOut::HandshakeThread(void *arg) {
+	FanOutHost *h = (FanOutHost*)arg;
+
+	h->handshakeOk = h->session->Initiate(h->host, h->port)
+				  && h->session->UserAuthentication();
+
+	write(h->wakeFd, &h, sizeof(h));
+	return NULL;
+}
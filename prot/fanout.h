@@ -0,0 +1,88 @@
+#pragma once
+
+#include "../sshay.h"
+#include <pthread.h>
+
+class Session;
+class Connection;
+
+/* Default number of hosts handled at once */
+#define FANOUT_PARALLEL 	32
+
+/*
+==================
+FanOutState
+==================
+*/
+enum FanOutState {
+	FO_WAITING,		// Not started
+	FO_HANDSHAKE,	// Key exchange and authentication
+	FO_RUNNING,		// The command is running
+	FO_DONE,		// The channel closed
+	FO_FAILED,		// Connecting or authenticating failed
+};
+
+/*
+==================
+FanOutHost
+
+A host and the session running the command on it.
+==================
+*/
+struct FanOutHost {
+	string 			host;
+	int 			port;
+	string 			prefix;			// "host: "
+
+	FanOutState 	state;
+	Session 		*session;
+	Connection 		*connection;
+	pthread_t 		thread;
+	bool 			handshakeOk;
+	int 			wakeFd;			// Written to when the handshake is done
+	int 			exitStatus;		// Of the command, -1 if unknown
+};
+
+/*
+==================
+FanOut
+
+Runs a single command on many hosts at once, and writes
+the output of each host line by line behind its name.
+
+At most "parallel" hosts are in progress at any time. The
+handshakes are blocking, and run on one thread per host.
+Once authenticated, a host's session is handed to the
+event loop on the main thread, which drives the command
+channels of all hosts from a single poll().
+==================
+*/
+class FanOut {
+public:
+					FanOut();
+					~FanOut();
+
+	void 			AddHost(string host, int port);
+	void 			SetCommand(string cmd) { command = cmd; }
+	void 			SetParallel(uint32 n);
+	void 			SetCredentials(string user, string password);
+
+	/* Returns the number of hosts which failed, or where the 
+	 * command exited with a non-zero status */
+	int 			Run();
+
+private:
+	vector<FanOutHost*> hosts;
+	string 			command;
+	uint32 			parallel;
+	string 			user;
+	string 			password;
+
+	int 			wakePipe[2];	// Written to by finished handshakes
+
+	bool 			StartHandshake(FanOutHost *h);
+	void 			FinishHandshake(FanOutHost *h);
+	void 			Finish(FanOutHost *h, FanOutState state);
+
+	static void* 	HandshakeThread(void *arg);
+};
@@ -0,0 +1,167 @@
+#include "inputring.h"
+#include <fcntl.h>
+
+/*
+==================
+InputRing::InputRing
+==================
+*/
+InputRing::InputRing() {
+	ring = new ubyte[INPUT_RING_SIZE];
+	head = 0;
+	tail = 0;
+	eof = false;
+	wakePipe[0] = -1;
+	wakePipe[1] = -1;
+}
+
+/*
+==================
+InputRing::~InputRing
+==================
+*/
+InputRing::~InputRing() {
+	delete[] ring;
+
+	if (wakePipe[0] >= 0) {
+		close(wakePipe[0]);
+		close(wakePipe[1]);
+	}
+}
+
+/*
+==================
+InputRing::Init
+==================
+*/
+bool InputRing::Init() {
+	if (pipe(wakePipe) < 0) {
+		Error("InputRing::Init(): Failed to create pipe", errno);
+		return false;
+	}
+
+	fcntl(wakePipe[0], F_SETFL, O_NONBLOCK);
+	fcntl(wakePipe[1], F_SETFL, O_NONBLOCK);
+
+	return true;
+}
+
+/*
+==================
+InputRing::Write
+
+The positions run freely, and are masked when indexing.
+==================
+*/
+uint32 InputRing::Write(const ubyte *data, uint32 len) {
+	uint32 h = head.load(memory_order_relaxed);
+	uint32 t = tail.load(memory_order_acquire);
+
+	len = MIN(len, INPUT_RING_SIZE - (h - t));
+	if (!len) {
+		return 0;
+	}
+
+	uint32 pos = h & (INPUT_RING_SIZE - 1);
+	uint32 first = MIN(len, INPUT_RING_SIZE - pos);
+
+	memcpy(ring+pos, data, first);
+	memcpy(ring, data+first, len-first);
+
+	head.store(h + len, memory_order_release);
+	Wake();
+
+	return len;
+}
+
+/*
+==================
+InputRing::Free
+==================
+*/
+uint32 InputRing::Free() {
+	return INPUT_RING_SIZE - (head.load(memory_order_relaxed) 
+							- tail.load(memory_order_acquire));
+}
+
+/*
+==================
+InputRing::SetEOF
+==================
+*/
+void InputRing::SetEOF() {
+	eof.store(true, memory_order_release);
+	Wake();
+}
+
+/*
+==================
+InputRing::Read
+==================
+*/
+uint32 InputRing::Read(ubyte *data, uint32 len) {
+	uint32 t = tail.load(memory_order_relaxed);
+	uint32 h = head.load(memory_order_acquire);
+
+	len = MIN(len, h - t);
+	if (!len) {
+		return 0;
+	}
+
+	uint32 pos = t & (INPUT_RING_SIZE - 1);
+	uint32 first = MIN(len, INPUT_RING_SIZE - pos);
+
+	memcpy(data, ring+pos, first);
+	memcpy(data+first, ring, len-first);
+
+	tail.store(t + len, memory_order_release);
+	return len;
+}
+
+/*
+==================
+InputRing::Size
+==================
+*/
+uint32 InputRing::Size() {
+	return head.load(memory_order_acquire) - tail.load(memory_order_relaxed);
+}
+
+/*
+==================
+InputRing::AtEOF
+
+The EOF flag is read before the size, so no input which
+was added before the EOF can be missed.
+==================
+*/
+bool InputRing::AtEOF() {
+	return eof.load(memory_order_acquire) && !Size();
+}
+
+/*
+==================
+InputRing::ClearWake
+==================
+*/
+void InputRing::ClearWake() {
+	char buf[64];
+
+	while (read(wakePipe[0], buf, sizeof(buf)) > 0);
+}
+
+/*
+==================
+InputRing::Wake
+
+A full pipe already wakes the consumer, so a failed write
+is of no concern.
+==================
+*/
+void InputRing::Wake() {
+	char c = 0;
+
+	if (wakePipe[1] >= 0) {
+		write(wakePipe[1], &c, 1);
+	}
+}
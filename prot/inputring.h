@@ -0,0 +1,62 @@
+#pragma once
+
+#include "../sshay.h"
+#include <atomic>
+
+/* Capacity of the ring, a power of two */
+#define INPUT_RING_SIZE 	(1 << 20)
+
+/*
+==================
+InputRing
+
+A single producer, single consumer byte ring, carrying
+stdin from the input thread to the network loop without
+a lock. The producer and the consumer each own one end,
+and publish it with a release store.
+
+Whenever the producer adds to the ring, a byte is written
+to the wake pipe, for the consumer to poll on. The producer
+adds a whole read() at a time, so this costs one write per
+read.
+==================
+*/
+class InputRing {
+public:
+					InputRing();
+					~InputRing();
+
+	bool 			Init();
+
+	/* Producer. Returns the number of bytes added */
+	uint32 			Write(const ubyte *data, uint32 len);
+	uint32 			Free();
+
+	/* The producer has reached the end of its input */
+	void 			SetEOF();
+
+	/* Consumer. Returns the number of bytes taken */
+	uint32 			Read(ubyte *data, uint32 len);
+	uint32 			Size();
+
+	/* True once the producer's EOF and everything before it
+	 * has been read */
+	bool 			AtEOF();
+
+	/* True once the producer has set EOF */
+	bool 			HasEnded() { return eof.load(memory_order_acquire); }
+
+	/* Readable when input has been added. The consumer calls
+	 * "ClearWake" before reading */
+	int 			GetWakeFd() { return wakePipe[0]; }
+	void 			ClearWake();
+
+private:
+	ubyte 			*ring;
+	atomic<uint32> 	head;		// Written by the producer
+	atomic<uint32> 	tail;		// Written by the consumer
+	atomic<bool> 	eof;
+	int 			wakePipe[2];
+
+	void 			Wake();
+};
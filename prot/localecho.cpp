@@ -0,0 +1,213 @@
+#include "localecho.h"
+
+/*
+==================
+LocalEcho::LocalEcho
+==================
+*/
+LocalEcho::LocalEcho(TermWriter *t, PredictMode m) {
+	term 	= t;
+	mode 	= m;
+	shown 	= 0;
+	blocked = false;
+	epoch 	= 0;
+	confirmed = 0;
+	srtt 	= 0;
+}
+
+/*
+==================
+LocalEcho::OnInput
+
+A prediction is only drawn if every prediction before it 
+is, so the drawn ones are always those right behind the 
+cursor.
+==================
+*/
+void LocalEcho::OnInput(const ubyte *data, uint32 len, uint64 now) {
+	uint32 first = shown;
+
+	if (mode == PM_NEVER) {
+		return;
+	}
+
+	for (uint32 i=0; i<len; i++) {
+		ubyte c = data[i];
+
+		if (c < 32 || c > 126) {
+			blocked = true;
+			epoch++;
+			continue;
+		}
+
+		if (blocked || pending.size() >= PREDICT_MAX) {
+			continue;
+		}
+
+		Prediction p = { c, now, false, epoch };
+		if (ShouldShow() && shown == pending.size()) {
+			p.shown = true;
+			shown++;
+		}
+
+		pending.push_back(p);
+	}
+
+	if (shown > first) {
+		Draw(first);
+	}
+}
+
+/*
+==================
+LocalEcho::OnOutput
+
+Output which starts with the predicted characters confirms
+them. Anything else means the predictions were wrong.
+==================
+*/
+void LocalEcho::OnOutput(const ubyte *data, uint32 len, uint64 now) {
+	uint32 matched = 0, drawn = shown;
+
+	while (matched < len && !pending.empty() && data[matched] == pending.front().c) {
+		uint64 sample = now - pending.front().sent;
+		srtt = srtt ? (7 * srtt + sample) / 8 : sample;
+
+		if (pending.front().shown) {
+			shown--;
+		}
+
+		confirmed = pending.front().epoch;
+		pending.pop_front();
+		matched++;
+	}
+
+	bool wrong = (matched < len && !pending.empty());
+
+	/* Back over the drawn predictions. The confirmed ones are
+	 * written over by their echo, and the rest drawn again 
+	 * behind it. Wrong ones are erased. */
+	if (drawn) {
+		Back(drawn, wrong);
+	}
+
+	if (wrong) {
+		pending.clear();
+		shown = 0;
+		epoch++;
+	}
+
+	term->Write(data, len);
+
+	if (shown) {
+		Draw(0);
+	}
+
+	if (pending.empty()) {
+		blocked = false;
+	}
+}
+
+/*
+==================
+LocalEcho::Tick
+==================
+*/
+void LocalEcho::Tick(uint64 now) {
+	uint64 timeout = MAX(3 * srtt, (uint64)PREDICT_TIMEOUT_MIN);
+
+	if (pending.empty() || now - pending.front().sent < timeout) {
+		return;
+	}
+
+	Clear();
+	epoch++;
+	blocked = false;
+}
+
+/*
+==================
+LocalEcho::ModeFromEnv
+
+$SSHAY_PREDICT is "always", "never" or "adaptive", the
+default.
+==================
+*/
+PredictMode LocalEcho::ModeFromEnv() {
+	const char *env = getenv("SSHAY_PREDICT");
+
+	if (env && !strcmp(env, "always")) {
+		return PM_ALWAYS;
+	}
+
+	if (env && !strcmp(env, "never")) {
+		return PM_NEVER;
+	}
+
+	return PM_ADAPTIVE;
+}
+
+/*
+==================
+LocalEcho::ShouldShow
+
+Only once a prediction of the current epoch is confirmed.
+==================
+*/
+bool LocalEcho::ShouldShow() {
+	if (confirmed != epoch) {
+		return false;
+	}
+
+	return mode == PM_ALWAYS || srtt >= PREDICT_RTT_MIN;
+}
+
+/*
+==================
+LocalEcho::Back
+
+Move the cursor back over "count" drawn predictions, and 
+with "clear", erase the rest of the line.
+==================
+*/
+void LocalEcho::Back(uint32 count, bool clear) {
+	char seq[32];
+
+	int n = snprintf(seq, sizeof(seq), "\e[%uD%s", count, clear ? "\e[K" : "");
+	term->Write((const ubyte*)seq, n);
+}
+
+/*
+==================
+LocalEcho::Draw
+
+The drawn predictions are always the first "shown" ones.
+Those from "from" on are drawn, underlined.
+==================
+*/
+void LocalEcho::Draw(uint32 from) {
+	string out = "\e[4m";
+
+	for (uint32 i=from; i<shown; i++) {
+		out += pending[i].c;
+	}
+	out += "\e[24m";
+
+	term->Write((const ubyte*)out.c_str(), out.length());
+}
+
+/*
+==================
+LocalEcho::Clear
+
+Erase whatever is drawn, and forget all predictions.
+==================
+*/
+void LocalEcho::Clear() {
+	if (shown) {
+		Back(shown, true);
+	}
+
+	pending.clear();
+	shown = 0;
+}
@@ -0,0 +1,95 @@
+#pragma once
+
+#include "../sshay.h"
+#include "termwriter.h"
+#include <deque>
+
+/* Echo slower than this is predicted, in microseconds */
+#define PREDICT_RTT_MIN 	30000
+
+/* Predictions are given up after at least this long */
+#define PREDICT_TIMEOUT_MIN 250000
+
+/* Most keystrokes awaiting their echo */
+#define PREDICT_MAX 		64
+
+/*
+==================
+PredictMode
+
+As mosh's --predict option.
+==================
+*/
+enum PredictMode {
+	PM_NEVER,		// Nothing is drawn locally
+	PM_ADAPTIVE,	// Drawn when the echo is slow
+	PM_ALWAYS,		// Drawn regardless of the echo's delay
+};
+
+/*
+==================
+LocalEcho
+
+Predicts the echo of typed characters, in the manner of 
+mosh. A printable keystroke is drawn at once, underlined
+as tentative, and remembered until the server's echo of
+it arrives.
+
+When output arrives, the cursor is moved back over what 
+was drawn, and the output is written over it. Echo which
+matches the predictions thus replaces them. Otherwise the
+predictions are wrong, and are erased; so they are when 
+no echo arrives in time.
+
+After any other key, like return or backspace, nothing is
+predicted until its effect has arrived. As in mosh, such a
+key, or a wrong prediction, starts a new epoch. Nothing is
+drawn again until a prediction made in the new epoch is 
+confirmed, so nothing typed at a password prompt is drawn.
+Only the current line is predicted, and the cursor is 
+assumed not to wrap.
+
+Times are in microseconds.
+==================
+*/
+class LocalEcho {
+public:
+					LocalEcho(TermWriter *t, PredictMode m);
+
+	/* Keystrokes, as sent to the server */
+	void 			OnInput(const ubyte *data, uint32 len, uint64 now);
+
+	/* Output from the server, written to the terminal */
+	void 			OnOutput(const ubyte *data, uint32 len, uint64 now);
+
+	/* Give up on predictions which are not echoed in time */
+	void 			Tick(uint64 now);
+
+	/* The smoothed time from a keystroke to its echo */
+	uint64 			GetSRTT() { return srtt; }
+
+	static PredictMode ModeFromEnv();
+
+private:
+	struct Prediction {
+		ubyte 		c;
+		uint64 		sent;
+		bool 		shown;
+		uint32 		epoch;
+	};
+
+	TermWriter 		*term;
+	PredictMode 	mode;
+	deque<Prediction> pending;
+	uint32 			shown;		// Pending predictions drawn
+
+	bool 			blocked;	// Waiting for the effect of another key
+	uint32 			epoch;		// Of the predictions being made
+	uint32 			confirmed;	// Epoch of the last confirmed prediction
+	uint64 			srtt;
+
+	bool 			ShouldShow();
+	void 			Back(uint32 count, bool clear);
+	void 			Draw(uint32 from);
+	void 			Clear();
+};
@@ -1,9 +1,5 @@
 #include "packet.h"
 #include "../prot/session.h"
-#include "../globdata.h"
-#include "../mac/macsha1.h"
-
-#include <openssl/hmac.h>
 
 /*
 ==================
@@ -29,11 +25,11 @@ Message::~Message() {
 ==================
 Message::GetData
 
-If Message::addLengths is TRUE, the first
-four bytes of the packet is a uint32 holding the
-length of the packet.
+The packet is returned without a MAC, which is
+appended by the Socket of the connection when the
+packet is written.
 
-len = total - sizeof(len) - sizeof(MAC)
+len = total - sizeof(len)
 
 5 is used as the default added length to
 include the byte used as the padding-length field.
@@ -63,34 +59,18 @@ ubyte* Message::GetData() {
 
 
 	/* The LENGTH field does NOT include the
-	 * LENGTH field itself, nor does it contain
-	 * the length of the MAC.
+	 * LENGTH field itself.
 	 */
-	uint32 lengthField = len - 4 - 20*Session::DoHashPackets();
+	uint32 lengthField = len - 4;
 
-	ubyte *blen = (ubyte*)&lengthField;
-	data[3] = blen[0];
-	data[2] = blen[1];
-	data[1] = blen[2];
-	data[0] = blen[3];
+	data[0] = lengthField >> 24;
+	data[1] = lengthField >> 16;
+	data[2] = lengthField >> 8;
+	data[3] = lengthField;
 
 	// Add the padding length
 	data[4] = padlen;
 
-	/* Add the mac */
-	if (Session::DoHashPackets()) {
-		/* TODO: Clean up this god awful mess */
-		MacSHA1 mac;
-		mac.AddUI(Session::GetSequenceOut());
-		mac.Add(data, len - 20);
-
-		const EVP_MD *evp = EVP_sha1();
-		HMAC_CTX ctx;
-		HMAC_Init(&ctx, GData::macKeyOut, 20, evp);
-		HMAC_Update(&ctx, mac.GetBuffer(), mac.GetBufferLength());
-		HMAC_Final(&ctx, data+len-20, NULL);
-	}
-
 	lptr = data;
 	return data;
 }
@@ -99,7 +79,7 @@ ubyte* Message::GetData() {
 ==================
 Message::GetLength
 
-The FINAL length is returned. 
+The length of the packet, excluding the MAC, is returned. 
 ==================
 */
 uint32 Message::GetLength() {
@@ -111,10 +91,6 @@ uint32 Message::GetLength() {
 		Error("Message::GetLength(): len is not a factor of 8!");
 	}
 
-	if (Session::DoHashPackets()) {
-		len += 20;
-	}
-
 	return len;
 }
 
@@ -158,13 +134,15 @@ void Message::Add(string s) {
 }
 
 void Message::Add(const ubyte *c, int len) {
-	for (unsigned i=0; i<len; i++) {
-		payload.push_back(c[i]);
-	}
+	payload.insert(payload.end(), c, c + len);
 }
 
 void Message::Add(MPInt &mpint) {
-	// TODO
+	uint32 len = mpint.GetRawLength();
+	uint32 off = payload.size();
+
+	payload.resize(off + len);
+	mpint.GetRawBytes(&payload[off]);
 }
 
 
@@ -209,30 +187,43 @@ void NameList::SetFromRaw(const ubyte *raw, uint32 len, int &myLen) {
 	// Copy the the first N-1 elements into the vector
 	for (unsigned i=0; i<num; i++) {
 		if (raw[b+i] == ',') {
-			char *name = new char[b+i-lasti];
-			memcpy(name, raw+lasti, b+i-lasti);
-
-			string strName = name;
+			string strName((const char*)raw+lasti, b+i-lasti);
 			names.push_back(strName);
 
 			lasti = b+i+1;
-			delete[] name;
 		}
 	}
 
 	// Copy the Nth element into the vector
-	char *name = new char[b+num-lasti];
-	memcpy(name, raw+lasti, b+num-lasti);
-
-	string strName = name;
+	string strName((const char*)raw+lasti, b+num-lasti);
 	names.push_back(strName);
 
-	delete[] name;
-
 	// "num" does not include its own length
 	myLen = num + sizeof(uint32);
 }
 
+/*
+==================
+NameList::FirstMatch
+
+Algorithm negotiation as defined in RFC-4253, section 7.1:
+the chosen algorithm is the first algorithm on the client's
+list that is also on the server's list. Call this method on
+the client's list.
+==================
+*/
+string NameList::FirstMatch(const NameList &other) {
+	for (unsigned i=0; i<names.size(); i++) {
+		for (unsigned j=0; j<other.names.size(); j++) {
+			if (names[i] == other.names[j]) {
+				return names[i];
+			}
+		}
+	}
+
+	return "";
+}
+
 /*
 ==================
 NameList::GetString
@@ -291,7 +282,7 @@ MPInt::MPInt
 ==================
 */
 MPInt::MPInt() {
-	leadingZero = false;
+	len = 0;
 }
 
 /*
@@ -326,169 +317,62 @@ uint32 MPInt::SetFromRaw(const ubyte *raw, uint32 packetlen) {
 /*
 ==================
 MPInt::GetRawLength
+
+A number of n bits needs n/8 + 1 bytes: the bytes of the
+magnitude, plus the leading zero when n is a multiple of 8.
 ==================
 */
-uint32 MPInt::GetRawLength() {
-	ubyte offset = 0;
-
-	uint32 nlen = mpz_sizeinbase(mpz.get_mpz_t(), 16);
-	if (nlen % 2) {
-		len++;
-		offset++;
+uint32 MPInt::GetRawLength() const {
+	if (sgn(mpz) == 0) {
+		return 4;
 	}
 
-	// Add a leading "0" to give an even lengthed string
-	char str[nlen + 1];
-	mpz_get_str(str+offset, 16, mpz.get_mpz_t());
-	for (int i=0; i<offset; i++) {
-		str[i] = 0;
-	}
-
-	/* IF THE HIGH ORDER BIT IS 1, THE
-	 * NUMBER IS TECHNICALLY NEGATIVE, AND
-	 * A LEADING ZERO MUST BE ADDED. 
-	 */
-	if (!leadingZero) {
-		char c[2] = { str[offset], 0 };
-		if (strtol(c, NULL, 16) & 8) { 
-			leadingZero = true;
-		}
-	}
-
-	nlen /= 2;
-	nlen += leadingZero;
-
-	return nlen + 4;
+	return mpz_sizeinbase(mpz.get_mpz_t(), 2) / 8 + 1 + 4;
 }
 
 /*
 ==================
 MPInt::GetRawBytes
+
+"buffer" must hold at least "GetRawLength()" bytes.
 ==================
 */
-void MPInt::GetRawBytes(ubyte *buffer) {
-	char *str;
-	char tmp[3] = {0, 0, 0};
-	ubyte offset = 0;
-	uint32 len;
-
-	memset(buffer, 0, 10);
-
-	// Get the length of the number in HEX
-	len = mpz_sizeinbase(mpz.get_mpz_t(), 16);
-	if (len % 2) {
-		len++;
-		offset++;
-	}
-
-	// Add a leading "0" to give an even lengthed string
-	str = new char[len + 1];
-	mpz_get_str(str+offset, 16, mpz.get_mpz_t());
-	for (int i=0; i<offset; i++) {
-		str[i] = 0;
-	}
+void MPInt::GetRawBytes(ubyte *buffer) const {
+	uint32 bytelen = GetRawLength() - 4;
 
-	// Copy the string into the data-array
-	for (int i=0; i<len/2; i++) {
-		tmp[0] = str[i*2];
-		tmp[1] = str[i*2+1];
+	buffer[0] = bytelen >> 24;
+	buffer[1] = bytelen >> 16;
+	buffer[2] = bytelen >> 8;
+	buffer[3] = bytelen;
 
-		buffer[i+4+leadingZero] = (ubyte)strtol(tmp, NULL, 16);
+	if (!bytelen) {
+		return;
 	}
 
-	// Fill in the length field
-	uint32 bytelen = len/2 + leadingZero;
-	ubyte *bytes = (ubyte*)&bytelen;
-
-	buffer[0] = bytes[3];
-	buffer[1] = bytes[2];
-	buffer[2] = bytes[1];
-	buffer[3] = bytes[0];
-
-	delete[] str;
-}
-
-
-// ======================================================
-
+	/* The magnitude is right-aligned, behind the optional zero */
+	size_t maglen = (mpz_sizeinbase(mpz.get_mpz_t(), 2) + 7) / 8;
+	size_t count = 0;
 
-/*
-==================
-DSSBlob::DSSBlob
-==================
-*/
-DSSBlob::DSSBlob() {
-	rawLen = 0;
-	raw = NULL;
+	buffer[4] = 0;
+	mpz_export(buffer + 4 + bytelen - maglen, &count, 1, 1, 1, 0, 
+			   mpz.get_mpz_t());
 }
 
 /*
 ==================
-DSSBlob::~DSSBlob
+MPInt::GetBIGNUM
 ==================
 */
-DSSBlob::~DSSBlob() {
-	if (raw) {
-		delete[] raw;
-	}
-}
-
-/*
-==================
-DSSBlob::SetFromRaw
-==================
-*/
-uint32 DSSBlob::SetFromRaw(const ubyte *packet, uint32 paclen) {
-	uint32 b=0;		// Byte iterator
-	uint32 len=0;	// DSS-field length
-	uint32 flen=0;	// Field length
-	char *kstr=0; 	// Identifity string (should be "ssh-dss")
-
-	/* Copy the raw data */
-	BytesToInt(len, packet);
-	b += sizeof(uint32);
-
-	rawLen = len+4;
-	raw = new ubyte[rawLen];
-	memcpy(raw, packet, rawLen);
-
-	if (paclen < len) {
-		Error("DSSBlob::SetFromRaw() : " 
-			   "subfield is shorter than packet length.");
-		return 0;
-	}
-
-	BytesToInt(flen, packet+b);
-	b += sizeof(uint32);
-
-	kstr = new char[flen+1];
-	kstr[flen] = 0;
-	memcpy(kstr, packet+b, flen);
-	if (strcmp(kstr, "ssh-dss") != 0) {
-		printf("Expected ssh-dss, got %s.\n", kstr);
-		delete[] kstr;
-		return 0;
-	}
-	delete[] kstr;
-	b += flen;
-
-	uint32 tmplen = 0;
-
-	lenp = p.SetFromRaw(packet+b, paclen);
-	b += lenp;
-	p.leadingZero = true;
-
-	lenq = q.SetFromRaw(packet+b, paclen);
-	b += lenq;
-
-	leng = g.SetFromRaw(packet+b, paclen);
-	b += leng;
-	g.leadingZero = true;
+BIGNUM* MPInt::GetBIGNUM(BIGNUM *bn) const {
+	size_t count = 0;
+	size_t maglen = (mpz_sizeinbase(mpz.get_mpz_t(), 2) + 7) / 8;
+	ubyte *mag = new ubyte[maglen];
 
-	leny = y.SetFromRaw(packet+b, paclen);
-	b += leny;
+	mpz_export(mag, &count, 1, 1, 1, 0, mpz.get_mpz_t());
+	bn = BN_bin2bn(mag, count, bn);
 
-	return len + 4;
+	delete[] mag;
+	return bn;
 }
 
 
@@ -597,7 +481,7 @@ KexPacket::KexPacket(const ubyte *raw, int len)
 	//printf("First kex follows: %i\n", firstKexFollows);
 	//printf("Reserved: %u\n", reserved);
 	//printf("Unread bytes: %i\n", len-b);
-	if (len-b != 0) {
+	if (len-b != 0 && len-b != 20) {
 		Warning("KexPacket: Length mismatch", len-b);
 	}
 }
@@ -615,20 +499,24 @@ KexDHPacket::KexDHPacket(const ubyte *raw, uint32 len)
 : Packet(raw, len) {
 	uint32 b = 6; 		// Byte iterator
 	uint32 flen = 0;	// Field length
-	char *kstr=0; 		// Identity string
+
+	valid = false;
+	rawF = NULL;
+	rawFlen = 0;
+	rawSig = NULL;
+	rawSiglen = 0;
 
 	if (!IsOfType(SSH_MSG_KEXDH_REPLY)) {
 		Warning("KexDHPacket(): Bad packet data given!");
 		return;
 	}
 
-	/* Read the dss blob */
-	if (GData::dssBlob) {
-		delete GData::dssBlob;
+	/* Read the host key */
+	flen = hostKey.SetFromRaw(raw+b, len-b);
+	if (!flen) {
+		return;
 	}
-
-	GData::dssBlob = new DSSBlob();
-	b += GData::dssBlob->SetFromRaw(raw+b, len);
+	b += flen;
 
 	/* Read the F value */
 	rawFlen = dhF.SetFromRaw(raw+b, len);
@@ -636,45 +524,26 @@ KexDHPacket::KexDHPacket(const ubyte *raw, uint32 len)
 	memcpy(rawF, raw+b, rawFlen);
 	b += rawFlen;
 
-	/* Copy the entire public-key field */
-	BytesToInt(flen, raw+b);
-	b += sizeof(uint32);
-
-	// The identification string must be "ssh-dss"
-	BytesToInt(flen, raw+b);
-	b += sizeof(uint32);
-	kstr = new char[flen+1];
-	kstr[flen] = 0;
-	memcpy(kstr, raw+b, flen);
-	if (strcmp(kstr, "ssh-dss") != 0) {
-		printf("KexDHPacket: Expected ssh-dss, got %s.\n", kstr);
-		delete[] kstr;
+	/* Read the signature field */
+	if (b + 4 > len) {
+		Error("KexDHPacket: Missing signature");
 		return;
 	}
 
-	delete[] kstr;
-	b += flen;
-
-	/* Read the signature blob */
 	BytesToInt(flen, raw+b);
 	b += sizeof(uint32);
 
-	if (flen != 40) {
-		/* TODO: Disconnect here */
-		stringstream ss;
-		ss <<"DSA signature-blob length mismatch! ";
-		ss <<"Expected 40 bytes, got " <<flen <<"!";
-		Error(ss.str().c_str());
+	if (flen > len - b) {
+		Error("KexDHPacket: Signature length mismatch");
 		return;
 	}
 
-	memcpy(dssR, raw+b, 20);
-	b += 20;
-
-	memcpy(dssS, raw+b, 20);
-	b += 20;
+	rawSiglen = flen;
+	rawSig = new ubyte[rawSiglen];
+	memcpy(rawSig, raw+b, rawSiglen);
+	b += flen;
 
-	b += paddingLength;
+	valid = true;
 }
 
 /*
@@ -684,4 +553,5 @@ KexDHPacket::~KexDHPacket
 */
 KexDHPacket::~KexDHPacket() {
 	delete[] rawF;
+	delete[] rawSig;
 }
\ No newline at end of file
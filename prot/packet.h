@@ -1,11 +1,12 @@
 #pragma once
 
 #include "../sshay.h"
+#include "../crypt/hostkey.h"
+#include <openssl/bn.h>
 
 class Socket;
 struct NameList;
 struct MPInt;
-struct DSSBlob;
 
 /*
 ==================
@@ -54,6 +55,10 @@ struct NameList {
 					NameList(const ubyte *, uint32, int &myLen);
 	void 			SetFromRaw(const ubyte *, uint32, int &myLen);
 
+	/* The first name in this list which is also in "other".
+	 * An empty string is returned if there is no match. */
+	string 			FirstMatch(const NameList &other);
+
 	string 			GetString();
 	void 			Display();
 
@@ -67,8 +72,10 @@ MPInt
 High precision integer. Works as a wrapper around
 an "mpz_t" from the GNU MP library.
 
-If "leadingZero == true", GetRawBytes will append
-a leading zero to pad a short mpint.
+The raw encoding is the SSH "mpint": a big-endian string
+with a leading zero byte whenever the high bit of the first
+byte is set, and no bytes at all for zero. Only non-negative
+numbers are supported.
 ==================
 */
 struct MPInt {
@@ -78,43 +85,19 @@ struct MPInt {
 	/* The total byte-length of the "mpint" is returned. */
 	uint32 			SetFromRaw(const ubyte*, uint32);
 
-	uint32 			GetRawLength();
-	void 			GetRawBytes(ubyte *buffer);
+	/* Length of the encoding, including the length field */
+	uint32 			GetRawLength() const;
+	void 			GetRawBytes(ubyte *buffer) const;
+
+	/* Set "bn" (or a new BIGNUM if NULL) to the value */
+	BIGNUM* 		GetBIGNUM(BIGNUM *bn = NULL) const;
 
-	uint32 			len;
+	uint32 			len;		// Length read by "SetFromRaw"
 	mpz_class 		mpz;
-	bool 			leadingZero;
 
 private:
 };
 
-/*
-==================
-DSSBlob
-==================
-*/
-struct DSSBlob {
-				DSSBlob();
-				~DSSBlob();
-				
-	/* The total length of the DSS-field is returned */
-	uint32 		SetFromRaw(const ubyte *packet, uint32 paclen);
-
-	MPInt 		p;
-	MPInt 		q;
-	MPInt 		g;
-	MPInt 		y;
-
-	/* Keep the raw data */
-	uint32 		rawLen;
-	ubyte 		*raw;
-
-	uint32  	lenp;
-	uint32 		lenq;
-	uint32 		leng;
-	uint32 		leny;
-};
-
 
 
 
@@ -201,22 +184,23 @@ SSH_MSG_KEXDH_REPLY packet sent from the server.
 The format is specified in SSH-TRANS:
 	byte      	SSH_MSG_KEXDH_REPLY
   	string   	server public host key and certificates (K_S).
-				This client only supports shh-dss, so this field
-				contains the mpints: p, q, g and y.
+				The key is parsed into "hostKey".
 	mpint     	f
-  	string    	signature of H. This field contains for DSS-
-  				signatures the R and S components of the signature.
-  				They are both 160 bit.
+  	string    	signature of H. The name of the signature
+  				algorithm, followed by the signature blob.
 ==================
 */
 struct KexDHPacket : public Packet {
 				KexDHPacket(const ubyte *raw, uint32 len);
 				~KexDHPacket();
 
-	DSSBlob 	dss;
+	HostKey 	hostKey;
 	MPInt 		dhF;
-	ubyte 		dssR[20];
-	ubyte 		dssS[20];
+	bool 		valid;
+
+	/* Keep the raw signature field, without its length */
+	uint32 		rawSiglen;
+	ubyte 		*rawSig;
 
 	/* Keep the raw F data */
 	uint32 		rawFlen;
@@ -0,0 +1,325 @@
+#include "recorder.h"
+#include "channel.h"
+
+#include <fcntl.h>
+#include <sys/time.h>
+
+/*
+==================
+SessionRecorder::SessionRecorder
+==================
+*/
+SessionRecorder::SessionRecorder() {
+	fd 		= -1;
+	start 	= 0;
+	withInput = false;
+	running = false;
+	stop 	= false;
+
+	pthread_mutex_init(&lock, NULL);
+	pthread_cond_init(&cond, NULL);
+}
+
+/*
+==================
+SessionRecorder::~SessionRecorder
+==================
+*/
+SessionRecorder::~SessionRecorder() {
+	Close();
+
+	pthread_mutex_destroy(&lock);
+	pthread_cond_destroy(&cond);
+}
+
+/*
+==================
+SessionRecorder::Open
+
+Create "path", write the asciicast header, and start the
+writer thread.
+==================
+*/
+bool SessionRecorder::Open(string path, uint32 width, uint32 height,
+						   string command) {
+	stringstream ss;
+	string carry;
+	const char *term = getenv("TERM");
+
+	fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0) {
+		Error("Failed to create the recording", errno);
+		return false;
+	}
+
+	start = GetTimeUsec();
+
+	ss <<"{\"version\": 2, \"width\": " <<width 
+	   <<", \"height\": " <<height
+	   <<", \"timestamp\": " <<start / 1000000;
+
+	string header = ss.str();
+	if (command.length()) {
+		header += ", \"command\": \"";
+		AppendJSON(header, carry, (const ubyte*)command.c_str(), command.length());
+		header += "\"";
+	}
+
+	header += ", \"env\": {\"TERM\": \"";
+	if (term) {
+		AppendJSON(header, carry, (const ubyte*)term, strlen(term));
+	}
+	header += "\"}}\n";
+
+	if (!Channel::WriteFd(fd, header.c_str(), header.length())) {
+		Error("Failed to write the recording", errno);
+		close(fd);
+		fd = -1;
+		return false;
+	}
+
+	if (pthread_create(&thread, NULL, &WriterThread, this)) {
+		Error("Failed to create the recording thread", errno);
+		close(fd);
+		fd = -1;
+		return false;
+	}
+
+	running = true;
+	return true;
+}
+
+/*
+==================
+SessionRecorder::Close
+==================
+*/
+void SessionRecorder::Close() {
+	if (!running) {
+		return;
+	}
+
+	pthread_mutex_lock(&lock);
+	stop = true;
+	pthread_cond_signal(&cond);
+	pthread_mutex_unlock(&lock);
+
+	pthread_join(thread, NULL);
+	running = false;
+
+	close(fd);
+	fd = -1;
+}
+
+/*
+==================
+SessionRecorder::Output
+==================
+*/
+void SessionRecorder::Output(const ubyte *data, uint32 len) {
+	Add('o', data, len);
+}
+
+/*
+==================
+SessionRecorder::Input
+
+Ignored unless the input is recorded.
+==================
+*/
+void SessionRecorder::Input(const ubyte *data, uint32 len) {
+	if (withInput) {
+		Add('i', data, len);
+	}
+}
+
+/*
+==================
+SessionRecorder::Add
+
+An event is buffered as its type, its time and the length 
+of its data, followed by the data.
+==================
+*/
+void SessionRecorder::Add(ubyte type, const ubyte *data, uint32 len) {
+	uint64 time = GetTimeUsec() - start;
+
+	if (!running || !len) {
+		return;
+	}
+
+	pthread_mutex_lock(&lock);
+
+	front.append((const char*)&type, 1);
+	front.append((const char*)&time, sizeof(time));
+	front.append((const char*)&len, sizeof(len));
+	front.append((const char*)data, len);
+
+	if (front.length() >= REC_WAKE_SIZE) {
+		pthread_cond_signal(&cond);
+	}
+
+	pthread_mutex_unlock(&lock);
+}
+
+/*
+==================
+static SessionRecorder::WriterThread
+
+Wakes when enough is buffered, or every REC_FLUSH_MS, and
+writes whatever is buffered. Stops once everything is 
+written after "Close".
+==================
+*/
+void* SessionRecorder::WriterThread(void *arg) {
+	SessionRecorder *rec = (SessionRecorder*)arg;
+	bool done = false;
+
+	while (!done) {
+		timespec ts;
+		timeval now;
+
+		gettimeofday(&now, NULL);
+		uint64 ns = (uint64)now.tv_usec * 1000 + (uint64)REC_FLUSH_MS * 1000000;
+		ts.tv_sec = now.tv_sec + ns / 1000000000;
+		ts.tv_nsec = ns % 1000000000;
+
+		pthread_mutex_lock(&rec->lock);
+		if (!rec->stop && rec->front.length() < REC_WAKE_SIZE) {
+			pthread_cond_timedwait(&rec->cond, &rec->lock, &ts);
+		}
+
+		rec->front.swap(rec->back);
+		done = rec->stop;
+		pthread_mutex_unlock(&rec->lock);
+
+		if (rec->back.length()) {
+			rec->WriteEvents(rec->back);
+			rec->back.clear();
+		}
+	}
+
+	return NULL;
+}
+
+/*
+==================
+SessionRecorder::WriteEvents
+
+Turn the buffered events into asciicast lines, and write
+them out.
+==================
+*/
+bool SessionRecorder::WriteEvents(const string &events) {
+	const ubyte *p = (const ubyte*)events.c_str();
+	uint32 pos = 0;
+	string out;
+	char stamp[64];
+
+	while (pos + 13 <= events.length()) {
+		ubyte type = p[pos];
+		uint64 time;
+		uint32 len;
+
+		memcpy(&time, p+pos+1, sizeof(time));
+		memcpy(&len, p+pos+9, sizeof(len));
+		pos += 13;
+
+		snprintf(stamp, sizeof(stamp), "[%lu.%06lu, \"%c\", \"", 
+				 time / 1000000, time % 1000000, type);
+
+		out += stamp;
+		AppendJSON(out, (type == 'o') ? carryOut : carryIn, p+pos, len);
+		out += "\"]\n";
+
+		pos += len;
+	}
+
+	if (!Channel::WriteFd(fd, out.c_str(), out.length())) {
+		Warning("Failed to write the recording", errno);
+		return false;
+	}
+
+	return true;
+}
+
+/*
+==================
+static SessionRecorder::AppendJSON
+
+Valid UTF-8 is kept as it is. Bytes which are not are each
+replaced by U+FFFD.
+==================
+*/
+void SessionRecorder::AppendJSON(string &out, string &carry, 
+								 const ubyte *data, uint32 len) {
+	string joined;
+	char esc[8];
+
+	if (carry.length()) {
+		joined = carry;
+		joined.append((const char*)data, len);
+		carry.clear();
+
+		data = (const ubyte*)joined.c_str();
+		len = joined.length();
+	}
+
+	for (uint32 i=0; i<len; ) {
+		ubyte c = data[i];
+
+		if (c < 0x80) {
+			switch (c) {
+				case '"':	out += "\\\""; 	break;
+				case '\\':	out += "\\\\"; 	break;
+				case '\n':	out += "\\n"; 	break;
+				case '\r':	out += "\\r"; 	break;
+				case '\t':	out += "\\t"; 	break;
+				default:
+					if (c < 0x20 || c == 0x7f) {
+						snprintf(esc, sizeof(esc), "\\u%04x", c);
+						out += esc;
+					} else {
+						out += c;
+					}
+			}
+			i++;
+			continue;
+		}
+
+		uint32 n = 0;
+		if (c >= 0xc2 && c <= 0xdf) {
+			n = 2;
+		} else if (c >= 0xe0 && c <= 0xef) {
+			n = 3;
+		} else if (c >= 0xf0 && c <= 0xf4) {
+			n = 4;
+		}
+
+		/* The rest of the sequence is in the next payload */
+		if (n && i + n > len) {
+			bool partial = true;
+			for (uint32 k=i+1; k<len; k++) {
+				partial &= (data[k] & 0xc0) == 0x80;
+			}
+
+			if (partial) {
+				carry.assign((const char*)data+i, len-i);
+				return;
+			}
+		}
+
+		bool valid = n && i + n <= len;
+		for (uint32 k=1; valid && k<n; k++) {
+			valid = (data[i+k] & 0xc0) == 0x80;
+		}
+
+		if (valid) {
+			out.append((const char*)data+i, n);
+			i += n;
+		} else {
+			out += "\xef\xbf\xbd";
+			i++;
+		}
+	}
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include "../sshay.h"
+#include <pthread.h>
+
+/* Buffered data which wakes the writer early */
+#define REC_WAKE_SIZE 		65536
+
+/* The writer wakes at least this often, in milliseconds */
+#define REC_FLUSH_MS 		200
+
+/*
+==================
+SessionRecorder
+
+Records the data of a channel to an asciicast v2 file, as
+played back by asciinema. Every CHANNEL_DATA payload from 
+the server becomes an "o" event, timed in microseconds from
+the start. As with asciinema's --stdin, the input is only
+recorded when asked for, as "i" events, since it holds 
+whatever is typed, passwords included.
+
+Recording never waits for the disk. The events are added 
+to the front buffer under a lock held only for the copy.
+A writer thread swaps in the empty back buffer, and turns 
+the events into JSON lines and writes them, unlocked.
+Nothing is dropped: if the disk falls behind, the front 
+buffer grows.
+==================
+*/
+class SessionRecorder {
+public:
+					SessionRecorder();
+					~SessionRecorder();
+
+	bool 			Open(string path, uint32 width, uint32 height, 
+						 string command);
+
+	/* Everything recorded so far is written before the file 
+	 * is closed */
+	void 			Close();
+
+	/* Record the input as well as the output */
+	void 			SetInput(bool r) { withInput = r; }
+
+	void 			Output(const ubyte *data, uint32 len);
+	void 			Input(const ubyte *data, uint32 len);
+
+	/* Append "data" to "out" as the contents of a JSON string.
+	 * An incomplete UTF-8 sequence at the end is kept in 
+	 * "carry", and prepended the next time. */
+	static void 	AppendJSON(string &out, string &carry,
+							   const ubyte *data, uint32 len);
+
+private:
+	int 			fd;
+	uint64 			start;
+	bool 			withInput;
+
+	pthread_t 		thread;
+	pthread_mutex_t lock;
+	pthread_cond_t 	cond;
+	bool 			running;
+	bool 			stop;
+
+	string 			front;		// Events added by the channel
+	string 			back;		// Events being written
+
+	string 			carryOut;	// Partial UTF-8 sequences
+	string 			carryIn;
+
+	void 			Add(ubyte type, const ubyte *data, uint32 len);
+	bool 			WriteEvents(const string &events);
+
+	static void* 	WriterThread(void *arg);
+};
@@ -0,0 +1,94 @@
+#include "recvwindow.h"
+
+/*
+==================
+RecvWindow::RecvWindow
+==================
+*/
+RecvWindow::RecvWindow() {
+	size 		= RWIN_INITIAL;
+	target 		= RWIN_INITIAL;
+	total 		= 0;
+	rtt 		= 0;
+	probing 	= false;
+	probeTime 	= 0;
+	probeEnd 	= 0;
+	epochTime 	= 0;
+	epochTotal 	= 0;
+}
+
+/*
+==================
+RecvWindow::Consume
+
+Data beyond the end of the probe completes a round trip
+sample. Once a round trip has passed, the target is 
+raised to twice the bytes consumed during it.
+==================
+*/
+void RecvWindow::Consume(uint32 len, uint64 now) {
+	size -= MIN(len, size);
+	total += len;
+
+	if (probing && total > probeEnd) {
+		uint64 sample = now - probeTime;
+		if (!rtt || sample < rtt) {
+			rtt = MAX(sample, (uint64)1);
+		}
+		probing = false;
+	}
+
+	/* The first data starts the first round trip */
+	if (total == len) {
+		epochTime = now;
+		epochTotal = 0;
+	}
+
+	if (rtt && now - epochTime >= rtt) {
+		uint64 want = 2 * (total - epochTotal);
+		if (want > target) {
+			target = (uint32)MIN(want, (uint64)RWIN_MAX);
+		}
+
+		epochTime = now;
+		epochTotal = total;
+	}
+}
+
+/*
+==================
+RecvWindow::PendingIncrement
+
+The window is topped up to the target once a quarter of 
+it is used, so the server is not held back while the 
+adjustment is on its way. Topping up in smaller steps
+would only cost more messages.
+==================
+*/
+uint32 RecvWindow::PendingIncrement() {
+	if (size >= target) {
+		return 0;
+	}
+
+	uint32 inc = target - size;
+	if (inc < target / 4) {
+		return 0;
+	}
+
+	return inc;
+}
+
+/*
+==================
+RecvWindow::Grant
+==================
+*/
+void RecvWindow::Grant(uint32 increment, uint64 now) {
+	if (!probing) {
+		probing = true;
+		probeTime = now;
+		probeEnd = total + size;
+	}
+
+	size += increment;
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include "../sshay.h"
+
+/* Window granted when a channel is opened */
+#define RWIN_INITIAL 		131072
+
+/* The window never grows beyond this */
+#define RWIN_MAX 			(8 * 1024 * 1024)
+
+/* Largest data packet the server may send us */
+#define RWIN_MAX_PACKET 	131072
+
+/*
+==================
+RecvWindow
+
+The receive window of a channel. The server may only send
+as much data as the window allows, so a fixed window caps
+the throughput at one window per round trip.
+
+The window is grown towards twice the bytes consumed per
+round trip, in the manner of Linux's receive buffer auto
+tuning. While the server is held back by the window, this
+doubles the window every round trip. Once the link or the
+server is the limit, the window settles at about twice the
+bandwidth-delay product.
+
+The round trip is timed from a WINDOW_ADJUST to the first
+byte beyond the previous end of the window, which the
+server can not send before it has the adjustment. The
+smallest sample is kept.
+
+Times are in microseconds.
+==================
+*/
+class RecvWindow {
+public:
+					RecvWindow();
+
+	/* Bytes the server may still send */
+	uint32 			Size() 		{ return size; }
+	uint32 			Target() 	{ return target; }
+
+	/* The round trip time, 0 until measured */
+	uint64 			RTT() 		{ return rtt; }
+
+	/* Account for "len" bytes of data consumed at "now" */
+	void 			Consume(uint32 len, uint64 now);
+
+	/* The increment due in a WINDOW_ADJUST, 0 if none is */
+	uint32 			PendingIncrement();
+
+	/* A WINDOW_ADJUST of "increment" was sent at "now" */
+	void 			Grant(uint32 increment, uint64 now);
+
+private:
+	uint32 			size;
+	uint32 			target;
+
+	uint64 			total;			// Bytes consumed
+	uint64 			rtt;
+
+	bool 			probing;
+	uint64 			probeTime;
+	uint64 			probeEnd;		// End of the window before the probe
+
+	uint64 			epochTime;		// Start of the current round trip
+	uint64 			epochTotal;
+};
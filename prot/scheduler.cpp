@@ -0,0 +1,139 @@
+#include "scheduler.h"
+#include "channel.h"
+#include "../net/socket.h"
+
+/*
+==================
+ChannelScheduler::ChannelScheduler
+==================
+*/
+ChannelScheduler::ChannelScheduler(Socket *s) {
+	socket = s;
+}
+
+/*
+==================
+ChannelScheduler::Activate
+
+Add the channel to the rotation of its class, unless it 
+is in a rotation already.
+==================
+*/
+void ChannelScheduler::Activate(Channel *ch) {
+	if (!active.insert(ch).second) {
+		return;
+	}
+
+	Entry e = { ch, 0, false };
+	queues[ClassOf(ch)].push_back(e);
+}
+
+/*
+==================
+ChannelScheduler::Remove
+==================
+*/
+void ChannelScheduler::Remove(Channel *ch) {
+	if (!active.erase(ch)) {
+		return;
+	}
+
+	for (int c=0; c<SC_COUNT; c++) {
+		for (deque<Entry>::iterator it=queues[c].begin(); it!=queues[c].end(); it++) {
+			if (it->ch == ch) {
+				queues[c].erase(it);
+				return;
+			}
+		}
+	}
+}
+
+/*
+==================
+ChannelScheduler::Run
+
+Send up to "budget" bytes of queued input. The packets are
+written to the socket together.
+==================
+*/
+uint32 ChannelScheduler::Run(uint32 budget) {
+	uint32 sent = 0;
+
+	if (active.empty()) {
+		return 0;
+	}
+
+	socket->Cork();
+
+	while (sent < budget) {
+		if (!queues[SC_INTERACTIVE].empty()) {
+			Step(queues[SC_INTERACTIVE], sent);
+			continue;
+		}
+
+		if (queues[SC_BULK].empty()) {
+			break;
+		}
+
+		/* What is written in this call is not in the kernel yet */
+		if (socket->Unsent() + sent >= SOCKET_UNSENT_LOWAT) {
+			break;
+		}
+
+		Step(queues[SC_BULK], sent);
+	}
+
+	socket->Uncork();
+	return sent;
+}
+
+/*
+==================
+ChannelScheduler::ClassOf
+==================
+*/
+SchedClass ChannelScheduler::ClassOf(Channel *ch) {
+	if (ch->IsInteractive() && ch->OutputPending() <= SCHED_INTERACTIVE_MAX) {
+		return SC_INTERACTIVE;
+	}
+
+	return SC_BULK;
+}
+
+/*
+==================
+ChannelScheduler::Step
+
+Send the next packet of the channel at the front of "q",
+if its deficit allows. Otherwise its turn is over, and it
+moves to the back of the rotation of its class.
+==================
+*/
+bool ChannelScheduler::Step(deque<Entry> &q, uint32 &sent) {
+	Entry &e = q.front();
+	uint32 n = e.ch->NextPacketSize();
+
+	if (!n) {
+		active.erase(e.ch);
+		q.pop_front();
+		return false;
+	}
+
+	if (!e.credited) {
+		e.deficit += SCHED_QUANTUM;
+		e.credited = true;
+	}
+
+	if (n <= e.deficit) {
+		e.deficit -= n;
+		sent += n;
+		return e.ch->SendPacket();
+	}
+
+	Entry next = e;
+	next.credited = false;
+	q.pop_front();
+	queues[ClassOf(next.ch)].push_back(next);
+
+	return false;
+}
@@ -0,0 +1,78 @@
+#pragma once
+
+#include "../sshay.h"
+#include <deque>
+#include <set>
+
+class Channel;
+class Socket;
+
+/* Bytes a bulk channel may send each time it is visited */
+#define SCHED_QUANTUM 		32768
+
+/* Bytes sent in a single call to "Run" */
+#define SCHED_BUDGET 		262144
+
+/* An interactive channel with more than this queued, like a 
+ * paste, is scheduled as bulk until its queue has drained */
+#define SCHED_INTERACTIVE_MAX 	4096
+
+/*
+==================
+SchedClass
+==================
+*/
+enum SchedClass {
+	SC_INTERACTIVE,	// Shells. Sent before anything else
+	SC_BULK,		// Everything else
+	SC_COUNT,
+};
+
+/*
+==================
+ChannelScheduler
+
+Decides which channel of a connection gets to send its 
+queued input next. Channels with input which the server's
+window allows to be sent are activated, and "Run" sends 
+their input a packet at a time.
+
+Interactive channels are always served first. The bulk 
+channels share what is left by deficit round robin: each 
+channel in turn may send SCHED_QUANTUM bytes, and saves up
+what it could not use for its next turn. A channel which 
+has nothing more to send, or is held back by its window, 
+leaves the rotation until it is activated again.
+
+Bulk data is held back while the kernel has more than 
+SOCKET_UNSENT_LOWAT bytes unsent, so keystrokes do not wait
+behind megabytes of data queued in the socket.
+==================
+*/
+class ChannelScheduler {
+public:
+					ChannelScheduler(Socket *s);
+
+	void 			Activate(Channel *ch);
+
+	/* Must be called before "ch" is deleted */
+	void 			Remove(Channel *ch);
+
+	/* Returns the number of bytes sent */
+	uint32 			Run(uint32 budget=SCHED_BUDGET);
+	bool 			HasWork() { return active.size() > 0; }
+
+private:
+	struct Entry {
+		Channel 	*ch;
+		uint32 		deficit;
+		bool 		credited;	// The quantum for this turn is added
+	};
+
+	Socket 			*socket;
+	deque<Entry> 	queues[SC_COUNT];
+	set<Channel*> 	active;
+
+	SchedClass 		ClassOf(Channel *ch);
+	bool 			Step(deque<Entry> &q, uint32 &sent);
+};
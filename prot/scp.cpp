@@ -0,0 +1,436 @@
+#include "scp.h"
+#include "channel.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*
+==================
+ScpClient::ScpClient
+==================
+*/
+ScpClient::ScpClient() {
+	channel 	= NULL;
+	state 		= SC_IDLE;
+	upload 		= false;
+	localFd 	= -1;
+	mode 		= 0644;
+	size 		= 0;
+	transferred = 0;
+	mapped 		= NULL;
+	released 	= 0;
+	inOff 		= 0;
+}
+
+/*
+==================
+ScpClient::~ScpClient
+==================
+*/
+ScpClient::~ScpClient() {
+	if (mapped) {
+		munmap((void*)mapped, size);
+	}
+
+	if (localFd >= 0) {
+		close(localFd);
+	}
+}
+
+/*
+==================
+ScpClient::Get
+==================
+*/
+void ScpClient::Get(string remote, string local) {
+	remotePath = remote;
+	localPath = local;
+	upload = false;
+}
+
+/*
+==================
+ScpClient::Put
+==================
+*/
+void ScpClient::Put(string local, string remote) {
+	remotePath = remote;
+	localPath = local;
+	upload = true;
+}
+
+/*
+==================
+ScpClient::Start
+
+An upload fails here if the local file cannot be read. If
+the file cannot be mapped, it is read a chunk at a time
+instead.
+==================
+*/
+bool ScpClient::Start(Channel *ch) {
+	struct stat st;
+
+	channel = ch;
+	channel->KeepOutput();
+
+	if (!upload) {
+		channel->SetCommand("scp -f " + QuotePath(remotePath));
+
+		/* The remote scp waits for us to be ready */
+		Ack();
+		state = SC_HEADER;
+		return true;
+	}
+
+	localFd = open(localPath.c_str(), O_RDONLY);
+	if (localFd < 0 || fstat(localFd, &st) < 0) {
+		Fail("Failed to open " + localPath);
+		return false;
+	}
+
+	if (!S_ISREG(st.st_mode)) {
+		Fail(localPath + " is not a regular file");
+		return false;
+	}
+
+	size = st.st_size;
+	mode = st.st_mode & 07777;
+
+	if (size) {
+		void *m = mmap(NULL, size, PROT_READ, MAP_PRIVATE, localFd, 0);
+
+		if (m != MAP_FAILED) {
+			madvise(m, size, MADV_SEQUENTIAL);
+			mapped = (const ubyte*)m;
+		} else {
+			posix_fadvise(localFd, 0, 0, POSIX_FADV_SEQUENTIAL);
+		}
+	}
+
+	channel->SetCommand("scp -t " + QuotePath(remotePath));
+	state = SC_READY;
+	return true;
+}
+
+/*
+==================
+ScpClient::Update
+==================
+*/
+void ScpClient::Update() {
+	channel->TakeOutput(inBuf);
+	ParseInput();
+	ReleaseSent();
+}
+
+/*
+==================
+ScpClient::OnData
+==================
+*/
+void ScpClient::OnData(const ubyte *data, uint32 len) {
+	inBuf.append((const char*)data, len);
+	ParseInput();
+}
+
+/*
+==================
+ScpClient::ParseInput
+
+The remote scp replies with a zero byte, or a line. Lines
+starting with 1 or 2 are errors, anything else a header.
+While receiving, the output is the file's data.
+==================
+*/
+void ScpClient::ParseInput() {
+	while (!IsDone() && inOff < inBuf.length()) {
+		const ubyte *p = (const ubyte*)inBuf.c_str() + inOff;
+		uint32 avail = inBuf.length() - inOff;
+
+		if (state == SC_RECEIVE) {
+			uint32 n = MIN((uint64)avail, size - transferred);
+
+			HandleReceive(p, n);
+			inOff += n;
+			continue;
+		}
+
+		if (p[0] == 0 && state != SC_HEADER) {
+			inOff++;
+			HandleAck();
+			continue;
+		}
+
+		const ubyte *nl = (const ubyte*)memchr(p, '\n', avail);
+		if (!nl) {
+			if (avail > SCP_MAX_LINE) {
+				Fail("Bad reply from the remote scp");
+			}
+			break;
+		}
+
+		string line((const char*)p, nl - p);
+		inOff += line.length() + 1;
+
+		/* The remote scp names itself in its messages */
+		if (p[0] == 1 || p[0] == 2) {
+			Error(line.c_str() + 1);
+			state = SC_FAILED;
+		} else if (state == SC_HEADER) {
+			HandleHeader(line);
+		} else {
+			Fail("Unexpected reply from the remote scp");
+		}
+	}
+
+	if (inOff == inBuf.length()) {
+		inBuf.clear();
+		inOff = 0;
+	}
+
+	Pump();
+}
+
+/*
+==================
+ScpClient::HandleAck
+
+A zero byte, accepting the last step of an upload, or
+ending the data of a download.
+==================
+*/
+void ScpClient::HandleAck() {
+	char header[SCP_MAX_LINE];
+	string name = localPath.substr(localPath.rfind('/') + 1);
+
+	switch (state) {
+		case SC_READY:
+			snprintf(header, sizeof(header), "C%04o %lu %s\n", 
+					 mode, size, name.c_str());
+			channel->SendInput(string(header));
+			state = SC_HEADER_ACK;
+			break;
+
+		case SC_HEADER_ACK:
+			state = SC_SEND;
+			break;
+
+		case SC_DATA_ACK:
+			channel->SendEOF();
+			state = SC_DONE;
+			break;
+
+		case SC_DATA_END:
+			Ack();
+			channel->SendEOF();
+			state = SC_DONE;
+			break;
+
+		default:
+			Fail("Unexpected reply from the remote scp");
+			break;
+	}
+}
+
+/*
+==================
+ScpClient::HandleHeader
+
+Times are only sent if asked for, and directories only if
+copying recursively. Neither is.
+==================
+*/
+void ScpClient::HandleHeader(string line) {
+	int name = 0;
+
+	if (line[0] == 'T') {
+		Ack();
+		return;
+	}
+
+	if (line[0] == 'D') {
+		Fail(remotePath + " is a directory");
+		return;
+	}
+
+	if (sscanf(line.c_str(), "C%o %lu %n", &mode, &size, &name) < 2 || !name) {
+		Fail("Bad header from the remote scp");
+		return;
+	}
+
+	localFd = open(localPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 
+				   mode & 0777);
+	if (localFd < 0) {
+		Fail("Failed to create " + localPath);
+		return;
+	}
+
+	/* Running out of space is found out before the transfer */
+	if (size && fallocate(localFd, 0, 0, size) < 0 
+	&&  errno != EOPNOTSUPP && errno != ENOSYS) {
+		Fail("Failed to allocate " + localPath);
+		return;
+	}
+
+	Ack();
+	state = size ? SC_RECEIVE : SC_DATA_END;
+}
+
+/*
+==================
+ScpClient::HandleReceive
+==================
+*/
+void ScpClient::HandleReceive(const ubyte *data, uint32 len) {
+	for (uint32 off=0; off < len; ) {
+		int n = write(localFd, data+off, len-off);
+
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+
+		if (n <= 0) {
+			Fail("Failed to write " + localPath);
+			return;
+		}
+
+		off += n;
+	}
+
+	transferred += len;
+
+	if (transferred == size) {
+		state = SC_DATA_END;
+	}
+}
+
+/*
+==================
+ScpClient::Pump
+
+Hand the file to the channel, all of the mapping at once,
+or as far as the channel's queue allows. The data is 
+followed by a zero byte.
+==================
+*/
+void ScpClient::Pump() {
+	if (state != SC_SEND) {
+		return;
+	}
+
+	if (mapped && transferred < size) {
+		channel->SendMapped(mapped, size);
+		transferred = size;
+	}
+
+	while (transferred < size && channel->OutputPending() < CHAN_QUEUE_MAX) {
+		uint32 n = MIN(size - transferred, (uint64)SCP_CHUNK);
+
+		if (!SendChunk(n)) {
+			return;
+		}
+	}
+
+	if (transferred == size) {
+		Ack();
+		state = SC_DATA_ACK;
+	}
+}
+
+/*
+==================
+ScpClient::SendChunk
+
+Read the next "len" bytes of a file which is not mapped
+into the channel's queue.
+==================
+*/
+bool ScpClient::SendChunk(uint32 len) {
+	ubyte buf[SCP_CHUNK];
+	uint32 got = 0;
+
+	while (got < len) {
+		int n = pread(localFd, buf+got, len-got, transferred+got);
+
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+
+		if (n <= 0) {
+			Fail("Failed to read " + localPath);
+			return false;
+		}
+
+		got += n;
+	}
+
+	channel->SendInput(buf, len);
+	transferred += len;
+	return true;
+}
+
+/*
+==================
+ScpClient::ReleaseSent
+
+Drop the pages of the mapping which the channel has sent,
+so a large upload does not stay in memory as a whole.
+==================
+*/
+void ScpClient::ReleaseSent() {
+	if (!mapped || transferred < size) {
+		return;
+	}
+
+	uint64 sent = size - channel->MappedPending();
+	uint64 end = sent & ~(uint64)(sysconf(_SC_PAGESIZE) - 1);
+
+	if (end >= released + SCP_RELEASE || (sent == size && end > released)) {
+		madvise((void*)(mapped + released), end - released, MADV_DONTNEED);
+		released = end;
+	}
+}
+
+/*
+==================
+ScpClient::Ack
+==================
+*/
+void ScpClient::Ack() {
+	ubyte zero = 0;
+	channel->SendInput(&zero, 1);
+}
+
+/*
+==================
+ScpClient::Fail
+==================
+*/
+void ScpClient::Fail(string msg) {
+	Error(("scp: " + msg).c_str());
+	state = SC_FAILED;
+}
+
+/*
+==================
+static ScpClient::QuotePath
+
+The path is put in single quotes, and every single quote 
+in it is ended, escaped and started again.
+==================
+*/
+string ScpClient::QuotePath(string path) {
+	string quoted = "'";
+
+	for (uint32 i=0; i<path.length(); i++) {
+		if (path[i] == '\'') {
+			quoted += "'\\''";
+		} else {
+			quoted += path[i];
+		}
+	}
+
+	return quoted + "'";
+}
@@ -0,0 +1,111 @@
+#pragma once
+
+#include "../sshay.h"
+
+class Channel;
+
+/* Data read at once while uploading an unmapped file */
+#define SCP_CHUNK 			65536
+
+/* Pages of the mapping are dropped once this much of it 
+ * has been sent */
+#define SCP_RELEASE 		4194304
+
+/* Longest accepted header or error line */
+#define SCP_MAX_LINE 		4096
+
+/*
+==================
+ScpState
+==================
+*/
+enum ScpState {
+	SC_IDLE,		// Not started
+	SC_READY,		// Waiting for the remote scp to be ready
+	SC_HEADER_ACK,	// Waiting for the file to be accepted
+	SC_SEND,		// Sending the file
+	SC_DATA_ACK,	// Waiting for the data to be accepted
+	SC_HEADER,		// Waiting for the file's header
+	SC_RECEIVE,		// Receiving the file
+	SC_DATA_END,	// Waiting for the end of the data
+	SC_DONE,		// Waiting for the remote scp to exit
+	SC_FAILED,
+};
+
+/*
+==================
+ScpClient
+
+Copies a single file to or from the server by running
+"scp -t" or "scp -f" on an exec channel, for servers
+without an sftp subsystem. The protocol is that of rcp:
+every file is sent as a "C<mode> <size> <name>" line and
+the data, and every step is acknowledged with a zero byte,
+or refused with an error line.
+
+An upload is mapped into memory, and the channel sends it
+straight from the mapping, without copying it into its 
+queue. A file which cannot be mapped is read into the 
+queue a chunk at a time instead. A download is allocated
+in full with fallocate before the data arrives.
+==================
+*/
+class ScpClient {
+public:
+					ScpClient();
+					~ScpClient();
+
+	/* Copy the remote file "remote" to "local" */
+	void 			Get(string remote, string local);
+
+	/* Copy the local file "local" to "remote" */
+	void 			Put(string local, string remote);
+
+	/* Start the transfer on "ch", before the channel is 
+	 * opened. The command is set on the channel. */
+	bool 			Start(Channel *ch);
+
+	/* Handle the output received by the channel, and send 
+	 * more of the file */
+	void 			Update();
+
+	/* Handle output, as received from the remote scp */
+	void 			OnData(const ubyte *data, uint32 len);
+
+	bool 			IsDone() { return state == SC_DONE 
+									|| state == SC_FAILED; }
+	bool 			HasFailed() { return state == SC_FAILED; }
+
+	/* Bytes of the file sent or received so far */
+	uint64 			GetTransferred() { return transferred; }
+
+	/* "path" quoted for the remote shell */
+	static string 	QuotePath(string path);
+
+private:
+	Channel 		*channel;
+	ScpState 		state;
+	bool 			upload;
+	string 			remotePath;
+	string 			localPath;
+
+	int 			localFd;
+	uint32 			mode;
+	uint64 			size;
+	uint64 			transferred;
+	const ubyte 	*mapped;	// The uploaded file, NULL if not mapped
+	uint64 			released;	// Start of the mapping still in memory
+
+	string 			inBuf;		// Output not yet handled
+	uint32 			inOff;
+
+	void 			ParseInput();
+	void 			HandleAck();
+	void 			HandleHeader(string line);
+	void 			HandleReceive(const ubyte *data, uint32 len);
+	void 			Pump();
+	bool 			SendChunk(uint32 len);
+	void 			ReleaseSent();
+	void 			Ack();
+	void 			Fail(string msg);
+};
@@ -2,122 +2,11 @@
 #include "../mac/macsha1.h"
 #include "../crypt/crypttdes.h"
 #include "../crypt/keyexchange.h"
-#include "../globdata.h"
+#include "../crypt/knownhosts.h"
+#include "../crypt/hostkey.h"
 #include "connection.h"
 
-
-Session* singleton = NULL;
-
-
-/*
-==================
-static Session::GetSingleton
-==================
-*/
-Session* Session::GetSingleton() {
-	return singleton;
-}
-
-/*
-==================
-static Session::DoHashPackets
-==================
-*/
-bool Session::DoHashPackets() {
-	if (singleton) {
-		return singleton->hashPackets;
-	} 
-
-	return false;
-}
-
-/*
-==================
-static Session::DoCipherPackets
-==================
-*/
-bool Session::DoCipherPackets() {
-	if (singleton) {
-		return singleton->cipherPackets;
-	}
-
-	throw "Session::DoCipherPackets(): No singleton!";
-	return false;
-}
-
-/*
-==================
-static Session::GetCipher
-==================
-*/
-CryptTDES* Session::GetCipher() {
-	if (singleton) {
-		return singleton->cipher;
-	}
-
-	throw "Session::GetCipher(): No singleton!";
-	return NULL;
-}
-
-/*
-==================
-static Session::GetSequenceOut
-==================
-*/
-uint32 Session::GetSequenceOut() {
-	if (singleton) {
-		return singleton->sequenceOut;
-	}
-
-	throw "Session::GetSequenceNum(): No singleton!";
-	return 0;
-}
-
-/*
-==================
-static Session::GetSequenceIn
-==================
-*/
-uint32 Session::GetSequenceIn() {
-	if (singleton) {
-		return singleton->sequenceIn;
-	}
-
-	throw "Session::GetSequenceIn(): No singleton!";
-	return 0;
-}
-
-/*
-==================
-static Session::IncrementSequenceOut
-
-This method should be called from Socket::Write and
-Socket::Read ONLY!
-==================
-*/
-void Session::IncrementSequenceOut() {
-	if (singleton) {
-		singleton->sequenceOut++;
-	} else {
-		throw "Session::IncrementSequenceOut(): No singleton!";
-	}
-}
-
-/*
-==================
-static Session::IncrementSequenceIn
-==================
-*/
-void Session::IncrementSequenceIn() {
-	if (singleton) {
-		singleton->sequenceIn++;
-	} else {
-		throw "Session::IncrementSequenceIn(): No singleton!";
-	}
-}
-
-
-// ======================================================
+#include <algorithm>
 
 
 /*
@@ -126,22 +15,32 @@ Session::Session
 ==================
 */
 Session::Session() {
-	singleton = this;
-	hashPackets = false;
-	cipherPackets = false;
-	sequenceOut = 0;
-	sequenceIn  = 0;
+	socket.SetTransport(&transport);
 
 	kex 		= NULL;
-	cipher 		= NULL; 		
+	nextKeys 	= NULL;
+	dhtype 		= DH_GROUP1;
+	guessKex 	= true;
+	guessRight 	= false;
+	kexGuessed 	= false;
+
+	rekeyState 	= RK_NONE;
+	rekeyBytes 	= 0;
+	rekeyTime 	= time(NULL);
+	rekeySeqOut = 0;
+	rekeySeqIn 	= 0;
+	batch 		= false;
+	recordInput = false;
 
 	idSoftware = "SSHay_0.0";
 	idProtnum  = "2.0";
 
 	/* Only algorithms denoted as REQUIRED are supported */
-	//nlKexAlgo.names.push_back("diffie-hellman-group14-sha1");
+	nlKexAlgo.names.push_back("diffie-hellman-group14-sha1");
 	nlKexAlgo.names.push_back("diffie-hellman-group1-sha1");
 	
+	nlServerHostKeyAlgo.names.push_back("ssh-ed25519");
+	nlServerHostKeyAlgo.names.push_back("rsa-sha2-256");
 	nlServerHostKeyAlgo.names.push_back("ssh-dss");
 	
 	nlCiphers.names.push_back("3des-cbc");
@@ -158,15 +57,14 @@ Session::~Session
 ==================
 */
 Session::~Session() {
-	singleton = NULL;
 	socket.Disconnect();
 
 	if (kex) {
 		delete kex;
 	}
 
-	if (cipher) {
-		delete cipher;
+	if (nextKeys) {
+		delete nextKeys;
 	}
 }
 
@@ -183,58 +81,73 @@ of the SSH-Transport Layer protocol.
 ==================
 */
 bool Session::Initiate(string host, int port) {
+	this->host = host;
+	this->port = port;
+
 	if (!socket.Connect(host, port)) {
 		return false;
 	}
 
-	if (!ValidateServerID()) {
-		Disconnect(SSH_DISCONNECT_PROTOCOL_ERROR);
-		return false;
-	}
+	/* The identification string, KEXINIT and the guessed 
+	 * KEXDH_INIT are all sent in a single write. */
+	socket.Cork();
 
-	/* Identification packets are NOT counted! */
-	sequenceIn = 0;
-	sequenceOut = 0;
+	SendID();
 
 	/* Send the KEXINIT packet and store the sent payload
 	 * in member variable "lKexinitpl".
 	 * Store the server's KEXINIT packet in "rKexinitPl". */
-	SendKexInit();
+	kex = new KeyExchange(&transport);
+	PreferKnownKeyTypes();
+	SendKexInit(guessKex);
 
-	if (!ReadKexInit()) {
+	if (!socket.Uncork()) {
+		return false;
+	}
+
+	if (!ValidateServerID()) {
 		Disconnect(SSH_DISCONNECT_PROTOCOL_ERROR);
 		return false;
 	}
 
-	/* Begin the Key Exchange */
-	kex = new KeyExchange;
-	kex->Init(DH_GROUP1, &socket);
-	if (!kex->SendDHInit()) {
+	if (!ReadKexInit()) {
+		Disconnect(SSH_DISCONNECT_PROTOCOL_ERROR);
 		return false;
-	} 
+	}
+
+	/* Begin the Key Exchange. A wrong guess is ignored by the
+	 * server, and the exchange is restarted with the negotiated
+	 * method (RFC-4253, section 7). */
+	if (!kexGuessed || !guessRight) {
+		kex->Init(dhtype, hostKeyAlgo, &socket);
+		if (!kex->SendDHInit()) {
+			return false;
+		} 
+	}
 
 	if (!kex->VerifyDHReply()) {
 		Disconnect(SSH_DISCONNECT_KEY_EXCHANGE_FAILED);
 		return false;
 	} 
 
-	DeriveKeys();
+	/* The exchange hash of the first exchange is the session
+	 * identifier for the rest of the connection. The host key
+	 * must stay the same through later exchanges. */
+	HostKey &key = transport.dhReply->hostKey;
+	memcpy(transport.sessionID, transport.exchangeHash, 20);
+	hostKey.assign(key.raw, key.raw + key.rawLen);
 
-	/* Send SSH_MSG_NEWKEYS */
-	Message msg;
-	msg.Add(SSH_MSG_NEWKEYS);
-	socket.Write(msg.GetData(), msg.GetLength());
-	//printf("Sent SSH_MSG_NEWKEYS\n");
+	if (!VerifyHostKey()) {
+		Disconnect(SSH_DISCONNECT_HOST_KEY_NOT_VERIFIABLE);
+		return false;
+	}
 
-	ubyte *data = socket.Read();
-	uint32 len = socket.LastSize();
+	DeriveKeys();
 
-	if (IsPacketOfType(data, len, SSH_MSG_NEWKEYS)) {
-		//printf("Received SSH_MSG_NEWKEYS\n");
-	}
-	
-	hashPackets = true;
-	cipherPackets = true;
+	/* Send SSH_MSG_NEWKEYS. It is held back in the corked socket,
+	 * and sent together with the first authentication request. */
+	socket.Cork();
+	SendNewKeys();
 
 	return true;
 }
@@ -242,6 +155,9 @@ bool Session::Initiate(string host, int port) {
 /*
 ==================
 Session::UserAuthentication
+
+NEWKEYS, SERVICE_REQUEST and the first USERAUTH_REQUEST
+are sent back to back, and the replies are read afterwards.
 ==================
 */
 bool Session::UserAuthentication() {
@@ -257,16 +173,165 @@ bool Session::UserAuthentication() {
 	return true;
 }
 
+
+/*
+==================
+Session::SetCredentials
+==================
+*/
+void Session::SetCredentials(string user, string password) {
+	batch = true;
+	batchUser = user;
+	batchPassword = password;
+}
+
+/*
+==================
+ReadStdinLine
+
+Stdin is read a byte at a time, so nothing after the line
+is left in a buffer. The input thread reads stdin directly.
+==================
+*/
+static bool ReadStdinLine(string &line) {
+	char c;
+
+	line.clear();
+
+	while (true) {
+		int n = read(STDIN_FILENO, &c, 1);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+
+		if (n <= 0) {
+			return line.length() > 0;
+		}
+
+		if (c == '\n') {
+			return true;
+		}
+
+		line += c;
+	}
+}
+
+/*
+==================
+static Session::PromptCredentials
+
+Read the username and password from stdin. The password
+is not echoed. The prompts go to stderr, leaving stdout
+to the output of commands.
+==================
+*/
+void Session::PromptCredentials(string &user, string &password) {
+	fprintf(stderr, "Username: ");
+	ReadStdinLine(user);
+
+	SetStdinEcho(false);
+	fprintf(stderr, "Password: ");
+	ReadStdinLine(password);
+	fprintf(stderr, "\n");
+	SetStdinEcho(true);
+}
+
 /*
 ==================
 Session::RunConnection
 ==================
 */
 int Session::RunConnection() {
-	Connection connection(&socket);
+	Connection connection(this, &socket);
+
+	if (controlPath.length()) {
+		connection.EnableControlMaster(controlPath);
+	}
+
+	if (recordPath.length() && !connection.EnableRecording(recordPath, "", recordInput)) {
+		return -1;
+	}
+
 	return connection.MainLoop();
 }
 
+/*
+==================
+Session::RunCommand
+
+Returns the exit status of the command.
+==================
+*/
+int Session::RunCommand(string command) {
+	Connection connection(this, &socket);
+
+	if (controlPath.length()) {
+		connection.EnableControlMaster(controlPath);
+	}
+
+	if (recordPath.length() && !connection.EnableRecording(recordPath, command, recordInput)) {
+		return 255;
+	}
+
+	int status = connection.RunCommand(command);
+
+	if (socket.IsConnected()) {
+		Disconnect(SSH_DISCONNECT_BY_APPLICATION);
+	}
+
+	return status;
+}
+
+/*
+==================
+Session::RunSftp
+
+Returns 0 if the file was transferred.
+==================
+*/
+int Session::RunSftp(SftpClient *sftp) {
+	Connection connection(this, &socket);
+
+	bool ok = connection.RunSftp(sftp);
+
+	if (socket.IsConnected()) {
+		Disconnect(SSH_DISCONNECT_BY_APPLICATION);
+	}
+
+	return ok ? 0 : 1;
+}
+
+/*
+==================
+Session::RunCapture
+
+Returns the exit status of the command, or -1.
+==================
+*/
+int Session::RunCapture(string command, string &out) {
+	Connection connection(this, &socket);
+	return connection.RunCapture(command, out);
+}
+
+/*
+==================
+Session::RunScp
+
+Returns 0 if the file was transferred.
+==================
+*/
+int Session::RunScp(ScpClient *scp) {
+	Connection connection(this, &socket);
+
+	bool ok = connection.RunScp(scp);
+
+	if (socket.IsConnected()) {
+		Disconnect(SSH_DISCONNECT_BY_APPLICATION);
+	}
+
+	return ok ? 0 : 1;
+}
+
 
 // ======================================================
 
@@ -278,11 +343,15 @@ Session::Disconnect
 Disconnect the current session. Callers of this method
 are REQUIRED to drop whatever they're doing and let the
 program terminate without causing trouble.
+
+Only abnormal disconnects are reported.
 ==================
 */
 void Session::Disconnect(uint32 reason) {
-	printf("Client terminating session. Reason: %s\n", 
-			GetDCReasonString(reason).c_str());
+	if (reason != SSH_DISCONNECT_BY_APPLICATION) {
+		printf("Client terminating session. Reason: %s\n", 
+				GetDCReasonString(reason).c_str());
+	}
 
 	Message msg;
 
@@ -294,7 +363,8 @@ void Session::Disconnect(uint32 reason) {
 		msg.Add(0);
 	}
 
-	if (!socket.Write(msg.GetData(), msg.GetLength())) {
+	if (!socket.Write(msg.GetData(), msg.GetLength())
+	||  !socket.Uncork()) {
 		printf("Failed to disconnect - "
 			   "The server disconnected first :(\n");
 	}
@@ -303,72 +373,84 @@ void Session::Disconnect(uint32 reason) {
 
 /*
 ==================
-Session::ValidateServerID
+Session::SendID
 ==================
 */
-bool Session::ValidateServerID() {
+void Session::SendID() {
 	string id = GetIDMessage();
-	GData::localid = id;
+	transport.localId = id;
 
 	//printf("Sending: %s\n", id.c_str());
-	socket.Write((const ubyte*)id.c_str(), id.length()); 
-
-	ubyte *data = socket.Read();
-	if (data) {
-		//printf("reply: %s\n", data);
+	socket.WriteRaw((const ubyte*)id.c_str(), id.length()); 
+}
 
-		/* Copy the identification string, remove CRLF */
-		char *c = (char*)data;
-		while (*c != 13 && *c) {
-			GData::remoteid += *c;
-			c++;
-		}
+/*
+==================
+Session::ValidateServerID
 
-		/* Discard the initial "SSH" */
-		char *strdiv = strtok((char*)data, "-");
+The server may send other lines of data before its 
+identification string. They are skipped.
+==================
+*/
+bool Session::ValidateServerID() {
+	string line;
 
-		/* Get the version number */
-		strdiv = strtok(NULL, "-");
-		if (!strdiv) {
-			Error("Bad reply from server");
+	do {
+		if (!socket.ReadLine(line)) {
 			return false;
 		}
-		//printf("Server SSH Version:  %s ", strdiv);
+	} while (line.compare(0, 4, "SSH-") != 0);
 
-		if (atof(strdiv) < 1.98 || atof(strdiv) > 2.02) {
-			//printf("%s[INCOMPATIBLE]%s\n", CRED, CWHITE);
-			return false;
-		} else {
-			//printf("[compatible]\n");
-			return true;
-		}
+	//printf("reply: %s\n", line.c_str());
+
+	/* Copy the identification string, CRLF is removed */
+	transport.remoteId = line;
+
+	/* Discard the initial "SSH" and get the version number */
+	size_t start = line.find('-') + 1;
+	size_t end = line.find('-', start);
+	if (end == string::npos) {
+		Error("Bad reply from server");
+		return false;
 	}
 
-	return false;
+	string version = line.substr(start, end-start);
+	//printf("Server SSH Version:  %s ", version.c_str());
+
+	if (atof(version.c_str()) < 1.98 || atof(version.c_str()) > 2.02) {
+		//printf("%s[INCOMPATIBLE]%s\n", CRED, CWHITE);
+		return false;
+	} else {
+		//printf("[compatible]\n");
+		return true;
+	}
 }
 
 /*
 ==================
-Session::SoundKexInit
+Session::SendKexInit
 
-Send the key-exchange init packet
+Send the key-exchange init packet. If "guess" is true, 
+KEXDH_INIT for our preferred method is sent right behind it,
+without waiting for the server's KEXINIT.
 ==================
 */
-void Session::SendKexInit() {
-	Message msg = GetKexInitMessage();
+void Session::SendKexInit(bool guess) {
+	Message msg = GetKexInitMessage(guess);
 	socket.Write(msg.GetData(), msg.GetLength());
 
 	//printf("Sent KEXINIT\n");
 
 	/* Store the sent payload in lKexinitPl */
-	Packet p(msg.GetData(), msg.GetLength());
-
-	GData::localKexinitlen = p.packetLength - p.paddingLength - 1;
-	GData::localKexinit = new ubyte[GData::localKexinitlen];
-
-	memcpy(	GData::localKexinit, 
-			msg.GetData()+5, 
-			GData::localKexinitlen );
+	transport.localKexinit = msg.payload;
+
+	kexGuessed = guess;
+	if (guess) {
+		GetDHType(nlKexAlgo.names[0], dhtype);
+		hostKeyAlgo = nlServerHostKeyAlgo.names[0];
+		kex->Init(dhtype, hostKeyAlgo, &socket);
+		kex->SendDHInit();
+	}
 }
 
 /*
@@ -377,23 +459,71 @@ Session::ReadKexInit
 ==================
 */
 bool Session::ReadKexInit() {
-	ubyte *data = socket.Read();
+	ubyte *data = ReadReply(SSH_MSG_KEXINIT);
 
-	if (!IsPacketOfType(data, socket.LastSize(), 
-						SSH_MSG_KEXINIT)) {
+	if (!data) {
 		return false;
 	}
 
 	//printf("Received MSG_KEXINIT\n");	
+	return HandleKexInit(data, socket.LastSize());
+}
 
+/*
+==================
+Session::HandleKexInit
+
+Store the server's KEXINIT payload and negotiate the
+key exchange method.
+==================
+*/
+bool Session::HandleKexInit(const ubyte *data, uint32 len) {
 	/* Store the payload in rKexinitPl */
-	KexPacket kex(data, socket.LastSize());
+	KexPacket kexp(data, len);
+
+	transport.remoteKexinit.assign(data + 5, 
+			data + 5 + kexp.packetLength - kexp.paddingLength - 1);
+
+	/* Pick the key exchange method */
+	string kexAlgo = nlKexAlgo.FirstMatch(kexp.kexAlgo);
+	if (!GetDHType(kexAlgo, dhtype)) {
+		Error("No common key exchange algorithm");
+		return false;
+	}
+
+	hostKeyAlgo = nlServerHostKeyAlgo.FirstMatch(kexp.serverHostKeyAlgo);
+	if (!hostKeyAlgo.length()) {
+		Error("No common host key algorithm");
+		return false;
+	}
+
+	/* The guess is right only if both parties prefer the same
+	 * key exchange AND host key algorithm. */
+	guessRight = kexp.kexAlgo.names.size()
+			  && kexp.serverHostKeyAlgo.names.size()
+			  && kexp.kexAlgo.names[0] == nlKexAlgo.names[0]
+			  && kexp.serverHostKeyAlgo.names[0] 
+			  		== nlServerHostKeyAlgo.names[0];
+
+	return true;
+}
 
-	GData::remoteKexinitlen = kex.packetLength-kex.paddingLength-1;
-	GData::remoteKexinit = new ubyte[GData::remoteKexinitlen];
-	memcpy(	GData::remoteKexinit, 
-			data+5, 
-			GData::remoteKexinitlen );
+/*
+==================
+Session::GetDHType
+
+Get the DHType of the key exchange method named "algo".
+False is returned if the method is unsupported.
+==================
+*/
+bool Session::GetDHType(string algo, DHType &type) {
+	if (algo == "diffie-hellman-group14-sha1") {
+		type = DH_GROUP14;
+	} else if (algo == "diffie-hellman-group1-sha1") {
+		type = DH_GROUP1;
+	} else {
+		return false;
+	}
 
 	return true;
 }
@@ -401,54 +531,151 @@ bool Session::ReadKexInit() {
 /*
 ==================
 Session::RequestAuth
+
+The reply is read by "PasswordAuth".
 ==================
 */
 bool Session::RequestAuth() {
 	string service  = "ssh-userauth";
 	Message msg;
-	ubyte *data;
 
 	msg.Add(SSH_MSG_SERVICE_REQUEST);
 	msg.AddUI(service.length());
 	msg.Add(service);
 	
-	socket.Write(msg.GetData(), msg.GetLength());
+	return socket.Write(msg.GetData(), msg.GetLength());
+}
 
-	data = socket.Read();
-	//DeterminePacket(data, socket.LastSize());
+/*
+==================
+Session::ReadNewKeys
 
-	if (!IsPacketOfType(data, socket.LastSize(),
-		SSH_MSG_SERVICE_ACCEPT)) {
+Read the server's NEWKEYS, after which incoming 
+packets are decrypted with the new keys.
+==================
+*/
+bool Session::ReadNewKeys() {
+	if (!ReadReply(SSH_MSG_NEWKEYS)) {
 		return false;
-	} 
+	}
+
+	//printf("Received SSH_MSG_NEWKEYS\n");
+	ActivateKeysIn();
 
 	return true;
 }
 
+/*
+==================
+Session::VerifyHostKey
+
+Look up the server's host key in the known_hosts file.
+Unknown hosts are trusted on first use and added to the
+file, while a mismatching key ends the connection.
+==================
+*/
+bool Session::VerifyHostKey() {
+	KnownHosts kh;
+	const ubyte *blob = transport.dhReply->hostKey.raw + 4;
+	uint32 len = transport.dhReply->hostKey.rawLen - 4;
+
+	if (!kh.Open(KnownHosts::DefaultPath())) {
+		Warning("Unable to read known_hosts, the host key is not verified");
+		return true;
+	}
+
+	switch (kh.Check(host, port, blob, len)) {
+		case KH_OK:
+			return true;
+
+		case KH_UNKNOWN:
+			fprintf(stderr, "Permanently added '%s' (port %i) to the "
+					"list of known hosts.\n", host.c_str(), port);
+			kh.Add(host, port, blob, len);
+			return true;
+
+		case KH_CHANGED:
+			Error("The host key has changed! Someone could be "
+				  "eavesdropping on you right now (man-in-the-middle).");
+			return false;
+
+		case KH_OTHER_TYPE:
+			Error("The host is known with a key of another type, and "
+				  "the key offered is not trusted. Remove the host from "
+				  "known_hosts if the new key is expected.");
+			return false;
+
+		default:
+			Error("Failed to verify the host key");
+			return false;
+	}
+}
+
+/*
+==================
+Session::PreferKnownKeyTypes
+
+Move the host key algorithms whose key types are already in
+known_hosts for the host to the front, keeping their order,
+as OpenSSH does. A server which also has a key of a type we
+prefer is then still verified with the key we know.
+==================
+*/
+void Session::PreferKnownKeyTypes() {
+	KnownHosts kh;
+	vector<string> known, first, rest;
+
+	if (!kh.Open(KnownHosts::DefaultPath())) {
+		return;
+	}
+
+	known = kh.KeyTypes(host, port);
+
+	for (uint32 i=0; i<nlServerHostKeyAlgo.names.size(); i++) {
+		string algo = nlServerHostKeyAlgo.names[i];
+		string type = HostKey::KeyTypeOf(algo);
+
+		if (find(known.begin(), known.end(), type) != known.end()) {
+			first.push_back(algo);
+		} else {
+			rest.push_back(algo);
+		}
+	}
+
+	first.insert(first.end(), rest.begin(), rest.end());
+	nlServerHostKeyAlgo.names = first;
+}
+
 /*
 ==================
 Session::PasswordAuth
 
 Attempt to verify the user via password authentcation.
+
+The first request is written behind the queued NEWKEYS
+and SERVICE_REQUEST, and the replies to all three are 
+read afterwards.
 ==================
 */
 bool Session::PasswordAuth() {
 	string service  = "ssh-connection";
 	string method   = "password";
 	string user, password;
-	Message msg;
+	ubyte replies[] = { SSH_MSG_USERAUTH_SUCCESS, 
+						SSH_MSG_USERAUTH_FAILURE };
+	bool first = true;
 	ubyte *data;
 	uint32 len;
 
 	do {
-		printf("Username: ");
-		getline(cin, user);
+		Message msg;
 
-		SetStdinEcho(false);
-		printf("Password: ");
-		getline(cin, password);
-		printf("\n");
-		SetStdinEcho(true);
+		if (batch) {
+			user = batchUser;
+			password = batchPassword;
+		} else {
+			PromptCredentials(user, password);
+		}
 
 		msg.Add(SSH_MSG_USERAUTH_REQUEST);
 		msg.AddUI(user.length());
@@ -461,19 +688,40 @@ bool Session::PasswordAuth() {
 		msg.AddUI(password.length());
 		msg.Add(password);	
 
-		socket.Write(msg.GetData(), msg.GetLength());
+		if (!socket.Write(msg.GetData(), msg.GetLength())
+		||  !socket.Uncork()) {
+			return false;
+		}
+
+		if (first) {
+			if (!ReadNewKeys()) {
+				return false;
+			}
+
+			if (!ReadReply(SSH_MSG_SERVICE_ACCEPT)) {
+				return false;
+			}
 
-		data = socket.Read();
+			first = false;
+		}
+
+		data = ReadReply(replies, 2);
 		len = socket.LastSize();
 
-		if (!len) {
+		if (!data) {
 			return false;
 		}
 
 		if (IsPacketOfType(data, len, SSH_MSG_USERAUTH_SUCCESS)) {
-			printf("Login successful!\n\n");
+			if (!batch) {
+				printf("Login successful!\n\n");
+			}
 			break;
 		} else if (IsPacketOfType(data, len, SSH_MSG_USERAUTH_FAILURE)) {
+			if (batch) {
+				Error("User authentication failed");
+				return false;
+			}
 			printf("User authentication failed.\n\n");
 		}
 	} while (true);
@@ -481,25 +729,334 @@ bool Session::PasswordAuth() {
 	return true;
 }
 
+/*
+==================
+Session::ReadReply
+
+Read the next packet with a message type in "types".
+IGNORE, DEBUG and USERAUTH_BANNER messages are handled
+and skipped on the way. Packets of other types are left
+in the socket's queue for later reads, so replies to 
+pipelined requests may arrive in any order.
+
+NULL is returned if the server disconnects.
+==================
+*/
+ubyte* Session::ReadReply(const ubyte *types, uint32 ntypes) {
+	vector<ubyte> accept(types, types+ntypes);
+	ubyte *data;
+	uint32 len;
+
+	accept.push_back(SSH_MSG_DISCONNECT);
+	accept.push_back(SSH_MSG_IGNORE);
+	accept.push_back(SSH_MSG_DEBUG);
+	accept.push_back(SSH_MSG_USERAUTH_BANNER);
+
+	while (true) {
+		data = socket.ReadMatching(&accept[0], accept.size());
+		len = socket.LastSize();
+
+		if (!data || len < 6) {
+			return NULL;
+		}
+
+		switch (data[5]) {
+			case SSH_MSG_IGNORE:
+			case SSH_MSG_DEBUG:
+				continue;
+
+			case SSH_MSG_USERAUTH_BANNER:
+				PrintBanner(data, len);
+				continue;
+
+			case SSH_MSG_DISCONNECT:
+				DeterminePacket(data, len);
+				socket.Disconnect();
+				return NULL;
+		}
+
+		return data;
+	}
+}
+
+ubyte* Session::ReadReply(ubyte type) {
+	return ReadReply(&type, 1);
+}
+
+/*
+==================
+Session::PrintBanner
+==================
+*/
+void Session::PrintBanner(const ubyte *packet, uint32 len) {
+	uint32 slen;
+
+	if (len < 10) {
+		return;
+	}
+
+	BytesToInt(slen, packet+6);
+	if (slen > len - 10) {
+		return;
+	}
+
+	fwrite(packet+10, 1, slen, stdout);
+}
+
 /*
 ==================
 Session::DeriveKeys
+
+The new keys are stored in "nextKeys", "nextMacOut" and
+"nextMacIn". Each direction is switched to the new keys 
+separately by "ActivateKeysOut" and "ActivateKeysIn".
 ==================
 */
 void Session::DeriveKeys() {
-	if (cipher) {
-		delete cipher;
+	if (nextKeys) {
+		delete nextKeys;
+	}
+	nextKeys = new CryptTDES;
+
+	/* K || H is shared by every key, and hashed only once */
+	MacSHA1 kh;
+	vector<ubyte> shared(transport.sharedSecret->GetRawLength());
+	transport.sharedSecret->GetRawBytes(&shared[0]);
+
+	kh.Add(&shared[0], shared.size());
+	kh.Add(transport.exchangeHash, 20);
+
+	CreateKey(kh, nextKeys->ivEnc, 'A', 8);
+	CreateKey(kh, nextKeys->ivDec, 'B', 8);
+
+	CreateKey(kh, nextKeys->keyEnc, 'C', 24);
+	CreateKey(kh, nextKeys->keyDec, 'D', 24);
+
+	CreateKey(kh, nextMacOut, 'E', 20);
+	CreateKey(kh, nextMacIn,  'F', 20);
+}
+
+/*
+==================
+Session::SendNewKeys
+
+Send SSH_MSG_NEWKEYS. Outgoing packets use the new keys 
+from here on.
+==================
+*/
+void Session::SendNewKeys() {
+	Message msg;
+	msg.Add(SSH_MSG_NEWKEYS);
+	socket.Write(msg.GetData(), msg.GetLength());
+	//printf("Sent SSH_MSG_NEWKEYS\n");
+
+	ActivateKeysOut();
+}
+
+/*
+==================
+Session::ActivateKeysOut
+==================
+*/
+void Session::ActivateKeysOut() {
+	if (!transport.cipher) {
+		transport.cipher = new CryptTDES;
+	}
+
+	memcpy(transport.cipher->keyEnc, nextKeys->keyEnc, 24);
+	memcpy(transport.cipher->ivEnc,  nextKeys->ivEnc,  8);
+	memcpy(transport.macKeyOut, nextMacOut, 20);
+
+	transport.hashOut = true;
+	transport.cipherOut = true;
+}
+
+/*
+==================
+Session::ActivateKeysIn
+==================
+*/
+void Session::ActivateKeysIn() {
+	if (!transport.cipher) {
+		transport.cipher = new CryptTDES;
+	}
+
+	memcpy(transport.cipher->keyDec, nextKeys->keyDec, 24);
+	memcpy(transport.cipher->ivDec,  nextKeys->ivDec,  8);
+	memcpy(transport.macKeyIn, nextMacIn, 20);
+
+	transport.hashIn = true;
+	transport.cipherIn = true;
+
+	/* Restart the rekey limits */
+	rekeyBytes = socket.GetBytesSent() + socket.GetBytesReceived();
+	rekeyTime = time(NULL);
+	rekeySeqOut = transport.sequenceOut;
+	rekeySeqIn = transport.sequenceIn;
+}
+
+
+// ======================================================
+
+
+/*
+==================
+Session::Send
+
+Send a message on the connection. While a key re-exchange
+is in progress, only transport and key exchange messages may
+be sent (RFC-4253, section 7.1). Other messages are held, and
+sent with the new keys once NEWKEYS has been sent.
+==================
+*/
+bool Session::Send(Message &msg) {
+	if (rekeyState != RK_NONE && rekeyState != RK_NEWKEYS_SENT
+	&&  msg.payload.size() && msg.payload[0] >= 50) {
+		heldMessages.push_back(msg.payload);
+		return true;
 	}
-	cipher = new CryptTDES;
 
-	CreateKey(cipher->ivEnc, 'A', 8);
-	CreateKey(cipher->ivDec, 'B', 8);
+	return socket.Write(msg.GetData(), msg.GetLength());
+}
+
+/*
+==================
+Session::CheckRekey
+
+Start a key re-exchange if too much data has been sent
+with the current keys, or they have been used for too long.
+==================
+*/
+void Session::CheckRekey() {
+	if (rekeyState != RK_NONE || !transport.cipherIn) {
+		return;
+	}
 
-	CreateKey(cipher->keyEnc, 'C', 24);
-	CreateKey(cipher->keyDec, 'D', 24);
+	uint64 bytes = socket.GetBytesSent() + socket.GetBytesReceived();
 
-	CreateKey(GData::macKeyOut, 'E', 20);
-	CreateKey(GData::macKeyIn,  'F', 20);
+	if (bytes - rekeyBytes >= REKEY_BYTES
+	||  time(NULL) - rekeyTime >= REKEY_SECONDS
+	||  transport.sequenceOut - rekeySeqOut >= REKEY_PACKETS
+	||  transport.sequenceIn - rekeySeqIn >= REKEY_PACKETS) {
+		StartRekey();
+	}
+}
+
+/*
+==================
+Session::StartRekey
+
+Send KEXINIT (and the guessed KEXDH_INIT). The replies 
+are handled by "HandleKexPacket" as they arrive, so incoming
+channel data is processed throughout the exchange.
+==================
+*/
+void Session::StartRekey() {
+	//printf("Starting key re-exchange\n");
+	rekeyState = RK_KEXINIT_SENT;
+
+	socket.Cork();
+	SendKexInit(guessKex);
+	socket.Uncork();
+}
+
+/*
+==================
+Session::HandleKexPacket
+
+Handle a key exchange message received after the initial
+exchange. The server may initiate a re-exchange at any time,
+in which case our KEXINIT is sent in response.
+==================
+*/
+void Session::HandleKexPacket(const ubyte *data, uint32 len) {
+	if (len < 6) {
+		return;
+	}
+
+	switch (data[5]) {
+		case SSH_MSG_KEXINIT: {
+			bool byServer = (rekeyState == RK_NONE);
+
+			if (rekeyState != RK_NONE && rekeyState != RK_KEXINIT_SENT) {
+				Disconnect(SSH_DISCONNECT_PROTOCOL_ERROR);
+				return;
+			}
+
+			rekeyState = RK_KEXINIT_SENT;
+			socket.Cork();
+
+			if (byServer) {
+				SendKexInit(false);
+			}
+
+			/* The packet without its MAC, as in the initial 
+			 * exchange */
+			uint32 plen;
+			BytesToInt(plen, data);
+
+			if (plen > len - 4 || !HandleKexInit(data, plen + 4)) {
+				Disconnect(SSH_DISCONNECT_KEY_EXCHANGE_FAILED);
+				return;
+			}
+
+			if (!kexGuessed || !guessRight) {
+				kex->Init(dhtype, hostKeyAlgo, &socket);
+				kex->SendDHInit();
+			}
+
+			socket.Uncork();
+			rekeyState = RK_DHINIT_SENT;
+			break;
+		}
+
+		case SSH_MSG_KEXDH_REPLY:
+			if (rekeyState != RK_DHINIT_SENT) {
+				Disconnect(SSH_DISCONNECT_PROTOCOL_ERROR);
+				return;
+			}
+
+			if (!kex->HandleDHReply(data, len)) {
+				Disconnect(SSH_DISCONNECT_KEY_EXCHANGE_FAILED);
+				return;
+			}
+
+			if (transport.dhReply->hostKey.rawLen != hostKey.size()
+			||  memcmp(transport.dhReply->hostKey.raw, &hostKey[0], 
+					   hostKey.size())) {
+				Error("The host key changed during key re-exchange");
+				Disconnect(SSH_DISCONNECT_HOST_KEY_NOT_VERIFIABLE);
+				return;
+			}
+
+			DeriveKeys();
+
+			/* NEWKEYS and the held messages go out in one write */
+			socket.Cork();
+			SendNewKeys();
+			rekeyState = RK_NEWKEYS_SENT;
+
+			for (unsigned i=0; i<heldMessages.size(); i++) {
+				Message msg;
+				msg.payload = heldMessages[i];
+				socket.Write(msg.GetData(), msg.GetLength());
+			}
+			heldMessages.clear();
+
+			socket.Uncork();
+			break;
+
+		case SSH_MSG_NEWKEYS:
+			if (rekeyState != RK_NEWKEYS_SENT) {
+				Disconnect(SSH_DISCONNECT_PROTOCOL_ERROR);
+				return;
+			}
+
+			ActivateKeysIn();
+			rekeyState = RK_NONE;
+			//printf("Key re-exchange complete\n");
+			break;
+	}
 }
 
 /*
@@ -507,57 +1064,46 @@ void Session::DeriveKeys() {
 Session::CreateKey
 
 This method generates keys and IV`s as defined
-in RFC-4253, section 7.2.
+in RFC-4253, section 7.2:
+	K1 = HASH(K || H || ch || session_id)
+	K2 = HASH(K || H || K1)
+	K3 = HASH(K || H || K1 || K2)
+
+"kh" holds the hash state after K || H, and is cloned for
+the letter. The extension keys only append to a second
+clone, so nothing is hashed more than once.
 ==================
 */
-void Session::CreateKey(ubyte *buf, char ch, uint32 reqlen) {
-	MacSHA1 mac;
+void Session::CreateKey(const MacSHA1 &kh, ubyte *buf, 
+						char ch, uint32 reqlen) {
+	MacSHA1 mac(kh);
 	uint32 pos = 0;
 	uint32 len = 0;
-	uint32 steps = 0;
-	ubyte *pkey[32] = { NULL };	// Maximum: 32 * maclen
-	uint32 sharelen = 0;
-	ubyte *shared = NULL;
-	uint32 origLen = reqlen;
-
-	sharelen = GData::sharedSecret->GetRawLength();
-	shared = new ubyte[sharelen];
-	GData::sharedSecret->GetRawBytes(shared);
-
-	mac.Add(shared, sharelen);
-	mac.Add(GData::exchangeHash, 20);
+
 	mac.Add(ch);
-	mac.Add(GData::exchangeHash, 20);
+	mac.Add(transport.sessionID, 20);
 
 	len = MIN(reqlen, 20);
 	memcpy(buf, mac.GetHash(), len);
 	pos    += len;
 	reqlen -= len;
 
+	if (!reqlen) {
+		return;
+	}
+
+	MacSHA1 ext(kh);
+	ubyte key[20];
+	memcpy(key, mac.GetHash(), 20);
+
 	while (reqlen > 0) {
-		pkey[steps] = new ubyte[20];
-		memcpy(pkey[steps], mac.GetHash(), 20);
-
-		mac.Clear();
-		mac.Add(shared, sharelen);
-		mac.Add(GData::exchangeHash, 20);
-		
-		for (int i=0; i<steps+1; i++) {
-			mac.Add(pkey[i], 20);
-		}
+		ext.Add(key, 20);
+		memcpy(key, ext.GetHash(), 20);
 
 		len = MIN(reqlen, 20);
-		memcpy(buf+pos, mac.GetHash(), len);
+		memcpy(buf+pos, key, len);
 		pos    += len;
 		reqlen -= len;
-
-		steps++;
-	}
-
-	delete[] shared;
-
-	for (int i=0; i<steps; i++) {
-		delete[] pkey[i];
 	}
 }
 
@@ -596,7 +1142,7 @@ string Session::GetIDMessage() {
 Session::GetKexInitMessage
 ==================
 */
-Message Session::GetKexInitMessage() {
+Message Session::GetKexInitMessage(bool guess) {
 	Message msg;
 
 	msg.Add(SSH_MSG_KEXINIT);
@@ -616,7 +1162,9 @@ Message Session::GetKexInitMessage() {
 	msg.Add(nlLang.GetString());
 	msg.Add(nlLang.GetString());
 
+	/* first_kex_packet_follows and the reserved uint32 */
 	ubyte resAndNextKex[5] = {0};
+	resAndNextKex[0] = guess;
 	msg.Add(resAndNextKex, 5);
 
 	return msg;
@@ -628,7 +1176,7 @@ Message Session::GetKexInitMessage() {
 
 /*
 ==================
-Session::DeterminePacket
+static Session::DeterminePacket
 ==================
 */
 void Session::DeterminePacket(const ubyte *packet, uint32 len) {
@@ -746,7 +1294,7 @@ void Session::DeterminePacket(const ubyte *packet, uint32 len) {
 
 /*
 ==================
-Session::IsPacketOfType
+static Session::IsPacketOfType
 
 Check the type of the received data without
 instantiating a Packet-object.
@@ -763,7 +1311,7 @@ bool Session::IsPacketOfType(const ubyte *packet, uint32 len,
 
 /*
 ==================
-Session::GetDisconnectReason
+static Session::GetDCReasonString
 ==================
 */
 string Session::GetDCReasonString(uint32 reason) {
@@ -836,7 +1384,7 @@ string Session::GetDCReasonString(uint32 reason) {
 
 /*
 ==================
-Session::DbgPrintDCReason
+static Session::DbgPrintDCReason
 
 Print the reson for a disconnected connection.
 ==================
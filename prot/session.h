@@ -4,41 +4,121 @@
 #include "../net/socket.h"
 #include "packet.h"
 #include "channel.h"
+#include "transport.h"
+#include "../crypt/dhgroup.h"
 
 class KeyExchange;
+class SftpClient;
+class ScpClient;
 class CryptTDES;
+class MacSHA1;
+
+/* Key re-exchange limits. 3des-cbc has a 64 bit block, and is
+ * rekeyed well before it gets anywhere near 1 GB of traffic. */
+#define REKEY_BYTES 		(uint64(1) << 28)
+#define REKEY_SECONDS 		3600
+#define REKEY_PACKETS 		(uint32(1) << 31)
+
+/*
+==================
+RekeyState
+
+Progress of a key re-exchange. Outgoing non-transport 
+messages are held from KEXINIT until NEWKEYS is sent.
+==================
+*/
+enum RekeyState {
+	RK_NONE,			// No exchange in progress
+	RK_KEXINIT_SENT,	// Waiting for the server's KEXINIT
+	RK_DHINIT_SENT,		// Waiting for KEXDH_REPLY
+	RK_NEWKEYS_SENT,	// Waiting for the server's NEWKEYS
+};
 
 /*
 ==================
 Session
 
-The main class handling the SSH-session
+The main class handling the SSH-session. Each Session
+is a connection of its own, with its own Transport.
 ==================
 */
 class Session {
 public:
-	static Session* GetSingleton();
-	static bool DoHashPackets();
-	static bool DoCipherPackets();
-	static CryptTDES *GetCipher();
-	static uint32 GetSequenceOut();
-	static uint32 GetSequenceIn();
-	static void	IncrementSequenceOut();
-	static void IncrementSequenceIn();
-
-
 				Session();
 				~Session();
 	bool 		Initiate(string host, int port);
 	bool 		UserAuthentication();
 	int 		RunConnection();
+	int 		RunCommand(string command);
+	int 		RunSftp(SftpClient *sftp);
+	int 		RunScp(ScpClient *scp);
+
+	/* Run "command", keeping its output in "out". The session
+	 * is kept open afterwards. */
+	int 		RunCapture(string command, string &out);
+
+	/* Close the current session */
+	void 		Disconnect(uint32 reason);
+
+	/* Authenticate with the given credentials instead of
+	 * prompting for them. Failed attempts are not retried. */
+	void 		SetCredentials(string user, string password);
+	static void PromptCredentials(string &user, string &password);
+
+	Socket* 	GetSocket() { return &socket; }
+
+	/* Share the connection through a control socket at "path" */
+	void 		SetControlPath(string path) { controlPath = path; }
+
+	/* Record the session to an asciicast file at "path", 
+	 * with what is typed only if "input" is set */
+	void 		SetRecordPath(string path, bool input) { recordPath = path;
+													 recordInput = input; }
+
+	/* Used by the connection layer */
+	bool 		Send(Message &msg);
+	void 		CheckRekey();
+	void 		HandleKexPacket(const ubyte *data, uint32 len);
 
 private:
 	Socket 		socket;
+	Transport 	transport;
 	KeyExchange *kex;
-	CryptTDES 	*cipher;
-	uint32 		sequenceOut;
-	uint32 		sequenceIn;
+	DHType 		dhtype;		// Negotiated key exchange
+	string 		hostKeyAlgo;	// Negotiated host key algorithm
+
+	/* Send KEXDH_INIT for our preferred method right behind KEXINIT */
+	bool 		guessKex;
+	bool 		guessRight;
+	bool 		kexGuessed;		// The current exchange was guessed
+
+	/* Derived keys which are not yet in use */
+	CryptTDES 	*nextKeys;
+	ubyte 		nextMacOut[20];
+	ubyte 		nextMacIn[20];
+
+	/* The host key of the first exchange */
+	vector<ubyte> hostKey;
+	string 		host;
+	int 		port;
+
+	/* Preset credentials, see "SetCredentials" */
+	bool 		batch;
+	string 		batchUser;
+	string 		batchPassword;
+
+	string 		controlPath;
+	string 		recordPath;
+	bool 		recordInput;
+
+	/* Key re-exchange */
+	RekeyState 	rekeyState;
+	uint64 		rekeyBytes;		// Bytes transferred at last NEWKEYS
+	time_t 		rekeyTime;		// Time of last NEWKEYS
+	uint32 		rekeySeqOut;
+	uint32 		rekeySeqIn;
+	vector< vector<ubyte> > 
+				heldMessages;
 
 	/* Local version identifiers */
 	string 		idSoftware;
@@ -53,19 +133,21 @@ private:
 	NameList 	nlComp;					// UNSUPPORTED
 	NameList 	nlLang;					// UNSUPPORTED
 
-	/* Do we attach hash to the packets? */
-	bool 		hashPackets;
-
-	/* Do we encrypt packets yet? */
-	bool 		cipherPackets;
-
-	/* Close the current session */
-	void 		Disconnect(uint32 reason);
-
 	/* Protocol-step methods */
+	void 		SendID();
 	bool		ValidateServerID();
-	void 		SendKexInit();
+	void 		SendKexInit(bool guess);
 	bool 		ReadKexInit(); 		// Validate the server's reply
+	bool 		HandleKexInit(const ubyte *data, uint32 len);
+	bool 		GetDHType(string algo, DHType &type);
+	bool 		ReadNewKeys();
+	bool 		VerifyHostKey();
+	void 		PreferKnownKeyTypes();
+
+	/* Read the reply to a request, see the definition */
+	ubyte* 		ReadReply(const ubyte *types, uint32 ntypes);
+	ubyte* 		ReadReply(ubyte type);
+	void 		PrintBanner(const ubyte *packet, uint32 len);
 
 	/* User Authentication Methods */
 	bool 		RequestAuth();
@@ -73,20 +155,25 @@ private:
 
 	/* Key Derivation methods */
 	void 		DeriveKeys();
-	void 		CreateKey(ubyte *buf, char ch, uint32 reqlen);
+	void 		CreateKey(const MacSHA1 &kh, ubyte *buf, 
+						  char ch, uint32 reqlen);
+	void 		SendNewKeys();
+	void 		ActivateKeysOut();
+	void 		ActivateKeysIn();
+	void 		StartRekey();
 
 	/* Message methods */
 	string  	GetIDMessage();
-	Message 	GetKexInitMessage();
+	Message 	GetKexInitMessage(bool guess);
 
 
 public:
 	/* Packet identification */
-	void 		DeterminePacket(const ubyte *packet, uint32 len);
-	bool 		IsPacketOfType(const ubyte *packet, uint32 len, 
+	static void 	DeterminePacket(const ubyte *packet, uint32 len);
+	static bool 	IsPacketOfType(const ubyte *packet, uint32 len, 
 												int type);
-	string 		GetDCReasonString(uint32 reason);
+	static string 	GetDCReasonString(uint32 reason);
 
 	/* Debug output */
-	void 		DbgPrintDCReason(const ubyte *packet, uint32 len);
+	static void 	DbgPrintDCReason(const ubyte *packet, uint32 len);
 };
\ No newline at end of file
@@ -0,0 +1,779 @@
+#include "sftp.h"
+#include "channel.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <algorithm>
+
+/*
+==================
+SftpStripes::SftpStripes
+==================
+*/
+SftpStripes::SftpStripes() : truncated(false), failed(false) {
+	next = 0;
+	holders = 0;
+	pthread_mutex_init(&lock, NULL);
+}
+
+/*
+==================
+SftpStripes::~SftpStripes
+==================
+*/
+SftpStripes::~SftpStripes() {
+	pthread_mutex_destroy(&lock);
+}
+
+/*
+==================
+SftpStripes::Claim
+
+Blocks given back are claimed first. A client which finds
+nothing to claim stops holding blocks once it is no longer
+busy, and waits while any other client still holds some.
+==================
+*/
+SftpClaim SftpStripes::Claim(uint64 end, uint64 &block, bool &holding, bool busy) {
+	SftpClaim claim = CLAIM_NONE;
+
+	pthread_mutex_lock(&lock);
+
+	if (lost.size()) {
+		block = lost.back();
+		lost.pop_back();
+		claim = CLAIM_BLOCK;
+	} else {
+		while (next < end && next / SFTP_BLOCK < done.size() 
+			   && done[next / SFTP_BLOCK]) {
+			next += SFTP_BLOCK;
+		}
+
+		if (next < end) {
+			block = next;
+			next += SFTP_BLOCK;
+			claim = CLAIM_BLOCK;
+		}
+	}
+
+	if (claim == CLAIM_BLOCK && !holding) {
+		holders++;
+		holding = true;
+	} else if (claim == CLAIM_NONE && holding && !busy) {
+		holders--;
+		holding = false;
+	}
+
+	/* Blocks may yet be given back by another client */
+	if (claim == CLAIM_NONE && holders > (holding ? 1u : 0u)) {
+		claim = CLAIM_WAIT;
+	}
+
+	pthread_mutex_unlock(&lock);
+
+	return claim;
+}
+
+/*
+==================
+SftpStripes::GiveBack
+==================
+*/
+void SftpStripes::GiveBack(const vector<uint64> &blocks, bool holding) {
+	pthread_mutex_lock(&lock);
+
+	lost.insert(lost.end(), blocks.begin(), blocks.end());
+	if (holding) {
+		holders--;
+	}
+
+	pthread_mutex_unlock(&lock);
+}
+
+/*
+==================
+SftpClient::SftpClient
+==================
+*/
+SftpClient::SftpClient() {
+	channel 	= NULL;
+	state 		= SF_IDLE;
+	upload 		= false;
+	localFd 	= -1;
+	depth 		= SFTP_DEPTH;
+	nextId 		= 1;
+	stripes 	= NULL;
+	stripeIndex = 0;
+	holding 	= false;
+	idle 		= false;
+	nextOffset 	= 0;
+	blockEnd 	= (uint64)-1;
+	end 		= (uint64)-1;
+	transferred = 0;
+	inOff 		= 0;
+}
+
+/*
+==================
+SftpClient::~SftpClient
+==================
+*/
+SftpClient::~SftpClient() {
+	if (localFd >= 0) {
+		close(localFd);
+	}
+}
+
+/*
+==================
+SftpClient::Get
+==================
+*/
+void SftpClient::Get(string remote, string local) {
+	remotePath = remote;
+	localPath = local;
+	upload = false;
+}
+
+/*
+==================
+SftpClient::Put
+==================
+*/
+void SftpClient::Put(string local, string remote) {
+	remotePath = remote;
+	localPath = local;
+	upload = true;
+}
+
+/*
+==================
+SftpClient::SetStripes
+
+Nothing is requested until a block is claimed.
+==================
+*/
+void SftpClient::SetStripes(SftpStripes *s, uint32 index) {
+	stripes = s;
+	stripeIndex = index;
+	blockEnd = 0;
+}
+
+/*
+==================
+SftpClient::Timeout
+==================
+*/
+int SftpClient::Timeout() {
+	return (IsWaiting() || idle) ? SFTP_WAIT_MS : -1;
+}
+
+/*
+==================
+SftpClient::Start
+
+An upload fails here if the local file cannot be read. 
+The requests are queued on the channel until the 
+subsystem has started.
+==================
+*/
+bool SftpClient::Start(Channel *ch) {
+	Message msg;
+	struct stat st;
+
+	channel = ch;
+
+	if (upload) {
+		localFd = open(localPath.c_str(), O_RDONLY);
+		if (localFd < 0 || fstat(localFd, &st) < 0) {
+			Fail("Failed to open " + localPath);
+			return false;
+		}
+
+		end = st.st_size;
+	}
+
+	msg.Add(SSH_FXP_INIT);
+	msg.AddUI(SFTP_VERSION);
+	Send(msg);
+
+	state = SF_VERSION;
+	return true;
+}
+
+/*
+==================
+SftpClient::Update
+==================
+*/
+void SftpClient::Update() {
+	channel->TakeOutput(inBuf);
+	ParseReplies();
+}
+
+/*
+==================
+SftpClient::OnData
+==================
+*/
+void SftpClient::OnData(const ubyte *data, uint32 len) {
+	inBuf.append((const char*)data, len);
+	ParseReplies();
+}
+
+/*
+==================
+SftpClient::Abandon
+
+Every block with a request in flight, or still to be 
+requested, is given back in full. Without the first client
+to truncate it, the remote file of an upload is not written
+by the others, and the transfer fails.
+==================
+*/
+void SftpClient::Abandon() {
+	vector<uint64> blocks;
+
+	if (!stripes || IsDone()) {
+		return;
+	}
+
+	map<uint32, SftpRequest>::iterator it;
+	for (it = pending.begin(); it != pending.end(); it++) {
+		if (it->second.type == SSH_FXP_READ || it->second.type == SSH_FXP_WRITE) {
+			blocks.push_back(it->second.offset - it->second.offset % SFTP_BLOCK);
+		}
+	}
+
+	for (unsigned i=0; i<retry.size(); i++) {
+		blocks.push_back(retry[i].offset - retry[i].offset % SFTP_BLOCK);
+	}
+
+	if (nextOffset < MIN(blockEnd, end)) {
+		blocks.push_back(nextOffset - nextOffset % SFTP_BLOCK);
+	}
+
+	sort(blocks.begin(), blocks.end());
+	blocks.erase(unique(blocks.begin(), blocks.end()), blocks.end());
+
+	if (upload && stripeIndex == 0 && !stripes->truncated) {
+		stripes->failed = true;
+	}
+
+	stripes->GiveBack(blocks, holding);
+	holding = false;
+	state = SF_FAILED;
+}
+
+/*
+==================
+SftpClient::ParseReplies
+
+Handle every complete reply in the input buffer.
+==================
+*/
+void SftpClient::ParseReplies() {
+	const ubyte *p = (const ubyte*)inBuf.c_str();
+	uint32 plen;
+
+	while (!IsDone() && inBuf.length() - inOff >= 4) {
+		BytesToInt(plen, p+inOff);
+
+		if (plen < 1 || plen > SFTP_MAX_PACKET) {
+			Fail("Bad packet from the sftp server");
+			break;
+		}
+
+		if (inBuf.length() - inOff - 4 < plen) {
+			break;
+		}
+
+		HandleReply(p+inOff+4, plen);
+		inOff += 4 + plen;
+	}
+
+	if (inOff == inBuf.length()) {
+		inBuf.clear();
+		inOff = 0;
+	} else if (inOff >= SFTP_MAX_PACKET) {
+		inBuf.erase(0, inOff);
+		inOff = 0;
+	}
+
+	Pump();
+}
+
+/*
+==================
+SftpClient::HandleReply
+
+Every reply but VERSION starts with the id of its request.
+==================
+*/
+void SftpClient::HandleReply(const ubyte *data, uint32 len) {
+	uint32 id, slen;
+
+	if (data[0] == SSH_FXP_VERSION) {
+		HandleVersion(data, len);
+		return;
+	}
+
+	if (len < 5) {
+		Fail("Bad packet from the sftp server");
+		return;
+	}
+
+	BytesToInt(id, data+1);
+	map<uint32, SftpRequest>::iterator it = pending.find(id);
+	if (it == pending.end()) {
+		Warning("sftp: reply to an unknown request", id);
+		return;
+	}
+
+	SftpRequest req = it->second;
+	pending.erase(it);
+
+	switch (data[0]) {
+		case SSH_FXP_STATUS:
+			HandleStatus(req, data, len);
+			break;
+
+		case SSH_FXP_HANDLE:
+			if (req.type != SSH_FXP_OPEN || len < 9) {
+				Fail("Unexpected HANDLE from the sftp server");
+				break;
+			}
+
+			BytesToInt(slen, data+5);
+			if (slen > len - 9) {
+				Fail("Bad HANDLE from the sftp server");
+				break;
+			}
+
+			handle.assign((const char*)data+9, slen);
+
+			if (!upload) {
+				int flags = stripes ? O_WRONLY : O_WRONLY | O_CREAT | O_TRUNC;
+
+				localFd = open(localPath.c_str(), flags, 0644);
+				if (localFd < 0) {
+					Fail("Failed to create " + localPath);
+					break;
+				}
+			} else if (stripes && stripeIndex == 0) {
+				stripes->truncated = true;
+			}
+
+			state = SF_TRANSFER;
+			break;
+
+		case SSH_FXP_DATA:
+			HandleData(req, data, len);
+			break;
+
+		/* The size is the first attribute, if present */
+		case SSH_FXP_ATTRS:
+			if (len >= 17 && (data[8] & SSH_FILEXFER_ATTR_SIZE)) {
+				BytesToInt(end, data+9);
+			}
+			break;
+
+		default:
+			Warning("sftp: unexpected reply", data[0]);
+			break;
+	}
+}
+
+/*
+==================
+SftpClient::HandleVersion
+
+The file is asked for once the server has replied to INIT.
+A download asks for the size and the handle at once.
+==================
+*/
+void SftpClient::HandleVersion(const ubyte *data, uint32 len) {
+	uint32 version;
+
+	if (state != SF_VERSION || len < 5) {
+		Fail("Unexpected VERSION from the sftp server");
+		return;
+	}
+
+	BytesToInt(version, data+1);
+	if (version < SFTP_VERSION) {
+		Fail("Unsupported sftp version");
+		return;
+	}
+
+	if (!upload) {
+		Message msg = NewRequest(SSH_FXP_STAT);
+		AddString(msg, remotePath);
+		Send(msg);
+	}
+
+	SendOpen();
+	state = SF_OPEN;
+}
+
+/*
+==================
+SftpClient::HandleData
+
+Write the data at the offset it was read from. If less 
+was returned than asked for, the rest is asked for again.
+==================
+*/
+void SftpClient::HandleData(SftpRequest &req, const ubyte *data, uint32 len) {
+	uint32 dlen;
+
+	if (req.type != SSH_FXP_READ || len < 9) {
+		Fail("Unexpected DATA from the sftp server");
+		return;
+	}
+
+	BytesToInt(dlen, data+5);
+	if (dlen > len - 9 || dlen > req.len) {
+		Fail("Bad DATA from the sftp server");
+		return;
+	}
+
+	for (uint32 off=0; off < dlen; ) {
+		int n = pwrite(localFd, data+9+off, dlen-off, req.offset+off);
+
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+
+		if (n <= 0) {
+			Fail("Failed to write " + localPath);
+			return;
+		}
+
+		off += n;
+	}
+
+	transferred += dlen;
+
+	if (dlen < req.len && req.offset + dlen < end) {
+		SftpRequest rest = { SSH_FXP_READ, req.offset + dlen, req.len - dlen };
+		retry.push_back(rest);
+	}
+}
+
+/*
+==================
+SftpClient::HandleStatus
+
+EOF in reply to a READ marks the end of the file. Any 
+other error ends the transfer, except a failed STAT, 
+after which the file is read until EOF.
+==================
+*/
+void SftpClient::HandleStatus(SftpRequest &req, const ubyte *data, uint32 len) {
+	uint32 code, mlen;
+	string message;
+
+	if (len < 9) {
+		Fail("Bad STATUS from the sftp server");
+		return;
+	}
+
+	BytesToInt(code, data+5);
+
+	if (len >= 13) {
+		BytesToInt(mlen, data+9);
+		if (mlen <= len - 13) {
+			message.assign((const char*)data+13, mlen);
+		}
+	}
+
+	if (req.type == SSH_FXP_READ && code == SSH_FX_EOF) {
+		end = MIN(end, req.offset);
+		return;
+	}
+
+	if (code == SSH_FX_OK) {
+		if (req.type == SSH_FXP_WRITE) {
+			transferred += req.len;
+		} else if (req.type == SSH_FXP_CLOSE) {
+			state = SF_DONE;
+		}
+		return;
+	}
+
+	if (req.type == SSH_FXP_STAT) {
+		return;
+	}
+
+	if (message.empty()) {
+		stringstream ss;
+		ss <<"error " <<code;
+		message = ss.str();
+	}
+
+	Fail(remotePath + ": " + message);
+}
+
+/*
+==================
+SftpClient::Pump
+
+Keep "depth" requests in flight, as long as the channel's
+queue is not too long. The handle is closed once the whole
+file is transferred.
+==================
+*/
+void SftpClient::Pump() {
+	/* The failure is reported by the client which failed */
+	if (stripes && stripes->failed && !IsDone()) {
+		state = SF_FAILED;
+		return;
+	}
+
+	if (state != SF_TRANSFER || IsWaiting()) {
+		return;
+	}
+
+	while (pending.size() < depth && channel->OutputPending() < CHAN_QUEUE_MAX) {
+		if (retry.size()) {
+			SftpRequest req = retry.front();
+			retry.pop_front();
+
+			if (req.offset < end) {
+				SendRead(req.offset, MIN(req.len, end - req.offset));
+			}
+			continue;
+		}
+
+		if (!HasNext()) {
+			break;
+		}
+
+		uint32 n = MIN(MIN(blockEnd, end) - nextOffset, (uint64)SFTP_CHUNK);
+
+		if (upload) {
+			if (!SendWrite(nextOffset, n)) {
+				return;
+			}
+		} else {
+			SendRead(nextOffset, n);
+		}
+
+		nextOffset += n;
+	}
+
+	if (pending.empty() && retry.empty() && !HasNext() && !idle) {
+		SendClose();
+	}
+}
+
+/*
+==================
+SftpClient::HasNext
+
+True if there is more of the file to request. With 
+stripes, another block is claimed once the current one is
+requested in full.
+==================
+*/
+bool SftpClient::HasNext() {
+	if (nextOffset < MIN(blockEnd, end)) {
+		return true;
+	}
+
+	if (!stripes) {
+		return false;
+	}
+
+	uint64 block;
+	bool busy = pending.size() || retry.size();
+	SftpClaim claim = stripes->Claim(end, block, holding, busy);
+
+	idle = (claim == CLAIM_WAIT);
+	if (claim != CLAIM_BLOCK) {
+		return false;
+	}
+
+	nextOffset = block;
+	blockEnd = block + SFTP_BLOCK;
+	return true;
+}
+
+/*
+==================
+SftpClient::IsWaiting
+
+An upload on a connection other than the first waits for 
+the first to truncate the remote file.
+==================
+*/
+bool SftpClient::IsWaiting() {
+	return state == SF_TRANSFER && upload && stripes 
+		&& stripeIndex && !stripes->truncated;
+}
+
+/*
+==================
+SftpClient::NewRequest
+
+A request of "type" with the next id, remembered until its
+reply arrives.
+==================
+*/
+Message SftpClient::NewRequest(ubyte type, uint64 offset, uint32 len) {
+	SftpRequest req = { type, offset, len };
+	Message msg;
+
+	msg.Add(type);
+	msg.AddUI(nextId);
+
+	pending[nextId++] = req;
+	return msg;
+}
+
+/*
+==================
+SftpClient::Send
+
+Send "msg", followed by "len" bytes of "data", as a single
+sftp packet.
+==================
+*/
+void SftpClient::Send(Message &msg, const ubyte *data, uint32 len) {
+	uint32 plen = msg.payload.size() + len;
+	string packet;
+
+	packet.reserve(4 + plen);
+	packet += (char)(plen >> 24);
+	packet += (char)(plen >> 16);
+	packet += (char)(plen >> 8);
+	packet += (char)plen;
+	packet.append((const char*)&msg.payload[0], msg.payload.size());
+	packet.append((const char*)data, len);
+
+	channel->SendInput((const ubyte*)packet.c_str(), packet.length());
+}
+
+/*
+==================
+SftpClient::SendOpen
+==================
+*/
+void SftpClient::SendOpen() {
+	Message msg = NewRequest(SSH_FXP_OPEN);
+	uint32 flags = SSH_FXF_READ;
+
+	if (upload) {
+		flags = SSH_FXF_WRITE | SSH_FXF_CREAT;
+
+		if (!stripes || (stripeIndex == 0 && !stripes->truncated)) {
+			flags |= SSH_FXF_TRUNC;
+		}
+	}
+
+	AddString(msg, remotePath);
+	msg.AddUI(flags);
+	msg.AddUI(0);			// No attributes
+
+	Send(msg);
+}
+
+/*
+==================
+SftpClient::SendRead
+==================
+*/
+void SftpClient::SendRead(uint64 offset, uint32 len) {
+	Message msg = NewRequest(SSH_FXP_READ, offset, len);
+
+	AddString(msg, handle);
+	AddUI64(msg, offset);
+	msg.AddUI(len);
+
+	Send(msg);
+}
+
+/*
+==================
+SftpClient::SendWrite
+
+The data is read from the local file at "offset".
+==================
+*/
+bool SftpClient::SendWrite(uint64 offset, uint32 len) {
+	ubyte buf[SFTP_CHUNK];
+	uint32 got = 0;
+
+	while (got < len) {
+		int n = pread(localFd, buf+got, len-got, offset+got);
+
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+
+		if (n <= 0) {
+			Fail("Failed to read " + localPath);
+			return false;
+		}
+
+		got += n;
+	}
+
+	Message msg = NewRequest(SSH_FXP_WRITE, offset, len);
+
+	AddString(msg, handle);
+	AddUI64(msg, offset);
+	msg.AddUI(len);
+
+	Send(msg, buf, len);
+	return true;
+}
+
+/*
+==================
+SftpClient::SendClose
+==================
+*/
+void SftpClient::SendClose() {
+	Message msg = NewRequest(SSH_FXP_CLOSE);
+
+	AddString(msg, handle);
+	Send(msg);
+
+	state = SF_CLOSE;
+}
+
+/*
+==================
+SftpClient::Fail
+==================
+*/
+void SftpClient::Fail(string msg) {
+	Error(("sftp: " + msg).c_str());
+	state = SF_FAILED;
+
+	if (stripes) {
+		stripes->failed = true;
+	}
+}
+
+/*
+==================
+static SftpClient::AddString
+==================
+*/
+void SftpClient::AddString(Message &msg, string s) {
+	msg.AddUI(s.length());
+	msg.Add(s);
+}
+
+/*
+==================
+static SftpClient::AddUI64
+==================
+*/
+void SftpClient::AddUI64(Message &msg, uint64 n) {
+	msg.AddUI(n >> 32);
+	msg.AddUI(n);
+}
@@ -0,0 +1,256 @@
+#pragma once
+
+#include "../sshay.h"
+#include "packet.h"
+#include <map>
+#include <deque>
+#include <atomic>
+#include <pthread.h>
+
+class Channel;
+
+/*
+==================
+SFTP packet types, version 3
+(draft-ietf-secsh-filexfer-02)
+==================
+*/
+#define SSH_FXP_INIT 			1
+#define SSH_FXP_VERSION 		2
+#define SSH_FXP_OPEN 			3
+#define SSH_FXP_CLOSE 			4
+#define SSH_FXP_READ 			5
+#define SSH_FXP_WRITE 			6
+#define SSH_FXP_STAT 			17
+#define SSH_FXP_STATUS 			101
+#define SSH_FXP_HANDLE 			102
+#define SSH_FXP_DATA 			103
+#define SSH_FXP_ATTRS 			105
+
+#define SSH_FX_OK 				0
+#define SSH_FX_EOF 				1
+
+#define SSH_FXF_READ 			0x01
+#define SSH_FXF_WRITE 			0x02
+#define SSH_FXF_CREAT 			0x08
+#define SSH_FXF_TRUNC 			0x10
+
+#define SSH_FILEXFER_ATTR_SIZE 	0x01
+
+#define SFTP_VERSION 			3
+
+/* Bytes read or written by a single request. Every server
+ * supports at least this much. */
+#define SFTP_CHUNK 				32768
+
+/* Default number of requests in flight */
+#define SFTP_DEPTH 				64
+
+/* Longest accepted reply */
+#define SFTP_MAX_PACKET 		262144
+
+/* Part of a striped file claimed by a connection at once */
+#define SFTP_BLOCK 				(1 << 20)
+
+/* How often a connection waiting for another one looks 
+ * again, in milliseconds */
+#define SFTP_WAIT_MS 			10
+
+/*
+==================
+SftpState
+==================
+*/
+enum SftpState {
+	SF_IDLE,		// Not started
+	SF_VERSION,		// Waiting for the server's VERSION
+	SF_OPEN,		// Waiting for the remote file's handle
+	SF_TRANSFER,	// Reading or writing the file
+	SF_CLOSE,		// Waiting for the handle to close
+	SF_DONE,
+	SF_FAILED,
+};
+
+/*
+==================
+SftpRequest
+
+A request waiting for its reply.
+==================
+*/
+struct SftpRequest {
+	ubyte 			type;
+	uint64 			offset;		// READ and WRITE only
+	uint32 			len;
+};
+
+/*
+==================
+SftpClaim
+==================
+*/
+enum SftpClaim {
+	CLAIM_BLOCK,	// A block was claimed
+	CLAIM_WAIT,		// None yet, another client may give some back
+	CLAIM_NONE,		// The whole file is copied
+};
+
+/*
+==================
+SftpStripes
+
+A file copied by several SftpClients at once, each on a
+connection of its own. Whenever a client has room for more
+requests, it claims the next SFTP_BLOCK of the file, so a
+faster connection copies more of it.
+
+The first client opens the remote file of an upload with
+truncation, unless it is already set. The others open it 
+as it is, and do not write until it has been truncated. 
+If any client fails, all of them stop.
+
+If the connection of a client is lost, the blocks it has
+claimed but not copied in full are given back, and claimed
+again by the others. A client with nothing left to copy
+waits for this while any other client holds a block.
+
+Blocks set in "done" are already the same on both sides,
+and are skipped. It is not changed once the clients start.
+==================
+*/
+struct SftpStripes {
+					SftpStripes();
+					~SftpStripes();
+
+	/* Claim a block of a file of "end" bytes for a client, 
+	 * which holds blocks while "holding". A client which is 
+	 * still "busy" with its requests keeps holding them. */
+	SftpClaim 		Claim(uint64 end, uint64 &block, bool &holding, bool busy);
+
+	/* Give back the blocks of a lost client */
+	void 			GiveBack(const vector<uint64> &blocks, bool holding);
+
+	pthread_mutex_t lock;
+	uint64 			next;		// Start of the next unclaimed block
+	uint32 			holders;	// Clients holding claimed blocks
+	vector<uint64> 	lost;		// Blocks given back, to be claimed again
+	atomic<bool> 	truncated;
+	atomic<bool> 	failed;
+	vector<bool> 	done;
+};
+
+/*
+==================
+SftpClient
+
+Copies a single file to or from the server over the
+"sftp" subsystem of a channel.
+
+The file is not transferred one chunk per round trip. Up
+to "depth" READ or WRITE requests are kept in flight, and
+a new one is sent as each reply arrives. Read replies are
+written at their own offsets with pwrite, in whatever
+order they arrive. A short read is asked for again from
+where it ended.
+
+Without a size from STAT, the file is read until the 
+server replies EOF.
+
+With stripes, the client copies the blocks it claims, and
+leaves the rest of the file to the other clients. The local
+file of a download is neither created nor truncated, this
+is left to the caller.
+==================
+*/
+class SftpClient {
+public:
+					SftpClient();
+					~SftpClient();
+
+	void 			SetDepth(uint32 n) { depth = n ? n : 1; }
+
+	/* Copy a share of the file, as client "index" of "s" */
+	void 			SetStripes(SftpStripes *s, uint32 index);
+
+	/* Copy the remote file "remote" to "local" */
+	void 			Get(string remote, string local);
+
+	/* Copy the local file "local" to "remote" */
+	void 			Put(string local, string remote);
+
+	/* Start the transfer on "ch", whose subsystem is sftp */
+	bool 			Start(Channel *ch);
+
+	/* Handle the replies received by the channel, and send 
+	 * more requests */
+	void 			Update();
+
+	/* Handle replies, as received from the server */
+	void 			OnData(const ubyte *data, uint32 len);
+
+	/* The connection is lost before the transfer is done.
+	 * The claimed blocks are given back to the others. */
+	void 			Abandon();
+
+	bool 			IsDone() { return state == SF_DONE 
+									|| state == SF_FAILED; }
+	bool 			HasFailed() { return state == SF_FAILED; }
+
+	/* Bytes of the file read or written so far */
+	uint64 			GetTransferred() { return transferred; }
+
+	/* Milliseconds until "Update" should be called again, 
+	 * even if nothing is received, or -1 */
+	int 			Timeout();
+
+private:
+	Channel 		*channel;
+	SftpState 		state;
+	bool 			upload;
+	string 			remotePath;
+	string 			localPath;
+	int 			localFd;
+	string 			handle;
+
+	uint32 			depth;
+	uint32 			nextId;
+	map<uint32, SftpRequest> pending;
+	deque<SftpRequest> retry;	// The rest of short reads
+
+	SftpStripes 	*stripes;
+	uint32 			stripeIndex;
+	bool 			holding;	// Of claimed blocks
+	bool 			idle;		// Waiting for blocks given back
+
+	uint64 			nextOffset;	// Start of the next request
+	uint64 			blockEnd;	// End of the block being requested
+	uint64 			end;		// Size of the file, as far as known
+	uint64 			transferred;
+
+	string 			inBuf;		// Replies not yet handled
+	uint32 			inOff;
+
+	void 			ParseReplies();
+	void 			HandleReply(const ubyte *data, uint32 len);
+	void 			HandleVersion(const ubyte *data, uint32 len);
+	void 			HandleData(SftpRequest &req, 
+							   const ubyte *data, uint32 len);
+	void 			HandleStatus(SftpRequest &req, 
+								 const ubyte *data, uint32 len);
+
+	void 			Pump();
+	bool 			HasNext();
+	bool 			IsWaiting();
+	Message 		NewRequest(ubyte type, uint64 offset=0, uint32 len=0);
+	void 			Send(Message &msg, const ubyte *data=NULL, 
+						 uint32 len=0);
+	void 			SendOpen();
+	void 			SendRead(uint64 offset, uint32 len);
+	bool 			SendWrite(uint64 offset, uint32 len);
+	void 			SendClose();
+
+	void 			Fail(string msg);
+
+	static void 	AddString(Message &msg, string s);
+	static void 	AddUI64(Message &msg, uint64 n);
+};
@@ -0,0 +1,280 @@
+#include "striped.h"
+#include "session.h"
+#include "blockhash.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+
+/*
+==================
+StripedTransfer::StripedTransfer
+==================
+*/
+StripedTransfer::StripedTransfer(uint32 count) {
+	port = 22;
+	upload = false;
+	resume = false;
+	remoteSize = 0;
+
+	for (uint32 i=0; i<MAX(count, 1); i++) {
+		Stripe *s = new Stripe;
+
+		s->owner = this;
+		s->index = i;
+		s->session = new Session;
+		s->started = false;
+		s->status = -1;
+		s->sftp.SetStripes(&shared, i);
+
+		stripes.push_back(s);
+	}
+}
+
+/*
+==================
+StripedTransfer::~StripedTransfer
+==================
+*/
+StripedTransfer::~StripedTransfer() {
+	for (unsigned i=0; i<stripes.size(); i++) {
+		delete stripes[i]->session;
+		delete stripes[i];
+	}
+}
+
+/*
+==================
+StripedTransfer::SetCredentials
+==================
+*/
+void StripedTransfer::SetCredentials(string u, string p) {
+	for (unsigned i=0; i<stripes.size(); i++) {
+		stripes[i]->session->SetCredentials(u, p);
+	}
+}
+
+/*
+==================
+StripedTransfer::SetDepth
+
+The depth of every connection.
+==================
+*/
+void StripedTransfer::SetDepth(uint32 n) {
+	for (unsigned i=0; i<stripes.size(); i++) {
+		stripes[i]->sftp.SetDepth(n);
+	}
+}
+
+/*
+==================
+StripedTransfer::Get
+==================
+*/
+void StripedTransfer::Get(string h, int p, string remote, string local) {
+	host = h;
+	port = p;
+	upload = false;
+	localPath = local;
+	remotePath = remote;
+
+	for (unsigned i=0; i<stripes.size(); i++) {
+		stripes[i]->sftp.Get(remote, local);
+	}
+}
+
+/*
+==================
+StripedTransfer::Put
+==================
+*/
+void StripedTransfer::Put(string h, int p, string local, string remote) {
+	host = h;
+	port = p;
+	upload = true;
+	localPath = local;
+	remotePath = remote;
+
+	for (unsigned i=0; i<stripes.size(); i++) {
+		stripes[i]->sftp.Put(local, remote);
+	}
+}
+
+/*
+==================
+StripedTransfer::Run
+
+The first connection is made here. The transfers, and the 
+other connections, are made on a thread per connection.
+==================
+*/
+int StripedTransfer::Run() {
+	Session *first = stripes[0]->session;
+
+	if (!first->Initiate(host, port) || !first->UserAuthentication()) {
+		return 1;
+	}
+
+	bool resumed = resume && PrepareResume();
+
+	/* The clients write into the file as it is */
+	if (!upload) {
+		int flags = O_WRONLY | O_CREAT | (resumed ? 0 : O_TRUNC);
+		int fd = open(localPath.c_str(), flags, 0644);
+
+		if (fd < 0) {
+			Error(("Failed to create " + localPath).c_str(), errno);
+			return 1;
+		}
+
+		close(fd);
+	}
+
+	for (unsigned i=0; i<stripes.size(); i++) {
+		Stripe *s = stripes[i];
+
+		if (pthread_create(&s->thread, NULL, &StripeThread, s)) {
+			Error("StripedTransfer: Failed to create thread", errno);
+
+			/* The others would wait for the first forever */
+			if (i == 0) {
+				return 1;
+			}
+			continue;
+		}
+
+		s->started = true;
+	}
+
+	for (unsigned i=0; i<stripes.size(); i++) {
+		if (stripes[i]->started) {
+			pthread_join(stripes[i]->thread, NULL);
+		}
+	}
+
+	/* Blocks given back after the others had finished, or
+	 * no connection which saw the transfer through */
+	bool copied = false;
+	for (unsigned i=0; i<stripes.size(); i++) {
+		copied |= (stripes[i]->status == 0);
+	}
+
+	if (shared.failed || shared.lost.size() || !copied) {
+		Error("StripedTransfer: The file was not copied in full");
+		return 1;
+	}
+
+	/* What was kept of a longer file */
+	if (resumed && !upload && truncate(localPath.c_str(), remoteSize)) {
+		Error(("Failed to truncate " + localPath).c_str(), errno);
+		return 1;
+	}
+
+	return 0;
+}
+
+/*
+==================
+StripedTransfer::PrepareResume
+
+Hash the blocks of the local file while the server hashes
+the same blocks of the remote one, and mark those which 
+are the same as done. The remote file of an upload is not
+truncated, unless it is longer than the local one.
+
+Returns false if the transfer is to be made in full.
+==================
+*/
+bool StripedTransfer::PrepareResume() {
+	struct stat st;
+
+	/* Nothing to resume from */
+	if (stat(localPath.c_str(), &st) || !S_ISREG(st.st_mode)) {
+		return false;
+	}
+
+	uint64 length = st.st_size;
+	BlockHasher hasher;
+	string out;
+
+	if (!hasher.Start(localPath, length)) {
+		return false;
+	}
+
+	int status = stripes[0]->session->RunCapture(
+			BlockHasher::RemoteCommand(remotePath, length), out);
+	vector<string> local = hasher.Finish();
+
+	uint64 size;
+	vector<string> remote;
+
+	if (status == HASH_NO_FILE) {
+		return false;
+	}
+
+	if (status || !BlockHasher::ParseRemote(out, size, remote)) {
+		Warning("Failed to hash the remote file, copying all of it", status);
+		return false;
+	}
+
+	if (upload && size > length) {
+		return false;
+	}
+
+	shared.done = BlockHasher::Compare(local, remote, MIN(length, size));
+	shared.truncated = upload;
+	remoteSize = size;
+
+	uint32 same = 0;
+	for (unsigned i=0; i<shared.done.size(); i++) {
+		same += shared.done[i];
+	}
+
+	printf("%lu of %lu bytes already copied\n", (uint64)same * HASH_BLOCK, 
+		   upload ? length : size);
+	return true;
+}
+
+/*
+==================
+StripedTransfer::GetTransferred
+==================
+*/
+uint64 StripedTransfer::GetTransferred() {
+	uint64 total = 0;
+
+	for (unsigned i=0; i<stripes.size(); i++) {
+		total += stripes[i]->sftp.GetTransferred();
+	}
+
+	return total;
+}
+
+/*
+==================
+static StripedTransfer::StripeThread
+
+Connect, unless this is the first connection, and run the
+transfer. If the connection is lost, the others copy what
+was left of its share.
+==================
+*/
+void* StripedTransfer::StripeThread(void *arg) {
+	Stripe *s = (Stripe*)arg;
+	StripedTransfer *t = s->owner;
+
+	if (s->index && (!s->session->Initiate(t->host, t->port) 
+				 ||  !s->session->UserAuthentication())) {
+		Warning("Continuing without a failed connection", s->index);
+		return NULL;
+	}
+
+	s->status = s->session->RunSftp(&s->sftp);
+
+	if (!s->sftp.IsDone()) {
+		Warning("Continuing without a lost connection", s->index);
+		s->sftp.Abandon();
+	}
+
+	return NULL;
+}
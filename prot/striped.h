@@ -0,0 +1,87 @@
+#pragma once
+
+#include "../sshay.h"
+#include "sftp.h"
+#include <pthread.h>
+
+class Session;
+class StripedTransfer;
+
+/*
+==================
+Stripe
+
+A connection of a striped transfer.
+==================
+*/
+struct Stripe {
+	StripedTransfer *owner;
+	uint32 			index;
+	Session 		*session;
+	SftpClient 		sftp;
+	pthread_t 		thread;
+	bool 			started;
+	int 			status;		// Of the transfer, -1 if not connected
+};
+
+/*
+==================
+StripedTransfer
+
+Copies a single file over several connections to the same
+host at once. Every connection has its own cipher and MAC,
+and runs on a thread of its own, so a transfer limited by
+the cipher uses as many cores as there are connections.
+The connections share the file as SftpStripes, and each
+writes the blocks it copies at their own offsets.
+
+The first connection is made before the others, so a bad
+password or a new host key is dealt with once. If one of
+the others cannot connect, the file is copied over those
+which could. If a connection is lost during the transfer,
+the blocks it had not copied are left to the others.
+
+With resume set, a destination left by an earlier transfer
+is compared with the source block by block, and only the
+blocks which differ are copied.
+==================
+*/
+class StripedTransfer {
+public:
+					StripedTransfer(uint32 count);
+					~StripedTransfer();
+
+	void 			SetCredentials(string user, string password);
+	void 			SetDepth(uint32 n);
+	void 			SetResume(bool r) { resume = r; }
+
+	/* Copy the remote file "remote" to "local" */
+	void 			Get(string host, int port, string remote, string local);
+
+	/* Copy the local file "local" to "remote" */
+	void 			Put(string host, int port, string local, string remote);
+
+	/* Returns 0 if the file was copied */
+	int 			Run();
+
+	/* Bytes copied over all connections */
+	uint64 			GetTransferred();
+
+private:
+	vector<Stripe*> stripes;
+	SftpStripes 	shared;
+
+	string 			host;
+	int 			port;
+	string 			user;
+	string 			password;
+	bool 			upload;
+	bool 			resume;
+	string 			localPath;
+	string 			remotePath;
+	uint64 			remoteSize;		// Of a resumed download
+
+	bool 			PrepareResume();
+
+	static void* 	StripeThread(void *arg);
+};
@@ -0,0 +1,89 @@
+#include "termwriter.h"
+#include "channel.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/*
+==================
+TermWriter::TermWriter
+==================
+*/
+TermWriter::TermWriter(int f) {
+	fd = f;
+}
+
+/*
+==================
+TermWriter::Write
+
+A payload without anything to translate is written 
+straight from "data".
+==================
+*/
+bool TermWriter::Write(const ubyte *data, uint32 len) {
+	uint32 pos = FindSpecial(data, len);
+
+	/* Whatever was printed through stdio goes first */
+	if (fd == STDOUT_FILENO) {
+		fflush(stdout);
+	}
+
+	if (pos == len) {
+		return Channel::WriteFd(fd, data, len);
+	}
+
+	buf.resize(len);
+	memcpy(&buf[0], data, pos);
+
+	while (pos < len) {
+		buf[pos] = Translate(data[pos]);
+		pos++;
+
+		uint32 run = FindSpecial(data+pos, len-pos);
+		memcpy(&buf[pos], data+pos, run);
+		pos += run;
+	}
+
+	return Channel::WriteFd(fd, &buf[0], len);
+}
+
+/*
+==================
+static TermWriter::FindSpecial
+==================
+*/
+uint32 TermWriter::FindSpecial(const ubyte *data, uint32 len) {
+	uint32 i = 0;
+
+#ifdef __SSE2__
+	const __m128i cr = _mm_set1_epi8(13);
+
+	for (; i + 16 <= len; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i*)(data+i));
+		int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, cr));
+
+		if (mask) {
+			return i + __builtin_ctz(mask);
+		}
+	}
+#endif
+
+	for (; i < len; i++) {
+		if (data[i] == 13) {
+			break;
+		}
+	}
+
+	return i;
+}
+
+/*
+==================
+static TermWriter::Translate
+==================
+*/
+ubyte TermWriter::Translate(ubyte c) {
+	return (c == 13) ? 8 : c;
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include "../sshay.h"
+
+/*
+==================
+TermWriter
+
+Writes shell output to the terminal. Most bytes are passed
+through untouched. A carriage return is written as a 
+backspace. 
+
+Each payload is scanned 16 bytes at a time for bytes that
+need translating. The runs between them are copied as they
+are, and the whole payload goes out in a single write().
+==================
+*/
+class TermWriter {
+public:
+					TermWriter(int fd=STDOUT_FILENO);
+
+	bool 			Write(const ubyte *data, uint32 len);
+
+	/* The index of the first byte to translate, "len" if none */
+	static uint32 	FindSpecial(const ubyte *data, uint32 len);
+	static ubyte 	Translate(ubyte c);
+
+private:
+	int 			fd;
+	vector<ubyte> 	buf;
+};
@@ -0,0 +1,86 @@
+/* HMAC_CTX is deprecated as of OpenSSL 3.0, but is the only
+ * interface shared with OpenSSL 1.1. */
+#define OPENSSL_API_COMPAT 0x10100000L
+
+#include "transport.h"
+#include "packet.h"
+#include "../crypt/crypttdes.h"
+
+#include <openssl/hmac.h>
+
+/*
+==================
+Transport::Transport
+==================
+*/
+Transport::Transport() {
+	cipher 		= NULL;
+	cipherOut 	= false;
+	cipherIn 	= false;
+	hashOut 	= false;
+	hashIn 		= false;
+	sequenceOut = 0;
+	sequenceIn 	= 0;
+
+	dhReply 	 = NULL;
+	sharedSecret = NULL;
+
+	memset(macKeyOut, 0, 20);
+	memset(macKeyIn, 0, 20);
+	memset(exchangeHash, 0, 20);
+	memset(sessionID, 0, 20);
+}
+
+/*
+==================
+Transport::~Transport
+==================
+*/
+Transport::~Transport() {
+	ClearKex();
+
+	if (cipher) {
+		delete cipher;
+	}
+}
+
+/*
+==================
+Transport::ClearKex
+==================
+*/
+void Transport::ClearKex() {
+	localKexinit.clear();
+	remoteKexinit.clear();
+
+	if (dhReply) {
+		delete dhReply;
+		dhReply = NULL;
+	}
+
+	if (sharedSecret) {
+		delete sharedSecret;
+		sharedSecret = NULL;
+	}
+}
+
+/*
+==================
+Transport::MacOut
+
+mac = MAC(key, sequence_number || unencrypted_packet)
+==================
+*/
+void Transport::MacOut(const ubyte *packet, uint32 len, ubyte *mac) {
+	ubyte seq[4] = {
+		(ubyte)(sequenceOut >> 24), (ubyte)(sequenceOut >> 16),
+		(ubyte)(sequenceOut >> 8),  (ubyte)sequenceOut
+	};
+
+	HMAC_CTX *ctx = HMAC_CTX_new();
+	HMAC_Init_ex(ctx, macKeyOut, 20, EVP_sha1(), NULL);
+	HMAC_Update(ctx, seq, 4);
+	HMAC_Update(ctx, packet, len);
+	HMAC_Final(ctx, mac, NULL);
+	HMAC_CTX_free(ctx);
+}
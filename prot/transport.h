@@ -0,0 +1,61 @@
+#pragma once
+
+#include "../sshay.h"
+
+class CryptTDES;
+struct KexDHPacket;
+struct MPInt;
+
+/*
+==================
+Transport
+
+The state of a single SSH-TRANS connection: the packet
+protection in both directions, and the transcript of the
+latest key exchange. Every connection owns one, and the
+Socket, KeyExchange and Session of the connection all
+refer to it, so any number of connections may live in the
+same process.
+
+All data is public, and owned by the Transport.
+==================
+*/
+struct Transport {
+					Transport();
+					~Transport();
+
+	/* Free the key exchange transcript */
+	void 			ClearKex();
+
+	/* Compute the MAC of an outgoing, unencrypted packet */
+	void 			MacOut(const ubyte *packet, uint32 len, ubyte *mac);
+
+	/* Packet protection. The directions are switched on
+	 * separately, when NEWKEYS is sent and received. */
+	CryptTDES 		*cipher;
+	bool 			cipherOut;
+	bool 			cipherIn;
+	bool 			hashOut;
+	bool 			hashIn;
+	ubyte 			macKeyOut[20];
+	ubyte 			macKeyIn[20];
+	uint32 			sequenceOut;
+	uint32 			sequenceIn;
+
+	/* Identification strings. "localId" includes CR LF */
+	string 			localId;
+	string 			remoteId;
+
+	/* KEXINIT payloads */
+	vector<ubyte> 	localKexinit;
+	vector<ubyte> 	remoteKexinit;
+
+	/* KexDH server reply, holding the host key */
+	KexDHPacket 	*dhReply;
+
+	/* The shared secret K */
+	MPInt 			*sharedSecret;
+
+	ubyte 			exchangeHash[20];
+	ubyte 			sessionID[20];		// H of the first exchange
+};
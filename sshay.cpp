@@ -1,12 +1,18 @@
 #include <pthread.h>
 #include <assert.h>
+#include <fstream>
+#include <sys/time.h>
 
 #include "sshay.h"
 #include "net/socket.h"
 #include "prot/packet.h"
 #include "prot/session.h"
+#include "prot/fanout.h"
+#include "prot/controlmaster.h"
+#include "prot/sftp.h"
+#include "prot/scp.h"
+#include "prot/striped.h"
 #include "test/unittest.h"
-#include "globdata.h"
 
 void Warning(const char *msg) {
 	printf("%s[WARNING]: %s%s\n", CRED, msg, CWHITE);
@@ -33,24 +39,36 @@ void Critical(const char *msg, int eid) {
 	exit(eid);
 }
 
-void DetermineHost(int argc, char *argv[], string &host, int &port) {
+void SplitHostPort(string str, string &host, int &port) {
+	size_t colon = str.find(':');
+
+	host = str;
+	if (colon != string::npos) {
+		port = atoi(str.c_str() + colon + 1);
+		host = str.substr(0, colon);
+	}
+}
+
+/*
+"args" holds the arguments following the options. The host 
+may be followed by a port, for compatibility, or by a 
+command to run instead of a shell.
+*/
+void DetermineHost(int nargs, char *args[], string &host, int &port,
+				   string &command) {
 	port = 22;
 	host = "localhost";
 
-	if (argc >= 2) {
-		host = argv[1];
-
-		if (argc == 3) {
-			port = atoi(argv[2]);
+	if (nargs >= 1) {
+		if (nargs == 2 && strspn(args[1], "0123456789") == strlen(args[1])) {
+			host = args[0];
+			port = atoi(args[1]);
 		} else {
-			for (unsigned i = 0; i < host.length(); i++) {
-				if (host[i] == ':') {
-					const char *pstr = host.c_str() + i + 1;
-					port = atoi(pstr);
+			SplitHostPort(args[0], host, port);
 
-					host = host.substr(0, i);
-					return;
-				}
+			for (int i=1; i<nargs; i++) {
+				command += (i > 1) ? " " : "";
+				command += args[i];
 			}
 		}
 	} else {
@@ -58,6 +76,152 @@ void DetermineHost(int argc, char *argv[], string &host, int &port) {
 	}
 }
 
+void PrintUsage() {
+	printf("usage: sshay [-M] [-R file [-I]] [host[:port]] [port]\n");
+	printf("       sshay [-M] [-R file [-I]] host[:port] command...\n");
+	printf("       sshay [-j parallel] -H host[:port],... command...\n");
+	printf("       sshay [-j parallel] -F hostfile command...\n");
+	printf("       sshay [-s | -r -n depth -c conns] -g host[:port] remote [local]\n");
+	printf("       sshay [-s | -r -n depth -c conns] -p host[:port] local [remote]\n");
+}
+
+/*
+Add the hosts of a comma separated list, or of a file with
+one host per line, to "fanout".
+*/
+void AddFanOutHosts(FanOut &fanout, string list, char sep) {
+	stringstream ss(list);
+	string item, host;
+	int port;
+
+	while (getline(ss, item, sep)) {
+		size_t start = item.find_first_not_of(" \t\r");
+		size_t end = item.find_last_not_of(" \t\r");
+
+		if (start == string::npos || item[start] == '#') {
+			continue;
+		}
+
+		port = 22;
+		SplitHostPort(item.substr(start, end-start+1), host, port);
+		fanout.AddHost(host, port);
+	}
+}
+
+bool AddFanOutFile(FanOut &fanout, const char *path) {
+	ifstream file(path);
+	stringstream content;
+
+	if (!file) {
+		Error("Unable to read the host file");
+		return false;
+	}
+
+	content <<file.rdbuf();
+	AddFanOutHosts(fanout, content.str(), '\n');
+	return true;
+}
+
+/*
+Run a command on several hosts at once. Returns 0 if the 
+command ran on every host.
+*/
+int RunFanOut(FanOut &fanout, string command) {
+	string user, password;
+
+	if (!command.length()) {
+		PrintUsage();
+		return 1;
+	}
+
+	Session::PromptCredentials(user, password);
+	fanout.SetCredentials(user, password);
+	fanout.SetCommand(command);
+
+	return fanout.Run() ? 1 : 0;
+}
+
+/*
+Copy a file to or from "args[0]" over sftp, or with "scp"
+over scp. Over sftp, the file can be split between "conns"
+connections, and with "resume", only the blocks which 
+differ from the destination are copied. Without a 
+destination, the file is copied to a file of the same name
+in the current directory, or in the home directory on the
+server. Returns 0 if the file was copied.
+*/
+int RunTransfer(int nargs, char *args[], bool upload, bool scp, 
+				bool resume, uint32 depth, uint32 conns) {
+	string host, user, password;
+	int port = 22;
+	Session session;
+	SftpClient sftp;
+	ScpClient scpc;
+
+	if (nargs < 2 || nargs > 3) {
+		PrintUsage();
+		return 1;
+	}
+
+	SplitHostPort(args[0], host, port);
+	string src = args[1];
+	string dst = (nargs == 3) ? args[2] : src.substr(src.rfind('/') + 1);
+
+	if (dst.empty()) {
+		PrintUsage();
+		return 1;
+	}
+
+	if (upload) {
+		sftp.Put(src, dst);
+		scpc.Put(src, dst);
+	} else {
+		sftp.Get(src, dst);
+		scpc.Get(src, dst);
+	}
+	sftp.SetDepth(depth);
+
+	Session::PromptCredentials(user, password);
+	session.SetCredentials(user, password);
+
+	uint64 start = GetTimeUsec();
+	uint64 bytes;
+	int status;
+
+	if (conns > 1 || resume) {
+		StripedTransfer striped(conns);
+
+		if (upload) {
+			striped.Put(host, port, src, dst);
+		} else {
+			striped.Get(host, port, src, dst);
+		}
+		striped.SetDepth(depth);
+		striped.SetResume(resume);
+		striped.SetCredentials(user, password);
+
+		status = striped.Run();
+		bytes = striped.GetTransferred();
+	} else {
+		if (!session.Initiate(host, port) 
+		||  !session.UserAuthentication()) {
+			return 1;
+		}
+
+		status = scp ? session.RunScp(&scpc) : session.RunSftp(&sftp);
+		bytes = scp ? scpc.GetTransferred() : sftp.GetTransferred();
+	}
+
+	double secs = (GetTimeUsec() - start) / 1e6;
+
+	if (!status) {
+		printf("%s: %lu bytes in %.1f s (%.1f MB/s)\n", dst.c_str(),
+			   bytes, secs, bytes / MAX(secs, 0.001) / 1e6);
+	}
+
+	return status;
+}
+
 void GetTermDim(uint32 &chW, uint32 &chH, uint32 &pW, uint32 &pH) {
 	struct winsize w;
     int ret;
@@ -70,8 +234,8 @@ void GetTermDim(uint32 &chW, uint32 &chH, uint32 &pW, uint32 &pH) {
    		return;
    	}
 
-    chW = w.ws_row;
-    chH = w.ws_col;
+    chW = w.ws_col;
+    chH = w.ws_row;
     pW  = w.ws_xpixel;
     pH  = w.ws_ypixel;
 }
@@ -91,6 +255,13 @@ void HexDump(const ubyte *data, uint32 len, string s) {
 	printf("\n");
 }
 
+uint64 GetTimeUsec() {
+	timeval tv;
+	gettimeofday(&tv, NULL);
+
+	return (uint64)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
 void SetStdinEcho(bool echo) {
 	struct termios tty;
     tcgetattr(STDIN_FILENO, &tty);
@@ -112,31 +283,168 @@ int main(int argc, char *argv[]) {
 	UT_Types();
 	UT_Mac();
 	UT_DSS();
+	UT_HostKey();
+	UT_DH();
+	UT_KnownHosts();
+	UT_Channel();
+	UT_Term();
+	UT_InputRing();
+	UT_Recorder();
+	UT_Sftp();
+	UT_Scp();
+	UT_BlockHash();
 	printf("Unit-tests OK!\n\n");
 	*/
 
-	string host;
-	int port;
-	pthread_t serverThread;
-	ubyte *data = NULL;
-	int ret;
+	/* Run benchmarks */
+	/*
+	BM_Term();
+	*/
+
+	string host, command, controlPath, recordPath;
+	int port, opt;
+	bool control = false;
+	bool recordInput = false;
+	bool fan = false;
+	bool get = false, put = false, scp = false, resume = false;
+	uint32 depth = SFTP_DEPTH;
+	uint32 conns = 1;
+	FanOut fanout;
+
+	while ((opt = getopt(argc, argv, "+MH:F:j:R:Igpsrn:c:")) != -1) {
+		switch (opt) {
+			case 'M':
+				control = true;
+				break;
+
+			case 'H':
+				AddFanOutHosts(fanout, optarg, ',');
+				fan = true;
+				break;
+
+			case 'F':
+				if (!AddFanOutFile(fanout, optarg)) {
+					return 1;
+				}
+				fan = true;
+				break;
+
+			case 'j':
+				fanout.SetParallel(atoi(optarg));
+				break;
+
+			case 'R':
+				recordPath = optarg;
+				break;
+
+			case 'I':
+				recordInput = true;
+				break;
+
+			case 'g':
+				get = true;
+				break;
+
+			case 'p':
+				put = true;
+				break;
+
+			case 's':
+				scp = true;
+				break;
+
+			case 'r':
+				resume = true;
+				break;
+
+			case 'n':
+				depth = atoi(optarg);
+				break;
+
+			case 'c':
+				conns = atoi(optarg);
+				break;
+
+			default:
+				PrintUsage();
+				return 1;
+		}
+	}
+
+	if (recordInput && recordPath.empty()) {
+		PrintUsage();
+		return 1;
+	}
+
+	if (get || put) {
+		if (fan || control || recordPath.length() || (get && put)
+		||  (scp && (conns > 1 || resume))) {
+			PrintUsage();
+			return 1;
+		}
+
+		return RunTransfer(argc - optind, argv + optind, put, scp, 
+						   resume, depth, conns);
+	}
+
+	if (fan) {
+		if (recordPath.length()) {
+			PrintUsage();
+			return 1;
+		}
+
+		for (int i=optind; i<argc; i++) {
+			command += (i > optind) ? " " : "";
+			command += argv[i];
+		}
+
+		return RunFanOut(fanout, command);
+	}
+
+	DetermineHost(argc - optind, argv + optind, host, port, command);
+
+	/* With -M, an existing connection to the host is used if 
+	 * there is one. Otherwise, this connection is shared. */
+	if (control) {
+		controlPath = ControlMaster::DefaultPath(host, port);
+
+		int status = ControlMaster::RunClient(controlPath, command);
+		if (status >= 0) {
+			return status;
+		}
+	}
+
+	/* A command is run without any output of our own on stdout,
+	 * and the exit status is that of the command, or 255 */
+	if (command.length()) {
+		string user, password;
+		Session session;
+
+		Session::PromptCredentials(user, password);
+		session.SetCredentials(user, password);
+
+		if (!session.Initiate(host, port) 
+		||  !session.UserAuthentication()) {
+			return 255;
+		}
+
+		session.SetControlPath(controlPath);
+		session.SetRecordPath(recordPath, recordInput);
+		return session.RunCommand(command);
+	}
 
-	DetermineHost(argc, argv, host, port);
 	printf("Connecting to %s:%i...\n", host.c_str(), port);
 
 	Session session;
 	if (!session.Initiate(host, port)) {
-		GData::Clear();
 		return 1;
 	}
 
 	if (!session.UserAuthentication()) {
-		GData::Clear();
 		return 1;
 	}
 
-	ret = session.RunConnection();
-
-	GData::Clear();
-	return ret;
+	session.SetControlPath(controlPath);
+	session.SetRecordPath(recordPath, recordInput);
+	return session.RunConnection();
 }
\ No newline at end of file
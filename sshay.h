@@ -68,6 +68,9 @@ void HexDump(const ubyte *data, uint32 len, string s);
 
 void SetStdinEcho(bool echo=true);
 
+/* Microseconds since the epoch */
+uint64 GetTimeUsec();
+
 
 // ========================================================== //
 // ==         All descriptions, definitions and            == //
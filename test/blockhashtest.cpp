@@ -0,0 +1,66 @@
+#include "unittest.h"
+#include "../prot/blockhash.h"
+
+#include <fstream>
+
+#define __TEST_TYPE "BlockHash"
+
+/* sha1sum of a block of HASH_BLOCK 'a's, and of "abc" */
+#define UT_HASH_A 	"454027d64e3b855735552d42230eea1cbd645fa0"
+#define UT_HASH_ABC "a9993e364706816aba3e25717850c26c9cd0d89d"
+
+bool UT__BlockHashLocal() {
+	const char *path = "/tmp/sshay-ut-blockhash.bin";
+	BlockHasher hasher;
+	bool ok = true;
+
+	std::ofstream out(path);
+	out <<string(HASH_BLOCK, 'a') <<"abc" <<"ignored";
+	out.close();
+
+	ok &= hasher.Start(path, HASH_BLOCK + 3);
+	vector<string> hashes = hasher.Finish();
+	unlink(path);
+
+	ok &= (hashes.size() == 2) && (hashes[0] == UT_HASH_A) 
+	   && (hashes[1] == UT_HASH_ABC);
+
+	return ok;
+}
+
+bool UT__BlockHashCompare() {
+	vector<string> local, remote, parsed;
+	uint64 size = 0;
+	bool ok = true;
+
+	ok &= BlockHasher::ParseRemote(" 3145729\n"
+		UT_HASH_A "  -\n" UT_HASH_ABC "  -\n" UT_HASH_A "  -\n", size, parsed);
+	ok &= (size == 3145729) && (parsed.size() == 3);
+
+	/* No size, or a line which is not a hash */
+	ok &= !BlockHasher::ParseRemote("", size, remote);
+	ok &= !BlockHasher::ParseRemote("12\nsha1sum: not found\n", size, remote);
+
+	/* The second differs, the third could not be read, the
+	 * fourth is partial */
+	local.push_back(UT_HASH_A);
+	local.push_back(UT_HASH_A);
+	local.push_back("");
+	local.push_back(UT_HASH_ABC);
+	remote = local;
+	remote[1] = UT_HASH_ABC;
+
+	vector<bool> same = BlockHasher::Compare(local, remote,
+											 3 * HASH_BLOCK + 3);
+	ok &= (same.size() == 3) && same[0] && !same[1] && !same[2];
+
+	/* Only what both sides have */
+	ok &= (BlockHasher::Compare(local, parsed, HASH_BLOCK).size() == 1);
+
+	return ok;
+}
+
+void UT_BlockHash() {
+	UNIT_TEST(UT__BlockHashLocal, "Hashing local blocks");
+	UNIT_TEST(UT__BlockHashCompare, "Remote hashes and comparing");
+}
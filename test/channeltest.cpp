@@ -0,0 +1,376 @@
+#include "unittest.h"
+#include "../prot/channel.h"
+#include "../prot/channeltable.h"
+#include "../prot/recvwindow.h"
+#include "../prot/scheduler.h"
+#include "../net/socket.h"
+
+#include <fcntl.h>
+
+#define __TEST_TYPE "Channel"
+
+/* Read everything written to the pipe "fd" so far */
+string UT__ReadPipe(int fd) {
+	char buf[256];
+	int n = read(fd, buf, sizeof(buf));
+
+	return (n > 0) ? string(buf, n) : string();
+}
+
+bool UT__ChanPrefixed() {
+	int fds[2];
+	string partial, out;
+	bool ok = true;
+
+	if (pipe(fds) < 0) {
+		return false;
+	}
+	fcntl(fds[0], F_SETFL, O_NONBLOCK);
+
+	/* Lines split across writes are joined, the end is kept */
+	Channel::WritePrefixed(fds[1], "a: ", partial, (const ubyte*)"one\ntw", 6);
+	ok &= (UT__ReadPipe(fds[0]) == "a: one\n") && (partial == "tw");
+
+	Channel::WritePrefixed(fds[1], "a: ", partial, (const ubyte*)"o\n\nthree", 8);
+	ok &= (UT__ReadPipe(fds[0]) == "a: two\na: \n") && (partial == "three");
+
+	/* Nothing is written before the line ends */
+	Channel::WritePrefixed(fds[1], "a: ", partial, (const ubyte*)"!", 1);
+	ok &= (UT__ReadPipe(fds[0]) == "") && (partial == "three!");
+
+	close(fds[0]);
+	close(fds[1]);
+
+	return ok;
+}
+
+/* A CHANNEL_DATA header addressed to channel "id" */
+void UT__ChanHeader(ubyte *buf, uint32 id) {
+	memset(buf, 0, 14);
+	buf[5] = SSH_MSG_CHANNEL_DATA;
+	buf[6] = id >> 24;
+	buf[7] = id >> 16;
+	buf[8] = id >> 8;
+	buf[9] = id;
+}
+
+bool UT__ChanTable() {
+	ChannelTable table;
+	vector<Channel*> chans;
+	ubyte hdr[14];
+
+	for (uint32 i=0; i<500; i++) {
+		chans.push_back(table.Open(NULL));
+		if (chans[i]->GetSenderChn() != i) {
+			return false;
+		}
+	}
+
+	/* Every other channel is removed */
+	for (uint32 i=0; i<500; i+=2) {
+		table.Remove(chans[i]);
+	}
+
+	if (table.Count() != 250) {
+		return false;
+	}
+
+	for (uint32 i=0; i<500; i++) {
+		UT__ChanHeader(hdr, i);
+		Channel *expect = (i % 2) ? chans[i] : NULL;
+
+		if (table.Lookup(hdr, 14) != expect) {
+			return false;
+		}
+	}
+
+	/* Unknown and truncated messages find nothing */
+	UT__ChanHeader(hdr, 100000);
+	if (table.Lookup(hdr, 14) || table.Lookup(hdr, 9)) {
+		return false;
+	}
+
+	/* Freed numbers are reused before the table grows */
+	for (uint32 i=0; i<250; i++) {
+		Channel *ch = table.Open(NULL);
+		if (ch->GetSenderChn() >= 500 || ch->GetSenderChn() % 2) {
+			return false;
+		}
+	}
+
+	return table.Open(NULL)->GetSenderChn() == 500;
+}
+
+bool UT__ChanWindow() {
+	RecvWindow w;
+	bool ok = true;
+
+	/* Nothing is due until a quarter of the window is used */
+	w.Consume(1000, 0);
+	ok &= (w.PendingIncrement() == 0);
+
+	w.Consume(RWIN_INITIAL/4 - 1000, 0);
+	ok &= (w.PendingIncrement() == RWIN_INITIAL/4);
+	w.Grant(RWIN_INITIAL/4, 0);
+	ok &= (w.Size() == RWIN_INITIAL);
+
+	/* The rest of the old window does not time a round trip */
+	w.Consume(RWIN_INITIAL - RWIN_INITIAL/4, 1000);
+	ok &= (w.RTT() == 0);
+
+	/* The first byte beyond it does, 100ms after the adjust. A
+	 * round trip has passed, and twice what was consumed in it
+	 * becomes the target. */
+	w.Consume(1, 100000);
+	ok &= (w.RTT() == 100000);
+	ok &= (w.Target() == 2 * (RWIN_INITIAL + 1));
+	ok &= (w.PendingIncrement() == w.Target() - w.Size());
+
+	/* While the server is held back by the window, the window
+	 * doubles every round trip, until it reaches the maximum */
+	uint64 t = 100000;
+	for (int i=0; i<12; i++) {
+		w.Grant(w.PendingIncrement(), t);
+		t += 100000;
+		w.Consume(w.Size(), t);
+	}
+	ok &= (w.Target() == RWIN_MAX) && (w.RTT() == 100000);
+
+	/* A slower round trip does not replace the measured one */
+	w.Grant(w.PendingIncrement(), t);
+	w.Consume(w.Size(), t + 700000);
+	ok &= (w.RTT() == 100000);
+
+	return ok;
+}
+
+/*
+A channel which keeps what it sends, instead of sending it
+through a session. "Open" makes it ready, as a command or
+as a shell, with the given window and maximum packet size.
+*/
+class UT__QueueChannel : public Channel {
+public:
+	UT__QueueChannel(uint32 id) : Channel(CH_CLI, id, "session", NULL) {
+		eofAfter = false;
+	}
+
+	void Open(uint32 win, uint32 max, bool shell) {
+		status = shell ? ST_SHELL_OPEN : ST_EXEC_OPEN;
+		if (!shell) {
+			command = "true";
+		}
+		winSizeOut = win;
+		maxSize = max;
+	}
+
+	/* The server lets "increment" more bytes be sent */
+	void Adjust(uint32 increment) {
+		ubyte buf[14] = { 0 };
+
+		buf[5] = SSH_MSG_CHANNEL_WINDOW_ADJUST;
+		for (int i=0; i<4; i++) {
+			buf[10+i] = increment >> (24 - 8*i);
+		}
+		HandleMessage(buf, sizeof(buf));
+	}
+
+	/* Bytes kept by the queue, sent or not */
+	uint32 Held() { return outBuf.length(); }
+
+	vector<uint32> 	packets;	// Sizes of the CHANNEL_DATA sent
+	string 			data;		// Everything sent as CHANNEL_DATA
+	bool 			eofAfter;	// EOF was sent, after all the data
+
+protected:
+	bool SendMessage(Message &msg) {
+		ubyte type = msg.payload[0];
+
+		if (type == SSH_MSG_CHANNEL_DATA) {
+			packets.push_back(msg.payload.size() - 9);
+			data.append((const char*)&msg.payload[9], msg.payload.size() - 9);
+			eofAfter = false;
+		} else if (type == SSH_MSG_CHANNEL_EOF) {
+			eofAfter = true;
+		}
+
+		return true;
+	}
+};
+
+/* "len" bytes which differ from one another, within 251 */
+string UT__QueueData(uint32 len) {
+	string s(len, 0);
+
+	for (uint32 i=0; i<len; i++) {
+		s[i] = i % 251;
+	}
+
+	return s;
+}
+
+bool UT__ChanQueueSplit() {
+	UT__QueueChannel ch(0);
+	string in = UT__QueueData(250);
+	bool ok = true;
+
+	/* Nothing is sent before the channel is ready */
+	ch.SendInput(in);
+	ok &= ch.packets.empty() && (ch.OutputPending() == 250);
+
+	ch.Open(1000, 100, false);
+	ch.Adjust(0);
+	ok &= (ch.packets.size() == 3) && (ch.packets[0] == 100) 
+	   && (ch.packets[1] == 100) && (ch.packets[2] == 50);
+	ok &= (ch.data == in) && (ch.OutputPending() == 0);
+
+	return ok;
+}
+
+bool UT__ChanQueueWindow() {
+	UT__QueueChannel ch(0);
+	string in = UT__QueueData(3 * CHAN_QUEUE_MAX);
+	bool ok = true;
+
+	ch.Open(150, 100, false);
+	ch.SendInput(in.substr(0, 400));
+	ok &= (ch.packets.size() == 2) && (ch.packets[1] == 50);
+	ok &= (ch.OutputPending() == 250) && (ch.NextPacketSize() == 0);
+
+	/* The rest waits for the window to open */
+	ch.Adjust(100);
+	ok &= (ch.packets.size() == 3) && (ch.OutputPending() == 150);
+
+	ch.Adjust(1000);
+	ok &= (ch.OutputPending() == 0) && (ch.data == in.substr(0, 400));
+
+	/* A queue refilled before it empties does not keep what
+	 * was sent, and sends it in order */
+	uint32 off = 400, held = 0;
+	while (off < in.length()) {
+		uint32 n = MIN(in.length() - off, (uint64)65536);
+
+		ch.SendInput(in.substr(off, n));
+		off += n;
+		ch.Adjust(ch.OutputPending() - 100);
+		held = MAX(held, ch.Held());
+	}
+	ok &= (ch.OutputPending() == 100) && (held < 2 * CHAN_QUEUE_MAX);
+
+	ch.Adjust(100);
+	ok &= (ch.data == in);
+
+	return ok;
+}
+
+bool UT__ChanQueueEOF() {
+	UT__QueueChannel ch(0);
+	bool ok = true;
+
+	ch.Open(100, 100, false);
+	ch.SendInput(UT__QueueData(300));
+
+	/* The EOF waits for the input queued before it */
+	ch.SendEOF();
+	ok &= !ch.eofAfter && (ch.OutputPending() == 200);
+
+	ch.Adjust(100);
+	ok &= !ch.eofAfter;
+
+	ch.Adjust(100);
+	ok &= ch.eofAfter && (ch.data.length() == 300);
+
+	return ok;
+}
+
+bool UT__ChanQueueMapped() {
+	UT__QueueChannel ch(0);
+	string in = UT__QueueData(430);
+	bool ok = true;
+
+	/* Sent in order, without packets across the block's ends,
+	 * and without copying the block into the queue */
+	ch.Open(0, 100, false);
+	ch.SendInput(in.substr(0, 150));
+	ch.SendMapped((const ubyte*)in.data() + 150, 250);
+	ch.SendInput(in.substr(400));
+	ok &= (ch.OutputPending() == 430) && (ch.Held() == 180);
+
+	ch.Adjust(1000);
+	ok &= (ch.packets.size() == 6) && (ch.packets[1] == 50) 
+	   && (ch.packets[4] == 50) && (ch.packets[5] == 30);
+	ok &= (ch.data == in) && (ch.OutputPending() == 0);
+
+	return ok;
+}
+
+/* Bytes sent by "ch" since it was last asked */
+uint32 UT__SchedSent(UT__QueueChannel &ch, uint32 &seen) {
+	uint32 n = ch.data.length() - seen;
+
+	seen = ch.data.length();
+	return n;
+}
+
+bool UT__ChanScheduler() {
+	Socket socket;
+	ChannelScheduler sched(&socket);
+	UT__QueueChannel a(0), b(1), shell(2);
+	uint32 seenA = 0, seenB = 0, seenShell = 0;
+	bool ok = true;
+
+	a.Open(RWIN_MAX, 8192, false);
+	b.Open(RWIN_MAX, 8192, false);
+	shell.Open(RWIN_MAX, 8192, true);
+	a.SetScheduler(&sched);
+	b.SetScheduler(&sched);
+	shell.SetScheduler(&sched);
+
+	/* Nothing is sent before the scheduler runs */
+	a.SendInput(UT__QueueData(8 * SCHED_QUANTUM));
+	b.SendInput(UT__QueueData(8 * SCHED_QUANTUM));
+	ok &= a.packets.empty() && b.packets.empty() && sched.HasWork();
+
+	/* Each bulk channel gets a quantum per round */
+	for (int i=0; i<3; i++) {
+		sched.Run(2 * SCHED_QUANTUM);
+		ok &= (UT__SchedSent(a, seenA) == SCHED_QUANTUM);
+		ok &= (UT__SchedSent(b, seenB) == SCHED_QUANTUM);
+	}
+
+	/* A keystroke goes before the bulk channels */
+	shell.SendInput("x");
+	sched.Run(1);
+	ok &= (UT__SchedSent(shell, seenShell) == 1);
+	ok &= (UT__SchedSent(a, seenA) == 0) && (UT__SchedSent(b, seenB) == 0);
+
+	/* A channel held back by its window leaves the rotation,
+	 * and the other gets all that is left */
+	a.Open(0, 8192, false);
+	sched.Run(2 * SCHED_QUANTUM);
+	ok &= (UT__SchedSent(a, seenA) == 0);
+	ok &= (UT__SchedSent(b, seenB) == 2 * SCHED_QUANTUM);
+
+	/* A run stops at SOCKET_UNSENT_LOWAT */
+	while (sched.Run());
+	ok &= (b.OutputPending() == 0) && !sched.HasWork();
+
+	/* Activated again once its window opens */
+	a.Adjust(RWIN_MAX);
+	ok &= sched.HasWork();
+	while (sched.Run());
+	ok &= (a.OutputPending() == 0) && (a.data.length() == 8 * SCHED_QUANTUM);
+
+	return ok;
+}
+
+void UT_Channel() {
+	UNIT_TEST(UT__ChanPrefixed, "Prefixed line output");
+	UNIT_TEST(UT__ChanTable, "Channel table");
+	UNIT_TEST(UT__ChanWindow, "Receive window tuning");
+	UNIT_TEST(UT__ChanQueueSplit, "Input split at the maximum packet size");
+	UNIT_TEST(UT__ChanQueueWindow, "Input held back by the window");
+	UNIT_TEST(UT__ChanQueueEOF, "EOF after the queued input");
+	UNIT_TEST(UT__ChanQueueMapped, "Input sent from where it is");
+	UNIT_TEST(UT__ChanScheduler, "Scheduling of several channels");
+}
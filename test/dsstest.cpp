@@ -1,11 +1,26 @@
 #include "unittest.h"
-#include "../crypt/keyexchange.h"
-#include "../prot/packet.h"
-
-#include <openssl/dsa.h>
+#include "../crypt/hostkey.h"
 
 #define __TEST_TYPE "DSS"
 
+/* Append an SSH "string" */
+void UT__AddString(vector<ubyte> &buf, const ubyte *data, uint32 len) {
+	for (int i=3; i>=0; i--) {
+		buf.push_back((len >> (8*i)) & 0xFF);
+	}
+	buf.insert(buf.end(), data, data+len);
+}
+
+/* Append a positive, big-endian number as an SSH "mpint" */
+void UT__AddMPInt(vector<ubyte> &buf, const ubyte *data, uint32 len) {
+	vector<ubyte> mp;
+	if (data[0] & 0x80) {
+		mp.push_back(0);
+	}
+	mp.insert(mp.end(), data, data+len);
+	UT__AddString(buf, &mp[0], mp.size());
+}
+
 
 bool UT__DssVerification() {
 	// len: 55
@@ -93,33 +108,29 @@ bool UT__DssVerification() {
 		0x6A, 0xB6, 0xE2, 0x2D, 0xBC, 0x05, 0xCA, 0x01, 
 	};
 
-	DSA_SIG *dsasig = DSA_SIG_new();
-	dsasig->r = BN_new();
-	dsasig->s = BN_new();
-
-	BN_bin2bn(sig, 20, dsasig->r);
-	BN_bin2bn(sig+20, 20, dsasig->s);
-
-	DSA *dsakey = DSA_new();
-	dsakey->p = BN_new();
-	dsakey->q = BN_new();
-	dsakey->g = BN_new();
-	dsakey->pub_key = BN_new();
-
-	BN_bin2bn(keyP, 128, dsakey->p);
-	BN_bin2bn(keyQ, 20, dsakey->q);
-	BN_bin2bn(keyG, 128, dsakey->g);
-	BN_bin2bn(keyY, 128, dsakey->pub_key);
+	/* K_S: string "ssh-dss", mpint p, q, g, y */
+	vector<ubyte> blob;
+	UT__AddString(blob, (const ubyte*)"ssh-dss", 7);
+	UT__AddMPInt(blob, keyP, 128);
+	UT__AddMPInt(blob, keyQ, 20);
+	UT__AddMPInt(blob, keyG, 128);
+	UT__AddMPInt(blob, keyY, 128);
 
-	ubyte newhash[20];
-	SHA1(hash, 20, newhash);
+	vector<ubyte> ks;
+	UT__AddString(ks, &blob[0], blob.size());
 
-	int res = DSA_do_verify(newhash, 20, dsasig, dsakey);
+	/* Signature: string "ssh-dss", string r||s */
+	vector<ubyte> sigfield;
+	UT__AddString(sigfield, (const ubyte*)"ssh-dss", 7);
+	UT__AddString(sigfield, sig, 40);
 
-	DSA_free(dsakey);
-	DSA_SIG_free(dsasig);
+	HostKey key;
+	if (key.SetFromRaw(&ks[0], ks.size()) != ks.size()) {
+		return false;
+	}
 
-	return res == 1;
+	/* The signed data is hashed (again) by the verification */
+	return key.Verify("ssh-dss", &sigfield[0], sigfield.size(), hash, 20);
 }
 
 void UT_DSS() {
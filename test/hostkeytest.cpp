@@ -0,0 +1,117 @@
+#define OPENSSL_API_COMPAT 0x10100000L
+
+#include "unittest.h"
+#include "../crypt/hostkey.h"
+
+#include <openssl/evp.h>
+#include <openssl/rsa.h>
+#include <openssl/bn.h>
+
+#define __TEST_TYPE "HostKey"
+
+/* The exchange hash H to sign */
+static ubyte UT__hash[20] = {
+	0x3a, 0xba, 0x2f, 0x3a, 0xa9, 0xe8, 0xd3, 0x4b,
+	0xad, 0x0f, 0x4e, 0x93, 0xe7, 0xc2, 0x00, 0x1e,
+	0x86, 0xea, 0xb9, 0x28,
+};
+
+/* Sign UT__hash with "pkey", and wrap it as an SSH signature */
+static vector<ubyte> UT__Sign(EVP_PKEY *pkey, const EVP_MD *md, string algo) {
+	vector<ubyte> field, sig(EVP_PKEY_size(pkey));
+	size_t siglen = sig.size();
+
+	EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+	EVP_DigestSignInit(ctx, NULL, md, NULL, pkey);
+	EVP_DigestSign(ctx, &sig[0], &siglen, UT__hash, 20);
+	EVP_MD_CTX_free(ctx);
+
+	UT__AddString(field, (const ubyte*)algo.c_str(), algo.length());
+	UT__AddString(field, &sig[0], siglen);
+
+	return field;
+}
+
+/* Verify a signature, and the rejection of a modified hash */
+static bool UT__Verify(vector<ubyte> &ks, string algo, vector<ubyte> &sig) {
+	HostKey key;
+	ubyte bad[20];
+
+	if (key.SetFromRaw(&ks[0], ks.size()) != ks.size()) {
+		return false;
+	}
+
+	if (!key.Verify(algo, &sig[0], sig.size(), UT__hash, 20)) {
+		return false;
+	}
+
+	memcpy(bad, UT__hash, 20);
+	bad[0] ^= 1;
+
+	return !key.Verify(algo, &sig[0], sig.size(), bad, 20);
+}
+
+bool UT__Ed25519Verification() {
+	EVP_PKEY *pkey = NULL;
+	EVP_PKEY_CTX *pctx = EVP_PKEY_CTX_new_id(EVP_PKEY_ED25519, NULL);
+	EVP_PKEY_keygen_init(pctx);
+	EVP_PKEY_keygen(pctx, &pkey);
+	EVP_PKEY_CTX_free(pctx);
+
+	ubyte pub[32];
+	size_t publen = 32;
+	EVP_PKEY_get_raw_public_key(pkey, pub, &publen);
+
+	/* K_S: string "ssh-ed25519", string key */
+	vector<ubyte> blob, ks;
+	UT__AddString(blob, (const ubyte*)"ssh-ed25519", 11);
+	UT__AddString(blob, pub, 32);
+	UT__AddString(ks, &blob[0], blob.size());
+
+	vector<ubyte> sig = UT__Sign(pkey, NULL, "ssh-ed25519");
+	EVP_PKEY_free(pkey);
+
+	return UT__Verify(ks, "ssh-ed25519", sig);
+}
+
+bool UT__RsaSha256Verification() {
+	EVP_PKEY *pkey = NULL;
+	EVP_PKEY_CTX *pctx = EVP_PKEY_CTX_new_id(EVP_PKEY_RSA, NULL);
+	EVP_PKEY_keygen_init(pctx);
+	EVP_PKEY_CTX_set_rsa_keygen_bits(pctx, 2048);
+	EVP_PKEY_keygen(pctx, &pkey);
+	EVP_PKEY_CTX_free(pctx);
+
+	const BIGNUM *n, *e;
+	RSA_get0_key(EVP_PKEY_get0_RSA(pkey), &n, &e, NULL);
+
+	vector<ubyte> nbuf(BN_num_bytes(n)), ebuf(BN_num_bytes(e));
+	BN_bn2bin(n, &nbuf[0]);
+	BN_bn2bin(e, &ebuf[0]);
+
+	/* K_S: string "ssh-rsa", mpint e, mpint n */
+	vector<ubyte> blob, ks;
+	UT__AddString(blob, (const ubyte*)"ssh-rsa", 7);
+	UT__AddMPInt(blob, &ebuf[0], ebuf.size());
+	UT__AddMPInt(blob, &nbuf[0], nbuf.size());
+	UT__AddString(ks, &blob[0], blob.size());
+
+	vector<ubyte> sig = UT__Sign(pkey, EVP_sha256(), "rsa-sha2-256");
+
+	/* A SHA-1 "ssh-rsa" signature must not be accepted */
+	vector<ubyte> sha1sig = UT__Sign(pkey, EVP_sha1(), "ssh-rsa");
+	EVP_PKEY_free(pkey);
+
+	HostKey key;
+	key.SetFromRaw(&ks[0], ks.size());
+	if (key.Verify("rsa-sha2-256", &sha1sig[0], sha1sig.size(), UT__hash, 20)) {
+		return false;
+	}
+
+	return UT__Verify(ks, "rsa-sha2-256", sig);
+}
+
+void UT_HostKey() {
+	UNIT_TEST(UT__Ed25519Verification, "Verification of Ed25519 signature");
+	UNIT_TEST(UT__RsaSha256Verification, "Verification of rsa-sha2-256 signature");
+}
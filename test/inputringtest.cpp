@@ -0,0 +1,158 @@
+#include "unittest.h"
+#include "../prot/inputring.h"
+#include "../prot/coalescer.h"
+
+#include <pthread.h>
+#include <poll.h>
+
+#define __TEST_TYPE "InputRing"
+
+/* Bytes written by the producer thread */
+#define UT__RING_TOTAL 		(16 * INPUT_RING_SIZE + 12345)
+
+bool UT__RingBasic() {
+	InputRing ring;
+	ubyte buf[64];
+	bool ok = true;
+
+	if (!ring.Init()) {
+		return false;
+	}
+
+	/* Writing wakes the consumer */
+	ok &= (ring.Write((const ubyte*)"hello", 5) == 5);
+	pollfd pfd = { ring.GetWakeFd(), POLLIN, 0 };
+	ok &= (poll(&pfd, 1, 0) == 1);
+
+	ring.ClearWake();
+	ok &= (poll(&pfd, 1, 0) == 0);
+
+	ok &= (ring.Size() == 5) && !ring.AtEOF();
+	ok &= (ring.Read(buf, sizeof(buf)) == 5) && !memcmp(buf, "hello", 5);
+	ok &= (ring.Read(buf, sizeof(buf)) == 0);
+
+	/* EOF is only reached once the ring is empty */
+	ring.Write((const ubyte*)"x", 1);
+	ring.SetEOF();
+	ok &= !ring.AtEOF();
+	ok &= (ring.Read(buf, sizeof(buf)) == 1) && ring.AtEOF();
+
+	return ok;
+}
+
+bool UT__RingFull() {
+	InputRing ring;
+	vector<ubyte> data(INPUT_RING_SIZE, 'a');
+	ubyte buf[100];
+	bool ok = true;
+
+	if (!ring.Init()) {
+		return false;
+	}
+
+	/* Nothing is added to a full ring */
+	ok &= (ring.Write(&data[0], 100) == 100);
+	ok &= (ring.Write(&data[0], INPUT_RING_SIZE) == INPUT_RING_SIZE - 100);
+	ok &= (ring.Free() == 0) && (ring.Write(&data[0], 1) == 0);
+
+	/* Writes wrap around the end */
+	ok &= (ring.Read(buf, 100) == 100);
+	ok &= (ring.Write((const ubyte*)"0123456789", 10) == 10);
+	ok &= (ring.Read(&data[0], INPUT_RING_SIZE - 100) == INPUT_RING_SIZE - 100);
+	ok &= (ring.Read(buf, sizeof(buf)) == 10) && !memcmp(buf, "0123456789", 10);
+
+	return ok;
+}
+
+void* UT__RingProducer(void *arg) {
+	InputRing *ring = (InputRing*)arg;
+	ubyte buf[4099];
+	uint32 sent = 0;
+
+	while (sent < UT__RING_TOTAL) {
+		uint32 n = MIN(sizeof(buf), UT__RING_TOTAL - sent);
+		for (uint32 i=0; i<n; i++) {
+			buf[i] = (sent + i) % 251;
+		}
+
+		uint32 done = 0;
+		while (done < n) {
+			done += ring->Write(buf+done, n-done);
+		}
+		sent += n;
+	}
+
+	ring->SetEOF();
+	return NULL;
+}
+
+bool UT__RingThreads() {
+	InputRing ring;
+	pthread_t thread;
+	ubyte buf[7919];
+	uint32 got = 0;
+
+	if (!ring.Init()) {
+		return false;
+	}
+
+	if (pthread_create(&thread, NULL, &UT__RingProducer, &ring)) {
+		return false;
+	}
+
+	while (!ring.AtEOF()) {
+		pollfd pfd = { ring.GetWakeFd(), POLLIN, 0 };
+		poll(&pfd, 1, 10);
+		ring.ClearWake();
+
+		uint32 n;
+		while ((n = ring.Read(buf, sizeof(buf)))) {
+			for (uint32 i=0; i<n; i++) {
+				if (buf[i] != (got + i) % 251) {
+					pthread_join(thread, NULL);
+					return false;
+				}
+			}
+			got += n;
+		}
+	}
+
+	pthread_join(thread, NULL);
+	return got == UT__RING_TOTAL;
+}
+
+bool UT__Coalesce() {
+	InputCoalescer c;
+	bool ok = true;
+
+	/* Keystrokes after idle input go out at once */
+	ok &= (c.Take(1, 32768, 1000000) == 1);
+	ok &= (c.Take(0, 32768, 1000100) == 0) && (c.Timeout(1000100) == -1);
+	ok &= (c.Take(3, 32768, 1050000) == 3);
+
+	/* A paste is held until it fills a packet */
+	ok &= (c.Take(4000, 32768, 2000000) == 0);
+	ok &= (c.Timeout(2000000) == 3);
+	ok &= (c.Take(20000, 32768, 2001000) == 0);
+	ok &= (c.Take(40000, 32768, 2002000) == 32768);
+
+	/* or until the hold expires */
+	ok &= (c.Take(7232, 32768, 2004000) == 0);
+	ok &= (c.Take(7232, 32768, 2005000) == 7232);
+
+	/* Input right behind a burst is held as well */
+	ok &= (c.Take(1, 32768, 2006000) == 0);
+	ok &= (c.Take(1, 32768, 2009000) == 1);
+
+	/* Everything goes at the end of the input */
+	ok &= (c.Take(10, 32768, 3000000, true) == 10);
+
+	return ok;
+}
+
+void UT_InputRing() {
+	UNIT_TEST(UT__RingBasic, "Read, write and EOF");
+	UNIT_TEST(UT__RingFull, "Full ring and wrapping");
+	UNIT_TEST(UT__RingThreads, "Producer thread");
+	UNIT_TEST(UT__Coalesce, "Keystroke and paste coalescing");
+}
@@ -0,0 +1,49 @@
+#include "unittest.h"
+#include "../crypt/dhgroup.h"
+
+#define __TEST_TYPE "DH"
+
+bool UT__FixedBasePowG(DHType type) {
+	DHGroup *group = DHGroup::Get(type);
+	gmp_randclass ran(gmp_randinit_default);
+	mpz_class x, fixed, plain;
+
+	ran.seed(1337);
+
+	for (int i=0; i<16; i++) {
+		group->RandomExponent(x, ran);
+
+		if (mpz_sizeinbase(x.get_mpz_t(), 2) > group->expBits) {
+			return false;
+		}
+
+		group->PowG(fixed, x);
+		mpz_powm(plain.get_mpz_t(), group->g.get_mpz_t(),
+				 x.get_mpz_t(), group->p.get_mpz_t());
+
+		if (fixed != plain) {
+			return false;
+		}
+	}
+
+	/* Exponents outside the table must still be correct */
+	x = group->q - 1;
+	group->PowG(fixed, x);
+	mpz_powm(plain.get_mpz_t(), group->g.get_mpz_t(),
+			 x.get_mpz_t(), group->p.get_mpz_t());
+
+	return fixed == plain;
+}
+
+bool UT__FixedBaseGroup1() {
+	return UT__FixedBasePowG(DH_GROUP1);
+}
+
+bool UT__FixedBaseGroup14() {
+	return UT__FixedBasePowG(DH_GROUP14);
+}
+
+void UT_DH() {
+	UNIT_TEST(UT__FixedBaseGroup1, "Fixed-base g^x, group 1");
+	UNIT_TEST(UT__FixedBaseGroup14, "Fixed-base g^x, group 14");
+}
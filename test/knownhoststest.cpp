@@ -0,0 +1,126 @@
+#include "unittest.h"
+#include "../crypt/knownhosts.h"
+
+#define __TEST_TYPE "KnownHosts"
+
+/* A fake key blob: string "type" followed by "data" */
+static vector<ubyte> UT__MakeBlob(string data, string type="ssh-dss") {
+	vector<ubyte> blob;
+
+	for (int i=3; i>=0; i--) {
+		blob.push_back((type.length() >> (8*i)) & 0xFF);
+	}
+	blob.insert(blob.end(), type.begin(), type.end());
+	blob.insert(blob.end(), data.begin(), data.end());
+
+	return blob;
+}
+
+static string UT__TempPath() {
+	stringstream ss;
+	ss <<"/tmp/sshay_known_hosts." <<getpid();
+	return ss.str();
+}
+
+static void UT__RemoveTemp(string path) {
+	unlink(path.c_str());
+	unlink((path + ".idx").c_str());
+}
+
+bool UT__KnownHostsLookup() {
+	string path = UT__TempPath();
+	vector<ubyte> key1 = UT__MakeBlob("first key");
+	vector<ubyte> key2 = UT__MakeBlob("second key");
+	KnownHosts kh;
+	bool ok = true;
+
+	UT__RemoveTemp(path);
+
+	/* A missing file knows nothing */
+	ok &= kh.Open(path);
+	ok &= kh.Check("example.com", 22, &key1[0], key1.size()) == KH_UNKNOWN;
+
+	ok &= kh.Add("example.com", 22, &key1[0], key1.size());
+	ok &= kh.Add("example.com", 2222, &key2[0], key2.size());
+
+	/* Added entries are visible through the updated index */
+	ok &= kh.Check("example.com", 22, &key1[0], key1.size()) == KH_OK;
+	ok &= kh.Check("EXAMPLE.com", 22, &key1[0], key1.size()) == KH_OK;
+	ok &= kh.Check("example.com", 22, &key2[0], key2.size()) == KH_CHANGED;
+	ok &= kh.Check("example.com", 2222, &key2[0], key2.size()) == KH_OK;
+	ok &= kh.Check("example.org", 22, &key1[0], key1.size()) == KH_UNKNOWN;
+
+	/* ... and through the index file after reopening */
+	kh.Close();
+	ok &= kh.Open(path);
+	ok &= kh.Check("example.com", 22, &key1[0], key1.size()) == KH_OK;
+	ok &= kh.Check("example.com", 2222, &key1[0], key1.size()) == KH_CHANGED;
+
+	UT__RemoveTemp(path);
+	return ok;
+}
+
+bool UT__KnownHostsStaleIndex() {
+	string path = UT__TempPath();
+	vector<ubyte> key = UT__MakeBlob("some key");
+	KnownHosts kh;
+	bool ok = true;
+
+	UT__RemoveTemp(path);
+
+	ok &= kh.Open(path);
+	ok &= kh.Add("a.example.com", 22, &key[0], key.size());
+	kh.Close();
+
+	/* Edit the file behind the index's back */
+	FILE *file = fopen(path.c_str(), "a");
+	if (!file) {
+		return false;
+	}
+	fprintf(file, "# comment\n[b.example.com]:22,c.example.com ssh-dss AAAA\n");
+	fclose(file);
+
+	ok &= kh.Open(path);
+	ok &= kh.Check("a.example.com", 22, &key[0], key.size()) == KH_OK;
+	ok &= kh.Check("b.example.com", 22, &key[0], key.size()) == KH_CHANGED;
+	ok &= kh.Check("c.example.com", 22, &key[0], key.size()) == KH_CHANGED;
+
+	UT__RemoveTemp(path);
+	return ok;
+}
+
+bool UT__KnownHostsOtherType() {
+	string path = UT__TempPath();
+	vector<ubyte> dss = UT__MakeBlob("dss key");
+	vector<ubyte> ed = UT__MakeBlob("ed25519 key", "ssh-ed25519");
+	KnownHosts kh;
+	bool ok = true;
+
+	UT__RemoveTemp(path);
+
+	ok &= kh.Open(path);
+	ok &= kh.Add("example.com", 22, &dss[0], dss.size());
+
+	/* A key of a type not seen from the host is not trusted */
+	ok &= kh.Check("example.com", 22, &ed[0], ed.size()) == KH_OTHER_TYPE;
+	ok &= kh.Check("example.org", 22, &ed[0], ed.size()) == KH_UNKNOWN;
+
+	vector<string> types = kh.KeyTypes("example.com", 22);
+	ok &= (types.size() == 1) && (types[0] == "ssh-dss");
+	ok &= kh.KeyTypes("example.org", 22).empty();
+
+	/* Once both are known, either is fine */
+	ok &= kh.Add("example.com", 22, &ed[0], ed.size());
+	ok &= kh.Check("example.com", 22, &ed[0], ed.size()) == KH_OK;
+	ok &= kh.Check("example.com", 22, &dss[0], dss.size()) == KH_OK;
+	ok &= (kh.KeyTypes("example.com", 22).size() == 2);
+
+	UT__RemoveTemp(path);
+	return ok;
+}
+
+void UT_KnownHosts() {
+	UNIT_TEST(UT__KnownHostsLookup, "Lookup and add");
+	UNIT_TEST(UT__KnownHostsStaleIndex, "Rebuilding a stale index");
+	UNIT_TEST(UT__KnownHostsOtherType, "Keys of other types");
+}
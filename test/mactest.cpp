@@ -27,6 +27,29 @@ bool UT__MacString() {
 	return true;
 }
 
+bool UT__MacClone() {
+	/* Hashing mid-way and cloning must not disturb the state */
+	MacSHA1 full, prefix;
+	ubyte expected[20];
+
+	full.Add("eplefjes og tur i skog");
+	memcpy(expected, full.GetHash(), 20);
+
+	prefix.Add("eplefjes og ");
+	prefix.GetHash();
+
+	MacSHA1 clone(prefix);
+	clone.Add("tur i skog");
+	prefix.Add("tur i mark");
+
+	if (memcmp(clone.GetHash(), expected, 20)) {
+		return false;
+	}
+
+	return memcmp(prefix.GetHash(), expected, 20) != 0;
+}
+
 void UT_Mac() {
 	UNIT_TEST(UT__MacString, "SHA-1 from string");
+	UNIT_TEST(UT__MacClone, "SHA-1 state cloning");
 }
\ No newline at end of file
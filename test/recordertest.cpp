@@ -0,0 +1,92 @@
+#include "unittest.h"
+#include "../prot/recorder.h"
+
+#include <fstream>
+
+#define __TEST_TYPE "Recorder"
+
+bool UT__RecEscape() {
+	string out, carry;
+	const char *ctl = "a\"b\\c\r\n\x1b[0m\t";
+	bool ok = true;
+
+	SessionRecorder::AppendJSON(out, carry, (const ubyte*)ctl, strlen(ctl));
+	ok &= (out == "a\\\"b\\\\c\\r\\n\\u001b[0m\\t") && carry.empty();
+
+	/* Valid UTF-8 is kept, invalid bytes are replaced */
+	out.clear();
+	SessionRecorder::AppendJSON(out, carry, (const ubyte*)"\xc3\xa5\xff", 3);
+	ok &= (out == "\xc3\xa5\xef\xbf\xbd") && carry.empty();
+
+	/* A broken sequence is replaced up to the bad byte */
+	out.clear();
+	SessionRecorder::AppendJSON(out, carry, (const ubyte*)"\xe2\x82x", 3);
+	ok &= (out == "\xef\xbf\xbd\xef\xbf\xbdx");
+
+	return ok;
+}
+
+bool UT__RecSplit() {
+	string out, carry;
+	const char *euro = "\xe2\x82\xac";
+	bool ok = true;
+
+	/* A sequence split over two payloads is joined */
+	SessionRecorder::AppendJSON(out, carry, (const ubyte*)"x\xe2\x82", 3);
+	ok &= (out == "x") && (carry == "\xe2\x82");
+
+	SessionRecorder::AppendJSON(out, carry, (const ubyte*)"\xac!", 2);
+	ok &= (out == string("x") + euro + "!") && carry.empty();
+
+	return ok;
+}
+
+bool UT__RecFile() {
+	SessionRecorder rec;
+	const char *path = "/tmp/sshay-ut-recording.cast";
+	vector<string> lines;
+	string line;
+	bool ok = true;
+
+	if (!rec.Open(path, 80, 24, "echo \"hi\"")) {
+		return false;
+	}
+
+	/* Enough to wake the writer before "Close" */
+	string big(REC_WAKE_SIZE, 'z');
+
+	/* The input is only recorded when asked for */
+	rec.Input((const ubyte*)"pw\r", 3);
+	rec.SetInput(true);
+	rec.Input((const ubyte*)"ls\r", 3);
+	rec.Output((const ubyte*)"ls\r\n", 4);
+	rec.Output((const ubyte*)big.c_str(), big.length());
+	rec.Close();
+
+	std::ifstream in(path);
+	while (std::getline(in, line)) {
+		lines.push_back(line);
+	}
+	unlink(path);
+
+	ok &= (lines.size() == 4);
+	if (!ok) {
+		return false;
+	}
+
+	ok &= (lines[0].find("{\"version\": 2, \"width\": 80, \"height\": 24") == 0);
+	ok &= (lines[0].find("\"command\": \"echo \\\"hi\\\"\"") != string::npos);
+
+	ok &= (lines[1].find("[0.") == 0);
+	ok &= (lines[1].find(", \"i\", \"ls\\r\"]") != string::npos);
+	ok &= (lines[2].find(", \"o\", \"ls\\r\\n\"]") != string::npos);
+	ok &= (lines[3].length() > big.length());
+
+	return ok;
+}
+
+void UT_Recorder() {
+	UNIT_TEST(UT__RecEscape, "JSON escaping of output");
+	UNIT_TEST(UT__RecSplit, "UTF-8 split between payloads");
+	UNIT_TEST(UT__RecFile, "asciicast events");
+}
@@ -0,0 +1,101 @@
+#include "unittest.h"
+#include "../prot/scp.h"
+#include "../prot/channel.h"
+
+#include <fstream>
+#include <sys/stat.h>
+
+#define __TEST_TYPE "SCP"
+
+void UT__ScpFeed(ScpClient &c, string data) {
+	c.OnData((const ubyte*)data.c_str(), data.length());
+}
+
+bool UT__ScpGet() {
+	const char *path = "/tmp/sshay-ut-scp.bin";
+	Channel ch(CH_CLI, 0, "session", NULL);
+	ScpClient c;
+	struct stat st;
+	bool ok = true;
+
+	c.Get("remote", path);
+	c.Start(&ch);
+
+	/* The file is allocated in full once announced */
+	UT__ScpFeed(c, "C0640 11 remote\nhello");
+	ok &= !stat(path, &st) && (st.st_size == 11);
+	ok &= ((st.st_mode & 0777) == 0640);
+	ok &= !c.IsDone() && (c.GetTransferred() == 5);
+
+	UT__ScpFeed(c, string(" world\0", 7));
+	ok &= c.IsDone() && !c.HasFailed();
+
+	std::ifstream in(path);
+	stringstream got;
+	got <<in.rdbuf();
+	unlink(path);
+
+	ok &= (got.str() == "hello world");
+
+	return ok;
+}
+
+bool UT__ScpPut() {
+	const char *path = "/tmp/sshay-ut-scp.bin";
+	Channel ch(CH_CLI, 0, "session", NULL);
+	ScpClient c;
+	string data(100000, 'x');
+	string zero(1, '\0');
+	bool ok = true;
+
+	std::ofstream out(path);
+	out <<data;
+	out.close();
+	chmod(path, 0644);
+
+	c.Put(path, "remote");
+	ok &= c.Start(&ch) && (ch.OutputPending() == 0);
+
+	/* The header follows the first zero, the data and its 
+	 * zero the second */
+	UT__ScpFeed(c, zero);
+	uint32 header = ch.OutputPending();
+	ok &= (header == strlen("C0644 100000 sshay-ut-scp.bin\n"));
+
+	UT__ScpFeed(c, zero);
+	ok &= (ch.OutputPending() == header + data.length() + 1);
+	ok &= (c.GetTransferred() == data.length()) && !c.IsDone();
+
+	UT__ScpFeed(c, zero);
+	ok &= c.IsDone() && !c.HasFailed();
+
+	unlink(path);
+	return ok;
+}
+
+bool UT__ScpError() {
+	Channel ch(CH_CLI, 0, "session", NULL);
+	ScpClient c;
+	bool ok = true;
+
+	ok &= (ScpClient::QuotePath("a b") == "'a b'");
+	ok &= (ScpClient::QuotePath("it's") == "'it'\\''s'");
+
+	c.Get("missing", "/tmp/sshay-ut-scp.bin");
+	c.Start(&ch);
+
+	/* Nothing is done until the line is complete */
+	UT__ScpFeed(c, "\x01scp: missing: No such");
+	ok &= !c.IsDone();
+
+	UT__ScpFeed(c, " file or directory\n");
+	ok &= c.HasFailed();
+
+	return ok;
+}
+
+void UT_Scp() {
+	UNIT_TEST(UT__ScpGet, "Download into an allocated file");
+	UNIT_TEST(UT__ScpPut, "Upload");
+	UNIT_TEST(UT__ScpError, "Errors and quoting");
+}
@@ -0,0 +1,287 @@
+#include "unittest.h"
+#include "../prot/sftp.h"
+#include "../prot/channel.h"
+
+#include <fstream>
+#include <fcntl.h>
+
+#define __TEST_TYPE "SFTP"
+
+/* Size of the downloaded file */
+#define UT__SFTP_SIZE 		100000
+
+/* A reply of "type" to request "id", followed by "body" */
+string UT__SftpReply(ubyte type, uint32 id, string body) {
+	string p;
+	uint32 len = 5 + body.length();
+
+	for (int i=24; i>=0; i-=8) {
+		p += (char)(len >> i);
+	}
+	p += (char)type;
+	for (int i=24; i>=0; i-=8) {
+		p += (char)(id >> i);
+	}
+
+	return p + body;
+}
+
+/* An SFTP uint32 followed by "s" */
+string UT__SftpString(string s) {
+	string p;
+
+	for (int i=24; i>=0; i-=8) {
+		p += (char)(s.length() >> i);
+	}
+
+	return p + s;
+}
+
+void UT__SftpFeed(SftpClient &c, string data) {
+	c.OnData((const ubyte*)data.c_str(), data.length());
+}
+
+bool UT__SftpGet() {
+	const char *path = "/tmp/sshay-ut-sftp.bin";
+	Channel ch(CH_CLI, 0, "session", NULL);
+	SftpClient c;
+	string file, version, attrs;
+	bool ok = true;
+
+	for (uint32 i=0; i<UT__SFTP_SIZE; i++) {
+		file += (char)(i * 7);
+	}
+
+	c.Get("remote", path);
+	c.SetDepth(4);
+	c.Start(&ch);
+
+	/* VERSION carries the version where the id would be. STAT
+	 * is request 1, OPEN 2. The reads of 0, 32768, 65536 and
+	 * 98304 are 3 to 6. */
+	version = UT__SftpReply(SSH_FXP_VERSION, SFTP_VERSION, "");
+
+	attrs = string("\0\0\0\x01\0\0\0\0\0\x01\x86\xa0", 12);
+
+	UT__SftpFeed(c, version);
+	UT__SftpFeed(c, UT__SftpReply(SSH_FXP_ATTRS, 1, attrs));
+	UT__SftpFeed(c, UT__SftpReply(SSH_FXP_HANDLE, 2, UT__SftpString("h")));
+
+	/* Replies arrive out of order. The short read of the 
+	 * first chunk is asked for again as request 7. */
+	UT__SftpFeed(c, UT__SftpReply(SSH_FXP_DATA, 5, 
+				 UT__SftpString(file.substr(65536, 32768))));
+	UT__SftpFeed(c, UT__SftpReply(SSH_FXP_DATA, 3, 
+				 UT__SftpString(file.substr(0, 1000))));
+	UT__SftpFeed(c, UT__SftpReply(SSH_FXP_DATA, 6, 
+				 UT__SftpString(file.substr(98304))));
+	ok &= !c.IsDone();
+
+	/* The rest in a single call */
+	UT__SftpFeed(c, UT__SftpReply(SSH_FXP_DATA, 7, 
+				 UT__SftpString(file.substr(1000, 31768))) 
+				 + UT__SftpReply(SSH_FXP_DATA, 4, 
+				 UT__SftpString(file.substr(32768, 32768))));
+	ok &= !c.IsDone() && (c.GetTransferred() == UT__SFTP_SIZE);
+
+	/* Closing the handle, request 8, ends the transfer */
+	UT__SftpFeed(c, UT__SftpReply(SSH_FXP_STATUS, 8, string(4, '\0')));
+	ok &= c.IsDone() && !c.HasFailed();
+
+	std::ifstream in(path, std::ios::binary);
+	stringstream got;
+	got <<in.rdbuf();
+	unlink(path);
+
+	ok &= (got.str() == file);
+
+	return ok;
+}
+
+bool UT__SftpFail() {
+	Channel ch(CH_CLI, 0, "session", NULL);
+	SftpClient c;
+	string version;
+
+	c.Get("missing", "/tmp/sshay-ut-sftp.bin");
+	c.Start(&ch);
+
+	version = UT__SftpReply(SSH_FXP_VERSION, SFTP_VERSION, "");
+	UT__SftpFeed(c, version);
+
+	/* The STAT failing is no error, the OPEN is */
+	UT__SftpFeed(c, UT__SftpReply(SSH_FXP_STATUS, 1, string("\0\0\0\x02", 4)));
+	if (c.IsDone()) {
+		return false;
+	}
+
+	UT__SftpFeed(c, UT__SftpReply(SSH_FXP_STATUS, 2, string("\0\0\0\x02", 4)));
+
+	return c.HasFailed();
+}
+
+/* Reply to INIT, STAT and OPEN. The file is "size" bytes. */
+void UT__SftpOpen(SftpClient &c, uint64 size) {
+	string attrs = string("\0\0\0\x01", 4);
+
+	for (int i=56; i>=0; i-=8) {
+		attrs += (char)(size >> i);
+	}
+
+	UT__SftpFeed(c, UT__SftpReply(SSH_FXP_VERSION, SFTP_VERSION, ""));
+	UT__SftpFeed(c, UT__SftpReply(SSH_FXP_ATTRS, 1, attrs));
+	UT__SftpFeed(c, UT__SftpReply(SSH_FXP_HANDLE, 2, UT__SftpString("h")));
+}
+
+bool UT__SftpStripes() {
+	const char *path = "/tmp/sshay-ut-sftp.bin";
+	Channel cha(CH_CLI, 0, "session", NULL);
+	Channel chb(CH_CLI, 1, "session", NULL);
+	SftpStripes stripes;
+	SftpClient a, b;
+	char buf[10];
+	bool ok = true;
+
+	close(open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644));
+
+	a.Get("remote", path);
+	a.SetStripes(&stripes, 0);
+	a.SetDepth(1);
+	a.Start(&cha);
+
+	b.Get("remote", path);
+	b.SetStripes(&stripes, 1);
+	b.SetDepth(1);
+	b.Start(&chb);
+
+	/* The first block goes to "a", the rest of the file, 
+	 * 10 bytes, to "b" */
+	UT__SftpOpen(a, SFTP_BLOCK + 10);
+	UT__SftpOpen(b, SFTP_BLOCK + 10);
+
+	/* "b" waits while "a" might yet give its block back */
+	UT__SftpFeed(b, UT__SftpReply(SSH_FXP_DATA, 3, 
+				 UT__SftpString(string(10, 'b'))));
+	ok &= !b.IsDone() && (b.Timeout() == SFTP_WAIT_MS);
+
+	UT__SftpFeed(a, UT__SftpReply(SSH_FXP_DATA, 3, 
+				 UT__SftpString(string(10, 'a'))));
+
+	/* Both close once "a" has copied its block, the rest of 
+	 * the short read being request 4 */
+	UT__SftpFeed(a, UT__SftpReply(SSH_FXP_DATA, 4, 
+				 UT__SftpString(string(SFTP_CHUNK - 10, 'a'))));
+	for (uint32 i=1; i<SFTP_BLOCK / SFTP_CHUNK; i++) {
+		UT__SftpFeed(a, UT__SftpReply(SSH_FXP_DATA, 4 + i, 
+					 UT__SftpString(string(SFTP_CHUNK, 'a'))));
+	}
+
+	UT__SftpFeed(b, "");
+	UT__SftpFeed(a, UT__SftpReply(SSH_FXP_STATUS, 4 + SFTP_BLOCK / SFTP_CHUNK, 
+				 string(4, '\0')));
+	UT__SftpFeed(b, UT__SftpReply(SSH_FXP_STATUS, 4, string(4, '\0')));
+	ok &= a.IsDone() && !a.HasFailed() && b.IsDone() && !b.HasFailed();
+
+	int fd = open(path, O_RDONLY);
+	ok &= (pread(fd, buf, 10, 0) == 10) && !memcmp(buf, "aaaaaaaaaa", 10);
+	ok &= (pread(fd, buf, 10, SFTP_BLOCK) == 10) && !memcmp(buf, "bbbbbbbbbb", 10);
+	close(fd);
+	unlink(path);
+
+	return ok;
+}
+
+bool UT__SftpStripesLost() {
+	const char *path = "/tmp/sshay-ut-sftp.bin";
+	Channel cha(CH_CLI, 0, "session", NULL);
+	Channel chb(CH_CLI, 1, "session", NULL);
+	SftpStripes stripes;
+	SftpClient a, b;
+	char buf[10];
+	bool ok = true;
+
+	close(open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644));
+
+	a.Get("remote", path);
+	a.SetStripes(&stripes, 0);
+	a.SetDepth(1);
+	a.Start(&cha);
+
+	b.Get("remote", path);
+	b.SetStripes(&stripes, 1);
+	b.SetDepth(1);
+	b.Start(&chb);
+
+	UT__SftpOpen(a, SFTP_BLOCK + 10);
+	UT__SftpOpen(b, SFTP_BLOCK + 10);
+
+	/* "a" is lost holding the first block, which "b" copies 
+	 * after its own as requests 4 and on */
+	a.Abandon();
+	ok &= a.HasFailed() && !stripes.failed;
+
+	UT__SftpFeed(b, UT__SftpReply(SSH_FXP_DATA, 3, 
+				 UT__SftpString(string(10, 'b'))));
+	for (uint32 i=0; i<SFTP_BLOCK / SFTP_CHUNK; i++) {
+		ok &= !b.IsDone();
+		UT__SftpFeed(b, UT__SftpReply(SSH_FXP_DATA, 4 + i, 
+					 UT__SftpString(string(SFTP_CHUNK, 'c'))));
+	}
+
+	UT__SftpFeed(b, UT__SftpReply(SSH_FXP_STATUS, 4 + SFTP_BLOCK / SFTP_CHUNK, 
+				 string(4, '\0')));
+	ok &= b.IsDone() && !b.HasFailed() && stripes.lost.empty();
+
+	int fd = open(path, O_RDONLY);
+	ok &= (pread(fd, buf, 10, 0) == 10) && !memcmp(buf, "cccccccccc", 10);
+	ok &= (pread(fd, buf, 10, SFTP_BLOCK - 10) == 10) 
+		&& !memcmp(buf, "cccccccccc", 10);
+	ok &= (pread(fd, buf, 10, SFTP_BLOCK) == 10) && !memcmp(buf, "bbbbbbbbbb", 10);
+	close(fd);
+	unlink(path);
+
+	return ok;
+}
+
+bool UT__SftpStripedPut() {
+	const char *path = "/tmp/sshay-ut-sftp.bin";
+	Channel ch(CH_CLI, 0, "session", NULL);
+	SftpStripes stripes;
+	SftpClient c;
+	bool ok = true;
+
+	std::ofstream out(path);
+	out <<string(1000, 'x');
+	out.close();
+
+	c.Put(path, "remote");
+	c.SetStripes(&stripes, 1);
+	c.Start(&ch);
+
+	UT__SftpFeed(c, UT__SftpReply(SSH_FXP_VERSION, SFTP_VERSION, ""));
+	UT__SftpFeed(c, UT__SftpReply(SSH_FXP_HANDLE, 1, UT__SftpString("h")));
+
+	/* Nothing is written before the first client truncates */
+	uint32 queued = ch.OutputPending();
+	ok &= (c.Timeout() == SFTP_WAIT_MS);
+
+	stripes.truncated = true;
+	UT__SftpFeed(c, "");
+	ok &= (ch.OutputPending() > queued + 1000) && (c.Timeout() < 0);
+
+	/* A failure of another client stops this one */
+	stripes.failed = true;
+	UT__SftpFeed(c, "");
+	ok &= c.HasFailed();
+
+	unlink(path);
+	return ok;
+}
+
+void UT_Sftp() {
+	UNIT_TEST(UT__SftpGet, "Pipelined reads, out of order");
+	UNIT_TEST(UT__SftpFail, "Failed open");
+	UNIT_TEST(UT__SftpStripes, "Blocks shared between connections");
+	UNIT_TEST(UT__SftpStripesLost, "Blocks of a lost connection");
+	UNIT_TEST(UT__SftpStripedPut, "Striped upload");
+}
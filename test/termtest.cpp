@@ -0,0 +1,236 @@
+#include "unittest.h"
+#include "../prot/termwriter.h"
+#include "../prot/localecho.h"
+
+#include <fcntl.h>
+
+#define __TEST_TYPE "Term"
+
+/* Write "in" through a TermWriter, and return what came out */
+string UT__TermThrough(const string &in) {
+	int fds[2];
+	char buf[1024];
+	string out;
+
+	if (pipe(fds) < 0) {
+		return "";
+	}
+
+	TermWriter term(fds[1]);
+	term.Write((const ubyte*)in.c_str(), in.length());
+	close(fds[1]);
+
+	int n;
+	while ((n = read(fds[0], buf, sizeof(buf))) > 0) {
+		out.append(buf, n);
+	}
+
+	close(fds[0]);
+	return out;
+}
+
+bool UT__TermPassthrough() {
+	string in;
+
+	for (int i=0; i<256; i++) {
+		if (i != 13) {
+			in += (char)i;
+		}
+	}
+
+	return UT__TermThrough(in) == in;
+}
+
+bool UT__TermTranslate() {
+	/* Carriage returns on both sides of 16 byte blocks */
+	string in = "\rabcdefghijklmn\r\ropqrstuvwxyz0123456789\r\nend\r";
+	string out = in;
+
+	for (uint32 i=0; i<out.length(); i++) {
+		if (out[i] == '\r') {
+			out[i] = '\b';
+		}
+	}
+
+	if (UT__TermThrough(in) != out) {
+		return false;
+	}
+
+	for (uint32 i=0; i<in.length(); i++) {
+		uint32 exp = in.find('\r', i);
+		if (exp == string::npos) {
+			exp = in.length();
+		}
+
+		const ubyte *p = (const ubyte*)in.c_str() + i;
+		if (TermWriter::FindSpecial(p, in.length()-i) != exp - i) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/* Read what was written to the pipe "fd" so far */
+string UT__TermRead(int fd) {
+	char buf[1024];
+	int n = read(fd, buf, sizeof(buf));
+
+	return (n > 0) ? string(buf, n) : string();
+}
+
+bool UT__TermPredict() {
+	int fds[2];
+	bool ok = true;
+
+	if (pipe(fds) < 0) {
+		return false;
+	}
+	fcntl(fds[0], F_SETFL, O_NONBLOCK);
+
+	TermWriter term(fds[1]);
+	LocalEcho echo(&term, PM_ALWAYS);
+
+	/* Typed characters are drawn underlined */
+	echo.OnInput((const ubyte*)"ab", 2, 0);
+	ok &= (UT__TermRead(fds[0]) == "\e[4mab\e[24m");
+
+	/* The echo of the first is written over it, and the second
+	 * is drawn again behind it */
+	echo.OnOutput((const ubyte*)"a", 1, 600000);
+	ok &= (UT__TermRead(fds[0]) == "\e[2Da\e[4mb\e[24m");
+	ok &= (echo.GetSRTT() == 600000);
+
+	echo.OnOutput((const ubyte*)"b", 1, 600000);
+	ok &= (UT__TermRead(fds[0]) == "\e[1Db");
+
+	/* Other output erases a wrong prediction */
+	echo.OnInput((const ubyte*)"x", 1, 1000000);
+	ok &= (UT__TermRead(fds[0]) == "\e[4mx\e[24m");
+	echo.OnOutput((const ubyte*)"y", 1, 1500000);
+	ok &= (UT__TermRead(fds[0]) == "\e[1D\e[Ky");
+
+	/* After which nothing is drawn, until a prediction is right */
+	echo.OnInput((const ubyte*)"c", 1, 2000000);
+	ok &= (UT__TermRead(fds[0]) == "");
+	echo.OnOutput((const ubyte*)"c", 1, 2600000);
+	ok &= (UT__TermRead(fds[0]) == "c");
+
+	/* Nothing is predicted behind return, until its echo */
+	echo.OnInput((const ubyte*)"\rd", 2, 3000000);
+	ok &= (UT__TermRead(fds[0]) == "");
+	echo.OnOutput((const ubyte*)"\r\n$ ", 4, 3600000);
+	UT__TermRead(fds[0]);
+
+	/* Nor is anything drawn behind return before a prediction
+	 * made after it is confirmed, as at a password prompt */
+	echo.OnInput((const ubyte*)"p", 1, 4000000);
+	ok &= (UT__TermRead(fds[0]) == "");
+	echo.Tick(6000000);
+	ok &= (UT__TermRead(fds[0]) == "");
+
+	echo.OnInput((const ubyte*)"q", 1, 7000000);
+	echo.OnOutput((const ubyte*)"q", 1, 7600000);
+	ok &= (UT__TermRead(fds[0]) == "q");
+	echo.OnInput((const ubyte*)"r", 1, 8000000);
+	ok &= (UT__TermRead(fds[0]) == "\e[4mr\e[24m");
+
+	/* Unechoed predictions expire */
+	echo.Tick(8100000);
+	ok &= (UT__TermRead(fds[0]) == "");
+	echo.Tick(10000000);
+	ok &= (UT__TermRead(fds[0]) == "\e[1D\e[K");
+
+	close(fds[0]);
+	close(fds[1]);
+
+	return ok;
+}
+
+bool UT__TermPredictAdaptive() {
+	int fds[2];
+	bool ok = true;
+
+	if (pipe(fds) < 0) {
+		return false;
+	}
+	fcntl(fds[0], F_SETFL, O_NONBLOCK);
+
+	TermWriter term(fds[1]);
+	LocalEcho echo(&term, PM_ADAPTIVE);
+
+	/* A fast echo is not predicted */
+	echo.OnInput((const ubyte*)"a", 1, 0);
+	echo.OnOutput((const ubyte*)"a", 1, 5000);
+	ok &= (UT__TermRead(fds[0]) == "a");
+
+	echo.OnInput((const ubyte*)"b", 1, 10000);
+	ok &= (UT__TermRead(fds[0]) == "");
+	echo.OnOutput((const ubyte*)"b", 1, 700000);
+	ok &= (UT__TermRead(fds[0]) == "b");
+
+	/* A slow one is */
+	echo.OnInput((const ubyte*)"c", 1, 800000);
+	ok &= (UT__TermRead(fds[0]) == "\e[4mc\e[24m");
+
+	close(fds[0]);
+	close(fds[1]);
+
+	return ok;
+}
+
+void UT_Term() {
+	UNIT_TEST(UT__TermPassthrough, "Untranslated bytes");
+	UNIT_TEST(UT__TermTranslate, "Carriage returns");
+	UNIT_TEST(UT__TermPredict, "Predicted echo");
+	UNIT_TEST(UT__TermPredictAdaptive, "Adaptive prediction");
+}
+
+/*
+==================
+BM_Term
+
+Writes 64 MB of "ls -l" like shell output, in 32 KB channel
+payloads, to /dev/null. Once through a TermWriter, and once
+a byte at a time through stdio, as shell output used to be.
+==================
+*/
+void BM_Term() {
+	const uint32 total = 64 * 1024 * 1024;
+	const uint32 chunk = 32768;
+	string line = "-rw-r--r-- 1 user user   4096 Oct 19 12:00 file.txt\r\n";
+	string payload;
+	uint64 start, wt, st;
+
+	while (payload.length() < chunk) {
+		payload += line;
+	}
+	payload.resize(chunk);
+
+	const ubyte *p = (const ubyte*)payload.c_str();
+	int fd = open("/dev/null", O_WRONLY);
+	FILE *file = fdopen(dup(fd), "w");
+
+	TermWriter term(fd);
+	start = GetTimeUsec();
+	for (uint32 n=0; n<total; n+=chunk) {
+		term.Write(p, chunk);
+	}
+	wt = GetTimeUsec() - start;
+
+	start = GetTimeUsec();
+	for (uint32 n=0; n<total; n+=chunk) {
+		for (uint32 i=0; i<chunk; i++) {
+			fprintf(file, "%c", (p[i] == 13) ? 8 : p[i]);
+		}
+	}
+	fflush(file);
+	st = GetTimeUsec() - start;
+
+	fclose(file);
+	close(fd);
+
+	printf("Terminal output, 64 MB:\n");
+	printf("\tTermWriter:     %6.1f ms, %8.1f MB/s\n", wt/1000.0, total/(double)wt);
+	printf("\tPer byte stdio: %6.1f ms, %8.1f MB/s\n", st/1000.0, total/(double)st);
+}
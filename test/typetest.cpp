@@ -109,8 +109,89 @@ bool UT__messageLen() {
 	return true;
 }
 
+/* Encode, decode and compare random numbers of "bits" bits,
+ * with and without the high bit of the top byte set. */
+bool UT__mpintRoundTrip(uint32 bits) {
+	gmp_randclass ran(gmp_randinit_default);
+	ran.seed(bits);
+
+	for (int i=0; i<32; i++) {
+		MPInt a, b;
+		a.mpz = ran.get_z_bits(bits);
+		if (i & 1) {
+			mpz_setbit(a.mpz.get_mpz_t(), bits - 1);
+		}
+
+		uint32 len = a.GetRawLength();
+		uint32 nbits = mpz_sizeinbase(a.mpz.get_mpz_t(), 2);
+		ubyte *buf = new ubyte[len];
+		a.GetRawBytes(buf);
+
+		/* A leading zero exactly when the top bit is set */
+		bool ok = (len == 4 + nbits/8 + 1)
+			   && ((nbits % 8 == 0) == (buf[4] == 0));
+
+		ok &= (b.SetFromRaw(buf, len) == len) && (a.mpz == b.mpz);
+		delete[] buf;
+
+		/* ... and through a BIGNUM */
+		BIGNUM *bn = a.GetBIGNUM();
+		char *hex = BN_bn2hex(bn);
+		ok &= (mpz_class(hex, 16) == a.mpz);
+		OPENSSL_free(hex);
+		BN_free(bn);
+
+		if (!ok) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+bool UT__mpintRoundTrip1024() {
+	return UT__mpintRoundTrip(1024);
+}
+
+bool UT__mpintRoundTrip2048() {
+	return UT__mpintRoundTrip(2048);
+}
+
+bool UT__mpintRoundTrip4096() {
+	return UT__mpintRoundTrip(4096);
+}
+
+bool UT__mpintSpecial() {
+	/* Zero has no bytes, 0x80 needs a leading zero */
+	MPInt zero, x80;
+	ubyte buf[6];
+	ubyte exp80[] = { 0x00, 0x00, 0x00, 0x02, 0x00, 0x80 };
+
+	zero.mpz = 0;
+	if (zero.GetRawLength() != 4) {
+		return false;
+	}
+
+	zero.GetRawBytes(buf);
+	if (buf[0] || buf[1] || buf[2] || buf[3]) {
+		return false;
+	}
+
+	x80.mpz = 0x80;
+	if (x80.GetRawLength() != 6) {
+		return false;
+	}
+
+	x80.GetRawBytes(buf);
+	return !memcmp(buf, exp80, 6);
+}
+
 void UT_Types() {
 	UNIT_TEST(UT__mpintFromRaw, "MPInt initialization from raw");
 	UNIT_TEST(UT__mpintRawToMpintToRaw, "MPInt raw-rotation");
 	UNIT_TEST(UT__messageLen, "Message lengths");
+	UNIT_TEST(UT__mpintSpecial, "MPInt zero and sign padding");
+	UNIT_TEST(UT__mpintRoundTrip1024, "MPInt 1024 bit round-trip");
+	UNIT_TEST(UT__mpintRoundTrip2048, "MPInt 2048 bit round-trip");
+	UNIT_TEST(UT__mpintRoundTrip4096, "MPInt 4096 bit round-trip");
 }
\ No newline at end of file
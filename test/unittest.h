@@ -1,6 +1,7 @@
 #pragma once
 
 #include <sstream>
+#include "../sshay.h"
 
 #define UNIT_TEST(_UT_FUNC_, _DESC_) 					\
 	printf("Testing %s: %s...\n", __TEST_TYPE, _DESC_); \
@@ -11,6 +12,10 @@
 		Critical(__ss.str().c_str());					\
 	}
 
+/* Key blob helpers, defined in dsstest.cpp */
+void UT__AddString(std::vector<ubyte> &buf, const ubyte *data, uint32 len);
+void UT__AddMPInt(std::vector<ubyte> &buf, const ubyte *data, uint32 len);
+
 /* Defined in packettest.cpp */
 void UT_Packet();
 
@@ -21,4 +26,34 @@ void UT_Types();
 void UT_Mac();
 
 /* Defined in dsstest.cpp */
-void UT_DSS();
\ No newline at end of file
+void UT_DSS();
+
+/* Defined in kextest.cpp */
+void UT_DH();
+
+/* Defined in knownhoststest.cpp */
+void UT_KnownHosts();
+
+/* Defined in hostkeytest.cpp */
+void UT_HostKey();
+
+/* Defined in channeltest.cpp */
+void UT_Channel();
+/* Defined in inputringtest.cpp */
+void UT_InputRing();
+
+/* Defined in blockhashtest.cpp */
+void UT_BlockHash();
+
+/* Defined in recordertest.cpp */
+void UT_Recorder();
+
+/* Defined in scptest.cpp */
+void UT_Scp();
+
+/* Defined in sftptest.cpp */
+void UT_Sftp();
+
+/* Defined in termtest.cpp */
+void UT_Term();
+void BM_Term();